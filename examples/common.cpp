@@ -119,6 +119,12 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             if (params.n_threads <= 0) {
                 params.n_threads = std::thread::hardware_concurrency();
             }
+        } else if (arg == "-tb" || arg == "--threads-batch") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_threads_batch = std::stoi(argv[i]);
         } else if (arg == "-p" || arg == "--prompt") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -133,6 +139,23 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.path_prompt_cache = argv[i];
+        } else if (arg == "--prompt-cache-dir") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.path_prompt_cache_dir = argv[i];
+        } else if (arg == "--prompt-cache-dir-size") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            const int size = std::stoi(argv[i]);
+            if (size <= 0) {
+                invalid_param = true;
+                break;
+            }
+            params.prompt_cache_dir_size = size;
         } else if (arg == "--prompt-cache-all") {
             params.prompt_cache_all = true;
         } else if (arg == "--prompt-cache-ro") {
@@ -521,6 +544,12 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
         exit(1);
     }
 
+    if (!params.path_prompt_cache.empty() && !params.path_prompt_cache_dir.empty()) {
+        fprintf(stderr, "error: --prompt-cache and --prompt-cache-dir are mutually exclusive\n");
+        gpt_print_usage(argc, argv, default_params);
+        exit(1);
+    }
+
     if (escape_prompt) {
         process_escapes(params.prompt);
         process_escapes(params.input_prefix);
@@ -545,10 +574,17 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stdout, "  --color               colorise output to distinguish prompt and user input from generations\n");
     fprintf(stdout, "  -s SEED, --seed SEED  RNG seed (default: -1, use random seed for < 0)\n");
     fprintf(stdout, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
+    fprintf(stdout, "  -tb N, --threads-batch N\n");
+    fprintf(stdout, "                        number of threads to use evaluating batches of tokens, e.g. the prompt (default: same as --threads)\n");
     fprintf(stdout, "  -p PROMPT, --prompt PROMPT\n");
     fprintf(stdout, "                        prompt to start generation with (default: empty)\n");
     fprintf(stdout, "  -e                    process prompt escapes sequences (\\n, \\r, \\t, \\', \\\", \\\\)\n");
     fprintf(stdout, "  --prompt-cache FNAME  file to cache prompt state for faster startup (default: none)\n");
+    fprintf(stdout, "  --prompt-cache-dir DIR\n");
+    fprintf(stdout, "                        directory to cache the states of any number of prompts in, restoring the one sharing\n");
+    fprintf(stdout, "                        the longest prefix with the prompt (default: none)\n");
+    fprintf(stdout, "  --prompt-cache-dir-size N\n");
+    fprintf(stdout, "                        MiB the --prompt-cache-dir may hold, evicting the least recently used (default: %zu)\n", params.prompt_cache_dir_size);
     fprintf(stdout, "  --prompt-cache-all    if specified, saves user input and generations to cache as well.\n");
     fprintf(stdout, "                        not supported with --interactive or other interactive options\n");
     fprintf(stdout, "  --prompt-cache-ro     if specified, uses the prompt cache but does not update it.\n");
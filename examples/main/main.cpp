@@ -8,6 +8,7 @@
 #include "llama.h"
 #include "build-info.h"
 #include "grammar-parser.h"
+#include "prompt-cache.h"
 
 #include <cassert>
 #include <cinttypes>
@@ -54,6 +55,11 @@ void sigint_handler(int signo) {
 }
 #endif
 
+// threads to evaluate n_eval tokens with: --threads-batch, if set, for more than one of them, as a prompt is
+static int eval_threads(const gpt_params & params, int n_eval) {
+    return n_eval > 1 && params.n_threads_batch > 0 ? params.n_threads_batch : params.n_threads;
+}
+
 int main(int argc, char ** argv) {
     gpt_params params;
 
@@ -221,6 +227,21 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // with a prompt cache directory, the session is whichever of its entries shares the longest prefix with the
+    // prompt, & path_session (set to the directory) says whether it's still to be saved, as with a session file
+    prompt_cache::store prompt_cache_store;
+    if (!params.path_prompt_cache_dir.empty()) {
+        if (!prompt_cache::init(prompt_cache_store, params, ctx)) {
+            return 1;
+        }
+        path_session = params.path_prompt_cache_dir;
+        if (prompt_cache::load(prompt_cache_store, ctx, embd_inp, session_tokens)) {
+            llama_set_rng_seed(ctx, params.seed);
+        } else {
+            fprintf(stderr, "%s: no prompt cache entry shares a prefix with the prompt, will create one\n", __func__);
+        }
+    }
+
     // debug message about similarity of saved session, if applicable
     size_t n_matching_session_tokens = 0;
     if (session_tokens.size()) {
@@ -513,7 +534,7 @@ int main(int argc, char ** argv) {
 
                 for (int i = 0; i < input_size; i += params.n_batch) {
                     int n_eval = std::min(input_size - i, params.n_batch);
-                    if (llama_eval(ctx_guidance, input_buf + i, n_eval, n_past_guidance, params.n_threads)) {
+                    if (llama_eval(ctx_guidance, input_buf + i, n_eval, n_past_guidance, eval_threads(params, n_eval))) {
                         fprintf(stderr, "%s : failed to eval\n", __func__);
                         return 1;
                     }
@@ -527,7 +548,7 @@ int main(int argc, char ** argv) {
                 if (n_eval > params.n_batch) {
                     n_eval = params.n_batch;
                 }
-                if (llama_eval(ctx, &embd[i], n_eval, n_past, params.n_threads)) {
+                if (llama_eval(ctx, &embd[i], n_eval, n_past, eval_threads(params, n_eval))) {
                     fprintf(stderr, "%s : failed to eval\n", __func__);
                     return 1;
                 }
@@ -562,7 +583,11 @@ int main(int argc, char ** argv) {
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session && !params.prompt_cache_ro) {
                 need_to_save_session = false;
-                llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+                if (!params.path_prompt_cache_dir.empty()) {
+                    prompt_cache::save(prompt_cache_store, ctx, session_tokens);
+                } else {
+                    llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+                }
             }
 
             llama_token id = 0;
@@ -808,7 +833,11 @@ int main(int argc, char ** argv) {
 
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
         fprintf(stderr, "\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
-        llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+        if (!params.path_prompt_cache_dir.empty()) {
+            prompt_cache::save(prompt_cache_store, ctx, session_tokens);
+        } else {
+            llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
+        }
     }
 
     llama_print_timings(ctx);
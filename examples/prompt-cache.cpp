@@ -0,0 +1,337 @@
+#include "prompt-cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+#define PROMPT_CACHE_MAGIC   0x67677063u // 'ggpc'
+#define PROMPT_CACHE_VERSION 1
+
+// an entry's state starts at a multiple of this, so that the KV rows are aligned when it is mapped
+#define PROMPT_CACHE_ALIGN   64
+
+namespace prompt_cache {
+    struct entry_header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint64_t state_size;
+        uint32_t n_tokens;
+        uint32_t reserved;
+    };
+
+    struct entry {
+        std::string path;
+        uint64_t    key;
+        size_t      size;
+        int64_t     last_used_ns; // the file's modification time, which a restore updates
+    };
+
+    static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+    static const uint64_t FNV_PRIME  = 1099511628211ULL;
+
+    static void hash_bytes(uint64_t & hash, const void * data, size_t size) {
+        const uint8_t * bytes = (const uint8_t *) data;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * FNV_PRIME;
+        }
+    }
+
+    static size_t state_offset(uint32_t n_tokens) {
+        const size_t end = sizeof(entry_header) + n_tokens * sizeof(llama_token);
+        return (end + PROMPT_CACHE_ALIGN - 1) / PROMPT_CACHE_ALIGN * PROMPT_CACHE_ALIGN;
+    }
+
+    static std::string entry_path(const store & cache, const std::vector<llama_token> & tokens) {
+        uint64_t hash = FNV_OFFSET;
+        hash_bytes(hash, tokens.data(), tokens.size() * sizeof(llama_token));
+
+        char name[64];
+        snprintf(name, sizeof(name), "%016" PRIx64 "-%016" PRIx64 ".bin", cache.key, hash);
+        return cache.dir + "/" + name;
+    }
+
+    // the entries in the cache directory, for any model
+    static std::vector<entry> list_entries(const std::string & dir) {
+        std::vector<std::string> names;
+#if defined(_WIN32)
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA((dir + "\\*.bin").c_str(), &data);
+        if (find != INVALID_HANDLE_VALUE) {
+            do {
+                names.push_back(data.cFileName);
+            } while (FindNextFileA(find, &data));
+            FindClose(find);
+        }
+#else
+        DIR * d = opendir(dir.c_str());
+        if (d != NULL) {
+            while (struct dirent * ent = readdir(d)) {
+                names.push_back(ent->d_name);
+            }
+            closedir(d);
+        }
+#endif
+
+        std::vector<entry> entries;
+        for (const std::string & name : names) {
+            // <key>-<tokens hash>.bin, which leaves out the temporary files of saves in progress
+            if (name.size() != 37 || name[16] != '-' || name.compare(33, 4, ".bin") != 0) {
+                continue;
+            }
+
+            entry e;
+            e.path = dir + "/" + name;
+            e.key  = strtoull(name.substr(0, 16).c_str(), NULL, 16);
+
+            struct stat st;
+            if (stat(e.path.c_str(), &st) != 0) {
+                continue;
+            }
+            e.size = st.st_size;
+#if defined(__linux__)
+            e.last_used_ns = st.st_mtim.tv_sec * (int64_t) 1000000000 + st.st_mtim.tv_nsec;
+#else
+            e.last_used_ns = st.st_mtime * (int64_t) 1000000000;
+#endif
+            entries.push_back(e);
+        }
+        return entries;
+    }
+
+    // reads an entry's header & tokens, checking that it's complete & for the given key
+    static bool read_entry(const entry & e, uint64_t key, entry_header & header, std::vector<llama_token> & tokens) {
+        std::ifstream file(e.path, std::ios::binary);
+        if (!file.read((char *) &header, sizeof(header)) ||
+                header.magic != PROMPT_CACHE_MAGIC || header.version != PROMPT_CACHE_VERSION || header.key != key ||
+                e.size != state_offset(header.n_tokens) + header.state_size) {
+            return false;
+        }
+
+        tokens.resize(header.n_tokens);
+        return (bool) file.read((char *) tokens.data(), tokens.size() * sizeof(llama_token));
+    }
+
+    bool init(store & cache, const gpt_params & params, llama_context * ctx) {
+        cache.dir       = params.path_prompt_cache_dir;
+        cache.max_bytes = (size_t) params.prompt_cache_dir_size << 20;
+
+#if defined(_WIN32)
+        _mkdir(cache.dir.c_str());
+#else
+        mkdir(cache.dir.c_str(), 0755);
+#endif
+        struct stat st;
+        if (stat(cache.dir.c_str(), &st) != 0 || !(st.st_mode & S_IFDIR)) {
+            fprintf(stderr, "%s: error: unable to use '%s' as a prompt cache directory\n", __func__, cache.dir.c_str());
+            return false;
+        }
+
+        // the model is told apart by its file's size & first & last MiB, which hold its hyperparameters, vocab &
+        // enough weights to tell apart two fine-tunes of one model; hashing all of it would take longer than most
+        // prompts take to evaluate
+        std::ifstream model(params.model, std::ios::binary | std::ios::ate);
+        if (!model) {
+            fprintf(stderr, "%s: error: unable to read model file '%s'\n", __func__, params.model.c_str());
+            return false;
+        }
+        const int64_t model_size = model.tellg();
+        const int64_t span       = std::min<int64_t>(model_size, 1 << 20);
+        std::vector<char> buf(span);
+
+        uint64_t hash = FNV_OFFSET;
+        hash_bytes(hash, &model_size, sizeof(model_size));
+        for (int64_t offset : { (int64_t) 0, model_size - span }) {
+            model.seekg(offset);
+            model.read(buf.data(), span);
+            hash_bytes(hash, buf.data(), buf.size());
+        }
+
+        // & a state is only restored into a context of the same size & KV type, & with what else changes its KV rows
+        const uint64_t state_size = llama_get_state_size(ctx);
+        hash_bytes(hash, &state_size,             sizeof(state_size));
+        hash_bytes(hash, &params.n_gqa,           sizeof(params.n_gqa));
+        hash_bytes(hash, &params.rms_norm_eps,    sizeof(params.rms_norm_eps));
+        hash_bytes(hash, &params.rope_freq_base,  sizeof(params.rope_freq_base));
+        hash_bytes(hash, &params.rope_freq_scale, sizeof(params.rope_freq_scale));
+        hash_bytes(hash, params.lora_adapter.data(), params.lora_adapter.size() + 1);
+        hash_bytes(hash, params.lora_base.data(),    params.lora_base.size() + 1);
+        cache.key = hash;
+
+        return true;
+    }
+
+    bool load(const store & cache, llama_context * ctx, const std::vector<llama_token> & prompt, std::vector<llama_token> & tokens_out) {
+        const entry * best = NULL;
+        size_t n_best = 1;
+
+        const std::vector<entry> entries = list_entries(cache.dir);
+        entry_header header;
+        std::vector<llama_token> tokens;
+        for (const entry & e : entries) {
+            if (e.key != cache.key || !read_entry(e, cache.key, header, tokens)) {
+                continue;
+            }
+
+            const size_t n = std::mismatch(tokens.begin(), tokens.begin() + std::min(tokens.size(), prompt.size()), prompt.begin()).first - tokens.begin();
+            if (n > n_best || (n == n_best && best != NULL && e.size < best->size)) {
+                best   = &e;
+                n_best = n;
+                tokens_out = tokens;
+            }
+        }
+        if (best == NULL) {
+            return false;
+        }
+
+        const size_t offset = state_offset(tokens_out.size());
+#if defined(_WIN32)
+        std::vector<uint8_t> state(best->size - offset);
+        std::ifstream file(best->path, std::ios::binary);
+        file.seekg(offset);
+        if (!file.read((char *) state.data(), state.size())) {
+            fprintf(stderr, "%s: error: unable to read '%s'\n", __func__, best->path.c_str());
+            return false;
+        }
+        llama_set_state_data(ctx, state.data());
+#else
+        // mapped rather than read, so the KV rows are copied into the context straight from the page cache
+        const int fd = open(best->path.c_str(), O_RDONLY);
+        void * addr = fd < 0 ? MAP_FAILED : mmap(NULL, best->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "%s: error: unable to map '%s': %s\n", __func__, best->path.c_str(), strerror(errno));
+            return false;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(addr, best->size, MADV_SEQUENTIAL);
+#endif
+        llama_set_state_data(ctx, (uint8_t *) addr + offset);
+        munmap(addr, best->size);
+#endif
+
+        // it's been used, so it's the last to be evicted
+#if defined(_WIN32)
+        _utime(best->path.c_str(), NULL);
+#else
+        utime(best->path.c_str(), NULL);
+#endif
+
+        fprintf(stderr, "%s: restored %zu of %zu prompt tokens from '%s' (%.1f MiB)\n", __func__,
+                n_best, prompt.size(), best->path.c_str(), best->size / 1048576.0);
+        return true;
+    }
+
+    bool save(const store & cache, llama_context * ctx, const std::vector<llama_token> & tokens) {
+        const std::string path = entry_path(cache, tokens);
+#if defined(_WIN32)
+        const std::string path_tmp = path + ".tmp" + std::to_string(_getpid());
+#else
+        const std::string path_tmp = path + ".tmp" + std::to_string(getpid());
+#endif
+
+        // llama_copy_state_data writes only the KV rows in use, but needs room for all of them; left uninitialized,
+        // the rest of the buffer is never touched, so costs no memory
+        std::unique_ptr<uint8_t[]> state(new uint8_t[llama_get_state_size(ctx)]);
+
+        entry_header header = {};
+        header.magic      = PROMPT_CACHE_MAGIC;
+        header.version    = PROMPT_CACHE_VERSION;
+        header.key        = cache.key;
+        header.state_size = llama_copy_state_data(ctx, state.get());
+        header.n_tokens   = tokens.size();
+
+        const size_t padding = state_offset(header.n_tokens) - sizeof(header) - tokens.size() * sizeof(llama_token);
+        const char zeros[PROMPT_CACHE_ALIGN] = {};
+
+        FILE * fp = std::fopen(path_tmp.c_str(), "wb");
+        bool ok = fp != NULL &&
+            std::fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            std::fwrite(tokens.data(), sizeof(llama_token), tokens.size(), fp) == tokens.size() &&
+            std::fwrite(zeros, 1, padding, fp) == padding &&
+            std::fwrite(state.get(), 1, header.state_size, fp) == header.state_size;
+        if (fp != NULL) {
+            ok = std::fclose(fp) == 0 && ok;
+        }
+#if defined(_WIN32)
+        std::remove(path.c_str());
+#endif
+        // renamed into place once complete, so that a concurrent run never restores part of it
+        if (!ok || std::rename(path_tmp.c_str(), path.c_str()) != 0) {
+            fprintf(stderr, "%s: error: unable to save prompt cache entry '%s'\n", __func__, path.c_str());
+            std::remove(path_tmp.c_str());
+            return false;
+        }
+
+        std::vector<entry> entries = list_entries(cache.dir);
+
+        // an entry for a prefix of these tokens is restored from this one as well, so is only taking up room
+        entry_header entry_hdr;
+        std::vector<llama_token> entry_tokens;
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const entry & e) {
+            if (e.path == path || e.key != cache.key || !read_entry(e, cache.key, entry_hdr, entry_tokens) ||
+                    entry_tokens.size() >= tokens.size() || !std::equal(entry_tokens.begin(), entry_tokens.end(), tokens.begin())) {
+                return false;
+            }
+            std::remove(e.path.c_str());
+            return true;
+        }), entries.end());
+
+        std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+            return a.last_used_ns < b.last_used_ns;
+        });
+        size_t total = 0;
+        for (const entry & e : entries) {
+            total += e.size;
+        }
+        bool kept = true;
+        for (const entry & e : entries) {
+            if (total <= cache.max_bytes) {
+                break;
+            }
+            std::remove(e.path.c_str());
+            total -= e.size;
+            kept = kept && e.path != path;
+        }
+        if (!kept) {
+            fprintf(stderr, "%s: warning: not keeping the state of %zu tokens (%.1f MiB), which is over the prompt cache's bound of %.1f MiB\n",
+                    __func__, tokens.size(), (state_offset(header.n_tokens) + header.state_size) / 1048576.0, cache.max_bytes / 1048576.0);
+            return false;
+        }
+
+        fprintf(stderr, "%s: saved %zu tokens to '%s' (%.1f MiB); the prompt cache holds %.1f MiB\n", __func__,
+                tokens.size(), path.c_str(), (state_offset(header.n_tokens) + header.state_size) / 1048576.0, total / 1048576.0);
+        return true;
+    }
+}
@@ -0,0 +1,34 @@
+// A directory of saved prompt states, for runs whose prompts share a preamble. Unlike the single session file
+// of --prompt-cache, it holds any number of entries, each named for a hash of the model & context it was saved
+// from & of its tokens. A lookup restores the entry sharing the longest prefix with the prompt, so that only the
+// tokens after that prefix are evaluated. Entries hold only the KV cache rows of their tokens, are mapped into
+// memory rather than read into a buffer when restored, and are evicted least recently used first once the
+// directory outgrows its size bound.
+
+#pragma once
+
+#include "common.h"
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace prompt_cache {
+    struct store {
+        std::string dir;
+        size_t      max_bytes = 0;
+        uint64_t    key       = 0; // hash of the model file & of everything about the context a state depends on
+    };
+
+    // opens (creating if need be) the directory given by params.path_prompt_cache_dir for states of ctx
+    bool init(store & cache, const gpt_params & params, llama_context * ctx);
+
+    // restores into ctx the entry sharing the longest prefix (of more than the BOS token) with prompt, setting
+    // tokens_out to the entry's tokens; false if no entry shares one
+    bool load(const store & cache, llama_context * ctx, const std::vector<llama_token> & prompt, std::vector<llama_token> & tokens_out);
+
+    // saves the state of ctx, which has evaluated tokens, as an entry; then removes entries that are a prefix of
+    // it, which it now serves in their place, & evicts entries until the directory is within its bound
+    bool save(const store & cache, llama_context * ctx, const std::vector<llama_token> & tokens);
+}
@@ -3,6 +3,9 @@
 #include "build-info.h"
 #include "grammar-parser.h"
 
+#include <map>
+#include <memory>
+
 #ifndef NDEBUG
 // crash the server in debug mode, otherwise send an http 500 error
 #define CPPHTTPLIB_NO_EXCEPTIONS 1
@@ -31,6 +34,7 @@ struct server_params
     int32_t port = 8080;
     int32_t read_timeout = 600;
     int32_t write_timeout = 600;
+    int32_t prefix_cache_mb = -1; // MiB for the prefix cache; -1 for as much as the KV cache, 0 to disable it
 };
 
 // completion token output with probabilities
@@ -178,6 +182,181 @@ static bool server_verbose = false;
 #define LOG_WARNING(MSG, ...) server_log("WARNING", __func__, __LINE__, MSG, __VA_ARGS__)
 #define LOG_INFO(MSG, ...) server_log("INFO", __func__, __LINE__, MSG, __VA_ARGS__)
 
+// a radix tree of the token sequences the context has evaluated, each node holding the KV cache rows of the tokens on
+// the edge to it, so that a prompt sharing a prefix with any earlier one, not only the last, skips evaluating it.
+// nodes split from one another share the rows they were saved with. least recently used leaves are evicted once
+// the rows held are over budget
+struct prefix_cache
+{
+    struct segment
+    {
+        std::vector<uint8_t> rows; // as llama_copy_kv_rows copied them
+        int n_tokens = 0;
+    };
+
+    struct node
+    {
+        std::vector<llama_token> tokens; // on the edge from the parent
+        size_t pos = 0;                  // the position of tokens[0] in the context
+        std::shared_ptr<segment> seg;
+        int i0 = 0;                      // the index of tokens[0] in seg
+        node *parent = nullptr;
+        std::map<llama_token, std::unique_ptr<node>> children; // by the first token on their edge
+        uint64_t last_used = 0;
+    };
+
+    node root;
+    size_t budget = 0;
+    size_t used = 0; // bytes of the segments that nodes hold
+    uint64_t clock = 0;
+
+    // restores the rows of the longest prefix of tokens in the tree into ctx, except those of the first n_live
+    // tokens, which ctx holds already, & returns the prefix's length
+    size_t restore(llama_context *ctx, const std::vector<llama_token> &tokens, size_t n_live)
+    {
+        size_t n_match = 0;
+        node *cur = &root;
+        while (n_match < tokens.size())
+        {
+            const auto it = cur->children.find(tokens[n_match]);
+            if (it == cur->children.end())
+            {
+                break;
+            }
+            node *child = it->second.get();
+            child->last_used = ++clock;
+
+            size_t k = 0;
+            while (k < child->tokens.size() && n_match + k < tokens.size() && child->tokens[k] == tokens[n_match + k])
+            {
+                k++;
+            }
+            const size_t end = child->pos + k;
+            if (end > n_live)
+            {
+                const size_t from = std::max(child->pos, n_live);
+                llama_set_kv_rows(ctx, child->seg->rows.data(), child->seg->n_tokens,
+                                  child->i0 + (int)(from - child->pos), (int)from, (int)(end - from));
+            }
+            n_match = end;
+            if (k < child->tokens.size())
+            {
+                break;
+            }
+            cur = child;
+        }
+        return n_match;
+    }
+
+    // adds the first n of tokens, whose rows ctx holds, copying those of the tokens not in the tree already
+    void insert(llama_context *ctx, const std::vector<llama_token> &tokens, size_t n)
+    {
+        if (budget == 0)
+        {
+            return;
+        }
+
+        size_t depth = 0;
+        node *cur = &root;
+        while (depth < n)
+        {
+            const auto it = cur->children.find(tokens[depth]);
+            if (it == cur->children.end())
+            {
+                break;
+            }
+            node *child = it->second.get();
+            child->last_used = ++clock;
+
+            size_t k = 0;
+            while (k < child->tokens.size() && depth + k < n && child->tokens[k] == tokens[depth + k])
+            {
+                k++;
+            }
+            if (k < child->tokens.size() && depth + k < n)
+            {
+                // the tokens diverge from the edge partway along it, so its first k tokens become a node of
+                // their own, which the rest & the new tokens branch from
+                std::unique_ptr<node> head(new node());
+                head->tokens.assign(child->tokens.begin(), child->tokens.begin() + k);
+                head->pos = child->pos;
+                head->seg = child->seg;
+                head->i0 = child->i0;
+                head->parent = cur;
+                head->last_used = child->last_used;
+
+                child->tokens.erase(child->tokens.begin(), child->tokens.begin() + k);
+                child->pos += k;
+                child->i0 += (int)k;
+                child->parent = head.get();
+                head->children[child->tokens[0]] = std::move(it->second);
+                it->second = std::move(head);
+                child = it->second.get();
+            }
+            depth += k;
+            cur = child;
+        }
+        if (depth >= n)
+        {
+            return;
+        }
+
+        const size_t size = llama_get_kv_rows_size(ctx, (int)(n - depth));
+        if (size > budget)
+        {
+            return;
+        }
+        std::shared_ptr<segment> seg = std::make_shared<segment>();
+        seg->n_tokens = (int)(n - depth);
+        seg->rows.resize(size);
+        llama_copy_kv_rows(ctx, seg->rows.data(), (int)depth, seg->n_tokens);
+
+        std::unique_ptr<node> leaf(new node());
+        leaf->tokens.assign(tokens.begin() + depth, tokens.begin() + n);
+        leaf->pos = depth;
+        leaf->seg = std::move(seg);
+        leaf->parent = cur;
+        leaf->last_used = ++clock;
+        cur->children[tokens[depth]] = std::move(leaf);
+        used += size;
+
+        while (used > budget && evict())
+        {
+        }
+    }
+
+    // removes the least recently used leaf, freeing its rows unless a node split from it still holds them
+    bool evict()
+    {
+        node *lru = nullptr;
+        std::vector<node *> stack = {&root};
+        while (!stack.empty())
+        {
+            node *nd = stack.back();
+            stack.pop_back();
+            if (nd->children.empty() && nd != &root && (lru == nullptr || nd->last_used < lru->last_used))
+            {
+                lru = nd;
+            }
+            for (auto &child : nd->children)
+            {
+                stack.push_back(child.second.get());
+            }
+        }
+        if (lru == nullptr)
+        {
+            return false;
+        }
+
+        if (lru->seg.use_count() == 1)
+        {
+            used -= lru->seg->rows.size();
+        }
+        lru->parent->children.erase(lru->tokens[0]);
+        return true;
+    }
+};
+
 struct llama_server_context
 {
     bool stream = false;
@@ -190,6 +369,11 @@ struct llama_server_context
     size_t n_past = 0;
     size_t n_remain = 0;
 
+    struct prefix_cache prefix_cache;
+    size_t n_prefix_hit = 0;      // prompt tokens not evaluated, as the context held or the prefix cache restored them
+    size_t n_prefix_restored = 0; // of those, the tokens the prefix cache restored
+    double t_prefix_restore_ms = 0;
+
     std::vector<llama_token> embd;
     std::vector<llama_token> last_n_tokens;
 
@@ -244,7 +428,15 @@ struct llama_server_context
         stopping_word = "";
         multibyte_pending = 0;
         n_remain = 0;
+
+        // the evaluated tokens are about to make way for the next prompt's, so keep their rows for later prompts
+        // sharing a prefix with them. any token sampled last was never evaluated, so doesn't count as cached
+        embd.resize(std::min(embd.size(), n_past));
+        prefix_cache.insert(ctx, embd, embd.size());
         n_past = 0;
+        n_prefix_hit = 0;
+        n_prefix_restored = 0;
+        t_prefix_restore_ms = 0;
 
         if (grammar != nullptr) {
             llama_grammar_free(grammar);
@@ -330,14 +522,24 @@ struct llama_server_context
             std::copy(prompt_tokens.begin(), prompt_tokens.end(), last_n_tokens.end() - ps);
         }
 
-        // compare the evaluated prompt with the new prompt
+        // compare the evaluated prompt with the new prompt, & restore any more of it that the prefix cache holds
         n_past = common_part(embd, prompt_tokens);
+        const int64_t t_restore_start_us = ggml_time_us();
+        const size_t n_cached = prefix_cache.restore(ctx, prompt_tokens, n_past);
+        if (n_cached > n_past)
+        {
+            n_prefix_restored = n_cached - n_past;
+            t_prefix_restore_ms = (ggml_time_us() - t_restore_start_us) / 1e3;
+            n_past = n_cached;
+        }
         embd = prompt_tokens;
         if (n_past == num_prompt_tokens)
         {
             // we have to evaluate at least 1 token to generate logits.
             n_past--;
+            n_prefix_restored = std::min(n_prefix_restored, n_past);
         }
+        n_prefix_hit = n_past;
 
         LOG_VERBOSE("prompt ingested", {
                                            {"n_past", n_past},
@@ -691,6 +893,8 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     fprintf(stdout, "  --path PUBLIC_PATH    path from which to serve static files (default %s)\n", sparams.public_path.c_str());
     fprintf(stdout, "  -to N, --timeout N    server read/write timeout in seconds (default: %d)\n", sparams.read_timeout);
     fprintf(stdout, "  --embedding           enable embedding vector output (default: %s)\n", params.embedding ? "enabled" : "disabled");
+    fprintf(stdout, "  --prefix-cache N      MiB to keep the KV cache rows of earlier prompts' prefixes in, to restore for later prompts\n");
+    fprintf(stdout, "                        sharing them (default: as much as the KV cache, 0 to disable)\n");
     fprintf(stdout, "\n");
 }
 
@@ -950,6 +1154,15 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         {
             params.embedding = true;
         }
+        else if (arg == "--prefix-cache")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.prefix_cache_mb = std::stoi(argv[i]);
+        }
         else
         {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
@@ -1023,6 +1236,10 @@ static json format_timings(llama_server_context &llama)
         {"predicted_ms", timings.t_eval_ms},
         {"predicted_per_token_ms", timings.t_eval_ms / timings.n_eval},
         {"predicted_per_second", 1e3 / timings.t_eval_ms * timings.n_eval},
+
+        {"prefix_hit_n", llama.n_prefix_hit},
+        {"prefix_restored_n", llama.n_prefix_restored},
+        {"prefix_restore_ms", llama.t_prefix_restore_ms},
     };
 }
 
@@ -1195,6 +1412,15 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    llama.prefix_cache.budget = sparams.prefix_cache_mb < 0 ? llama_get_kv_rows_size(llama.ctx, params.n_ctx)
+                                                             : (size_t)sparams.prefix_cache_mb << 20;
+    if (llama.prefix_cache.budget > 0 && !llama_kv_rows_supported(llama.ctx))
+    {
+        // its rows are copied to & from the KV cache in CPU memory
+        LOG_WARNING("prefix cache disabled, as the KV cache is offloaded to the GPU", {{"n_gpu_layers", params.n_gpu_layers}});
+        llama.prefix_cache.budget = 0;
+    }
+
     Server svr;
 
     svr.set_default_headers({{"Server", "llama.cpp"},
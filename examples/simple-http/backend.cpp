@@ -0,0 +1,1258 @@
+#include "backend.h"
+#include "http.h"
+#include "thread-budget.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+
+// threads to evaluate `n_tokens` at once with: at most those set for it, fewer if the calling thread's share of the
+// thread budget is smaller, as it may be from one evaluation to the next
+static int _eval_threads(const gpt_params &params, size_t n_tokens)
+{
+    const bool prefill = n_tokens > 1;
+    return budget_threads(prefill, prefill && params.n_threads_batch > 0 ? params.n_threads_batch : params.n_threads);
+}
+
+// evaluates `n_tokens` after the `n_past` already in `ctx` at most `params.n_batch` at a time, as llama.cpp sizes
+// its buffers for. returns non-zero on failure, as llama_eval() does
+static int _eval_batched(llama_context *ctx, const gpt_params &params, const llama_token *tokens, size_t n_tokens, int n_past)
+{
+    for (size_t i = 0; i < n_tokens;)
+    {
+        const size_t n_eval = std::min(n_tokens - i, (size_t)std::max(1, params.n_batch));
+        if (llama_eval(ctx, tokens + i, n_eval, n_past + i, _eval_threads(params, n_eval)))
+        {
+            return 1;
+        }
+        i += n_eval;
+    }
+    return 0;
+}
+
+// adds the work `from` measured to `to`, as when resuming a preempted generation
+static void _add_timings(struct llama_timings *to, const struct llama_timings &from)
+{
+    to->t_start_ms = from.t_start_ms;
+    to->t_load_ms += from.t_load_ms;
+    to->t_p_eval_ms += from.t_p_eval_ms;
+    to->t_eval_ms += from.t_eval_ms;
+    to->n_p_eval += from.n_p_eval;
+    to->n_eval += from.n_eval;
+}
+
+// restores the stats of a preempted generation, moving its timestamps on past the time it spent preempted, so
+// that its durations are of the work it did alone
+static void _resume_stats(GenerationStats *stats, const PreemptedGeneration &saved)
+{
+    *stats = saved.stats;
+    const int64_t t_preempted_us = llama_time_us() - saved.preempted_us;
+    for (int64_t *t_us : {&stats->start_us, &stats->decode_start_us, &stats->first_token_us})
+    {
+        if (*t_us >= 0)
+        {
+            *t_us += t_preempted_us;
+        }
+    }
+}
+
+std::string generate(
+    llama_context *ctx,
+    gpt_params &params,
+    std::vector<llama_token> &ctx_tokens,
+    Sampler &sampler,
+    GenerationStats *stats,
+    const preemption_check &preempt,
+    std::shared_ptr<PreemptedGeneration> *preempted)
+{
+    GenerationStats local_stats;
+    if (!stats)
+    {
+        stats = &local_stats;
+    }
+
+    const int max_context_size = llama_n_ctx(ctx);
+    const int n_vocab = llama_n_vocab(ctx);
+
+    std::vector<llama_token> tokens_list;
+    size_t n_past = 0;
+    std::stringstream outstream;
+
+    if (preempted && *preempted)
+    {
+        // the KV cache, sampler & output are restored as they were at the token or prompt chunk boundary where it
+        // stopped
+        const int64_t t_restore_start_us = llama_time_us();
+        const auto &saved = **preempted;
+        llama_set_state_data(ctx, const_cast<uint8_t *>(saved.state.data()));
+        _resume_stats(stats, saved);
+        sampler = saved.sampler;
+        ctx_tokens = saved.ctx_tokens;
+        n_past = ctx_tokens.size();
+        tokens_list = saved.pending;
+        ctx_tokens.insert(ctx_tokens.end(), saved.pending.begin(), saved.pending.end());
+        outstream << saved.response;
+        preempted->reset();
+        stats->preemption_overhead_us += llama_time_us() - t_restore_start_us;
+    }
+    else
+    {
+        if (stats->start_us < 0)
+        {
+            stats->start_us = llama_time_us();
+        }
+
+        tokens_list = ::llama_tokenize(ctx, params.prompt, true);
+
+        const int max_tokens_list_size = max_context_size - 4;
+        if ((int)tokens_list.size() > max_tokens_list_size)
+        {
+            HTTP_LOGGER("error: prompt too long (%d tokens, max %d)\n",
+                        (int)tokens_list.size(), max_tokens_list_size);
+            ctx_tokens.clear();
+            return "";
+        }
+
+        // reuse the longest prefix shared with whatever the KV cache already holds, always leaving at least
+        // one prompt token to evaluate so that there are fresh logits to sample from
+        while (n_past < ctx_tokens.size() && n_past + 1 < tokens_list.size() && ctx_tokens[n_past] == tokens_list[n_past])
+        {
+            n_past++;
+        }
+
+        ctx_tokens.resize(n_past);
+        ctx_tokens.insert(ctx_tokens.end(), tokens_list.begin() + n_past, tokens_list.end());
+        tokens_list.erase(tokens_list.begin(), tokens_list.begin() + n_past);
+
+        stats->n_prompt_evaluated += tokens_list.size();
+        stats->n_prompt_reused += n_past;
+
+        sampler.begin(ctx_tokens);
+        if (stats->decode_start_us < 0)
+        {
+            stats->decode_start_us = llama_time_us();
+        }
+    }
+
+    // The LLM keeps a contextual cache memory of previous token evaluation.
+    // Usually, once this cache is full, it is required to recompute a compressed context based on previous
+    // tokens (see "infinite text generation via context swapping" in the main example), but in this minimalist
+    // example, we will just stop the loop once this cache is full or once an end of stream is detected.
+
+    // stops with `pending` (the rest of the prompt, or the token just sampled) left to evaluate on resuming
+    auto spill = [&](const std::vector<llama_token> &pending)
+    {
+        // the state is written to a spill arena sized for a full KV cache, of which only the pages actually
+        // written are touched, & then kept trimmed to what was written
+        const int64_t t_save_start_us = llama_time_us();
+        const size_t max_state_size = llama_get_state_size(ctx);
+        std::unique_ptr<uint8_t[]> arena(new uint8_t[max_state_size]);
+        const size_t state_size = llama_copy_state_data(ctx, arena.get());
+
+        std::shared_ptr<PreemptedGeneration> saved(new PreemptedGeneration);
+        saved->state.assign(arena.get(), arena.get() + state_size);
+        saved->ctx_tokens.assign(ctx_tokens.begin(), ctx_tokens.begin() + n_past);
+        saved->pending = pending;
+        saved->response = outstream.str();
+        saved->sampler = sampler;
+
+        stats->n_preemptions++;
+        stats->preemption_overhead_us += llama_time_us() - t_save_start_us;
+        saved->stats = *stats;
+        saved->preempted_us = llama_time_us();
+        *preempted = saved;
+
+        ctx_tokens.resize(n_past);
+        return saved->response;
+    };
+
+    while ((int)n_past < max_context_size)
+    {
+        // a prompt is evaluated n_batch tokens at a time, checking between chunks whether to stop, so that a long
+        // one delays a prompt preempting it by no more than a chunk's evaluation
+        while (tokens_list.size())
+        {
+            const size_t n_eval = std::min(tokens_list.size(), (size_t)std::max(1, params.n_batch));
+            if (llama_eval(ctx, tokens_list.data(), n_eval, n_past, _eval_threads(params, n_eval)))
+            {
+                HTTP_LOGGER("failed to eval\n");
+                ctx_tokens.clear();
+                return "";
+            }
+
+            n_past += n_eval;
+            tokens_list.erase(tokens_list.begin(), tokens_list.begin() + n_eval);
+            if (tokens_list.size() && preempt && preempted && preempt())
+            {
+                return spill(tokens_list);
+            }
+        }
+
+        const int64_t t_sample_start_us = llama_time_us();
+        const llama_token new_token_id = sampler.next(llama_get_logits(ctx), n_vocab);
+        stats->sample_us += llama_time_us() - t_sample_start_us;
+
+        // is it an end of stream ?
+        if (new_token_id == llama_token_eos())
+        {
+            break;
+        }
+
+        if (!stats->n_generated++)
+        {
+            stats->first_token_us = llama_time_us();
+        }
+
+        outstream << llama_token_to_str(ctx, new_token_id);
+
+        // Push this new token for next evaluation :
+        tokens_list.push_back(new_token_id);
+        ctx_tokens.push_back(new_token_id);
+
+        if (preempt && preempted && (int)n_past < max_context_size && preempt())
+        {
+            return spill(tokens_list);
+        }
+    }
+
+    // the final sampled token was never evaluated, so it isn't resident
+    ctx_tokens.resize(n_past);
+    stats->end_us = llama_time_us();
+
+    return outstream.str();
+}
+
+std::string generate_speculative(
+    llama_context *ctx,
+    llama_context *draft_ctx,
+    gpt_params &params,
+    Sampler &sampler,
+    GenerationStats *stats)
+{
+    GenerationStats local_stats;
+    if (!stats)
+    {
+        stats = &local_stats;
+    }
+
+    if (stats->start_us < 0)
+    {
+        stats->start_us = llama_time_us();
+    }
+
+    // every token in the sequence so far: ctx has evaluated the first n_past & draft_ctx the first n_past_draft
+    std::vector<llama_token> seq = ::llama_tokenize(ctx, params.prompt, true);
+
+    const int n_ctx = llama_n_ctx(ctx);
+    const int n_vocab = llama_n_vocab(ctx);
+
+    if ((int)seq.size() > n_ctx - 4)
+    {
+        HTTP_LOGGER("error: prompt too long (%d tokens, max %d)\n", (int)seq.size(), n_ctx - 4);
+        return "";
+    }
+
+    sampler.begin(seq);
+    const bool greedy = sampler.greedy();
+
+    if (_eval_batched(ctx, params, seq.data(), seq.size(), 0))
+    {
+        HTTP_LOGGER("failed to eval\n");
+        return "";
+    }
+
+    int n_past = seq.size();
+    int n_past_draft = 0;
+    stats->n_prompt_evaluated += n_past;
+    if (stats->decode_start_us < 0)
+    {
+        stats->decode_start_us = llama_time_us();
+    }
+
+    // the logits are of the prompt's last chunk alone
+    const int n_last_chunk = (n_past - 1) % std::max(1, params.n_batch) + 1;
+    llama_token next = sampler.next(llama_get_logits(ctx) + (size_t)(n_last_chunk - 1) * n_vocab, n_vocab);
+
+    std::stringstream outstream;
+    auto emit = [&](llama_token id)
+    {
+        if (!stats->n_generated++)
+        {
+            stats->first_token_us = llama_time_us();
+        }
+
+        outstream << llama_token_to_str(ctx, id);
+        seq.push_back(id);
+    };
+
+    std::vector<llama_token> drafts;
+    std::vector<std::vector<float>> draft_probs(params.n_draft); // the full distribution each draft was sampled from
+
+    while (next != llama_token_eos() && n_past < n_ctx)
+    {
+        emit(next);
+
+        // draft, leaving room for the target to evaluate `next` & every draft in one batch, which (as its logits
+        // are all needed) can't be split into n_batch chunks
+        const int n_draft = std::min({params.n_draft, n_ctx - n_past - 1, params.n_batch - 1});
+        drafts.clear();
+        while ((int)drafts.size() < n_draft && (drafts.empty() || drafts.back() != llama_token_eos()))
+        {
+            std::vector<llama_token> pending;
+            if (drafts.empty())
+            {
+                pending.assign(seq.begin() + n_past_draft, seq.end());
+            }
+            else
+            {
+                pending.push_back(drafts.back());
+            }
+
+            if (_eval_batched(draft_ctx, params, pending.data(), pending.size(), n_past_draft))
+            {
+                HTTP_LOGGER("failed to eval draft\n");
+                return outstream.str();
+            }
+            n_past_draft += pending.size();
+
+            const int64_t t_sample_start_us = llama_time_us();
+            const float *draft_logits = llama_get_logits(draft_ctx);
+            // rejection sampling needs the whole distribution each draft was drawn from
+            drafts.push_back(sampler.sample_draft(draft_logits, n_vocab, draft_probs[drafts.size()]));
+            stats->sample_us += llama_time_us() - t_sample_start_us;
+        }
+
+        sampler.discard_drafts();
+
+        // verify: row i of the target's logits is its distribution for the token following batch[i]
+        std::vector<llama_token> batch{next};
+        batch.insert(batch.end(), drafts.begin(), drafts.end());
+        if (llama_eval(ctx, batch.data(), batch.size(), n_past, _eval_threads(params, batch.size())))
+        {
+            HTTP_LOGGER("failed to eval\n");
+            return outstream.str();
+        }
+
+        const int64_t t_sample_start_us = llama_time_us();
+        const float *logits = llama_get_logits(ctx);
+        size_t n_accepted = 0;
+        bool rejected = false;
+        while (n_accepted < drafts.size() && !rejected)
+        {
+            const llama_token draft = drafts[n_accepted];
+            sampler.build(logits + n_accepted * n_vocab, n_vocab);
+
+            if (greedy)
+            {
+                next = sampler.distribution().data[0].id;
+                rejected = next != draft;
+            }
+            else
+            {
+                const auto &q = draft_probs[n_accepted];
+                rejected = !sampler.accepts_draft(draft, q);
+                next = rejected ? sampler.sample_residual(q) : draft;
+            }
+
+            sampler.accept(next);
+            if (!rejected)
+            {
+                n_accepted++;
+                if (draft == llama_token_eos())
+                {
+                    break;
+                }
+                emit(draft);
+            }
+        }
+
+        stats->n_drafted += drafts.size();
+        stats->n_draft_accepted += n_accepted;
+
+        // the previous `next` & the accepted drafts are now resident in ctx, though perhaps not all in draft_ctx
+        n_past += 1 + n_accepted;
+        n_past_draft = std::min(n_past_draft, n_past);
+
+        if (!rejected && !(n_accepted && drafts[n_accepted - 1] == llama_token_eos()))
+        {
+            // every draft was accepted, so the final row gives another token for free
+            next = sampler.next(logits + n_accepted * n_vocab, n_vocab);
+        }
+        stats->sample_us += llama_time_us() - t_sample_start_us;
+    }
+
+    stats->end_us = llama_time_us();
+    return outstream.str();
+}
+
+struct LlamaBackend : InferenceBackend
+{
+    // a model kept loaded, for embeddings or because it was preloaded, with the contexts it has been used in
+    struct ResidentModel
+    {
+        llama_model *model = nullptr;
+        std::mutex embd_lock; // held while `embd_ctx` is in use
+        llama_context *embd_ctx = nullptr;    // created on first use
+        std::vector<llama_token> embd_tokens; // resident in `embd_ctx`'s KV cache
+        // if preloaded, the (warmed) context prompts run in, as run_one_prompt() is never called concurrently
+        llama_context *prompt_ctx = nullptr;
+        std::vector<llama_token> prompt_tokens; // resident in `prompt_ctx`'s KV cache
+        bool trimmed = false;                   // since last warmed
+        // the LoRA adapters of the variants based on it, by path, loaded on first use & kept. each context
+        // evaluates with whichever one (or none) was last set on it
+        std::mutex adapters_lock;
+        std::map<std::string, llama_lora_adapter *> adapters;
+        const llama_lora_adapter *embd_adapter = nullptr;
+        const llama_lora_adapter *prompt_adapter = nullptr;
+    };
+
+    std::mutex resident_lock;
+    std::map<std::string, std::unique_ptr<ResidentModel>> resident;
+
+    ~LlamaBackend()
+    {
+        for (auto &resident_ent : resident)
+        {
+            llama_free(resident_ent.second->embd_ctx);
+            llama_free(resident_ent.second->prompt_ctx);
+            for (auto &adapter_ent : resident_ent.second->adapters)
+            {
+                llama_free_lora_adapter(adapter_ent.second);
+            }
+            llama_free_model(resident_ent.second->model);
+        }
+    }
+
+    // resident models are never freed before the backend is, so the result stays valid
+    ResidentModel *find_resident(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lg(resident_lock);
+        auto found = resident.find(path);
+        return found == resident.end() ? nullptr : found->second.get();
+    }
+
+    ResidentModel *load_resident(const gpt_params &params)
+    {
+        std::lock_guard<std::mutex> lg(resident_lock);
+        auto &slot = resident[params.model];
+        if (!slot)
+        {
+            std::unique_ptr<ResidentModel> loaded(new ResidentModel);
+            loaded->model = llama_load_model_from_file(params.model.c_str(), llama_context_params_from_gpt_params(params));
+            if (!loaded->model)
+            {
+                resident.erase(params.model);
+                return nullptr;
+            }
+
+            slot = std::move(loaded);
+        }
+
+        return slot.get();
+    }
+
+    // the adapter at `path` for `rm`'s model, or none if `path` is empty. false if it can't be loaded
+    bool find_adapter(ResidentModel *rm, const std::string &path, llama_lora_adapter **adapter)
+    {
+        *adapter = nullptr;
+        if (path.empty())
+        {
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lg(rm->adapters_lock);
+        auto &slot = rm->adapters[path];
+        if (!slot)
+        {
+            slot = llama_load_lora_adapter_from_file(rm->model, path.c_str());
+            if (!slot)
+            {
+                rm->adapters.erase(path);
+                return false;
+            }
+        }
+
+        *adapter = slot;
+        return true;
+    }
+
+    // sets `adapter` on a resident context, whose KV cache (`ctx_tokens`) was evaluated with `*current` & so can't
+    // be reused with another
+    bool set_adapter(llama_context *ctx, const llama_lora_adapter *adapter, const llama_lora_adapter **current,
+                     std::vector<llama_token> &ctx_tokens)
+    {
+        if (adapter == *current)
+        {
+            return true;
+        }
+
+        ctx_tokens.clear();
+        if (llama_set_lora_adapter(ctx, adapter))
+        {
+            return false;
+        }
+        *current = adapter;
+        return true;
+    }
+
+    std::string preload(const gpt_params &params) override
+    {
+        auto *rm = load_resident(params);
+        if (!rm)
+        {
+            return "unable to load model";
+        }
+
+        llama_lora_adapter *adapter;
+        if (!find_adapter(rm, params.lora_adapter, &adapter))
+        {
+            return "unable to load LoRA adapter";
+        }
+
+        if (!rm->prompt_ctx)
+        {
+            rm->prompt_ctx = llama_new_context_with_model(rm->model, llama_context_params_from_gpt_params(params));
+            if (!rm->prompt_ctx)
+            {
+                return "unable to create a context";
+            }
+            if (!set_adapter(rm->prompt_ctx, adapter, &rm->prompt_adapter, rm->prompt_tokens))
+            {
+                return "unable to apply LoRA adapter";
+            }
+
+            return warm(rm, params);
+        }
+
+        return "";
+    }
+
+    // evaluating a token allocates & faults in the compute buffers (& the weights, all of which it reads), & leaves
+    // BOS in the KV cache for the next prompt to reuse
+    std::string warm(ResidentModel *rm, const gpt_params &params)
+    {
+        const llama_token bos = llama_token_bos();
+        if (llama_eval(rm->prompt_ctx, &bos, 1, 0, params.n_threads))
+        {
+            rm->prompt_tokens.clear();
+            return "failed to eval";
+        }
+        rm->prompt_tokens = {bos};
+        rm->trimmed = false;
+        return "";
+    }
+
+    std::vector<ResidentModel *> resident_models()
+    {
+        std::lock_guard<std::mutex> lg(resident_lock);
+        std::vector<ResidentModel *> models;
+        for (auto &resident_ent : resident)
+        {
+            models.push_back(resident_ent.second.get());
+        }
+        return models;
+    }
+
+    std::map<std::string, ModelMemory> resident_memory() override
+    {
+        std::map<std::string, ModelMemory> memory;
+        std::lock_guard<std::mutex> lg(resident_lock);
+        for (auto &resident_ent : resident)
+        {
+            const auto *rm = resident_ent.second.get();
+            auto &model_memory = memory[resident_ent.first];
+            model_memory.weights = llama_model_get_resident_size(rm->model);
+            // reading residency is safe while the contexts are in use, which they're never freed while resident
+            model_memory.prompt_context = rm->prompt_ctx ? llama_get_resident_size(rm->prompt_ctx) : 0;
+            model_memory.embedding_context = rm->embd_ctx ? llama_get_resident_size(rm->embd_ctx) : 0;
+        }
+        return memory;
+    }
+
+    size_t trim(bool weights) override
+    {
+        size_t released = 0;
+        for (auto *rm : resident_models())
+        {
+            if (rm->prompt_ctx)
+            {
+                released += llama_release_memory(rm->prompt_ctx);
+                rm->prompt_tokens.clear();
+                rm->trimmed = true;
+            }
+
+            {
+                std::lock_guard<std::mutex> lg(rm->embd_lock);
+                if (rm->embd_ctx)
+                {
+                    released += llama_release_memory(rm->embd_ctx);
+                    rm->embd_tokens.clear();
+                }
+            }
+
+            if (weights)
+            {
+                released += llama_model_release_memory(rm->model);
+                rm->trimmed = true;
+            }
+        }
+        return released;
+    }
+
+    void warm_up(const gpt_params &params) override
+    {
+        auto *rm = find_resident(params.model);
+        if (!rm || !rm->trimmed || !rm->prompt_ctx)
+        {
+            return;
+        }
+
+        const int64_t t_start_us = llama_time_us();
+        auto error = warm(rm, params);
+        if (error.empty())
+        {
+            HTTP_LOGGER("Warmed up %s in %.1f ms\n", params.model.c_str(), (llama_time_us() - t_start_us) / 1000.0);
+        }
+        else
+        {
+            HTTP_LOGGER("error: unable to warm up %s: %s\n", params.model.c_str(), error.c_str());
+        }
+    }
+
+    std::string embed(const gpt_params &params, const std::vector<std::string> &texts,
+                      std::vector<float> &embeddings, int *n_embd) override
+    {
+        auto *rm = load_resident(params);
+        if (!rm)
+        {
+            return "unable to load model";
+        }
+
+        std::lock_guard<std::mutex> lg(rm->embd_lock);
+        if (!rm->embd_ctx)
+        {
+            auto lparams = llama_context_params_from_gpt_params(params);
+            lparams.embedding = true;
+            rm->embd_ctx = llama_new_context_with_model(rm->model, lparams);
+            if (!rm->embd_ctx)
+            {
+                return "unable to create a context";
+            }
+        }
+
+        llama_lora_adapter *adapter;
+        if (!find_adapter(rm, params.lora_adapter, &adapter) ||
+            !set_adapter(rm->embd_ctx, adapter, &rm->embd_adapter, rm->embd_tokens))
+        {
+            return "unable to apply LoRA adapter";
+        }
+
+        llama_context *ctx = rm->embd_ctx;
+        const int n_ctx = llama_n_ctx(ctx);
+        *n_embd = llama_n_embd(ctx);
+
+        std::vector<std::vector<llama_token>> tokens(texts.size());
+        for (size_t i = 0; i < texts.size(); i++)
+        {
+            tokens[i] = ::llama_tokenize(ctx, texts[i], true);
+            if ((int)tokens[i].size() > n_ctx)
+            {
+                return "text " + std::to_string(i) + " is too long (" + std::to_string(tokens[i].size()) +
+                       " tokens, max " + std::to_string(n_ctx) + ")";
+            }
+        }
+
+        // there's no way to evaluate independent sequences in one llama_eval(), so rather than packing texts
+        // together they're run back to back in sorted order, each reusing the KV cache for any prefix (e.g. an
+        // instruction) it shares with the text before it
+        std::vector<size_t> order(texts.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&tokens](size_t a, size_t b)
+                  { return tokens[a] < tokens[b]; });
+
+        const size_t offset = embeddings.size();
+        embeddings.resize(offset + texts.size() * *n_embd);
+
+        auto &ctx_tokens = rm->embd_tokens;
+        for (size_t i : order)
+        {
+            const auto &text_tokens = tokens[i];
+
+            // the embedding is that of the last token evaluated, so at least one must be
+            size_t n_past = 0;
+            while (n_past < ctx_tokens.size() && n_past + 1 < text_tokens.size() && ctx_tokens[n_past] == text_tokens[n_past])
+            {
+                n_past++;
+            }
+
+            ctx_tokens.resize(n_past);
+            while (n_past < text_tokens.size())
+            {
+                const int n_eval = std::min((int)(text_tokens.size() - n_past), params.n_batch);
+                if (llama_eval(ctx, text_tokens.data() + n_past, n_eval, n_past, _eval_threads(params, n_eval)))
+                {
+                    ctx_tokens.clear();
+                    return "failed to eval";
+                }
+
+                ctx_tokens.insert(ctx_tokens.end(), text_tokens.begin() + n_past, text_tokens.begin() + n_past + n_eval);
+                n_past += n_eval;
+            }
+
+            memcpy(embeddings.data() + offset + i * *n_embd, llama_get_embeddings(ctx), *n_embd * sizeof(float));
+        }
+
+        return "";
+    }
+
+    std::vector<std::string> run_one_prompt(gpt_params &params, const SamplingParams &sampling, struct llama_timings *timings,
+                                            GenerationStats *stats, const preemption_check &preempt,
+                                            std::shared_ptr<PreemptedGeneration> *preempted, std::string *error) override
+    {
+        GenerationStats local_stats;
+        if (!stats)
+        {
+            stats = &local_stats;
+        }
+
+        // includes the model load, which the requester waits for too
+        const int64_t t_start_us = llama_time_us();
+        stats->start_us = t_start_us;
+
+        llama_model *model;
+        llama_context *ctx = nullptr;
+
+        // verifying drafts needs the logits of every token in the batch, which is what `perplexity` enables. a
+        // preempted generation wasn't speculative, so it resumes as it ran
+        const bool resuming = preempted && *preempted;
+        const bool speculative = !params.model_draft.empty() && !resuming;
+        gpt_params target_params = params;
+        target_params.perplexity = speculative;
+
+        // a LoRA variant's base is kept resident, to be shared with the other variants of it, rather than having
+        // the adapter merged into a copy of its own
+        const bool lora = !params.lora_adapter.empty();
+
+        // a preloaded model's prompts run in its warm context, unless speculative, which needs `perplexity`
+        auto *rm = lora ? load_resident(params) : find_resident(params.model);
+        const bool warm = rm && rm->prompt_ctx && !speculative;
+        if (warm)
+        {
+            model = rm->model;
+            ctx = rm->prompt_ctx;
+            llama_reset_timings(ctx);
+        }
+        else if (rm)
+        {
+            model = rm->model;
+            ctx = llama_new_context_with_model(model, llama_context_params_from_gpt_params(target_params));
+        }
+        else if (lora)
+        {
+            model = nullptr;
+        }
+        else
+        {
+            std::tie(model, ctx) = llama_init_from_gpt_params(target_params);
+        }
+
+        // fails only this prompt, with empty responses, freeing what was loaded for it (but not a resident model)
+        auto fail = [&](const std::string &why)
+        {
+            HTTP_LOGGER("error: %s\n", why.c_str());
+            *error = why;
+            if (ctx && !warm)
+            {
+                llama_free(ctx);
+            }
+            if (preempted)
+            {
+                preempted->reset();
+            }
+            llama_backend_free();
+            return std::vector<std::string>(sampling.n, "");
+        };
+
+        if (model == nullptr)
+        {
+            return fail("unable to load model " + params.model);
+        }
+        if (ctx == nullptr)
+        {
+            return fail("unable to create a context");
+        }
+
+        llama_lora_adapter *adapter = nullptr;
+        if (rm && (!find_adapter(rm, params.lora_adapter, &adapter) ||
+                   (warm ? !set_adapter(ctx, adapter, &rm->prompt_adapter, rm->prompt_tokens)
+                         : adapter && llama_set_lora_adapter(ctx, adapter))))
+        {
+            return fail("unable to apply LoRA adapter " + params.lora_adapter);
+        }
+
+        llama_model *draft_model = nullptr;
+        llama_context *draft_ctx = nullptr;
+        if (speculative)
+        {
+            gpt_params draft_params = params;
+            draft_params.model = params.model_draft;
+            draft_params.lora_adapter = "";
+            std::tie(draft_model, draft_ctx) = llama_init_from_gpt_params(draft_params);
+
+            if (draft_model && llama_n_vocab(draft_ctx) != llama_n_vocab(ctx))
+            {
+                HTTP_LOGGER("error: draft model %s has a different vocabulary; not decoding speculatively\n", params.model_draft.c_str());
+                llama_free(draft_ctx);
+                llama_free_model(draft_model);
+                draft_model = nullptr;
+            }
+            else if (!draft_model)
+            {
+                HTTP_LOGGER("error: unable to load draft model %s; not decoding speculatively\n", params.model_draft.c_str());
+            }
+        }
+
+        struct llama_timings earlier_timings = {};
+        if (resuming)
+        {
+            // reloading the model is overhead the preemption added
+            (*preempted)->stats.preemption_overhead_us += llama_time_us() - t_start_us;
+            earlier_timings = (*preempted)->timings;
+        }
+
+        // the completions run one after another in `ctx`, each after the first reusing the prompt's evaluation
+        std::vector<std::string> responses;
+        if (resuming)
+        {
+            responses = (*preempted)->completed;
+        }
+
+        Sampler sampler;
+        std::vector<llama_token> ctx_tokens;
+        if (warm)
+        {
+            ctx_tokens.swap(rm->prompt_tokens);
+        }
+        for (int i = responses.size(); i < sampling.n; i++)
+        {
+            sampler.reset(completion_sampling(sampling, i));
+            if (draft_model)
+            {
+                responses.push_back(generate_speculative(ctx, draft_ctx, params, sampler, stats));
+                continue;
+            }
+
+            auto response = generate(ctx, params, ctx_tokens, sampler, stats, preempt, preempted);
+            if (preempted && *preempted)
+            {
+                (*preempted)->completed = responses;
+                responses.push_back(response);
+                break;
+            }
+            responses.push_back(response);
+        }
+
+        auto local_timings = llama_get_timings(ctx);
+        if (warm)
+        {
+            // it was loaded at startup, not for this prompt
+            local_timings.t_load_ms = 0;
+        }
+        if (draft_model)
+        {
+            // the draft's evaluations are part of decoding
+            auto draft_timings = llama_get_timings(draft_ctx);
+            local_timings.t_eval_ms += draft_timings.t_p_eval_ms + draft_timings.t_eval_ms;
+        }
+        if (resuming)
+        {
+            _add_timings(&local_timings, earlier_timings);
+        }
+        // sampling happens outside llama_sample_*()
+        local_timings.t_sample_ms = stats->sample_us / 1000.0;
+        local_timings.n_sample = stats->n_generated;
+
+        if (preempted && *preempted)
+        {
+            (*preempted)->timings = local_timings;
+        }
+
+        if (timings)
+        {
+            memcpy(timings, &local_timings, sizeof(struct llama_timings));
+        }
+
+        if (draft_model)
+        {
+            llama_free(draft_ctx);
+            llama_free_model(draft_model);
+        }
+
+        if (warm)
+        {
+            rm->prompt_tokens.swap(ctx_tokens);
+        }
+        else
+        {
+            llama_free(ctx);
+        }
+
+        if (!rm)
+        {
+            llama_free_model(model);
+        }
+
+        llama_backend_free();
+
+        return responses;
+    }
+};
+
+std::unique_ptr<InferenceBackend> make_llama_backend()
+{
+    return std::unique_ptr<InferenceBackend>(new LlamaBackend);
+}
+
+bool parse_synthetic_backend_options(const std::string &spec, SyntheticBackendOptions &options)
+{
+    std::stringstream ss(spec);
+    std::string ent;
+    while (std::getline(ss, ent, ','))
+    {
+        if (ent.empty())
+        {
+            continue;
+        }
+
+        auto eq = ent.find('=');
+        if (eq == std::string::npos)
+        {
+            return false;
+        }
+
+        const auto key = ent.substr(0, eq);
+        const auto value = ent.substr(eq + 1);
+        try
+        {
+            if (key == "load_ms")
+            {
+                options.load_ms = std::stof(value);
+            }
+            else if (key == "prefill_tokens_per_s")
+            {
+                options.prefill_tokens_per_s = std::stof(value);
+            }
+            else if (key == "token_ms")
+            {
+                options.token_ms = std::stof(value);
+            }
+            else if (key == "n_predict")
+            {
+                options.n_predict = std::stoi(value);
+            }
+            else if (key == "kv_bytes_per_token")
+            {
+                options.kv_bytes_per_token = std::stoull(value);
+            }
+            else if (key == "n_vocab")
+            {
+                options.n_vocab = std::stoull(value);
+            }
+            else if (key == "n_embd")
+            {
+                options.n_embd = std::stoi(value);
+            }
+            else
+            {
+                return false;
+            }
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+    }
+
+    return options.prefill_tokens_per_s > 0 && options.token_ms >= 0 && options.load_ms >= 0 && options.n_vocab > 0 &&
+           options.n_embd > 0;
+}
+
+struct SyntheticBackend : InferenceBackend
+{
+    SyntheticBackendOptions options;
+
+    std::mutex preloaded_lock;
+    std::set<std::string> preloaded; // models whose prompts skip the load delay
+
+    SyntheticBackend(const SyntheticBackendOptions &options) : options(options) {}
+
+    std::string preload(const gpt_params &params) override
+    {
+        std::this_thread::sleep_for(std::chrono::duration<float, std::milli>(options.load_ms));
+        std::lock_guard<std::mutex> lg(preloaded_lock);
+        preloaded.insert(params.model);
+        return "";
+    }
+
+    // it keeps nothing between prompts but the set of preloaded models, so has nothing to trim or warm up
+    std::map<std::string, ModelMemory> resident_memory() override
+    {
+        std::map<std::string, ModelMemory> memory;
+        std::lock_guard<std::mutex> lg(preloaded_lock);
+        for (const auto &model : preloaded)
+        {
+            memory[model] = ModelMemory{};
+        }
+        return memory;
+    }
+
+    size_t trim(bool) override
+    {
+        return 0;
+    }
+
+    void warm_up(const gpt_params &) override {}
+
+    // deterministic unit vectors for each text, after sleeping as long as prefilling them would take
+    std::string embed(const gpt_params &, const std::vector<std::string> &texts,
+                      std::vector<float> &embeddings, int *n_embd) override
+    {
+        using namespace std::chrono;
+        *n_embd = options.n_embd;
+
+        size_t n_tokens = 0;
+        for (const auto &text : texts)
+        {
+            n_tokens += 1 + text.size() / 4;
+        }
+        std::this_thread::sleep_for(duration<float>(n_tokens / options.prefill_tokens_per_s));
+
+        for (const auto &text : texts)
+        {
+            std::mt19937 rng(std::hash<std::string>{}(text));
+            std::normal_distribution<float> normal;
+            const size_t offset = embeddings.size();
+            float sum_sq = 0.0f;
+            for (int i = 0; i < options.n_embd; i++)
+            {
+                embeddings.push_back(normal(rng));
+                sum_sq += embeddings.back() * embeddings.back();
+            }
+
+            const float norm = sqrtf(sum_sq);
+            for (size_t i = offset; i < embeddings.size(); i++)
+            {
+                embeddings[i] /= norm;
+            }
+        }
+
+        return "";
+    }
+
+    // a preempted generation spills the KV cache it has touched & resumes from it, & completions share the prompt's
+    // prefill, as with the llama backend
+    std::vector<std::string> run_one_prompt(gpt_params &params, const SamplingParams &sampling, struct llama_timings *timings,
+                                            GenerationStats *stats, const preemption_check &preempt,
+                                            std::shared_ptr<PreemptedGeneration> *preempted, std::string *) override
+    {
+        using namespace std::chrono;
+        static const char *words[] = {
+            " the", " llama", " alpaca", " is", " a", " domesticated", " camelid", " of", " South", " America",
+            ",", " and", " its", " fleece", " was", " prized", " by", " the", " Inca", "."};
+        const size_t n_words = sizeof(words) / sizeof(words[0]);
+
+        GenerationStats local_stats;
+        if (!stats)
+        {
+            stats = &local_stats;
+        }
+
+        std::shared_ptr<PreemptedGeneration> resumed;
+        if (preempted)
+        {
+            resumed.swap(*preempted);
+        }
+
+        bool warm;
+        {
+            std::lock_guard<std::mutex> lg(preloaded_lock);
+            warm = preloaded.count(params.model);
+        }
+
+        const int64_t t_start_us = llama_time_us();
+        auto deadline = steady_clock::now() + duration_cast<steady_clock::duration>(duration<float, std::milli>(warm ? 0.0f : options.load_ms));
+        std::this_thread::sleep_until(deadline);
+        const int64_t t_load_us = llama_time_us() - t_start_us;
+
+        // roughly what a SentencePiece vocabulary averages for English, plus BOS
+        const int n_prompt = resumed ? resumed->stats.n_prompt_evaluated : 1 + (int)(params.prompt.size() / 4);
+        if (n_prompt > params.n_ctx - 4)
+        {
+            HTTP_LOGGER("error: prompt too long (%d tokens, max %d)\n", n_prompt, params.n_ctx - 4);
+            return std::vector<std::string>(sampling.n);
+        }
+
+        // a real context allocates its whole KV cache & logits up front but only faults in what it writes
+        std::unique_ptr<uint8_t[]> kv(new uint8_t[(size_t)params.n_ctx * options.kv_bytes_per_token]);
+        std::vector<float> logits(options.n_vocab);
+        auto touch_kv = [this, &kv](int from, int to)
+        {
+            memset(kv.get() + (size_t)from * options.kv_bytes_per_token, 0, (size_t)(to - from) * options.kv_bytes_per_token);
+        };
+
+        std::vector<std::string> responses;
+        std::string resumed_response;
+        int n_resumed = 0;   // tokens the resumed completion had generated
+        int n_prefilled = 0; // prompt tokens in the KV cache
+
+        // stops with the first `n_used` tokens' KV cache kept, to resume from
+        auto spill = [&](int n_used, const std::string &response)
+        {
+            const int64_t t_save_start_us = llama_time_us();
+            std::shared_ptr<PreemptedGeneration> saved(new PreemptedGeneration);
+            saved->state.assign(kv.get(), kv.get() + (size_t)n_used * options.kv_bytes_per_token);
+            saved->ctx_tokens.resize(n_used);
+            saved->response = response;
+            saved->completed = responses;
+            stats->n_preemptions++;
+            stats->preemption_overhead_us += llama_time_us() - t_save_start_us;
+            saved->stats = *stats;
+            saved->preempted_us = llama_time_us();
+            *preempted = saved;
+        };
+
+        if (resumed)
+        {
+            const int64_t t_restore_start_us = llama_time_us();
+            _resume_stats(stats, *resumed);
+            memcpy(kv.get(), resumed->state.data(), resumed->state.size());
+            responses = resumed->completed;
+            resumed_response = resumed->response;
+            n_prefilled = std::min((int)resumed->ctx_tokens.size(), n_prompt);
+            n_resumed = (int)resumed->ctx_tokens.size() - n_prefilled;
+            // reloading is overhead the preemption added
+            stats->preemption_overhead_us += t_load_us + llama_time_us() - t_restore_start_us;
+        }
+        else
+        {
+            stats->start_us = t_start_us;
+            stats->n_prompt_evaluated = n_prompt;
+            stats->n_prompt_reused = 0;
+            stats->n_generated = 0;
+        }
+
+        // n_batch tokens at a time, checking between chunks whether to stop, as the llama backend does
+        const int n_prefilled_before = n_prefilled;
+        const int64_t t_prefill_start_us = llama_time_us();
+        while (n_prefilled < n_prompt)
+        {
+            const int n_chunk = std::min(n_prompt - n_prefilled, std::max(1, params.n_batch));
+            touch_kv(n_prefilled, n_prefilled + n_chunk);
+            deadline += duration_cast<steady_clock::duration>(duration<float>(n_chunk / options.prefill_tokens_per_s));
+            std::this_thread::sleep_until(deadline);
+            n_prefilled += n_chunk;
+
+            if (n_prefilled < n_prompt && preempt && preempted && preempt())
+            {
+                spill(n_prefilled, "");
+                break;
+            }
+        }
+        const int64_t t_prefill_us = llama_time_us() - t_prefill_start_us;
+
+        if (n_prefilled == n_prompt && stats->decode_start_us < 0)
+        {
+            stats->decode_start_us = llama_time_us();
+        }
+
+        const int n_predict = std::min(options.n_predict, params.n_ctx - n_prompt);
+        const int n_generated_before = stats->n_generated;
+        const int64_t t_decode_start_us = llama_time_us();
+        deadline = std::max(deadline, steady_clock::now());
+
+        const int first = responses.size();
+        for (int c = first; c < sampling.n && !(preempted && *preempted); c++)
+        {
+            // deterministic for a given prompt & completion
+            size_t word = std::hash<std::string>{}(params.prompt) + c;
+            const int i_start = c == first ? n_resumed : 0;
+            for (int i = 0; i < i_start; i++)
+            {
+                word = word * 6364136223846793005ULL + 1442695040888963407ULL;
+            }
+            std::string response = c == first ? resumed_response : "";
+
+            for (int i = i_start; i < n_predict; i++)
+            {
+                deadline += duration_cast<steady_clock::duration>(duration<float, std::milli>(options.token_ms));
+                std::this_thread::sleep_until(deadline);
+
+                touch_kv(n_prompt + i, n_prompt + i + 1);
+                std::fill(logits.begin(), logits.end(), 0.0f);
+
+                if (!stats->n_generated++)
+                {
+                    stats->first_token_us = llama_time_us();
+                }
+
+                word = word * 6364136223846793005ULL + 1442695040888963407ULL;
+                response += words[(word >> 33) % n_words];
+
+                if (preempt && preempted && i + 1 < n_predict && preempt())
+                {
+                    spill(n_prompt + i + 1, response);
+                    break;
+                }
+            }
+
+            responses.push_back(response);
+        }
+
+        if (!preempted || !*preempted)
+        {
+            stats->end_us = llama_time_us();
+        }
+
+        struct llama_timings local_timings = {};
+        local_timings.t_start_ms = stats->start_us / 1000.0;
+        local_timings.t_end_ms = llama_time_us() / 1000.0;
+        local_timings.t_load_ms = t_load_us / 1000.0;
+        local_timings.t_p_eval_ms = t_prefill_us / 1000.0;
+        local_timings.t_eval_ms = (llama_time_us() - t_decode_start_us) / 1000.0;
+        local_timings.n_p_eval = n_prefilled - n_prefilled_before;
+        local_timings.n_eval = stats->n_generated - n_generated_before;
+        if (resumed)
+        {
+            _add_timings(&local_timings, resumed->timings);
+        }
+        local_timings.n_sample = stats->n_generated;
+
+        if (preempted && *preempted)
+        {
+            (*preempted)->timings = local_timings;
+        }
+
+        if (timings)
+        {
+            memcpy(timings, &local_timings, sizeof(struct llama_timings));
+        }
+
+        return responses;
+    }
+};
+
+std::unique_ptr<InferenceBackend> make_synthetic_backend(const SyntheticBackendOptions &options)
+{
+    return std::unique_ptr<InferenceBackend>(new SyntheticBackend(options));
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "common.h"
+#include "llama.h"
+#include "sampling.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// accumulates across the generations it's passed to, as the completions of one request are
+struct GenerationStats
+{
+    int n_prompt_evaluated = 0; // prompt tokens actually evaluated
+    int n_prompt_reused = 0;    // prompt tokens reused from the KV cache
+    int n_generated = 0;
+    int n_drafted = 0;          // when decoding speculatively
+    int n_draft_accepted = 0;
+    int64_t sample_us = 0;        // spent choosing tokens from the logits
+    int n_preemptions = 0;
+    int64_t preemption_overhead_us = 0; // spent saving & restoring state when preempted, including reloading models
+    int64_t start_us = -1;
+    int64_t decode_start_us = -1; // once the prompt has been evaluated
+    int64_t first_token_us = -1;  // -1 if no token was generated
+    int64_t end_us = -1;
+};
+
+// a generation stopped at a token boundary (or between chunks of its prompt), with all it needs to resume exactly
+// where it left off
+struct PreemptedGeneration
+{
+    std::vector<uint8_t> state;          // the context's state, chiefly its KV cache trimmed to the tokens in use
+    std::vector<llama_token> ctx_tokens; // resident in that KV cache
+    std::vector<llama_token> pending;    // yet to be evaluated: the rest of the prompt, or the token last sampled
+    std::string response;                // so far
+    Sampler sampler;
+    GenerationStats stats;
+    struct llama_timings timings = {};   // of the work done so far
+    int64_t preempted_us = -1;           // when, by llama_time_us()
+    std::vector<std::string> completed;  // of the request's completions, those done before this one
+    bool crashed = false;                // it wasn't preempted: what was running it died, & it starts over
+};
+
+// polled at each token boundary & between prompt chunks: once it returns true, the generation stops there to be
+// resumed later
+using preemption_check = std::function<bool()>;
+
+// evaluates `params.prompt` in `ctx` (`params.n_batch` tokens at a time) & samples with `sampler` until end of
+// stream or the context is full.
+// `ctx_tokens` must hold the tokens already resident in `ctx`'s KV cache (empty for a fresh context): any leading
+// run of them shared with the new prompt is kept rather than re-evaluated (so completions generated one after another
+// in the same context share their prompt's evaluation). On return it holds the tokens now resident.
+// If `preempt` stops the generation, it's saved to `*preempted` & what it has generated so far is returned; a
+// `*preempted` set on entry is resumed (in a fresh context) instead of starting anew, & is cleared if it completes.
+std::string generate(
+    llama_context *ctx,
+    gpt_params &params,
+    std::vector<llama_token> &ctx_tokens,
+    Sampler &sampler,
+    GenerationStats *stats = nullptr,
+    const preemption_check &preempt = nullptr,
+    std::shared_ptr<PreemptedGeneration> *preempted = nullptr);
+
+// like generate() in a fresh context, but each step drafts up to `params.n_draft` tokens with the (much cheaper)
+// `draft_ctx` & verifies them all in one batched evaluation of `ctx`, which must have been created with `logits_all`.
+// Greedy sampling accepts drafts that match the target's own choice exactly; otherwise drafts are accepted by
+// rejection sampling against the distribution `sampler` builds from the target's logits. Either way the output is
+// distributed exactly as if `ctx` had generated it alone. The two models must share a vocabulary.
+std::string generate_speculative(
+    llama_context *ctx,
+    llama_context *draft_ctx,
+    gpt_params &params,
+    Sampler &sampler,
+    GenerationStats *stats = nullptr);
+
+// the bytes of a kept model's memory resident in RAM, by what it holds
+struct ModelMemory
+{
+    size_t weights = 0;
+    size_t prompt_context = 0;    // the KV cache & compute buffers of the context it was preloaded with
+    size_t embedding_context = 0; // likewise, of the context it computes embeddings in
+};
+
+// what the servicer loop runs each prompt on: turns `params.prompt` into `sampling.n` responses using the model
+// at `params.model`, sampled as `sampling` says, filling `timings` & `stats` (either of which may be null) as it
+// does so. `preempt` & `preempted` are as for generate(), & `timings` & `stats` of a resumed generation cover
+// all of it. speculative decoding is never preempted. if the prompt can't be run at all (its model fails to load,
+// say), its responses are empty & `*error` is set to why.
+struct InferenceBackend
+{
+    virtual ~InferenceBackend() {}
+    virtual std::vector<std::string> run_one_prompt(gpt_params &params, const SamplingParams &sampling, struct llama_timings *timings,
+                                       GenerationStats *stats, const preemption_check &preempt,
+                                       std::shared_ptr<PreemptedGeneration> *preempted, std::string *error) = 0;
+
+    // keeps the model at `params.model` loaded (locked in memory if `params.use_mlock`) along with a context its
+    // prompts reuse, warmed by a one-token evaluation, so that its first prompt waits no longer than those after
+    // it. returns an empty string on success, else why it failed.
+    virtual std::string preload(const gpt_params &params) = 0;
+
+    // computes the embedding of each of `texts` with the model at `params.model`, appending them in order to
+    // `embeddings` & setting `*n_embd`. may be called concurrently with run_one_prompt() & with itself. returns
+    // an empty string on success, else why it failed.
+    virtual std::string embed(const gpt_params &params, const std::vector<std::string> &texts,
+                              std::vector<float> &embeddings, int *n_embd) = 0;
+
+    // the resident memory of each model kept loaded (by preload() or embed()), by path. may be called concurrently
+    // with anything else.
+    virtual std::map<std::string, ModelMemory> resident_memory() = 0;
+
+    // for when there are no prompts to run: gives the memory of kept contexts' KV caches & compute buffers back to
+    // the OS, emptying them, &, if `weights`, that of memory-mapped & unlocked weights, all of which are faulted
+    // back in as they're next used. never called concurrently with run_one_prompt(). returns the bytes released.
+    virtual size_t trim(bool weights) = 0;
+
+    // if the model at `params.model` was trimmed since it was last used, restores it as preload() left it (warming
+    // its context, which faults back in its weights & buffers) before its prompt runs
+    virtual void warm_up(const gpt_params &params) = 0;
+};
+
+// loads the model & a context for each prompt & frees them once it is complete, unless it was preloaded. if `params.model_draft`
+// is set, that model is loaded too & decoding is speculative. a model used for embeddings stays resident
+// with a context of its own, & prompts for it then share its weights rather than loading another copy.
+std::unique_ptr<InferenceBackend> make_llama_backend();
+
+struct SyntheticBackendOptions
+{
+    float load_ms = 0.0f;            // simulated time to load the model, per prompt
+    float prefill_tokens_per_s = 500.0f;
+    float token_ms = 20.0f;          // simulated per-token decode latency
+    int n_predict = 128;             // tokens to emit, if the context has room for them
+    size_t kv_bytes_per_token = 2 * 32 * 4096 * sizeof(uint16_t); // f16 K & V for a 7B model's 32 layers
+    size_t n_vocab = 32000;          // sizes the logits buffer
+    int n_embd = 4096;               // dimensions of the embeddings it returns
+};
+
+// parses a comma-separated list of `key=value` pairs (keys named as in SyntheticBackendOptions, e.g.
+// "token_ms=5,prefill_tokens_per_s=2000") over the defaults. returns false on an unknown key or bad value.
+bool parse_synthetic_backend_options(const std::string &spec, SyntheticBackendOptions &options);
+
+// loads nothing & emits deterministic filler text at the configured rates, without model weights. It
+// allocates & touches a KV-cache-sized buffer as it goes, so memory behaves like a real context's.
+std::unique_ptr<InferenceBackend> make_synthetic_backend(const SyntheticBackendOptions &options);
+
+// runs prompts in `n_workers` worker processes rather than in this one, so that a crash (in a model, context or
+// kernel) fails only the prompt it was running, which is requeued to start over, & that worker is replaced. each
+// worker starts with a copy of `inner` (which must not yet have loaded anything) & `params`, which it runs prompts
+// with but for the fields the servicer sets for each; being memory-mapped, the weights of the models they load are
+// shared through the page cache. work & results go to & fro over rings in shared memory. embeddings are computed in
+// this process, by `inner`. must be called before this process starts any threads (other than those of ggml, which
+// end with each evaluation). returns nullptr if worker processes aren't supported (anywhere but Linux).
+std::unique_ptr<InferenceBackend> make_process_backend(std::unique_ptr<InferenceBackend> inner, int n_workers, const gpt_params &params);
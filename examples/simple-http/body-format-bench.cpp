@@ -0,0 +1,145 @@
+// the cost of encoding & parsing simple-http's request & response bodies as JSON, CBOR & MessagePack: a POST /prompt
+// body, a finished GET /prompt/:id result & a POST /embeddings response (whose vectors are packed in the binary
+// formats), reporting each one's size & microseconds per encode & parse
+#include "body-format.h"
+#include "deps/json/single_include/nlohmann/json.hpp"
+#include "deps/popl/include/popl.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#define BENCH_LOGGER(fmt_str, ...) fprintf(stderr, "[bench] " fmt_str, ##__VA_ARGS__)
+
+using bench_clock = std::chrono::steady_clock;
+
+static std::string _words(std::mt19937 &rng, int n)
+{
+    static const char *words[] = {"the", "llama", "is", "a", "domesticated", "South", "American", "camelid", "widely", "used", "for", "meat", "and", "pack", "animal"};
+    std::string out;
+    for (int i = 0; i < n; i++)
+    {
+        out += (i ? " " : "") + std::string(words[rng() % (sizeof(words) / sizeof(words[0]))]);
+    }
+    return out;
+}
+
+static nlohmann::json _embeddings_body(const std::vector<float> &embeddings, int n_texts, int n_embd, BodyFormat format)
+{
+    nlohmann::json json{{"model", "model.bin"}, {"dimensions", n_embd}, {"elapsed_ms", 123}};
+    auto &vectors = json["embeddings"] = nlohmann::json::array();
+    for (int i = 0; i < n_texts; i++)
+    {
+        vectors.push_back(pack_floats(embeddings.data() + i * n_embd, n_embd, format));
+    }
+    return json;
+}
+
+// microseconds per call of `fn`, over `n` calls
+template <typename F>
+static double _us_per(int n, F fn)
+{
+    const auto start = bench_clock::now();
+    for (int i = 0; i < n; i++)
+    {
+        fn();
+    }
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count() / n;
+}
+
+int main(int argc, char **argv)
+{
+    popl::OptionParser op("allowed options");
+    auto help_opt = op.add<popl::Switch>("h", "help", "This help");
+    auto iters_opt = op.add<popl::Value<int>>("n", "iterations", "Times each body is encoded & parsed in each format", 200);
+    auto texts_opt = op.add<popl::Value<int>>("e", "embeddings", "Texts in the embeddings response", 32);
+    auto dims_opt = op.add<popl::Value<int>>("d", "dimensions", "Dimensions of each embedding", 4096);
+    auto tokens_opt = op.add<popl::Value<int>>("t", "tokens", "Words in the prompt & in the result's response", 512);
+    op.parse(argc, argv);
+
+    if (help_opt->is_set())
+    {
+        std::cout << argv[0] << " " << op.help();
+        return 0;
+    }
+
+    const int n_iters = iters_opt->value(), n_texts = texts_opt->value(), n_embd = dims_opt->value();
+    std::mt19937 rng(42);
+    std::normal_distribution<float> normal;
+    std::vector<float> embeddings(n_texts * n_embd);
+    for (auto &f : embeddings)
+    {
+        f = normal(rng) * 0.02f;
+    }
+
+    const nlohmann::json prompt{
+        {"model", "model.bin"},
+        {"prompt", _words(rng, tokens_opt->value())},
+        {"priority", "NORMAL"},
+        {"temperature", 0.7},
+        {"top_p", 0.9},
+        {"seed", 1234},
+        {"n", 1},
+    };
+    const nlohmann::json result{
+        {"prompt", prompt["prompt"]},
+        {"response", _words(rng, tokens_opt->value())},
+        {"elapsed_ms", 10234.5},
+        {"tokens", tokens_opt->value()},
+        {"model", "model.bin"},
+        {"ms_per_token", 19.99},
+        {"queue_ms", 12},
+        {"e2e_ms", 10250},
+        {"ttft_ms", 230},
+    };
+
+    nlohmann::json report = nlohmann::json::object();
+    for (const auto format : {BodyFormat::JSON, BodyFormat::CBOR, BodyFormat::MessagePack})
+    {
+        const std::string name = format == BodyFormat::JSON ? "json" : format == BodyFormat::CBOR ? "cbor" : "msgpack";
+        BENCH_LOGGER("Measuring %s\n", name.c_str());
+
+        auto &by_body = report[name];
+        for (const auto &body : {std::make_pair("prompt", prompt), std::make_pair("result", result)})
+        {
+            const std::string encoded = encode_body(body.second, format);
+            by_body[body.first] = {
+                {"bytes", encoded.size()},
+                {"encode_us", _us_per(n_iters, [&]()
+                                      { encode_body(body.second, format); })},
+                {"parse_us", _us_per(n_iters, [&]()
+                                     { parse_body(encoded, format); })},
+            };
+        }
+
+        // building the body (as the endpoint does) is part of encoding it, & reading the floats back out of
+        // parsing it
+        const std::string encoded = encode_body(_embeddings_body(embeddings, n_texts, n_embd, format), format);
+        std::vector<float> unpacked;
+        by_body["embeddings"] = {
+            {"bytes", encoded.size()},
+            {"encode_us", _us_per(n_iters, [&]()
+                                  { encode_body(_embeddings_body(embeddings, n_texts, n_embd, format), format); })},
+            {"parse_us", _us_per(n_iters, [&]()
+                                 {
+                auto parsed = parse_body(encoded, format);
+                unpacked.clear();
+                for (const auto &vector : parsed["embeddings"])
+                {
+                    unpack_floats(vector, unpacked);
+                } })},
+        };
+
+        if (unpacked.size() != embeddings.size())
+        {
+            BENCH_LOGGER("%s embeddings read back as %zu floats, not %zu\n", name.c_str(), unpacked.size(), embeddings.size());
+            return 1;
+        }
+    }
+
+    std::cout << report.dump(2) << std::endl;
+    return 0;
+}
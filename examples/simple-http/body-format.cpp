@@ -0,0 +1,174 @@
+#include "body-format.h"
+
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+
+// RFC 8746's tag for a typed array of little-endian float32s
+const uint64_t CBOR_TAG_FLOAT32_LE = 85;
+
+static bool _little_endian()
+{
+    const uint16_t probe = 1;
+    return *(const uint8_t *)&probe == 1;
+}
+
+static BodyFormat _media_type_format(std::string type, bool *known)
+{
+    type = type.substr(0, type.find(';'));
+    type.erase(0, type.find_first_not_of(" \t"));
+    type.erase(type.find_last_not_of(" \t") + 1);
+
+    *known = true;
+    if (!strcasecmp(type.c_str(), "application/cbor"))
+    {
+        return BodyFormat::CBOR;
+    }
+    if (!strcasecmp(type.c_str(), "application/msgpack") || !strcasecmp(type.c_str(), "application/x-msgpack") ||
+        !strcasecmp(type.c_str(), "application/vnd.msgpack"))
+    {
+        return BodyFormat::MessagePack;
+    }
+
+    *known = !strcasecmp(type.c_str(), "application/json");
+    return BodyFormat::JSON;
+}
+
+BodyFormat body_format_of(const std::string &media_types)
+{
+    size_t start = 0;
+    while (start <= media_types.size())
+    {
+        size_t comma = media_types.find(',', start);
+        if (comma == std::string::npos)
+        {
+            comma = media_types.size();
+        }
+
+        bool known;
+        const auto format = _media_type_format(media_types.substr(start, comma - start), &known);
+        if (known)
+        {
+            return format;
+        }
+        start = comma + 1;
+    }
+    return BodyFormat::JSON;
+}
+
+const char *body_format_media_type(BodyFormat format)
+{
+    switch (format)
+    {
+    case BodyFormat::CBOR:
+        return "application/cbor";
+    case BodyFormat::MessagePack:
+        return "application/msgpack";
+    default:
+        return "application/json";
+    }
+}
+
+nlohmann::json parse_body(const std::string &body, BodyFormat format)
+{
+    switch (format)
+    {
+    case BodyFormat::CBOR:
+        // keeping tags, so that a tagged typed array reads as binary with the tag as its subtype
+        return nlohmann::json::from_cbor(body, true, false, nlohmann::json::cbor_tag_handler_t::store);
+    case BodyFormat::MessagePack:
+        return nlohmann::json::from_msgpack(body, true, false);
+    default:
+        return nlohmann::json::parse(body, nullptr, false);
+    }
+}
+
+std::string encode_body(const nlohmann::json &json, BodyFormat format)
+{
+    std::string out;
+    switch (format)
+    {
+    case BodyFormat::CBOR:
+        nlohmann::json::to_cbor(json, out);
+        return out;
+    case BodyFormat::MessagePack:
+        nlohmann::json::to_msgpack(json, out);
+        return out;
+    default:
+        return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+    }
+}
+
+nlohmann::json pack_floats(const float *floats, size_t n, BodyFormat format)
+{
+    if (format == BodyFormat::JSON)
+    {
+        return std::vector<float>(floats, floats + n);
+    }
+
+    std::vector<uint8_t> packed((const uint8_t *)floats, (const uint8_t *)(floats + n));
+    if (!_little_endian())
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            std::reverse(packed.begin() + i * sizeof(float), packed.begin() + (i + 1) * sizeof(float));
+        }
+    }
+
+    return format == BodyFormat::CBOR ? nlohmann::json::binary(std::move(packed), CBOR_TAG_FLOAT32_LE)
+                                      : nlohmann::json::binary(std::move(packed));
+}
+
+int packed_floats_size(const nlohmann::json &value)
+{
+    if (value.is_array())
+    {
+        return value.size();
+    }
+
+    // untagged bytes are taken to be float32s too, as MessagePack has no tag to say so
+    if (value.is_binary() && value.get_binary().size() % sizeof(float) == 0 &&
+        (!value.get_binary().has_subtype() || value.get_binary().subtype() == CBOR_TAG_FLOAT32_LE))
+    {
+        return value.get_binary().size() / sizeof(float);
+    }
+    return -1;
+}
+
+bool unpack_floats(const nlohmann::json &value, std::vector<float> &floats)
+{
+    const int n = packed_floats_size(value);
+    if (n < 0)
+    {
+        return false;
+    }
+
+    if (value.is_array())
+    {
+        for (const auto &f : value)
+        {
+            if (!f.is_number())
+            {
+                return false;
+            }
+        }
+        for (const auto &f : value)
+        {
+            floats.push_back(f.get<float>());
+        }
+        return true;
+    }
+
+    const size_t start = floats.size();
+    floats.resize(start + n);
+    memcpy(floats.data() + start, value.get_binary().data(), n * sizeof(float));
+    if (!_little_endian())
+    {
+        for (int i = 0; i < n; i++)
+        {
+            auto *b = (uint8_t *)&floats[start + i];
+            std::reverse(b, b + sizeof(float));
+        }
+    }
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "deps/json/single_include/nlohmann/json.hpp"
+
+#include <string>
+#include <vector>
+
+// the encodings a request or response body may be in instead of JSON, all of the same nlohmann::json values.
+// the binary ones are smaller & quicker to parse & write, & carry vectors of floats as packed bytes rather than text
+enum class BodyFormat
+{
+    JSON,
+    CBOR,
+    MessagePack,
+};
+
+// the format a Content-Type header names, or the first that an Accept header lists (ignoring quality values);
+// JSON if none is recognized
+BodyFormat body_format_of(const std::string &media_types);
+const char *body_format_media_type(BodyFormat format);
+
+// parses `body`; discarded (rather than thrown) if it's malformed
+nlohmann::json parse_body(const std::string &body, BodyFormat format);
+// strings that aren't valid UTF-8 (e.g. a sampled token that splits a character) have it replaced in JSON
+std::string encode_body(const nlohmann::json &json, BodyFormat format);
+
+// `n` floats, as an array of numbers for JSON, else packed little-endian: in CBOR, tagged as an RFC 8746
+// float32 typed array; in MessagePack, as bin
+nlohmann::json pack_floats(const float *floats, size_t n, BodyFormat format);
+// appends the floats in `value`, an array of numbers or packed as pack_floats() does. returns false (having
+// appended nothing) if it's neither
+bool unpack_floats(const nlohmann::json &value, std::vector<float> &floats);
+// the number of floats in `value`, as unpack_floats() would read them, or -1
+int packed_floats_size(const nlohmann::json &value);
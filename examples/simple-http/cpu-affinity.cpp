@@ -0,0 +1,139 @@
+#include "cpu-affinity.h"
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+
+#if defined(__linux__) && !defined(__BIONIC__)
+#include <pthread.h>
+#include <sched.h>
+#define HAVE_THREAD_AFFINITY 1
+#endif
+
+bool parse_cpu_list(const std::string &spec, cpu_list_t *cpus)
+{
+    cpu_list_t parsed;
+    std::stringstream ss(spec);
+    for (std::string range; std::getline(ss, range, ',');)
+    {
+        int first, last;
+        char trailing;
+        if (sscanf(range.c_str(), "%d-%d%c", &first, &last, &trailing) == 2 ||
+            (sscanf(range.c_str(), "%d%c", &first, &trailing) == 1 && (last = first, true)))
+        {
+            if (first < 0 || last < first)
+            {
+                return false;
+            }
+
+            for (int cpu = first; cpu <= last; cpu++)
+            {
+                parsed.push_back(cpu);
+            }
+            continue;
+        }
+
+        return false;
+    }
+
+    std::sort(parsed.begin(), parsed.end());
+    parsed.erase(std::unique(parsed.begin(), parsed.end()), parsed.end());
+    if (parsed.empty())
+    {
+        return false;
+    }
+
+    *cpus = parsed;
+    return true;
+}
+
+std::string format_cpu_list(const cpu_list_t &cpus)
+{
+    std::string formatted;
+    for (size_t i = 0; i < cpus.size();)
+    {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+        {
+            j++;
+        }
+
+        formatted += (formatted.empty() ? "" : ",") + std::to_string(cpus[i]);
+        if (j > i)
+        {
+            formatted += "-" + std::to_string(cpus[j]);
+        }
+        i = j + 1;
+    }
+    return formatted;
+}
+
+cpu_list_t current_thread_cpus()
+{
+    cpu_list_t cpus;
+#ifdef HAVE_THREAD_AFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (!pthread_getaffinity_np(pthread_self(), sizeof(set), &set))
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+#endif
+
+    for (int cpu = 0; cpu < (int)std::max(1u, std::thread::hardware_concurrency()); cpu++)
+    {
+        cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+bool pin_current_thread(const cpu_list_t &cpus)
+{
+#ifdef HAVE_THREAD_AFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        if (cpu >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        CPU_SET(cpu, &set);
+    }
+    return !cpus.empty() && !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+cpu_list_t cpu_list_difference(const cpu_list_t &from, const cpu_list_t &remove)
+{
+    cpu_list_t difference;
+    std::set_difference(from.begin(), from.end(), remove.begin(), remove.end(), std::back_inserter(difference));
+    return difference;
+}
+
+ScopedThreadPin::ScopedThreadPin(const cpu_list_t &cpus)
+{
+    if (!cpus.empty())
+    {
+        previous = current_thread_cpus();
+        pin_current_thread(cpus);
+    }
+}
+
+ScopedThreadPin::~ScopedThreadPin()
+{
+    if (!previous.empty())
+    {
+        pin_current_thread(previous);
+    }
+}
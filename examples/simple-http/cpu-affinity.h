@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// CPUs by number, as /proc/cpuinfo & `taskset -c` number them, in ascending order
+using cpu_list_t = std::vector<int>;
+
+// parses a list of CPUs & ranges of them such as "0-3,8,10-11", as `taskset -c` & isolcpus= take. returns false if
+// `spec` isn't one
+bool parse_cpu_list(const std::string &spec, cpu_list_t *cpus);
+std::string format_cpu_list(const cpu_list_t &cpus);
+
+// the CPUs the calling thread may run on: all of them where affinity isn't supported
+cpu_list_t current_thread_cpus();
+
+// confines the calling thread, & the threads it creates from then on, to `cpus`. returns false if that isn't
+// supported or fails
+bool pin_current_thread(const cpu_list_t &cpus);
+
+// the CPUs of `from` not in `remove`
+cpu_list_t cpu_list_difference(const cpu_list_t &from, const cpu_list_t &remove);
+
+// pins the calling thread to `cpus` (unless empty) for as long as it lives, then restores the CPUs it could run on
+// before
+struct ScopedThreadPin
+{
+    explicit ScopedThreadPin(const cpu_list_t &cpus);
+    ~ScopedThreadPin();
+
+private:
+    cpu_list_t previous;
+};
@@ -0,0 +1,196 @@
+// per-token decode latency & its jitter with & without front-end-like load, & with that load partitioned off onto
+// housekeeping CPUs as simple-http's -C & -K do
+#include "common.h"
+#include "llama.h"
+#include "cpu-affinity.h"
+#include "deps/json/single_include/nlohmann/json.hpp"
+#include "deps/popl/include/popl.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_LOGGER(fmt_str, ...) fprintf(stderr, "[bench] " fmt_str, ##__VA_ARGS__)
+
+using bench_clock = std::chrono::steady_clock;
+
+// what an HTTP front end keeps doing while prompts decode: building, serializing & parsing JSON bodies, & formatting
+// log lines, all of which allocate
+static void _make_noise(const std::atomic<bool> &stop, std::atomic<uint64_t> &n_bodies)
+{
+    while (!stop)
+    {
+        nlohmann::json body{{"model", "noise"}, {"prompt", std::string(2048, 'x')}, {"tokens", nlohmann::json::array()}};
+        for (int i = 0; i < 256; i++)
+        {
+            body["tokens"].push_back(nlohmann::json{{"id", i}, {"logprob", -i / 256.0}});
+        }
+
+        char line[256];
+        snprintf(line, sizeof(line), "[noise] %zu bytes\n", nlohmann::json::parse(body.dump()).dump().size());
+        n_bodies++;
+    }
+}
+
+// milliseconds at the `p`th percentile of sorted `ms`
+static double _percentile(const std::vector<double> &ms, double p)
+{
+    return ms[std::min(ms.size() - 1, (size_t)(p / 100.0 * ms.size()))];
+}
+
+int main(int argc, char **argv)
+{
+    popl::OptionParser op("allowed options");
+    auto help_opt = op.add<popl::Switch>("h", "help", "This help");
+    auto model_opt = op.add<popl::Value<std::string>>("m", "model", "Path to a model binary");
+    auto tokens_opt = op.add<popl::Value<int>>("n", "tokens", "Tokens decoded per mode", 256);
+    auto prompt_opt = op.add<popl::Value<int>>("P", "prompt-tokens", "Tokens evaluated before decoding", 64);
+    auto threads_opt = op.add<popl::Value<int>>("t", "threads", "Threads decoding; 0 for one per inference CPU", 0);
+    auto noise_opt = op.add<popl::Value<int>>("j", "noise-threads", "Threads making front-end-like load; 0 for one per housekeeping CPU", 0);
+    auto inference_cpus_opt = op.add<popl::Value<std::string>>("C", "inference-cpus", "CPUs to decode on in the isolated mode, as for simple-http");
+    auto housekeeping_cpus_opt = op.add<popl::Value<std::string>>("K", "housekeeping-cpus", "CPUs to confine the load to in the isolated mode; defaults to those available but not in -C");
+    auto modes_opt = op.add<popl::Value<std::string>>("M", "modes", "Comma-separated modes to measure: quiet (no load), shared (load on any CPU) & isolated (load on -K, decoding on -C)", "quiet,shared,isolated");
+    op.parse(argc, argv);
+
+    if (help_opt->is_set() || !model_opt->is_set())
+    {
+        std::cout << argv[0] << " " << op.help();
+        return help_opt->is_set() ? 0 : 1;
+    }
+
+    const cpu_list_t available = current_thread_cpus();
+    cpu_list_t inference_cpus = available, housekeeping_cpus = available;
+    if (inference_cpus_opt->is_set())
+    {
+        if (!parse_cpu_list(inference_cpus_opt->value(), &inference_cpus) ||
+            (housekeeping_cpus_opt->is_set() && !parse_cpu_list(housekeeping_cpus_opt->value(), &housekeeping_cpus)))
+        {
+            BENCH_LOGGER("Bad CPU list\n");
+            return 1;
+        }
+
+        if (!housekeeping_cpus_opt->is_set())
+        {
+            housekeeping_cpus = cpu_list_difference(available, inference_cpus);
+        }
+    }
+
+    std::vector<std::string> modes;
+    std::stringstream modes_ss(modes_opt->value());
+    for (std::string mode; std::getline(modes_ss, mode, ',');)
+    {
+        if (mode == "isolated" && (!inference_cpus_opt->is_set() || housekeeping_cpus.empty()))
+        {
+            BENCH_LOGGER("Skipping the isolated mode, which needs -C (& CPUs left over for -K)\n");
+            continue;
+        }
+        modes.push_back(mode);
+    }
+
+    gpt_params params;
+    params.model = model_opt->value();
+    const int n_tokens = std::max(1, tokens_opt->value());
+    params.n_ctx = prompt_opt->value() + n_tokens + 1;
+    params.n_threads = threads_opt->value() > 0 ? threads_opt->value() : inference_cpus.size();
+    const int n_noise = noise_opt->value() > 0 ? noise_opt->value() : std::max<int>(1, housekeeping_cpus.size());
+
+    llama_backend_init(false);
+    llama_model *model;
+    llama_context *ctx;
+    std::tie(model, ctx) = llama_init_from_gpt_params(params);
+    if (!model)
+    {
+        BENCH_LOGGER("Unable to load %s\n", params.model.c_str());
+        return 1;
+    }
+
+    // what's evaluated doesn't affect how long it takes, so any tokens will do
+    const int n_vocab = llama_n_vocab(ctx);
+    std::vector<llama_token> prompt(std::max(1, prompt_opt->value()));
+    prompt[0] = llama_token_bos();
+    for (size_t i = 1; i < prompt.size(); i++)
+    {
+        prompt[i] = (llama_token)((i * 7919) % n_vocab);
+    }
+
+    nlohmann::json report{
+        {"model", params.model},
+        {"threads", params.n_threads},
+        {"noise_threads", n_noise},
+        {"inference_cpus", format_cpu_list(inference_cpus)},
+        {"housekeeping_cpus", format_cpu_list(housekeeping_cpus)},
+    };
+
+    for (const auto &mode : modes)
+    {
+        const bool isolated = mode == "isolated";
+        std::atomic<bool> stop{false};
+        std::atomic<uint64_t> n_bodies{0};
+        std::vector<std::thread> noise;
+        for (int t = 0; mode != "quiet" && t < n_noise; t++)
+        {
+            noise.emplace_back([&, isolated]()
+                               {
+                if (isolated)
+                {
+                    pin_current_thread(housekeeping_cpus);
+                }
+                _make_noise(stop, n_bodies); });
+        }
+
+        // ggml's threads for each evaluation inherit this one's CPUs
+        ScopedThreadPin pin(isolated ? inference_cpus : available);
+        llama_eval(ctx, prompt.data(), prompt.size(), 0, params.n_threads);
+
+        std::vector<double> ms;
+        for (int i = 0; i < n_tokens; i++)
+        {
+            const llama_token token = prompt[(i + 1) % prompt.size()];
+            const auto start = bench_clock::now();
+            llama_eval(ctx, &token, 1, prompt.size() + i, params.n_threads);
+            ms.push_back(std::chrono::duration<double, std::milli>(bench_clock::now() - start).count());
+        }
+
+        stop = true;
+        for (auto &t : noise)
+        {
+            t.join();
+        }
+
+        double mean = 0.0, var = 0.0;
+        for (double m : ms)
+        {
+            mean += m / ms.size();
+        }
+        for (double m : ms)
+        {
+            var += (m - mean) * (m - mean) / ms.size();
+        }
+        std::sort(ms.begin(), ms.end());
+
+        BENCH_LOGGER("%s: p50 %.2f ms, p99 %.2f ms\n", mode.c_str(), _percentile(ms, 50), _percentile(ms, 99));
+        report["modes"][mode] = nlohmann::json{
+            {"mean_ms", mean},
+            {"stddev_ms", sqrt(var)},
+            {"p50_ms", _percentile(ms, 50)},
+            {"p90_ms", _percentile(ms, 90)},
+            {"p99_ms", _percentile(ms, 99)},
+            {"max_ms", ms.back()},
+            {"noise_bodies", (uint64_t)n_bodies},
+        };
+    }
+
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::cout << report.dump(4) << std::endl;
+    return 0;
+}
@@ -0,0 +1,669 @@
+#include "event-server.h"
+#include "http.h"
+#include "common.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <netdb.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// the most a request's line & headers, & then its body, may be
+const size_t EVENT_SERVER_MAX_HEAD_BYTES = 64 * 1024;
+const size_t EVENT_SERVER_MAX_BODY_BYTES = 64 * 1024 * 1024;
+// how long a connection may sit with nothing to do before it's closed, in seconds: long, as holding idle ones is
+// the point, but not forever. & how long one may take over the rest of a request it's begun, or a response it's
+// not reading, so that slow clients can't hold memory indefinitely
+const int64_t EVENT_SERVER_IDLE_TIMEOUT_S = 600;
+const int64_t EVENT_SERVER_REQUEST_TIMEOUT_S = 30;
+
+EventServer &EventServer::Get(const std::string &pattern, Handler handler)
+{
+    get_routes.emplace_back(std::regex(pattern), std::move(handler));
+    return *this;
+}
+
+EventServer &EventServer::Post(const std::string &pattern, Handler handler)
+{
+    post_routes.emplace_back(std::regex(pattern), std::move(handler));
+    return *this;
+}
+
+void EventServer::route(httplib::Request &req, httplib::Response &res) const
+{
+    const _routes_t *routes = req.method == "GET" ? &get_routes : req.method == "POST" ? &post_routes : nullptr;
+    if (!routes)
+    {
+        res.status = 405;
+        return;
+    }
+
+    for (const auto &route : *routes)
+    {
+        if (!std::regex_match(req.path, req.matches, route.first))
+        {
+            continue;
+        }
+
+        try
+        {
+            route.second(req, res);
+        }
+        catch (const std::exception &e)
+        {
+            HTTP_LOGGER("Handler for %s %s threw: %s\n", req.method.c_str(), req.path.c_str(), e.what());
+            res = httplib::Response();
+            res.status = 500;
+        }
+
+        if (res.status == -1)
+        {
+            res.status = 200;
+        }
+        return;
+    }
+
+    res.status = 404;
+}
+
+#ifdef __linux__
+
+static int64_t _now_s()
+{
+    using namespace std::chrono;
+    return duration_cast<seconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+struct _Connection
+{
+    int fd = -1;
+    uint64_t serial = 0; // tells it apart from a later connection given the same fd
+    std::string remote_addr;
+    int remote_port = -1;
+    std::string in;           // received, & not yet handed off as a request
+    std::string out;          // the response yet to be written
+    size_t out_offset = 0;    // how much of `out` has been
+    bool handling = false;    // its request is with a handler thread, so nothing more is read until it's answered
+    bool close_after = false; // once `out` is written
+    bool continued = false;   // "100 Continue" was sent for the request in `in`
+    int64_t active_s = 0;     // when it last made progress
+};
+
+// a complete request, on its way to a handler thread
+struct _Job
+{
+    int fd;
+    uint64_t serial;
+    std::unique_ptr<httplib::Request> req;
+    bool keep_alive;
+};
+
+// & its response, on the way back
+struct _Done
+{
+    int fd;
+    uint64_t serial;
+    std::string out;
+    bool keep_alive;
+};
+
+static std::string _serialize(const httplib::Response &res, bool keep_alive)
+{
+    std::string out = "HTTP/1.1 " + std::to_string(res.status) + " " + httplib::detail::status_message(res.status) + "\r\n";
+    for (const auto &header : res.headers)
+    {
+        if (strcasecmp(header.first.c_str(), "Content-Length") && strcasecmp(header.first.c_str(), "Connection"))
+        {
+            out += header.first + ": " + header.second + "\r\n";
+        }
+    }
+    out += "Content-Length: " + std::to_string(res.body.size()) + "\r\n";
+    out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    out += res.body;
+    return out;
+}
+
+static std::string _trim(const std::string &s)
+{
+    const auto begin = s.find_first_not_of(" \t");
+    return begin == std::string::npos ? "" : s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
+// parses a request's line & headers (`head`, without the blank line that ends them) into `req`. returns an HTTP
+// status to reply with if they're not acceptable, or 0
+static int _parse_head(const std::string &head, httplib::Request *req, bool *keep_alive, size_t *content_length)
+{
+    size_t line_end = head.find("\r\n");
+    const std::string request_line = head.substr(0, line_end);
+    const auto sp1 = request_line.find(' '), sp2 = request_line.rfind(' ');
+    if (sp1 == std::string::npos || sp1 == sp2)
+    {
+        return 400;
+    }
+
+    req->method = request_line.substr(0, sp1);
+    req->target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+    req->version = request_line.substr(sp2 + 1);
+    if (req->version != "HTTP/1.1" && req->version != "HTTP/1.0")
+    {
+        return 505;
+    }
+
+    const auto query = req->target.find('?');
+    req->path = httplib::detail::decode_url(req->target.substr(0, query), false);
+    if (query != std::string::npos)
+    {
+        httplib::detail::parse_query_text(req->target.substr(query + 1), req->params);
+    }
+
+    while (line_end != std::string::npos)
+    {
+        const size_t start = line_end + 2;
+        line_end = head.find("\r\n", start);
+        const std::string line = head.substr(start, line_end == std::string::npos ? std::string::npos : line_end - start);
+        const auto colon = line.find(':');
+        if (colon == std::string::npos || colon == 0)
+        {
+            return 400;
+        }
+        req->headers.emplace(line.substr(0, colon), _trim(line.substr(colon + 1)));
+    }
+
+    if (req->has_header("Transfer-Encoding"))
+    {
+        // nothing served takes a body it can't know the length of up front
+        return 411;
+    }
+
+    *content_length = 0;
+    if (req->has_header("Content-Length"))
+    {
+        const std::string length = req->get_header_value("Content-Length");
+        char *end;
+        *content_length = strtoull(length.c_str(), &end, 10);
+        if (length.empty() || *end)
+        {
+            return 400;
+        }
+        if (*content_length > EVENT_SERVER_MAX_BODY_BYTES)
+        {
+            return 413;
+        }
+    }
+
+    const std::string connection = req->get_header_value("Connection");
+    *keep_alive = req->version == "HTTP/1.1" ? strcasecmp(connection.c_str(), "close") != 0
+                                             : strcasecmp(connection.c_str(), "keep-alive") == 0;
+    return 0;
+}
+
+class _EventLoop
+{
+public:
+    _EventLoop(int listen_fd, int n_threads, std::function<void(httplib::Request &, httplib::Response &)> router)
+        : listen_fd(listen_fd), n_threads(n_threads), router(router)
+    {
+    }
+
+    void run()
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wake_fd, EPOLLIN, EPOLL_CTL_ADD);
+
+        for (int i = 0; i < n_threads; i++)
+        {
+            std::thread([this]()
+                        { handle(); })
+                .detach();
+        }
+
+        epoll_event events[256];
+        int64_t swept_s = _now_s();
+        while (true)
+        {
+            const int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), 1000);
+            for (int i = 0; i < n; i++)
+            {
+                const int fd = events[i].data.fd;
+                if (fd == listen_fd)
+                {
+                    accept_all();
+                }
+                else if (fd == wake_fd)
+                {
+                    uint64_t count;
+                    while (read(wake_fd, &count, sizeof(count)) > 0)
+                    {
+                    }
+                    answer_all();
+                }
+                else
+                {
+                    on_event(fd, events[i].events);
+                }
+            }
+
+            if (_now_s() != swept_s)
+            {
+                swept_s = _now_s();
+                sweep(swept_s);
+            }
+        }
+    }
+
+private:
+    const int listen_fd;
+    const int n_threads;
+    const std::function<void(httplib::Request &, httplib::Response &)> router;
+
+    int epoll_fd = -1;
+    int wake_fd = -1;                // written to by handler threads as they finish, to wake the loop
+    bool accepting = true;           // false while out of file descriptors
+    uint64_t serials = 0;
+    std::unordered_map<int, std::unique_ptr<_Connection>> connections; // only touched by the loop
+
+    std::mutex jobs_lock; // guards `jobs`
+    std::condition_variable jobs_cv;
+    std::deque<_Job> jobs;
+
+    std::mutex done_lock; // guards `done`
+    std::vector<_Done> done;
+
+    void watch(int fd, uint32_t events, int op)
+    {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, op, fd, &ev);
+    }
+
+    void accept_all()
+    {
+        while (true)
+        {
+            sockaddr_storage addr;
+            socklen_t addr_len = sizeof(addr);
+            const int fd = accept4(listen_fd, (sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                if (errno == EMFILE || errno == ENFILE)
+                {
+                    // stop listening (which would otherwise wake the loop until one can be) until one closes
+                    HTTP_LOGGER("Out of file descriptors at %zu connections; accepting no more until one closes\n", connections.size());
+                    watch(listen_fd, 0, EPOLL_CTL_DEL);
+                    accepting = false;
+                }
+                if (errno == EINTR || errno == ECONNABORTED)
+                {
+                    continue;
+                }
+                return;
+            }
+
+            std::unique_ptr<_Connection> c(new _Connection);
+            c->fd = fd;
+            c->serial = ++serials;
+            c->active_s = _now_s();
+            char host[NI_MAXHOST], port[NI_MAXSERV];
+            if (!getnameinfo((sockaddr *)&addr, addr_len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV))
+            {
+                c->remote_addr = host;
+                c->remote_port = atoi(port);
+            }
+
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+            connections[fd] = std::move(c);
+        }
+    }
+
+    void close_connection(_Connection *c)
+    {
+        // closing it takes it out of the epoll set
+        close(c->fd);
+        connections.erase(c->fd);
+
+        if (!accepting)
+        {
+            watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+            accepting = true;
+        }
+    }
+
+    void on_event(int fd, uint32_t events)
+    {
+        auto found = connections.find(fd);
+        if (found == connections.end())
+        {
+            return;
+        }
+
+        _Connection *c = found->second.get();
+        if (events & EPOLLERR)
+        {
+            close_connection(c);
+        }
+        else if (events & EPOLLOUT)
+        {
+            flush(c);
+        }
+        else if (events & (EPOLLIN | EPOLLHUP))
+        {
+            receive(c);
+        }
+    }
+
+    void receive(_Connection *c)
+    {
+        static char buf[64 * 1024];
+        while (true)
+        {
+            const ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n > 0)
+            {
+                c->in.append(buf, n);
+                c->active_s = _now_s();
+                continue;
+            }
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+
+            // closed, or reset
+            close_connection(c);
+            return;
+        }
+
+        take_request(c);
+    }
+
+    // hands the request at the front of `c->in` to a handler thread, if it's all arrived
+    void take_request(_Connection *c)
+    {
+        if (c->handling || c->out.size())
+        {
+            return;
+        }
+
+        const size_t head_end = c->in.find("\r\n\r\n");
+        if (head_end == std::string::npos)
+        {
+            if (c->in.size() > EVENT_SERVER_MAX_HEAD_BYTES)
+            {
+                reply_error(c, 431);
+            }
+            return;
+        }
+
+        std::unique_ptr<httplib::Request> req(new httplib::Request);
+        bool keep_alive = false;
+        size_t content_length = 0;
+        const int error = _parse_head(c->in.substr(0, head_end), req.get(), &keep_alive, &content_length);
+        if (error)
+        {
+            reply_error(c, error);
+            return;
+        }
+
+        const size_t body_start = head_end + 4;
+        if (c->in.size() - body_start < content_length)
+        {
+            if (!c->continued && !strcasecmp(req->get_header_value("Expect").c_str(), "100-continue"))
+            {
+                // it's waiting for this before it sends the body; a partial write just means it waits a while
+                static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                send(c->fd, continue_line, sizeof(continue_line) - 1, MSG_NOSIGNAL);
+                c->continued = true;
+            }
+            return;
+        }
+
+        req->body = c->in.substr(body_start, content_length);
+        req->remote_addr = c->remote_addr;
+        req->remote_port = c->remote_port;
+        c->in.erase(0, body_start + content_length);
+        if (c->in.empty())
+        {
+            // so that an idle connection holds no buffer
+            std::string().swap(c->in);
+        }
+        c->continued = false;
+        c->handling = true;
+        watch(c->fd, 0, EPOLL_CTL_MOD);
+
+        _Job job;
+        job.fd = c->fd;
+        job.serial = c->serial;
+        job.req = std::move(req);
+        job.keep_alive = keep_alive;
+        {
+            std::lock_guard<std::mutex> lg(jobs_lock);
+            jobs.push_back(std::move(job));
+        }
+        jobs_cv.notify_one();
+    }
+
+    void reply_error(_Connection *c, int status)
+    {
+        httplib::Response res;
+        res.status = status;
+        c->out = _serialize(res, false);
+        c->out_offset = 0;
+        c->close_after = true;
+        std::string().swap(c->in);
+        flush(c);
+    }
+
+    // writes what it can of `c->out`, waiting to be told it can write more if that isn't all of it
+    void flush(_Connection *c)
+    {
+        while (c->out_offset < c->out.size())
+        {
+            const ssize_t n = send(c->fd, c->out.data() + c->out_offset, c->out.size() - c->out_offset, MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                c->out_offset += n;
+                c->active_s = _now_s();
+                continue;
+            }
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                watch(c->fd, EPOLLOUT, EPOLL_CTL_MOD);
+                return;
+            }
+
+            close_connection(c);
+            return;
+        }
+
+        if (c->close_after)
+        {
+            close_connection(c);
+            return;
+        }
+
+        std::string().swap(c->out);
+        c->out_offset = 0;
+        watch(c->fd, EPOLLIN, EPOLL_CTL_MOD);
+        // one pipelined behind it may already be here
+        take_request(c);
+    }
+
+    void answer_all()
+    {
+        std::vector<_Done> answers;
+        {
+            std::lock_guard<std::mutex> lg(done_lock);
+            answers.swap(done);
+        }
+
+        for (auto &answer : answers)
+        {
+            auto found = connections.find(answer.fd);
+            if (found == connections.end() || found->second->serial != answer.serial)
+            {
+                // it closed while its request was handled
+                continue;
+            }
+
+            _Connection *c = found->second.get();
+            c->handling = false;
+            c->out = std::move(answer.out);
+            c->out_offset = 0;
+            c->close_after = !answer.keep_alive;
+            c->active_s = _now_s();
+            flush(c);
+        }
+    }
+
+    void sweep(int64_t now_s)
+    {
+        std::vector<_Connection *> expired;
+        for (const auto &it : connections)
+        {
+            const _Connection *c = it.second.get();
+            const int64_t timeout_s = c->in.empty() && c->out.empty() ? EVENT_SERVER_IDLE_TIMEOUT_S : EVENT_SERVER_REQUEST_TIMEOUT_S;
+            if (!c->handling && now_s - c->active_s > timeout_s)
+            {
+                expired.push_back(it.second.get());
+            }
+        }
+
+        for (auto *c : expired)
+        {
+            close_connection(c);
+        }
+    }
+
+    void handle()
+    {
+        while (true)
+        {
+            _Job job;
+            {
+                std::unique_lock<std::mutex> lk(jobs_lock);
+                jobs_cv.wait(lk, [this]()
+                             { return !jobs.empty(); });
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            httplib::Response res;
+            router(*job.req, res);
+
+            _Done answer;
+            answer.fd = job.fd;
+            answer.serial = job.serial;
+            answer.out = _serialize(res, job.keep_alive);
+            answer.keep_alive = job.keep_alive;
+            {
+                std::lock_guard<std::mutex> lg(done_lock);
+                done.push_back(std::move(answer));
+            }
+
+            const uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0)
+            {
+                HTTP_LOGGER("Unable to wake the event loop: %s\n", strerror(errno));
+            }
+        }
+    }
+};
+
+// binds & listens on the first of `host`'s addresses that it can. returns the socket, or -1
+static int _listen_socket(const std::string &host, int port)
+{
+    addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addrs))
+    {
+        return -1;
+    }
+
+    int fd = -1;
+    for (auto *addr = addrs; addr && fd < 0; addr = addr->ai_next)
+    {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        const int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, addr->ai_addr, addr->ai_addrlen) || ::listen(fd, SOMAXCONN))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+bool EventServer::listen(const std::string &host, int port)
+{
+    const int fd = _listen_socket(host, port);
+    if (fd < 0)
+    {
+        HTTP_LOGGER("Unable to listen on %s:%d: %s\n", host.c_str(), port, strerror(errno));
+        return false;
+    }
+
+    // each connection is a file descriptor, so allow as many as may be
+    rlimit files;
+    if (!getrlimit(RLIMIT_NOFILE, &files) && files.rlim_cur < files.rlim_max)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    getrlimit(RLIMIT_NOFILE, &files);
+    HTTP_LOGGER("Serving HTTP from an event loop with %d handler threads, for up to %llu connections\n",
+                handler_threads, (unsigned long long)files.rlim_cur);
+
+    _EventLoop loop(fd, handler_threads, [this](httplib::Request &req, httplib::Response &res)
+                    { route(req, res); });
+    loop.run();
+    return true;
+}
+
+#else
+
+bool EventServer::listen(const std::string &host, int port)
+{
+    HTTP_LOGGER("The event loop front end requires Linux\n");
+    return false;
+}
+
+#endif
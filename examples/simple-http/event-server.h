@@ -0,0 +1,37 @@
+#pragma once
+
+#include "deps/cpp-httplib/httplib.h"
+
+#include <regex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// an HTTP/1.1 server with the routing interface of cpp-httplib's (& its Request & Response, so the same handlers
+// serve either) that holds every connection in one epoll event loop, handing only complete requests to a small
+// pool of threads to run. an idle keep-alive, long-poll or slow client then costs a file descriptor & a few hundred
+// bytes rather than a thread, so tens of thousands may be open at once. Linux only
+class EventServer
+{
+public:
+    using Handler = httplib::Server::Handler;
+
+    EventServer &Get(const std::string &pattern, Handler handler);
+    EventServer &Post(const std::string &pattern, Handler handler);
+
+    // how many threads run handlers, & so how many requests are handled at once; set before listen()
+    void set_handler_threads(int n) { handler_threads = n; }
+
+    // serves until the process exits. returns false if it couldn't bind to `host`:`port`, or this isn't Linux
+    bool listen(const std::string &host, int port);
+
+private:
+    using _routes_t = std::vector<std::pair<std::regex, Handler>>;
+
+    int handler_threads = 4;
+    _routes_t get_routes;
+    _routes_t post_routes;
+
+    // runs the handler routed to for `req`, as httplib::Server would
+    void route(httplib::Request &req, httplib::Response &res) const;
+};
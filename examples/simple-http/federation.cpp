@@ -0,0 +1,307 @@
+#include "federation.h"
+#include "common.h"
+
+#include "deps/cpp-httplib/httplib.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <initializer_list>
+#include <thread>
+
+// how long a peer may take to accept a connection & to answer, in seconds: they're on the same network, & a slow
+// one is better skipped than waited on
+const time_t PEER_CONNECT_TIMEOUT_S = 1;
+const time_t PEER_READ_TIMEOUT_S = 5;
+// attempts to return a result to a peer that can't be reached, a second apart
+const int PEER_RESULT_ATTEMPTS = 5;
+// polls in a row a peer must fail to answer before it's considered to have dropped out
+const int PEER_LOST_POLLS = 3;
+
+static int64_t _epoch_ms()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+bool parse_peer(const std::string &spec, Peer *peer)
+{
+    const auto colon = spec.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == spec.size())
+    {
+        return false;
+    }
+
+    char *end;
+    const long port = strtol(spec.c_str() + colon + 1, &end, 10);
+    if (*end || port <= 0 || port > UINT16_MAX)
+    {
+        return false;
+    }
+
+    peer->host = spec.substr(0, colon);
+    peer->port = port;
+    return true;
+}
+
+nlohmann::json peer_status_json(const PeerStatus &status)
+{
+    return nlohmann::json{
+        {"busy", status.busy},
+        {"queued", status.queued},
+        {"stealable", status.stealable},
+        {"models", status.models},
+        {"loaded", status.loaded},
+    };
+}
+
+// whether `json` is an object with all of `keys`, which must be checked before indexing it, as operator[] on a
+// const json is undefined for a missing key
+static bool _has_keys(const nlohmann::json &json, std::initializer_list<const char *> keys)
+{
+    if (!json.is_object())
+    {
+        return false;
+    }
+
+    for (const char *key : keys)
+    {
+        if (!json.contains(key))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parse_peer_status(const nlohmann::json &json, PeerStatus *status)
+{
+    if (!_has_keys(json, {"busy", "queued", "stealable", "models", "loaded"}) || !json["busy"].is_boolean() ||
+        !json["queued"].is_number_unsigned() || !json["stealable"].is_object() || !json["models"].is_array() ||
+        !json["loaded"].is_array())
+    {
+        return false;
+    }
+
+    PeerStatus parsed;
+    parsed.busy = json["busy"];
+    parsed.queued = json["queued"];
+    for (auto it = json["stealable"].begin(); it != json["stealable"].end(); ++it)
+    {
+        if (!it.value().is_number_unsigned())
+        {
+            return false;
+        }
+        parsed.stealable[it.key()] = it.value();
+    }
+    for (const auto &model : json["models"])
+    {
+        if (!model.is_string())
+        {
+            return false;
+        }
+        parsed.models.push_back(model);
+    }
+    for (const auto &model : json["loaded"])
+    {
+        if (!model.is_string())
+        {
+            return false;
+        }
+        parsed.loaded.push_back(model);
+    }
+
+    *status = parsed;
+    return true;
+}
+
+nlohmann::json peer_prompt_json(const PeerPrompt &prompt)
+{
+    char id[17];
+    snprintf(id, sizeof(id), "%" PRIx64, prompt.id);
+    return nlohmann::json{
+        {"id", id},
+        {"prompt", prompt.prompt},
+        {"model", prompt.model},
+        {"priority", (int)prompt.priority},
+        {"sampling", sampling_params_json(prompt.sampling)},
+    };
+}
+
+bool parse_peer_prompt(const nlohmann::json &json, PeerPrompt *prompt)
+{
+    if (!_has_keys(json, {"id", "prompt", "model", "priority", "sampling"}) || !json["id"].is_string() ||
+        !json["prompt"].is_string() || !json["model"].is_string() || !json["priority"].is_number_integer() ||
+        !json["sampling"].is_object())
+    {
+        return false;
+    }
+
+    PeerPrompt parsed;
+    std::string error;
+    if (sscanf(json["id"].get<std::string>().c_str(), "%" SCNx64, &parsed.id) != 1 ||
+        !parse_sampling_params(json["sampling"], parsed.sampling, &error))
+    {
+        return false;
+    }
+
+    const int priority = json["priority"];
+    parsed.priority = priority > QueuePriority::NORMAL ? QueuePriority::HIGH
+                      : priority < QueuePriority::NORMAL ? QueuePriority::LOW
+                                                         : QueuePriority::NORMAL;
+    parsed.prompt = json["prompt"];
+    parsed.model = json["model"];
+    *prompt = parsed;
+    return true;
+}
+
+Federation::Federation(const std::vector<Peer> &peers, const std::string &name, const std::string &key, int64_t poll_ms)
+    : peers(peers), self(name), key(key), poll_ms(poll_ms)
+{
+}
+
+static std::unique_ptr<httplib::Client> _peer_client(const Peer &peer, const std::string &key)
+{
+    std::unique_ptr<httplib::Client> cli(new httplib::Client(peer.host, peer.port));
+    cli->set_connection_timeout(PEER_CONNECT_TIMEOUT_S);
+    cli->set_read_timeout(PEER_READ_TIMEOUT_S);
+    if (key.length())
+    {
+        cli->set_basic_auth("peer", key);
+    }
+    return cli;
+}
+
+void Federation::start()
+{
+    std::thread([this]()
+                {
+        while (true)
+        {
+            poll();
+            std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+        } })
+        .detach();
+}
+
+void Federation::poll()
+{
+    for (const auto &peer : peers)
+    {
+        PeerStatus status;
+        auto res = _peer_client(peer, key)->Get("/peer/status");
+        if (!res || res->status != 200 || !parse_peer_status(nlohmann::json::parse(res->body, nullptr, false), &status))
+        {
+            // an unreachable peer has nothing to give until it's heard from again
+            std::lock_guard<std::mutex> lg(lock);
+            by_peer[peer.name()].stealable.clear();
+            failed_polls[peer.name()]++;
+            continue;
+        }
+
+        status.updated_ms = _epoch_ms();
+        std::lock_guard<std::mutex> lg(lock);
+        by_peer[peer.name()] = status;
+        failed_polls[peer.name()] = 0;
+    }
+}
+
+bool Federation::lost(const std::string &name)
+{
+    std::lock_guard<std::mutex> lg(lock);
+    auto found = failed_polls.find(name);
+    return found != failed_polls.end() && found->second >= PEER_LOST_POLLS;
+}
+
+std::map<std::string, PeerStatus> Federation::statuses()
+{
+    std::lock_guard<std::mutex> lg(lock);
+    return by_peer;
+}
+
+bool Federation::steal(const std::vector<std::string> &models, size_t max_prompt_chars, PeerPrompt *stolen, Peer *origin)
+{
+    // only from a peer that's busy, as an idle one is about to start on what it has
+    const Peer *busiest = nullptr;
+    size_t most_queued = 0;
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        for (const auto &peer : peers)
+        {
+            const auto &status = by_peer[peer.name()];
+            size_t n_stealable = 0;
+            for (const auto &model : models)
+            {
+                auto found = status.stealable.find(model);
+                n_stealable += found != status.stealable.end() ? found->second : 0;
+            }
+
+            if (status.busy && n_stealable && status.queued > most_queued)
+            {
+                busiest = &peer;
+                most_queued = status.queued;
+            }
+        }
+    }
+
+    if (!busiest)
+    {
+        return false;
+    }
+
+    nlohmann::json body{{"node", self}, {"models", models}, {"maxPromptChars", max_prompt_chars}};
+    auto res = _peer_client(*busiest, key)->Post("/peer/steal", body.dump(), "application/json");
+    if (!res || res->status != 200 || !parse_peer_prompt(nlohmann::json::parse(res->body, nullptr, false), stolen))
+    {
+        // whatever it had is gone (or was too long); don't ask again until it says otherwise
+        std::lock_guard<std::mutex> lg(lock);
+        by_peer[busiest->name()].stealable.clear();
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        auto &status = by_peer[busiest->name()];
+        if (status.queued > 0)
+        {
+            status.queued--;
+        }
+        if (status.stealable[stolen->model] > 0)
+        {
+            status.stealable[stolen->model]--;
+        }
+    }
+
+    *origin = *busiest;
+    return true;
+}
+
+void Federation::return_result(const Peer &origin, uint64_t id, const nlohmann::json &result)
+{
+    const std::string key = this->key;
+    char path[64];
+    snprintf(path, sizeof(path), "/peer/result/%" PRIx64, id);
+    const std::string body = result.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+
+    std::thread([origin, key, path, body]()
+                {
+        for (int attempt = 1; attempt <= PEER_RESULT_ATTEMPTS; attempt++)
+        {
+            auto res = _peer_client(origin, key)->Post(path, body, "application/json");
+            if (res && res->status == 200)
+            {
+                return;
+            }
+
+            if (res && res->status == 404)
+            {
+                break;
+            }
+
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+
+        HTTP_LOGGER("Unable to return the result of %s to %s\n", path, origin.name().c_str()); })
+        .detach();
+}
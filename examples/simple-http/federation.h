@@ -0,0 +1,93 @@
+#pragma once
+
+#include "http.h"
+#include "sampling.h"
+
+#include "deps/json/single_include/nlohmann/json.hpp"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// another simple-http node that this one shares queued work with, as -F names it
+struct Peer
+{
+    std::string host;
+    uint16_t port = 0;
+
+    std::string name() const { return host + ":" + std::to_string(port); }
+};
+
+// parses "host:port". returns false if `spec` isn't that
+bool parse_peer(const std::string &spec, Peer *peer);
+
+// what a node advertises to its peers at GET /peer/status
+struct PeerStatus
+{
+    bool busy = false;                        // processing a prompt, so that those queued are waiting on it
+    size_t queued = 0;                        // prompts waiting, of any kind
+    std::map<std::string, size_t> stealable;  // prompts waiting that a peer may take, by model
+    std::vector<std::string> models;          // those it serves
+    std::vector<std::string> loaded;          // those preloaded, & so quickest to start on
+    int64_t updated_ms = -1;                  // when it was last heard from, in milliseconds since the epoch
+};
+
+nlohmann::json peer_status_json(const PeerStatus &status);
+bool parse_peer_status(const nlohmann::json &json, PeerStatus *status);
+
+// a prompt as it leaves a node's queue for a peer's, with everything needed to run it there as it would have run
+// at home
+struct PeerPrompt
+{
+    uint64_t id = 0; // at the node it came from, under which the result goes back
+    std::string prompt;
+    std::string model;
+    QueuePriority priority = QueuePriority::NORMAL;
+    SamplingParams sampling;
+};
+
+nlohmann::json peer_prompt_json(const PeerPrompt &prompt);
+bool parse_peer_prompt(const nlohmann::json &json, PeerPrompt *prompt);
+
+// this node's view of its peers: their statuses, polled in the background, & the requests that take work from
+// them & send its results back. all of it is safe to call from any thread
+class Federation
+{
+public:
+    // `name` is how this node identifies itself to its peers (in their logs & runtime data), & `key` the API key
+    // it authenticates to them with, if they require one
+    Federation(const std::vector<Peer> &peers, const std::string &name, const std::string &key, int64_t poll_ms);
+
+    // starts polling each peer's status every `poll_ms` on a thread of its own, which inherits the caller's CPUs
+    void start();
+
+    const std::string &name() const { return self; }
+    std::map<std::string, PeerStatus> statuses();
+
+    // takes the prompt that the busiest peer with any waiting for one of `models` would otherwise run last, if
+    // it's no longer than `max_prompt_chars`. returns false if no peer had one to give. `*origin` is set to the
+    // peer it came from, to which its result must be returned
+    bool steal(const std::vector<std::string> &models, size_t max_prompt_chars, PeerPrompt *stolen, Peer *origin);
+
+    // sends `result` (shaped like a GET /prompt/:id body) for prompt `id` back to `origin`, in the background,
+    // retrying a few times if it can't be reached
+    void return_result(const Peer &origin, uint64_t id, const nlohmann::json &result);
+
+    // whether `name` is one of this node's peers that has stopped answering at /peer/status, so that any prompt it
+    // took from this node won't be returned
+    bool lost(const std::string &name);
+
+private:
+    const std::vector<Peer> peers;
+    const std::string self;
+    const std::string key;
+    const int64_t poll_ms;
+
+    std::mutex lock; // guards `by_peer` & `failed_polls`
+    std::map<std::string, PeerStatus> by_peer;
+    std::map<std::string, int> failed_polls; // in a row, by peer
+
+    void poll();
+};
@@ -1,5 +1,10 @@
 #include "http.h"
 #include "common.h"
+#include "backend.h"
+#include "vector-index.h"
+#include "federation.h"
+#include "event-server.h"
+#include "body-format.h"
 
 #include "deps/cpp-httplib/httplib.h"
 #include "deps/json/single_include/nlohmann/json.hpp"
@@ -17,6 +22,9 @@
 
 std::mt19937_64 rng(time(NULL));
 
+// the most matches (& candidates considered) a query to a vector index may ask for
+const int64_t MAX_QUERY_K = 10000;
+
 struct _http_get_prompt_result_return
 {
     std::string prompt;
@@ -25,10 +33,22 @@ struct _http_get_prompt_result_return
 };
 
 using _http_user_handler = std::function<std::string(const httplib::Request &, httplib::Response &)>;
-using _http_server_starter = std::function<void(httplib::Server &)>;
-using _http_put_prompt_on_queue = std::function<std::pair<uint64_t, ssize_t>(std::string, std::string, std::string, QueuePriority, uint)>;
+template <typename Server>
+using _http_server_starter = std::function<void(Server &)>;
+using _http_put_prompt_on_queue = std::function<std::pair<uint64_t, ssize_t>(std::string, std::string, std::string, QueuePriority, SamplingParams)>;
 using _http_get_prompt_result = std::function<_http_get_prompt_result_return(uint64_t)>;
 
+// the internal API peers use to see this node's queue, take work from it & return its results; each unset when
+// there are no peers
+struct _http_peer_handlers
+{
+    std::function<nlohmann::json()> status;
+    // takes a prompt a peer asked for; returns false (& sets nothing) if there's none it may have
+    std::function<bool(const nlohmann::json &request, PeerPrompt *)> steal;
+    // records the result a peer returned for a prompt it took; returns false if no prompt `id` was taken
+    std::function<bool(uint64_t id, const nlohmann::json &result)> result;
+};
+
 // the actual queue is a priority queue with QueueElementCmp as the comparator function
 // std::priority_queue isn't used because it doesn't allow access to the underlying container
 using _queue_t = std::deque<QueueElement>;
@@ -68,6 +88,12 @@ ssize_t QueueElementPosById(uint64_t id, const _queue_t *q, std::mutex *q_lock)
     return -1;
 }
 
+int64_t _now_ms()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
 std::string _hexify_id(uint64_t id)
 {
     std::stringstream ss;
@@ -96,6 +122,57 @@ void _log_request(const httplib::Request &req, const std::string &extra_logging)
                 extra_logging.c_str());
 }
 
+std::string model_admission_error(const nlohmann::json &model_spec)
+{
+    if (!model_spec.is_object() || model_spec.value("fitsInMemory", true))
+    {
+        return "";
+    }
+
+    char error[128];
+    snprintf(error, sizeof(error), "model needs an estimated %.1f MiB of memory, more than this machine has",
+             (size_t)model_spec["memoryEstimate"]["totalBytes"] / 1048576.0);
+    return error;
+}
+
+std::string wrap_prompt(const nlohmann::json &model_spec, const nlohmann::json &request_body)
+{
+    std::string pre = "";
+    std::string post = "";
+
+    // first, look for JSON-sidecar-configured wrappers
+    if (model_spec.is_object() && model_spec.contains("promptWrappers") && model_spec["promptWrappers"].is_object())
+    {
+        const auto &pw = model_spec["promptWrappers"];
+        if (pw.contains("pre") && pw["pre"].is_string())
+        {
+            pre = pw["pre"];
+        }
+
+        if (pw.contains("post") && pw["post"].is_string())
+        {
+            post = pw["post"];
+        }
+    }
+
+    // then, allow user-specified wrappers to override the configured
+    if (request_body.contains("promptWrappers") && request_body["promptWrappers"].is_object())
+    {
+        const auto &pw = request_body["promptWrappers"];
+        if (pw.contains("pre") && pw["pre"].is_string())
+        {
+            pre = pw["pre"];
+        }
+
+        if (pw.contains("post") && pw["post"].is_string())
+        {
+            post = pw["post"];
+        }
+    }
+
+    return pre + request_body["prompt"].get<std::string>() + post;
+}
+
 using _check_auth_t = std::function<std::string(AuthLevel min_auth_level, const httplib::Request &req, httplib::Response &res)>;
 using _check_auth_bound_t = std::function<std::string(const httplib::Request &req, httplib::Response &res)>;
 
@@ -118,16 +195,46 @@ httplib::Server::Handler _request_wrapper(_check_auth_bound_t check_auth, _http_
     };
 }
 
+// a request's body, in the format its Content-Type names (JSON unless it's CBOR or MessagePack); discarded if
+// it's malformed or isn't an object, as every endpoint's body is
+nlohmann::json _request_body(const httplib::Request &req)
+{
+    auto body = parse_body(req.body, body_format_of(req.get_header_value("Content-Type")));
+    if (!body.is_object())
+    {
+        return nlohmann::json(nlohmann::json::value_t::discarded);
+    }
+    return body;
+}
+
+// the format the client's Accept asks responses be in
+BodyFormat _response_format(const httplib::Request &req)
+{
+    return body_format_of(req.get_header_value("Accept"));
+}
+
+void _set_body(const httplib::Request &req, httplib::Response &res, const nlohmann::json &json)
+{
+    const auto format = _response_format(req);
+    res.set_content(encode_body(json, format), body_format_media_type(format));
+}
+
+// registers every route on a `Server` (httplib::Server, or an EventServer) & then hands it to `go` to serve
+template <typename Server>
 void _http_server_run(
     models_map_t models,
     std::shared_ptr<std::string> *session_ss,
     std::function<std::string()> session_private,
-    _http_server_starter go,
+    _http_server_starter<Server> go,
     _http_put_prompt_on_queue put_q,
     _http_get_prompt_result get_res,
-    AuthOptions auth_options)
+    SamplingParams sampling_defaults,
+    http_embedder embedder,
+    VectorIndexes *indexes,
+    AuthOptions auth_options,
+    _http_peer_handlers peer)
 {
-    httplib::Server server;
+    Server server;
 
     _check_auth_t check_auth = [auth_options](AuthLevel min_auth_level, const httplib::Request &req, httplib::Response &res)
     {
@@ -209,15 +316,15 @@ void _http_server_run(
                               [models](const httplib::Request &req, httplib::Response &res)
                               {
         nlohmann::json json(models);
-        res.set_content(json.dump(), "application/json");
+        _set_body(req, res, json);
         return std::string(""); }));
 
     server.Post("/prompt",
                 _request_wrapper(
                     bind_check_auth(AuthLevel::POSTPrompt),
-                    [put_q, &models, check_auth](const httplib::Request &req, httplib::Response &res)
+                    [put_q, &models, check_auth, sampling_defaults](const httplib::Request &req, httplib::Response &res)
                     {
-        auto parsed_body = nlohmann::json::parse(req.body);
+        auto parsed_body = _request_body(req);
         if (parsed_body.is_discarded() 
             || parsed_body["prompt"].is_null()
             || !parsed_body["prompt"].is_string()
@@ -228,29 +335,12 @@ void _http_server_run(
             return std::string("400 Bad Request");
         }
 
-        std::string pre = "";
-        std::string post = "";
-        auto& model_spec = models[parsed_body["model"]];
-
-        // first, look for JSON-sidecar-configured wrappers
-        if (!model_spec.is_null() && !model_spec["promptWrappers"].is_null())
+        if (models.find(parsed_body["model"]) == models.end())
         {
-            pre = model_spec["promptWrappers"]["pre"];
-            post = model_spec["promptWrappers"]["post"];
-        }
-
-        // then, allow user-specified wrappers to override the configured
-        if (!parsed_body["promptWrappers"].is_discarded() && parsed_body["promptWrappers"].is_object())
-        {
-            auto& pw = parsed_body["promptWrappers"];
-            if (pw["pre"].is_string()) {
-                pre = pw["pre"];
-            }
-
-            if (pw["post"].is_string()) {
-                post = pw["post"];
-            }
+            res.status = 404;
+            return std::string("404 No Model");
         }
+        const auto &model_spec = models.at(parsed_body["model"]);
 
         QueuePriority priority{QueuePriority::NORMAL};
         if (!parsed_body["priority"].is_discarded() && parsed_body["priority"].is_string())
@@ -270,15 +360,25 @@ void _http_server_run(
             }
         }
 
-        uint mirostat = 0;
-        if (!parsed_body["mirostat"].is_discarded() && parsed_body["mirostat"].is_number_unsigned()) {
-            mirostat = parsed_body["mirostat"];
+        SamplingParams sampling;
+        std::string error;
+        if (!resolve_sampling_params(sampling_defaults, model_spec, parsed_body, sampling, &error)) {
+            res.status = 400;
+            _set_body(req, res, nlohmann::json{{"error", error}});
+            return "400 " + error;
         }
 
-        std::string prompt = pre + (std::string)parsed_body["prompt"] + post;
+        error = model_admission_error(model_spec);
+        if (error.length()) {
+            res.status = 507;
+            _set_body(req, res, nlohmann::json{{"error", error}});
+            return "507 " + error;
+        }
+
+        std::string prompt = wrap_prompt(model_spec, parsed_body);
         uint64_t new_id = 0;
         size_t q_pos = -1;
-        std::tie(new_id, q_pos) = put_q(prompt, parsed_body["model"], _remote_addr(req), priority, mirostat);
+        std::tie(new_id, q_pos) = put_q(prompt, parsed_body["model"], _remote_addr(req), priority, sampling);
 
         if (new_id == 0) {
             res.status = 413;
@@ -290,9 +390,311 @@ void _http_server_run(
             {"queuePosition", q_pos}
         };
 
-        res.set_content(json.dump(), "application/json");
+        _set_body(req, res, json);
         return _hexify_id(new_id); }));
 
+    if (embedder)
+    {
+        server.Post("/embeddings",
+                    _request_wrapper(
+                        bind_check_auth(AuthLevel::POSTPrompt),
+                        [embedder, &models](const httplib::Request &req, httplib::Response &res)
+                        {
+        auto parsed_body = _request_body(req);
+        if (parsed_body.is_discarded()
+            || !parsed_body["model"].is_string()
+            || models.find(parsed_body["model"]) == models.end()
+            || !parsed_body["texts"].is_array()
+            || parsed_body["texts"].empty()
+            || (parsed_body.contains("format") && !parsed_body["format"].is_string())) {
+            res.status = 400;
+            HTTP_LOGGER("Bad JSON body!\n%s", req.body.c_str());
+            return std::string("400 Bad Request");
+        }
+
+        const auto admission_error = model_admission_error(models.at(parsed_body["model"]));
+        if (admission_error.length())
+        {
+            res.status = 507;
+            _set_body(req, res, nlohmann::json{{"error", admission_error}});
+            return "507 " + admission_error;
+        }
+
+        std::vector<std::string> texts;
+        for (const auto &text : parsed_body["texts"])
+        {
+            if (!text.is_string())
+            {
+                res.status = 400;
+                return std::string("400 Bad Request");
+            }
+            texts.push_back(text);
+        }
+
+        const auto start_ms = _now_ms();
+        std::vector<float> embeddings;
+        int n_embd = 0;
+        auto error = embedder(parsed_body["model"], texts, embeddings, &n_embd);
+        if (error.length())
+        {
+            res.status = 422;
+            _set_body(req, res, nlohmann::json{{"error", error}});
+            return "422 " + error;
+        }
+
+        // formatting millions of floats as JSON costs more than computing them, so clients may opt out of it
+        if (parsed_body.value("format", "") == "binary" || req.get_header_value("Accept") == "application/octet-stream")
+        {
+            const uint16_t endian_probe = 1;
+            if (*(const uint8_t *)&endian_probe != 1)
+            {
+                for (auto &f : embeddings)
+                {
+                    auto *b = (uint8_t *)&f;
+                    std::reverse(b, b + sizeof(float));
+                }
+            }
+
+            res.set_header("X-Embedding-Count", std::to_string(texts.size()));
+            res.set_header("X-Embedding-Dimensions", std::to_string(n_embd));
+            res.set_content((const char *)embeddings.data(), embeddings.size() * sizeof(float), "application/octet-stream");
+        }
+        else
+        {
+            nlohmann::json json {
+                {"model", parsed_body["model"]},
+                {"dimensions", n_embd},
+                {"elapsed_ms", _now_ms() - start_ms},
+            };
+
+            auto &vectors = json["embeddings"] = nlohmann::json::array();
+            for (size_t i = 0; i < texts.size(); i++)
+            {
+                // packed, for CBOR & MessagePack
+                vectors.push_back(pack_floats(embeddings.data() + i * n_embd, n_embd, _response_format(req)));
+            }
+
+            _set_body(req, res, json);
+        }
+
+        return std::to_string(texts.size()) + " texts"; }));
+    }
+
+    if (embedder && indexes)
+    {
+        // the vectors to insert or query: either embeddings of `texts` or the given `vectors`. returns an
+        // empty string on success, else why it failed
+        auto body_vectors = [embedder](const nlohmann::json &body, std::vector<float> &vectors, int *n_dims) -> std::string
+        {
+            if (body.contains("texts") && body["texts"].is_array())
+            {
+                std::vector<std::string> texts;
+                for (const auto &text : body["texts"])
+                {
+                    if (!text.is_string())
+                    {
+                        return "texts must be strings";
+                    }
+                    texts.push_back(text);
+                }
+                return embedder(body["model"], texts, vectors, n_dims);
+            }
+
+            // each an array of numbers, or (in CBOR or MessagePack) packed float32s
+            if (body.contains("vectors") && body["vectors"].is_array() && !body["vectors"].empty() &&
+                packed_floats_size(body["vectors"][0]) > 0)
+            {
+                *n_dims = packed_floats_size(body["vectors"][0]);
+                for (const auto &vector : body["vectors"])
+                {
+                    if (packed_floats_size(vector) != *n_dims)
+                    {
+                        return "vectors must all have the same dimensions";
+                    }
+                    if (!unpack_floats(vector, vectors))
+                    {
+                        return "vectors must be numbers";
+                    }
+                }
+                return "";
+            }
+
+            return "one of texts or vectors is required";
+        };
+
+        // parses the body, which must name a model &, if `need_ids`, have an array of (unsigned integer) ids
+        auto index_request = [&models](const httplib::Request &req, httplib::Response &res, nlohmann::json &body, bool need_ids)
+        {
+            body = _request_body(req);
+            bool valid = !body.is_discarded() && body["model"].is_string() && models.find(body["model"]) != models.end();
+            if (valid && need_ids)
+            {
+                valid = body["ids"].is_array();
+                for (const auto &id : body["ids"])
+                {
+                    valid = valid && id.is_number_unsigned();
+                }
+            }
+
+            if (!valid)
+            {
+                res.status = 400;
+                HTTP_LOGGER("Bad JSON body!\n%s", req.body.c_str());
+            }
+            return valid;
+        };
+
+        auto index_error = [](const httplib::Request &req, httplib::Response &res, const std::string &error)
+        {
+            res.status = 422;
+            _set_body(req, res, nlohmann::json{{"error", error}});
+            return "422 " + error;
+        };
+
+        server.Post("/index/insert",
+                    _request_wrapper(
+                        bind_check_auth(AuthLevel::POSTPrompt),
+                        [indexes, index_request, index_error, body_vectors](const httplib::Request &req, httplib::Response &res)
+                        {
+        nlohmann::json body;
+        if (!index_request(req, res, body, true)) {
+            return std::string("400 Bad Request");
+        }
+
+        std::vector<float> vectors;
+        int n_dims = 0;
+        auto error = body_vectors(body, vectors, &n_dims);
+        if (error.empty() && vectors.size() != body["ids"].size() * n_dims)
+        {
+            error = "ids & texts (or vectors) must be the same length";
+        }
+        if (error.length())
+        {
+            return index_error(req, res, error);
+        }
+
+        VectorIndex *index;
+        {
+            std::lock_guard<std::mutex> lg(indexes->lock);
+            auto &slot = indexes->by_model[body["model"]];
+            if (!slot)
+            {
+                VectorIndexParams params;
+                params.n_dims = n_dims;
+                slot = make_vector_index(params);
+            }
+            index = slot.get();
+        }
+
+        if (index->params().n_dims != n_dims)
+        {
+            return index_error(req, res, "this model's index has " + std::to_string(index->params().n_dims) + " dimensions");
+        }
+
+        for (size_t i = 0; i < body["ids"].size(); i++)
+        {
+            index->insert(body["ids"][i].get<uint64_t>(), vectors.data() + i * n_dims);
+        }
+
+        _set_body(req, res, nlohmann::json{{"size", index->size()}});
+        return std::to_string(body["ids"].size()) + " inserted"; }));
+
+        server.Post("/index/remove",
+                    _request_wrapper(
+                        bind_check_auth(AuthLevel::POSTPrompt),
+                        [indexes, index_request](const httplib::Request &req, httplib::Response &res)
+                        {
+        nlohmann::json body;
+        if (!index_request(req, res, body, true)) {
+            return std::string("400 Bad Request");
+        }
+
+        size_t n_removed = 0;
+        std::lock_guard<std::mutex> lg(indexes->lock);
+        auto index = indexes->by_model.find(body["model"]);
+        if (index != indexes->by_model.end())
+        {
+            for (const auto &id : body["ids"])
+            {
+                n_removed += index->second->remove(id.get<uint64_t>());
+            }
+        }
+
+        _set_body(req, res, nlohmann::json{{"removed", n_removed}});
+        return std::to_string(n_removed) + " removed"; }));
+
+        server.Post("/index/query",
+                    _request_wrapper(
+                        bind_check_auth(AuthLevel::POSTPrompt),
+                        [indexes, index_request, index_error, body_vectors](const httplib::Request &req, httplib::Response &res)
+                        {
+        nlohmann::json body;
+        if (!index_request(req, res, body, false)) {
+            return std::string("400 Bad Request");
+        }
+
+        VectorIndex *index = nullptr;
+        {
+            std::lock_guard<std::mutex> lg(indexes->lock);
+            auto found = indexes->by_model.find(body["model"]);
+            if (found != indexes->by_model.end())
+            {
+                index = found->second.get();
+            }
+        }
+
+        if (!index)
+        {
+            res.status = 404;
+            return std::string("404 No Index");
+        }
+
+        std::vector<float> vectors;
+        int n_dims = 0;
+        auto error = body_vectors(body, vectors, &n_dims);
+        if (error.empty() && n_dims != index->params().n_dims)
+        {
+            error = "this model's index has " + std::to_string(index->params().n_dims) + " dimensions";
+        }
+        if (error.length())
+        {
+            return index_error(req, res, error);
+        }
+
+        // the candidates a query considers are at least `k`, so both are bounded to keep one query's work bounded
+        const struct { const char *key; int64_t min; } bounds[] = {{"k", 1}, {"ef", 0}};
+        for (const auto &bound : bounds)
+        {
+            if (!body.contains(bound.key))
+            {
+                continue;
+            }
+            const auto &value = body[bound.key];
+            if (!value.is_number_integer() || value < bound.min || value > MAX_QUERY_K)
+            {
+                const auto error = std::string("`") + bound.key + "` must be an integer from " + std::to_string(bound.min) + " to " + std::to_string(MAX_QUERY_K);
+                res.status = 400;
+                _set_body(req, res, nlohmann::json{{"error", error}});
+                return "400 " + error;
+            }
+        }
+
+        const int k = body.value("k", 10);
+        const int ef = body.value("ef", 0);
+        auto results = nlohmann::json::array();
+        for (size_t i = 0; i < vectors.size() / n_dims; i++)
+        {
+            auto &matches_json = *results.insert(results.end(), nlohmann::json::array());
+            for (const auto &match : index->query(vectors.data() + i * n_dims, k, ef))
+            {
+                matches_json.push_back(nlohmann::json{{"id", match.id}, {"similarity", match.similarity}});
+            }
+        }
+
+        _set_body(req, res, nlohmann::json{{"results", results}});
+        return std::to_string(results.size()) + " queries"; }));
+    }
+
     server.Get("/prompt/([\\da-f]+)",
                _request_wrapper(
                    bind_check_auth(AuthLevel::GETPromptById),
@@ -309,14 +711,20 @@ void _http_server_run(
         {
             res.status = 404;
         }
-        else if (get_response.rpm.response.empty())
+        else if (get_response.rpm.end_iso8601.empty())
         {
             nlohmann::json json {
                 {"queuePosition", get_response.queue_position},
                 {"model", get_response.rpm.model},
                 {"prompt", get_response.prompt},
             };
-            res.set_content(json.dump(), "application/json");
+
+            if (get_response.rpm.stolen_by.length())
+            {
+                json["stolenBy"] = get_response.rpm.stolen_by;
+            }
+
+            _set_body(req, res, json);
             res.status = 202;
         }
         else
@@ -327,17 +735,143 @@ void _http_server_run(
                 {"elapsed_ms", get_response.rpm.elapsed_ms},
                 {"tokens", get_response.rpm.tokens},
                 {"model", get_response.rpm.model},
-                {"ms_per_token", get_response.rpm.elapsed_ms / get_response.rpm.tokens}
+                {"ms_per_token", get_response.rpm.tokens > 0 ? get_response.rpm.elapsed_ms / get_response.rpm.tokens : 0.0f},
+                {"queue_ms", get_response.rpm.start_ms - get_response.rpm.queued_ms},
+                {"e2e_ms", get_response.rpm.end_ms - get_response.rpm.queued_ms},
             };
-            res.set_content(json.dump(), "application/json");
+
+            if (get_response.rpm.responses.size())
+            {
+                json["responses"] = get_response.rpm.responses;
+            }
+
+            if (get_response.rpm.preemptions)
+            {
+                json["preemptions"] = get_response.rpm.preemptions;
+            }
+
+            if (get_response.rpm.crashes)
+            {
+                json["crashes"] = get_response.rpm.crashes;
+            }
+
+            if (get_response.rpm.error.length())
+            {
+                json["error"] = get_response.rpm.error;
+                res.status = 500;
+            }
+
+            if (get_response.rpm.first_token_ms >= 0)
+            {
+                json["ttft_ms"] = get_response.rpm.first_token_ms - get_response.rpm.queued_ms;
+            }
+
+            // a sampled response may split a multi-byte character across tokens, which _set_body() replaces
+            _set_body(req, res, json);
         }
 
         return ""; },
                    false));
 
+    if (peer.status)
+    {
+        server.Get("/peer/status",
+                   _request_wrapper(
+                       bind_check_auth(AuthLevel::Runtime),
+                       [peer](const httplib::Request &req, httplib::Response &res)
+                       {
+        _set_body(req, res, peer.status());
+        return ""; },
+                       false));
+
+        server.Post("/peer/steal",
+                    _request_wrapper(
+                        bind_check_auth(AuthLevel::Runtime),
+                        [peer](const httplib::Request &req, httplib::Response &res)
+                        {
+        auto parsed_body = _request_body(req);
+        if (parsed_body.is_discarded() || !parsed_body["node"].is_string() || !parsed_body["models"].is_array() ||
+            !parsed_body["maxPromptChars"].is_number_unsigned()) {
+            res.status = 400;
+            return std::string("400 Bad Request");
+        }
+
+        PeerPrompt stolen;
+        if (!peer.steal(parsed_body, &stolen)) {
+            res.status = 204;
+            return std::string("204 Nothing To Steal");
+        }
+
+        _set_body(req, res, peer_prompt_json(stolen));
+        return _hexify_id(stolen.id) + " stolen by " + parsed_body["node"].get<std::string>(); }));
+
+        server.Post("/peer/result/([\\da-f]+)",
+                    _request_wrapper(
+                        bind_check_auth(AuthLevel::Runtime),
+                        [peer](const httplib::Request &req, httplib::Response &res)
+                        {
+        std::stringstream ss;
+        uint64_t prompt_id;
+        ss << std::hex << req.matches[1].str();
+        ss >> prompt_id;
+
+        auto parsed_body = _request_body(req);
+        if (parsed_body.is_discarded() || !parsed_body["response"].is_string() || !parsed_body["tokens"].is_number_integer()) {
+            res.status = 400;
+            return std::string("400 Bad Request");
+        }
+
+        if (!peer.result(prompt_id, parsed_body)) {
+            res.status = 404;
+            return std::string("404 Not Stolen");
+        }
+
+        return "result of " + _hexify_id(prompt_id); },
+                        false));
+    }
+
     go(server);
 }
 
+// how often an idle node asks a peer for work, when one last said it had some
+const int64_t PEER_STEAL_INTERVAL_MS = 50;
+// how long a peer has to return the result of a prompt it took before it's requeued here, as if never taken. long
+// enough for any generation, as a peer that has gone away is noticed sooner by its dropping out of /peer/status
+const int64_t PEER_LEASE_MS = 10 * 60 * 1000;
+
+// a prompt a peer took, kept until its result is returned so that it can be requeued if that never happens
+struct _stolen_element
+{
+    QueueElement element;
+    int64_t lease_end_ms;
+};
+using _stolen_t = std::map<uint64_t, _stolen_element>;
+
+// requeues in their original positions the prompts taken by peers whose lease has run out or that have dropped
+// out. `q_lock` must be held
+void _reclaim_stolen(_queue_t *q, _map_t *m, _stolen_t *leases, Federation *federation)
+{
+    const int64_t now = _now_ms();
+    for (auto it = leases->begin(); it != leases->end();)
+    {
+        auto &rpm = m->at(it->first).second;
+        const bool expired = now >= it->second.lease_end_ms;
+        if (!expired && !(federation && federation->lost(rpm.stolen_by)))
+        {
+            ++it;
+            continue;
+        }
+
+        HTTP_LOGGER("Requeuing prompt ID %s, as %s %s\n", _hexify_id(it->first).c_str(), rpm.stolen_by.c_str(),
+                    expired ? "didn't return its result in time" : "dropped out");
+        rpm.stolen_by.clear();
+        rpm.start_ms = -1;
+        q->push_back(it->second.element);
+        std::push_heap(q->begin(), q->end(), QueueElementCmp);
+        it = leases->erase(it);
+    }
+}
+
 uint_fast64_t _unique_id(_map_t *m)
 {
     auto try_id = rng();
@@ -355,13 +889,23 @@ http_prompt_servicer http_server_run(
     models_map_t models,
     std::shared_ptr<std::string> *session_ep,
     llama_timings *total_timings,
-    AuthOptions auth_options)
+    model_totals_map_t *model_totals,
+    SamplingParams sampling_defaults,
+    http_embedder embedder,
+    VectorIndexes *indexes,
+    AuthOptions auth_options,
+    http_memory_reporter memory_reporter,
+    http_idle_handler idle_handler,
+    int64_t idle_ms,
+    Federation *federation,
+    int event_loop_threads)
 {
     std::mutex *q_lock = new std::mutex;
     _queue_t *q = new _queue_t;
     _map_t *m = new _map_t;
     uint64_t *pending_id = new uint64_t(0);
     uint32_t *lifetime_queued = new uint32_t(0);
+    _stolen_t *leases = new _stolen_t;
 
     if (session_ep)
     {
@@ -389,15 +933,22 @@ http_prompt_servicer http_server_run(
     }
 
     // server startup (_http_server_starter)
-    auto server_startup_handler = [hostname, port](httplib::Server &server)
+    _http_server_starter<httplib::Server> server_startup_handler = [hostname, port](httplib::Server &server)
+    {
+        server.listen(hostname, port);
+    };
+    _http_server_starter<EventServer> event_server_startup_handler = [hostname, port, event_loop_threads](EventServer &server)
     {
+        server.set_handler_threads(event_loop_threads);
         server.listen(hostname, port);
     };
 
-    auto runtime_info_ep_handler = [q, q_lock, m, pending_id, total_timings, lifetime_queued, auth_options]()
+    auto runtime_info_ep_handler = [q, q_lock, m, pending_id, total_timings, model_totals, lifetime_queued, auth_options, memory_reporter, federation]()
     {
         q_lock->lock();
         _queue_t local_q = *q;
+        _map_t local_m = *m;
+        const uint64_t local_pending_id = *pending_id;
         q_lock->unlock();
 
         std::sort_heap(local_q.begin(), local_q.end(), QueueElementCmp);
@@ -421,11 +972,47 @@ http_prompt_servicer http_server_run(
                            {"tokens", total_timings->n_sample},
                        }}};
 
+        auto &per_model = json["models"] = std::map<std::string, nlohmann::json>{};
+        for (const auto &totals_ent : *model_totals)
+        {
+            const auto &totals = totals_ent.second;
+            auto &model_json = per_model[totals_ent.first] = nlohmann::json{
+                {"prompts", totals.prompts},
+                {"tokens", totals.tokens},
+                {"decode_ms", totals.decode_ms},
+                {"tokens_per_s", totals.decode_ms > 0 ? totals.tokens * 1000.0 / totals.decode_ms : 0.0},
+            };
+
+            if (totals.drafted)
+            {
+                model_json["drafted"] = totals.drafted;
+                model_json["draft_acceptance_rate"] = (double)totals.draft_accepted / totals.drafted;
+            }
+
+            if (totals.preemptions)
+            {
+                model_json["preemptions"] = totals.preemptions;
+                model_json["preemption_overhead_ms"] = totals.preemption_overhead_ms;
+            }
+
+            if (totals.crashes)
+            {
+                model_json["crashes"] = totals.crashes;
+            }
+        }
+
         auto &processed = json["prompts"] = std::map<std::string, nlohmann::json>{};
-        for (const auto &outer_pair : *m)
+        size_t results_bytes = 0;
+        for (const auto &outer_pair : local_m)
         {
             auto &inner_pair = outer_pair.second;
             auto &metrics = inner_pair.second;
+            results_bytes += sizeof(outer_pair) + inner_pair.first.capacity() + metrics.response.capacity();
+            for (const auto &response : metrics.responses)
+            {
+                results_bytes += sizeof(response) + response.capacity();
+            }
+
             processed[_hexify_id(outer_pair.first)] = {
                 {"prompt", inner_pair.first},
                 {"model", metrics.model},
@@ -435,13 +1022,43 @@ http_prompt_servicer http_server_run(
                                 {"tokens", metrics.tokens},
                                 {"queued_time", metrics.queued_iso8601},
                                 {"end_time", metrics.end_iso8601},
+                                {"queue_ms", metrics.start_ms >= 0 ? metrics.start_ms - metrics.queued_ms : -1},
                             }},
             };
+
+            if (metrics.stolen_by.length())
+            {
+                processed[_hexify_id(outer_pair.first)]["stolen_by"] = metrics.stolen_by;
+            }
+            if (metrics.origin.length())
+            {
+                processed[_hexify_id(outer_pair.first)]["origin"] = metrics.origin;
+            }
+            if (metrics.error.length())
+            {
+                processed[_hexify_id(outer_pair.first)]["error"] = metrics.error;
+            }
+        }
+
+        if (local_pending_id)
+        {
+            json["pendingId"] = _hexify_id(local_pending_id);
         }
 
-        if (*pending_id)
+        if (memory_reporter)
         {
-            json["pendingId"] = _hexify_id(*pending_id);
+            auto &memory = json["memory"] = memory_reporter();
+            memory["results_bytes"] = results_bytes;
+        }
+
+        if (federation)
+        {
+            auto &peers = json["peers"] = std::map<std::string, nlohmann::json>{};
+            for (const auto &status_ent : federation->statuses())
+            {
+                auto &peer_json = peers[status_ent.first] = peer_status_json(status_ent.second);
+                peer_json["updated_ms"] = status_ent.second.updated_ms;
+            }
         }
 
         if (auth_options.level > AuthLevel::None)
@@ -467,25 +1084,24 @@ http_prompt_servicer http_server_run(
                             std::string model,
                             std::string remote_addr,
                             QueuePriority priority,
-                            uint mirostat) -> std::pair<uint64_t, ssize_t>
+                            SamplingParams sampling) -> std::pair<uint64_t, ssize_t>
     {
         if (prompt.length() > (std::size_t)context_size)
         {
             return std::make_pair((long unsigned)0, (ssize_t)-1);
         }
 
-        auto id = _unique_id(m);
         ResponsePlusMetrics rpm;
         rpm.model = model;
         rpm.remote_addr = remote_addr;
         rpm.queued_iso8601 = iso8601_timestamp();
+        rpm.queued_ms = _now_ms();
 
+        uint64_t id = 0;
         {
-            using namespace std::chrono;
-            auto qtsms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-            QueueElement qe{id, qtsms, prompt, priority, mirostat};
-
             std::lock_guard<std::mutex> lg(*q_lock);
+            id = _unique_id(m);
+            QueueElement qe{id, rpm.queued_ms, prompt, priority, sampling, nullptr};
             q->push_back(qe);
             std::push_heap(q->begin(), q->end(), QueueElementCmp);
             m->emplace(std::make_pair(id, std::make_pair(prompt, rpm)));
@@ -496,64 +1112,318 @@ http_prompt_servicer http_server_run(
     };
 
     // GET promptId handler (_http_get_prompt_result)
-    auto GET_promptId_handler = [q, q_lock, m](uint64_t id) -> _http_get_prompt_result_return
+    auto GET_promptId_handler = [q, q_lock, m, leases, federation](uint64_t id) -> _http_get_prompt_result_return
     {
-        auto ele = m->find(id);
-        if (ele == m->end())
+        _http_get_prompt_result_return result{};
         {
-            return _http_get_prompt_result_return{};
+            // so that a prompt taken by a peer that never returns it doesn't stay "stolenBy" it forever
+            std::lock_guard<std::mutex> lg(*q_lock);
+            _reclaim_stolen(q, m, leases, federation);
+
+            auto ele = m->find(id);
+            if (ele == m->end())
+            {
+                return result;
+            }
+            result.prompt = ele->second.first;
+            result.rpm = ele->second.second;
         }
 
-        return _http_get_prompt_result_return{
-            ele->second.first,
-            ele->second.second,
-            QueueElementPosById(ele->first, q, q_lock)};
+        result.queue_position = QueueElementPosById(id, q, q_lock);
+        return result;
     };
 
-    std::thread(
-        _http_server_run,
-        models,
-        session_ep,
-        runtime_info_ep_handler,
-        server_startup_handler,
-        POST_handler,
-        GET_promptId_handler,
-        auth_options)
-        .detach();
-
-    return [hostname, port, q, q_lock, pending_id, m](std::string *response, float predict_elapsed_ms = -1.0, int num_tokens_predicted = -1)
+    std::vector<std::string> model_names;
+    for (const auto &model_ent : models)
+    {
+        model_names.push_back(model_ent.first);
+    }
+
+    _http_peer_handlers peer;
+    if (federation)
     {
-        if (response && *pending_id > 0)
+        peer.status = [q, q_lock, m, pending_id, model_names, models]()
         {
+            PeerStatus status;
+            status.models = model_names;
+            for (const auto &model_ent : models)
+            {
+                if (model_ent.second.value("preload", false) == true)
+                {
+                    status.loaded.push_back(model_ent.first);
+                }
+            }
+
+            std::lock_guard<std::mutex> lg(*q_lock);
+            status.busy = *pending_id != 0;
+            status.queued = q->size();
+            for (const auto &q_element : *q)
+            {
+                const auto &rpm = m->at(q_element.id).second;
+                // a preempted prompt's state is here, & one taken from a peer must be returned by this node
+                if (!q_element.preempted && rpm.origin.empty())
+                {
+                    status.stealable[rpm.model]++;
+                }
+            }
+            return peer_status_json(status);
+        };
+
+        peer.steal = [q, q_lock, m, leases](const nlohmann::json &request, PeerPrompt *stolen)
+        {
+            const std::vector<std::string> models = request["models"];
+            const size_t max_prompt_chars = request["maxPromptChars"];
+
+            std::lock_guard<std::mutex> lg(*q_lock);
+            // the one that would otherwise run last
+            auto last = q->end();
+            for (auto it = q->begin(); it != q->end(); ++it)
+            {
+                const auto &rpm = m->at(it->id).second;
+                if (!it->preempted && rpm.origin.empty() && it->prompt.length() <= max_prompt_chars &&
+                    std::find(models.begin(), models.end(), rpm.model) != models.end() &&
+                    (last == q->end() || QueueElementCmp(*it, *last)))
+                {
+                    last = it;
+                }
+            }
+
+            if (last == q->end())
+            {
+                return false;
+            }
+
+            auto &rpm = m->at(last->id).second;
+            rpm.stolen_by = request["node"];
+            rpm.start_ms = _now_ms();
+            stolen->id = last->id;
+            stolen->prompt = last->prompt;
+            stolen->model = rpm.model;
+            stolen->priority = last->priority;
+            stolen->sampling = last->sampling;
+
+            (*leases)[last->id] = _stolen_element{*last, rpm.start_ms + PEER_LEASE_MS};
+            q->erase(last);
+            std::make_heap(q->begin(), q->end(), QueueElementCmp);
+            return true;
+        };
+
+        peer.result = [q_lock, m, leases](uint64_t id, const nlohmann::json &result)
+        {
+            std::lock_guard<std::mutex> lg(*q_lock);
+            auto found = m->find(id);
+            // not if it was requeued, once its lease ran out
+            if (found == m->end() || leases->erase(id) == 0 || found->second.second.end_ms >= 0)
+            {
+                return false;
+            }
+
+            auto &rpm = found->second.second;
+            rpm.response = result["response"];
+            if (result.contains("responses") && result["responses"].is_array())
+            {
+                rpm.responses = result["responses"].get<std::vector<std::string>>();
+            }
+            rpm.elapsed_ms = result.value("elapsed_ms", -1.0f);
+            rpm.tokens = result["tokens"];
+            rpm.error = result.value("error", "");
+            rpm.end_iso8601 = iso8601_timestamp();
+            rpm.end_ms = _now_ms();
+            // as measured by the peer from when it took the prompt
+            if (result.contains("ttft_ms") && result["ttft_ms"].is_number())
+            {
+                rpm.first_token_ms = rpm.start_ms + result["ttft_ms"].get<int64_t>();
+            }
+            return true;
+        };
+    }
+
+    if (event_loop_threads > 0)
+    {
+        std::thread(
+            _http_server_run<EventServer>,
+            models,
+            session_ep,
+            runtime_info_ep_handler,
+            event_server_startup_handler,
+            POST_handler,
+            GET_promptId_handler,
+            sampling_defaults,
+            embedder,
+            indexes,
+            auth_options,
+            peer)
+            .detach();
+    }
+    else
+    {
+        std::thread(
+            _http_server_run<httplib::Server>,
+            models,
+            session_ep,
+            runtime_info_ep_handler,
+            server_startup_handler,
+            POST_handler,
+            GET_promptId_handler,
+            sampling_defaults,
+            embedder,
+            indexes,
+            auth_options,
+            peer)
+            .detach();
+    }
+
+    // what's pending when it's preempted, so it can be requeued as it was
+    auto *pending = new QueueElement();
+
+    return [hostname, port, q, q_lock, pending_id, pending, m, leases, idle_handler, idle_ms, federation, model_names, context_size, lifetime_queued](std::vector<std::string> *responses, float predict_elapsed_ms = -1.0, int num_tokens_predicted = -1, float ttft_ms = -1.0,
+                                                               std::shared_ptr<PreemptedGeneration> preempted = nullptr, std::string error = "")
+    {
+        if (preempted && *pending_id > 0)
+        {
+            pending->preempted = preempted;
+            std::lock_guard<std::mutex> lg(*q_lock);
+            if (preempted->crashed)
+            {
+                m->at(*pending_id).second.crashes++;
+            }
+            else
+            {
+                m->at(*pending_id).second.preemptions++;
+            }
+            q->push_back(*pending);
+            std::push_heap(q->begin(), q->end(), QueueElementCmp);
+            *pending_id = 0;
+        }
+        else if (responses && *pending_id > 0)
+        {
+            std::unique_lock<std::mutex> lk(*q_lock);
             ResponsePlusMetrics resp_obj = m->at(*pending_id).second;
-            resp_obj.response = *response;
+            resp_obj.response = responses->size() ? responses->front() : "";
+            if (responses->size() > 1)
+            {
+                resp_obj.responses = *responses;
+            }
             resp_obj.elapsed_ms = predict_elapsed_ms;
             resp_obj.tokens = num_tokens_predicted;
+            resp_obj.error = error;
             resp_obj.end_iso8601 = iso8601_timestamp();
-            (*m)[*pending_id] = std::make_pair(m->at(*pending_id).first, resp_obj);
+            resp_obj.end_ms = _now_ms();
+            if (ttft_ms >= 0)
+            {
+                resp_obj.first_token_ms = resp_obj.start_ms + (int64_t)ttft_ms;
+            }
+
+            m->at(*pending_id).second = resp_obj;
             *pending_id = 0;
+            lk.unlock();
+
+            Peer origin;
+            if (federation && parse_peer(resp_obj.origin, &origin))
+            {
+                nlohmann::json result{
+                    {"response", resp_obj.response},
+                    {"elapsed_ms", resp_obj.elapsed_ms},
+                    {"tokens", resp_obj.tokens},
+                    {"queue_ms", resp_obj.start_ms - resp_obj.queued_ms},
+                };
+                if (resp_obj.responses.size())
+                {
+                    result["responses"] = resp_obj.responses;
+                }
+                if (resp_obj.error.length())
+                {
+                    result["error"] = resp_obj.error;
+                }
+                if (resp_obj.first_token_ms >= 0)
+                {
+                    result["ttft_ms"] = resp_obj.first_token_ms - resp_obj.queued_ms;
+                }
+                federation->return_result(origin, resp_obj.origin_id, result);
+            }
         }
 
         std::string r = "";
         std::string model = "";
 
-        while (!q->size())
+        // idle from when the last prompt finished, or the server started
+        const auto idle_start = std::chrono::steady_clock::now();
+        auto last_steal = idle_start - std::chrono::milliseconds(PEER_STEAL_INTERVAL_MS);
+        bool idled = false;
+        QueueElement q_element;
+        while (true)
         {
+            {
+                // checked & taken at once, as a peer may take what's queued at any moment
+                std::lock_guard<std::mutex> lg(*q_lock);
+                _reclaim_stolen(q, m, leases, federation);
+                if (q->size())
+                {
+                    std::pop_heap(q->begin(), q->end(), QueueElementCmp);
+                    q_element = q->back();
+                    q->pop_back();
+                    *pending_id = q_element.id;
+                    break;
+                }
+            }
+
+            PeerPrompt stolen;
+            Peer origin;
+            if (federation && std::chrono::steady_clock::now() - last_steal >= std::chrono::milliseconds(PEER_STEAL_INTERVAL_MS))
+            {
+                last_steal = std::chrono::steady_clock::now();
+                if (federation->steal(model_names, context_size, &stolen, &origin))
+                {
+                    ResponsePlusMetrics rpm;
+                    rpm.model = stolen.model;
+                    rpm.remote_addr = origin.name();
+                    rpm.origin = origin.name();
+                    rpm.origin_id = stolen.id;
+                    rpm.queued_iso8601 = iso8601_timestamp();
+                    rpm.queued_ms = _now_ms();
+
+                    std::lock_guard<std::mutex> lg(*q_lock);
+                    auto id = _unique_id(m);
+                    q->push_back(QueueElement{id, rpm.queued_ms, stolen.prompt, stolen.priority, stolen.sampling, nullptr});
+                    std::push_heap(q->begin(), q->end(), QueueElementCmp);
+                    m->emplace(std::make_pair(id, std::make_pair(stolen.prompt, rpm)));
+                    (*lifetime_queued)++;
+                    HTTP_LOGGER("Took prompt ID %s from %s as %s\n", _hexify_id(stolen.id).c_str(), origin.name().c_str(), _hexify_id(id).c_str());
+                    continue;
+                }
+            }
+
+            if (idle_handler && idle_ms > 0 && !idled &&
+                std::chrono::steady_clock::now() - idle_start >= std::chrono::milliseconds(idle_ms))
+            {
+                idle_handler();
+                idled = true;
+            }
             std::this_thread::sleep_for(std::chrono::microseconds(500));
         }
 
-        QueueElement q_element;
+        r = q_element.prompt;
         {
             std::lock_guard<std::mutex> lg(*q_lock);
-            std::pop_heap(q->begin(), q->end(), QueueElementCmp);
-            q_element = q->back();
-            q->pop_back();
+            auto &rpm = m->at(q_element.id).second;
+            model = rpm.model;
+            if (rpm.start_ms < 0)
+            {
+                rpm.start_ms = _now_ms();
+            }
         }
 
-        *pending_id = q_element.id;
-        r = q_element.prompt;
-        model = m->at(q_element.id).second.model;
+        const auto priority = q_element.priority;
+        auto outranked = [q, q_lock, priority]()
+        {
+            std::lock_guard<std::mutex> lg(*q_lock);
+            return !q->empty() && q->front().priority > priority;
+        };
+
+        auto preempted_generation = q_element.preempted;
+        q_element.preempted.reset();
+        *pending = q_element;
 
-        return ServicerResponse{_hexify_id(*pending_id), r, model, q_element.mirostat};
+        return ServicerResponse{_hexify_id(*pending_id), r, model, q_element.sampling, preempted_generation, outranked, priority};
     };
 }
\ No newline at end of file
@@ -3,6 +3,10 @@
 #include <string>
 #include <functional>
 #include <map>
+#include <memory>
+#include <vector>
+
+#include "sampling.h"
 
 #include "deps/json/single_include/nlohmann/json.hpp"
 
@@ -10,6 +14,10 @@
 
 using models_map_t = std::map<std::string, nlohmann::json>;
 
+struct VectorIndexes;
+struct PreemptedGeneration;
+class Federation;
+
 enum QueuePriority
 {
     LOW = -128,
@@ -23,7 +31,9 @@ struct QueueElement
     int64_t queued_ts_ms;
     std::string prompt;
     QueuePriority priority;
-    uint mirostat;
+    SamplingParams sampling;
+    // set if it was preempted, to be resumed from here
+    std::shared_ptr<PreemptedGeneration> preempted;
 };
 
 struct ServicerResponse
@@ -31,20 +41,54 @@ struct ServicerResponse
     std::string id;
     std::string prompt;
     std::string model;
-    uint mirostat;
+    SamplingParams sampling;
+    std::shared_ptr<PreemptedGeneration> preempted;
+    // true once a prompt of higher priority than this one is waiting, i.e. when it should be preempted
+    std::function<bool()> outranked;
+    QueuePriority priority;
 };
 
 struct ResponsePlusMetrics
 {
     std::string response = "";
+    std::vector<std::string> responses; // all of them, when more than one completion was asked for
     float elapsed_ms = -1.0;
     int tokens = -1;
     std::string model = "";
     std::string remote_addr = "";
     std::string queued_iso8601 = "";
     std::string end_iso8601 = "";
+    // milliseconds since the epoch; -1 until reached
+    int64_t queued_ms = -1;
+    int64_t start_ms = -1;
+    int64_t first_token_ms = -1;
+    int64_t end_ms = -1;
+    int preemptions = 0;
+    int crashes = 0; // of workers running it, each of which requeued it to start over
+    // why it failed, if it couldn't be run; its response is then empty
+    std::string error = "";
+    // set on the node it was queued on if a peer took it to run, which returns its result; "host:port" of the peer
+    std::string stolen_by = "";
+    // set on the peer that took it: "host:port" of the node it was queued on, & its ID there
+    std::string origin = "";
+    uint64_t origin_id = 0;
+};
+
+// running totals for each model, as shown by the runtime endpoint
+struct ModelTotals
+{
+    uint64_t prompts = 0;
+    uint64_t tokens = 0;
+    double decode_ms = 0.0; // time spent generating, i.e. after the prompt was evaluated
+    uint64_t drafted = 0;   // when decoding speculatively
+    uint64_t draft_accepted = 0;
+    uint64_t preemptions = 0;
+    double preemption_overhead_ms = 0.0; // saving, reloading & restoring preempted generations
+    uint64_t crashes = 0;                // of workers running its prompts
 };
 
+using model_totals_map_t = std::map<std::string, ModelTotals>;
+
 struct KeyedRequestAuditLog
 {
     uint64_t count = 0;
@@ -77,11 +121,37 @@ struct AuthOptions
     std::map<std::string, KeyedRequestAuditLog> *keys = nullptr;
 };
 
+// returns the request's prompt with the model's sidecar-configured `promptWrappers` applied, each of
+// which may be overridden by `promptWrappers` in `request_body`. `request_body["prompt"]` must be a string.
+std::string wrap_prompt(const nlohmann::json &model_spec, const nlohmann::json &request_body);
+
+// why the model's prompts & embeddings are refused, or an empty string if they aren't: a model whose `memoryEstimate`
+// is more than the machine's memory would only thrash (or be killed) loading it
+std::string model_admission_error(const nlohmann::json &model_spec);
+
 // blocks until the next prompt is available
-// the first parameter must be the response to the *last* prompt; null if no response available (e.g. on first call)
+// the first parameter must be the responses to the *last* prompt (one per completion); null if no response available
+// (e.g. on first call)
 // the second parameter is the total elapsed prediction time, in milliseconds
 // the third parameter is the number of tokens processed in the prediction
-using http_prompt_servicer = std::function<ServicerResponse(std::string *, float, int)>;
+// the fourth parameter is the time from the start of processing until the first token was generated, in
+// milliseconds; negative if none was
+// the fifth parameter, if set (in which case the first must be null), is the last prompt's preempted generation:
+// that prompt goes back on the queue, in its original place, to be resumed (or started over, if it crashed)
+// the sixth parameter, if not empty, is why the last prompt failed, whose responses are then empty
+using http_prompt_servicer = std::function<ServicerResponse(std::vector<std::string> *, float, int, float, std::shared_ptr<PreemptedGeneration>, std::string)>;
+
+// computes an embedding of `model` for each of `texts`, appending them in order (each `*n_embd` floats) to
+// `embeddings`. returns an empty string on success, else why it failed. called from the HTTP server's threads.
+using http_embedder = std::function<std::string(const std::string &model, const std::vector<std::string> &texts, std::vector<float> &embeddings, int *n_embd)>;
+
+// the runtime endpoint's `memory` object, to which the size of the prompts & responses held is added. called from
+// the HTTP server's threads.
+using http_memory_reporter = std::function<nlohmann::json()>;
+
+// called by the servicer as it waits for a prompt, once none has been queued for the idle period; not again until
+// one has.
+using http_idle_handler = std::function<void()>;
 
 http_prompt_servicer http_server_run(
     std::string &hostname,
@@ -91,4 +161,22 @@ http_prompt_servicer http_server_run(
     // set to nullptr to disable the session private endpoint entirely
     std::shared_ptr<std::string> *session_ep,
     struct llama_timings *total_timings,
-    AuthOptions auth_options);
+    // must already have an entry for each model in `models`
+    model_totals_map_t *model_totals,
+    // what prompts are sampled with, unless their model's sidecar or the request itself says otherwise
+    SamplingParams sampling_defaults,
+    // set to nullptr to disable the embeddings endpoint
+    http_embedder embedder,
+    // set to nullptr to disable the vector index endpoints, which also require `embedder`
+    VectorIndexes *indexes,
+    AuthOptions auth_options,
+    // set to nullptr to leave `memory` out of the runtime endpoint
+    http_memory_reporter memory_reporter,
+    // set to nullptr, or `idle_ms` to 0, to never call it
+    http_idle_handler idle_handler,
+    int64_t idle_ms,
+    // set to nullptr to neither take queued work from peers nor let them take it
+    Federation *federation,
+    // 0 to serve with a thread per connection (cpp-httplib's pool), else from an event loop that runs handlers on
+    // this many threads, so that idle & slow connections hold none
+    int event_loop_threads);
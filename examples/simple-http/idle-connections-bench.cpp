@@ -0,0 +1,262 @@
+// how many connections a running simple-http can hold open, what each costs it in memory & threads, & whether a
+// new client is still served promptly while they're held: first idle (connected, having sent nothing), then each
+// sending a request at once, then idle again as kept-alive connections. Linux only
+#include "deps/json/single_include/nlohmann/json.hpp"
+#include "deps/popl/include/popl.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BENCH_LOGGER(fmt_str, ...) fprintf(stderr, "[bench] " fmt_str, ##__VA_ARGS__)
+
+using bench_clock = std::chrono::steady_clock;
+
+static double _ms_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+// a connected socket, or -1 if it couldn't connect within `timeout_s`
+static int _connect(const addrinfo *addr, int timeout_s)
+{
+    const int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    timeval tv{timeout_s, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// whether `received` holds an entire response
+static bool _response_complete(const std::string &received)
+{
+    const auto head_end = received.find("\r\n\r\n");
+    if (head_end == std::string::npos)
+    {
+        return false;
+    }
+
+    size_t content_length = 0;
+    const auto length_at = received.find("Content-Length:");
+    if (length_at != std::string::npos && length_at < head_end)
+    {
+        content_length = strtoull(received.c_str() + length_at + strlen("Content-Length:"), nullptr, 10);
+    }
+    return received.size() >= head_end + 4 + content_length;
+}
+
+// milliseconds a new connection took to be answered, or -1 if it wasn't within `timeout_s`
+static double _probe(const addrinfo *addr, const std::string &request, int timeout_s)
+{
+    const auto start = bench_clock::now();
+    const int fd = _connect(addr, timeout_s);
+    if (fd < 0 || send(fd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    std::string received;
+    char buf[4096];
+    ssize_t n;
+    while (!_response_complete(received) && (n = recv(fd, buf, sizeof(buf), 0)) > 0)
+    {
+        received.append(buf, n);
+    }
+    close(fd);
+    return _response_complete(received) ? _ms_since(start) : -1;
+}
+
+// the server's resident memory (in KiB) & thread count, from /proc
+static nlohmann::json _server_usage(int pid)
+{
+    nlohmann::json usage{{"rss_kib", nullptr}, {"threads", nullptr}};
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (!line.compare(0, 6, "VmRSS:"))
+        {
+            usage["rss_kib"] = std::stoll(line.substr(6));
+        }
+        else if (!line.compare(0, 8, "Threads:"))
+        {
+            usage["threads"] = std::stoll(line.substr(8));
+        }
+    }
+    return usage;
+}
+
+// `usage` & a probe's latency, & the memory each of `n_conns` costs over `baseline`
+static nlohmann::json _phase(int pid, const addrinfo *addr, const std::string &request, int timeout_s, const nlohmann::json &baseline, size_t n_conns)
+{
+    nlohmann::json phase = pid > 0 ? _server_usage(pid) : nlohmann::json::object();
+    phase["probe_ms"] = _probe(addr, request, timeout_s);
+    if (pid > 0 && n_conns && phase["rss_kib"].is_number() && baseline["rss_kib"].is_number())
+    {
+        phase["bytes_per_connection"] = (phase["rss_kib"].get<double>() - baseline["rss_kib"].get<double>()) * 1024.0 / n_conns;
+    }
+    return phase;
+}
+
+int main(int argc, char **argv)
+{
+    popl::OptionParser op("allowed options");
+    auto help_opt = op.add<popl::Switch>("h", "help", "This help");
+    auto host_opt = op.add<popl::Value<std::string>>("H", "host", "simple-http host", "localhost");
+    auto port_opt = op.add<popl::Value<int>>("p", "port", "simple-http port", 42000);
+    auto num_opt = op.add<popl::Value<int>>("n", "connections", "Connections to hold open", 10000);
+    auto pid_opt = op.add<popl::Value<int>>("P", "pid", "simple-http's process ID, to report its memory & threads (if it runs on this host)");
+    auto path_opt = op.add<popl::Value<std::string>>("u", "path", "Path each request GETs", "/models");
+    auto timeout_opt = op.add<popl::Value<int>>("t", "timeout", "Seconds to wait for a connection, or for responses", 10);
+    auto settle_opt = op.add<popl::Value<int>>("s", "settle-ms", "Milliseconds to wait after each phase before measuring it", 1000);
+    op.parse(argc, argv);
+
+    if (help_opt->is_set())
+    {
+        std::cout << argv[0] << " " << op.help();
+        return 0;
+    }
+
+    rlimit files;
+    if (!getrlimit(RLIMIT_NOFILE, &files) && files.rlim_cur < files.rlim_max)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    getrlimit(RLIMIT_NOFILE, &files);
+    const size_t n_wanted = num_opt->value();
+    if (n_wanted + 16 > files.rlim_cur)
+    {
+        BENCH_LOGGER("Only %llu file descriptors are allowed; some connections will fail\n", (unsigned long long)files.rlim_cur);
+    }
+
+    addrinfo hints, *addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host_opt->value().c_str(), std::to_string(port_opt->value()).c_str(), &hints, &addr))
+    {
+        BENCH_LOGGER("Unable to resolve %s\n", host_opt->value().c_str());
+        return 1;
+    }
+
+    const int pid = pid_opt->is_set() ? pid_opt->value() : 0;
+    const int timeout_s = timeout_opt->value();
+    const auto settle = std::chrono::milliseconds(settle_opt->value());
+    const std::string request = "GET " + path_opt->value() + " HTTP/1.1\r\nHost: " + host_opt->value() + "\r\n\r\n";
+
+    nlohmann::json report{{"connections", n_wanted}};
+    report["baseline"] = _phase(pid, addr, request, timeout_s, nullptr, 0);
+
+    BENCH_LOGGER("Opening %zu connections\n", n_wanted);
+    std::vector<int> conns;
+    const auto open_start = bench_clock::now();
+    for (size_t i = 0; i < n_wanted; i++)
+    {
+        const int fd = _connect(addr, timeout_s);
+        if (fd < 0)
+        {
+            BENCH_LOGGER("Connection %zu failed: %s\n", i, strerror(errno));
+            break;
+        }
+        conns.push_back(fd);
+    }
+    report["opened"] = conns.size();
+    report["open_ms"] = _ms_since(open_start);
+
+    std::this_thread::sleep_for(settle);
+    report["idle"] = _phase(pid, addr, request, timeout_s, report["baseline"], conns.size());
+
+    // every connection sends its request at once, & is answered when the server gets to it
+    BENCH_LOGGER("Sending a request on each\n");
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<std::string> received(conns.size());
+    std::vector<bool> done(conns.size(), false);
+    const auto active_start = bench_clock::now();
+    for (size_t i = 0; i < conns.size(); i++)
+    {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i], &ev);
+        if (send(conns[i], request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size())
+        {
+            BENCH_LOGGER("Request on connection %zu failed: %s\n", i, strerror(errno));
+        }
+    }
+
+    size_t n_answered = 0, n_done = 0;
+    epoll_event events[256];
+    while (n_done < conns.size() && _ms_since(active_start) < timeout_s * 1000.0)
+    {
+        const int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), 100);
+        for (int e = 0; e < n; e++)
+        {
+            const size_t i = events[e].data.u64;
+            if (done[i])
+            {
+                continue;
+            }
+            char buf[4096];
+            const ssize_t got = recv(conns[i], buf, sizeof(buf), MSG_DONTWAIT);
+            if (got > 0)
+            {
+                received[i].append(buf, got);
+            }
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR) || _response_complete(received[i]))
+            {
+                n_answered += _response_complete(received[i]);
+                n_done++;
+                done[i] = true;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conns[i], nullptr);
+            }
+        }
+    }
+    const double active_ms = _ms_since(active_start);
+    close(epoll_fd);
+
+    report["active"] = {
+        {"answered", n_answered},
+        {"ms", active_ms},
+        {"requests_per_s", n_answered / (active_ms / 1000.0)},
+    };
+
+    std::this_thread::sleep_for(settle);
+    report["kept_alive"] = _phase(pid, addr, request, timeout_s, report["baseline"], conns.size());
+
+    for (const int fd : conns)
+    {
+        close(fd);
+    }
+    freeaddrinfo(addr);
+
+    std::cout << report.dump(2) << std::endl;
+    return 0;
+}
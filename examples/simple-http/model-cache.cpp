@@ -0,0 +1,213 @@
+#include "model-cache.h"
+#include "common.h"
+#include "http.h"
+
+#include "deps/json/single_include/nlohmann/json.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+// copied a chunk at a time, which is big enough for the copy to run at the disk's speed
+const size_t MODEL_CACHE_COPY_CHUNK = 8 << 20;
+
+std::string model_file_fingerprint(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+    {
+        return "";
+    }
+
+    const int64_t size = in.tellg();
+    const int64_t span = std::min<int64_t>(size, 1 << 20);
+    uint64_t hash = 14695981039346656037ULL;
+    std::vector<char> buf(span);
+    for (int64_t offset : {(int64_t)0, size - span})
+    {
+        in.seekg(offset);
+        in.read(buf.data(), span);
+        for (char c : buf)
+        {
+            hash = (hash ^ (uint8_t)c) * 1099511628211ULL;
+        }
+    }
+
+    char fingerprint[64];
+    snprintf(fingerprint, sizeof(fingerprint), "%" PRId64 "-%016" PRIx64, size, hash);
+    return fingerprint;
+}
+
+// the file's size & modification time (in ns), or false if it can't be stat'd
+static bool _file_version(const std::string &path, int64_t *size, int64_t *mtime_ns)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st))
+    {
+        return false;
+    }
+
+    *size = st.st_size;
+#if defined(__APPLE__)
+    *mtime_ns = st.st_mtimespec.tv_sec * (int64_t)1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    *mtime_ns = st.st_mtim.tv_sec * (int64_t)1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+// copies `from` to `to` (which it creates), returning an empty string on success, else why it failed
+static std::string _copy_file(const std::string &from, const std::string &to)
+{
+    const int in = open(from.c_str(), O_RDONLY);
+    if (in < 0)
+    {
+        return strerror(errno);
+    }
+    const int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        const std::string error = strerror(errno);
+        close(in);
+        return error;
+    }
+
+    std::string error;
+    std::vector<char> buf(MODEL_CACHE_COPY_CHUNK);
+    ssize_t n;
+    while (error.empty() && (n = read(in, buf.data(), buf.size())) != 0)
+    {
+        if (n < 0)
+        {
+            error = strerror(errno);
+        }
+        for (ssize_t written = 0, w; error.empty() && written < n; written += w)
+        {
+            w = write(out, buf.data() + written, n - written);
+            if (w < 0)
+            {
+                error = strerror(errno);
+            }
+        }
+    }
+
+#ifdef POSIX_FADV_DONTNEED
+    // the copy holds the file's pages now, so those it left in the page cache would only be held twice
+    posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(in);
+    if (close(out) && error.empty())
+    {
+        error = strerror(errno);
+    }
+    return error;
+}
+
+std::string cached_model_path(const std::string &cache_dir, const std::string &path)
+{
+    int64_t size, mtime_ns;
+    const std::string fingerprint = model_file_fingerprint(path);
+    if (!_file_version(path, &size, &mtime_ns) || fingerprint.empty())
+    {
+        return path;
+    }
+
+    // named for the file's path, so that two files with the same name are cached apart
+    uint64_t path_hash = 14695981039346656037ULL;
+    for (char c : path)
+    {
+        path_hash = (path_hash ^ (uint8_t)c) * 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "-%016" PRIx64, path_hash);
+    const std::string base_name = path.substr(path.find_last_of('/') + 1);
+    const std::string copy_path = cache_dir + "/" + base_name + name;
+    const std::string meta_path = copy_path + ".json";
+
+    nlohmann::json meta;
+    {
+        std::ifstream in(meta_path);
+        meta = nlohmann::json::parse(in, nullptr, false);
+    }
+
+    int64_t copy_size, copy_mtime_ns;
+    if (meta.is_object() && meta.value("size", (int64_t)-1) == size && meta.value("mtimeNs", (int64_t)-1) == mtime_ns &&
+        meta.value("fingerprint", "") == fingerprint && _file_version(copy_path, &copy_size, &copy_mtime_ns) &&
+        copy_size == size && model_file_fingerprint(copy_path) == fingerprint)
+    {
+        HTTP_LOGGER("Mapping %s from its copy in the model cache\n", path.c_str());
+        return copy_path;
+    }
+
+    // stale (or half-written by a process that died), & in the way of a copy of the file as it now is
+    unlink(meta_path.c_str());
+    unlink(copy_path.c_str());
+
+    mkdir(cache_dir.c_str(), 0755);
+    struct statvfs vfs;
+    if (statvfs(cache_dir.c_str(), &vfs))
+    {
+        HTTP_LOGGER("Not caching %s: model cache %s is unusable: %s\n", path.c_str(), cache_dir.c_str(), strerror(errno));
+        return path;
+    }
+    const size_t free_bytes = (size_t)vfs.f_bavail * vfs.f_frsize;
+    if (free_bytes < (size_t)size)
+    {
+        HTTP_LOGGER("Not caching %s: it's %.1f MiB, but model cache %s has only %.1f MiB free\n", path.c_str(),
+                    size / 1048576.0, cache_dir.c_str(), free_bytes / 1048576.0);
+        return path;
+    }
+
+    // written under a name of its own & renamed into place once complete, so that no other process maps part of it
+    const int64_t start_us = llama_time_us();
+    const std::string tmp_path = copy_path + ".tmp" + std::to_string(getpid());
+    std::string error = _copy_file(path, tmp_path);
+
+    int64_t after_size, after_mtime_ns;
+    if (error.empty() && (!_file_version(path, &after_size, &after_mtime_ns) || after_size != size || after_mtime_ns != mtime_ns))
+    {
+        error = "it changed while being copied";
+    }
+    if (error.empty() && rename(tmp_path.c_str(), copy_path.c_str()))
+    {
+        error = strerror(errno);
+    }
+    if (!error.empty())
+    {
+        HTTP_LOGGER("Not caching %s: copying it into model cache %s failed: %s\n", path.c_str(), cache_dir.c_str(), error.c_str());
+        unlink(tmp_path.c_str());
+        return path;
+    }
+
+    const std::string meta_tmp_path = meta_path + ".tmp" + std::to_string(getpid());
+    std::ofstream out(meta_tmp_path, std::ios::trunc);
+    out << nlohmann::json{
+               {"source", path},
+               {"size", size},
+               {"mtimeNs", mtime_ns},
+               {"fingerprint", fingerprint},
+           }
+               .dump(4)
+        << "\n";
+    out.close();
+    if (!out || rename(meta_tmp_path.c_str(), meta_path.c_str()))
+    {
+        // the copy is still good for this process, but a later one won't trust it
+        HTTP_LOGGER("Unable to record the copy of %s in model cache %s\n", path.c_str(), cache_dir.c_str());
+        unlink(meta_tmp_path.c_str());
+    }
+
+    HTTP_LOGGER("Copied %s (%.1f MiB) into model cache %s in %.1f s\n", path.c_str(), size / 1048576.0,
+                cache_dir.c_str(), (llama_time_us() - start_us) / 1e6);
+    return copy_path;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+// the file's size & an FNV-1a hash of its first & last MiB, which hold its header & hyperparameters & enough
+// weights to tell apart any two models of the same shape; hashing all of a model would take far longer. empty if
+// the file can't be read
+std::string model_file_fingerprint(const std::string &path);
+
+// the path to load the model file at `path` from, which is its copy in `cache_dir`: a directory on a memory-backed
+// filesystem, e.g. tmpfs at /dev/shm (mounted with `huge=always` for huge pages), where copies outlive the process
+// that made them without one to keep them. a restarted server then maps its models' weights straight from memory,
+// rather than reading them from disk again. a copy is only used while the file's size, modification time &
+// fingerprint still match those it was made from, & is otherwise made again, if the cache has room for it; if it
+// hasn't, or copying fails, returns `path` itself
+std::string cached_model_path(const std::string &cache_dir, const std::string &path);
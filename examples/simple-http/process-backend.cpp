@@ -0,0 +1,531 @@
+#include "backend.h"
+#include "http.h"
+#include "shm-ring.h"
+#include "thread-budget.h"
+
+#include "deps/json/single_include/nlohmann/json.hpp"
+
+#include <cstring>
+#include <map>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// each way, per worker: plenty for any prompt or response, which are streamed through if not
+const size_t WORKER_RING_BYTES = 4 << 20;
+// times a prompt's worker may die running it before it's given up on, rather than crash yet another
+const int WORKER_MAX_CRASHES = 3;
+
+// a worker's share of the memory mapped before the zygote was forked, & so at the same address in every process
+struct _WorkerSlot
+{
+    std::atomic<int32_t> pid;  // -1 while the zygote is forking it, 0 once it has exited
+    std::atomic<bool> preempt; // set by the supervisor to stop the running prompt at its next token
+    ShmRing *requests;
+    ShmRing *results;
+};
+
+// a generation preempted in a worker, which keeps it, to be resumed there. a requeued prompt whose worker died
+// has no `handle` & starts over
+struct _RemotePreemption : PreemptedGeneration
+{
+    int worker = -1;
+    uint64_t incarnation = 0; // of the worker, as a replacement doesn't have it
+    uint64_t handle = 0;
+    int crashes = 0;
+};
+
+template <typename T>
+static nlohmann::json _pod_json(const T &pod)
+{
+    const auto *bytes = reinterpret_cast<const uint8_t *>(&pod);
+    return nlohmann::json::binary(std::vector<uint8_t>(bytes, bytes + sizeof(T)));
+}
+
+template <typename T>
+static void _pod_from_json(const nlohmann::json &json, T *pod)
+{
+    const auto &bytes = json.get_binary();
+    if (pod && bytes.size() == sizeof(T))
+    {
+        memcpy(pod, bytes.data(), sizeof(T));
+    }
+}
+
+// the fields of gpt_params that the servicer sets for each prompt; the rest are as the workers were started with
+static nlohmann::json _prompt_params_json(const gpt_params &params)
+{
+    return nlohmann::json{
+        {"model", params.model},
+        {"modelDraft", params.model_draft},
+        {"loraAdapter", params.lora_adapter},
+        {"prompt", params.prompt},
+        {"nDraft", params.n_draft},
+        {"nThreads", params.n_threads},
+        {"nThreadsBatch", params.n_threads_batch},
+        {"useMlock", params.use_mlock},
+    };
+}
+
+static void _apply_prompt_params(const nlohmann::json &json, gpt_params &params)
+{
+    params.model = json["model"];
+    params.model_draft = json["modelDraft"];
+    params.lora_adapter = json["loraAdapter"];
+    params.prompt = json["prompt"];
+    params.n_draft = json["nDraft"];
+    params.n_threads = json["nThreads"];
+    params.n_threads_batch = json["nThreadsBatch"];
+    params.use_mlock = json["useMlock"];
+}
+
+// answers the supervisor's requests, one at a time, until it's gone
+static void _worker_main(int index, _WorkerSlot *slot, InferenceBackend *inner, const gpt_params &base)
+{
+    std::map<uint64_t, std::shared_ptr<PreemptedGeneration>> preempted_by_handle;
+    uint64_t next_handle = 1;
+
+    std::vector<uint8_t> message;
+    while (slot->requests->receive(message, nullptr))
+    {
+        const auto request = nlohmann::json::from_cbor(message);
+        const std::string op = request["op"];
+        gpt_params params = base;
+        nlohmann::json reply = nlohmann::json::object();
+
+        if (op == "preload")
+        {
+            _apply_prompt_params(request["params"], params);
+            reply["error"] = inner->preload(params);
+        }
+        else if (op == "trim")
+        {
+            reply["released"] = inner->trim(request["weights"]);
+        }
+        else if (op == "run")
+        {
+            _apply_prompt_params(request["params"], params);
+            SamplingParams sampling;
+            std::string error;
+            parse_sampling_params(request["sampling"], sampling, &error);
+
+            std::shared_ptr<PreemptedGeneration> preempted;
+            auto resumed = preempted_by_handle.find(request["resume"].get<uint64_t>());
+            if (resumed != preempted_by_handle.end())
+            {
+                preempted = resumed->second;
+                preempted_by_handle.erase(resumed);
+            }
+
+            preemption_check preempt = nullptr;
+            if (request["preemptible"])
+            {
+                preempt = [slot]()
+                {
+                    return slot->preempt.load();
+                };
+            }
+
+            // evaluating in the supervisor's share of the thread budget, which it holds while it waits
+            ScopedThreadShareAdoption share(request.value("threadShare", -1));
+            struct llama_timings timings = {};
+            GenerationStats stats;
+            std::string run_error;
+            inner->warm_up(params);
+            reply["responses"] = inner->run_one_prompt(params, sampling, &timings, &stats, preempt, &preempted, &run_error);
+            reply["error"] = run_error;
+            reply["timings"] = _pod_json(timings);
+            reply["stats"] = _pod_json(stats);
+            reply["preempted"] = 0;
+            if (preempted)
+            {
+                preempted_by_handle[next_handle] = preempted;
+                reply["preempted"] = next_handle++;
+            }
+        }
+
+        // responses may split multi-byte characters across tokens, which CBOR carries as they are
+        if (!slot->results->send(nlohmann::json::to_cbor(reply), nullptr))
+        {
+            break;
+        }
+    }
+
+    HTTP_LOGGER("Worker %d exiting\n", index);
+    _exit(0);
+}
+
+// forks a worker into each slot the supervisor writes to `spawn_fd`, & marks each slot's as gone once it exits.
+// being forked before the supervisor starts any threads (& staying single-threaded), it can fork safely at any
+// time, & each worker starts as this did: with `inner` unused & no locks held
+static void _zygote_main(int spawn_fd, _WorkerSlot *slots, InferenceBackend *inner, const gpt_params &base)
+{
+    std::map<pid_t, int> index_by_pid;
+    while (true)
+    {
+        pollfd pfd{spawn_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 10) > 0)
+        {
+            int32_t index;
+            if (read(spawn_fd, &index, sizeof(index)) != sizeof(index))
+            {
+                _exit(0); // the supervisor is gone
+            }
+
+            const pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(spawn_fd);
+                prctl(PR_SET_PDEATHSIG, SIGKILL);
+                _worker_main(index, &slots[index], inner, base);
+            }
+
+            slots[index].pid = pid > 0 ? pid : 0;
+            if (pid > 0)
+            {
+                index_by_pid[pid] = index;
+                HTTP_LOGGER("Started worker %d as pid %d\n", index, pid);
+            }
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            auto found = index_by_pid.find(pid);
+            if (found == index_by_pid.end())
+            {
+                continue;
+            }
+
+            if (WIFSIGNALED(status))
+            {
+                HTTP_LOGGER("Worker %d (pid %d) was killed by signal %d\n", found->second, pid, WTERMSIG(status));
+            }
+            slots[found->second].pid = 0;
+            index_by_pid.erase(found);
+        }
+    }
+}
+
+struct ProcessBackend : InferenceBackend
+{
+    ProcessBackend(std::unique_ptr<InferenceBackend> inner, int n_workers, const gpt_params &params)
+        : inner(std::move(inner)), base(params), workers(n_workers)
+    {
+        const size_t ring_bytes = ShmRing::size_for(WORKER_RING_BYTES);
+        const size_t slots_bytes = (n_workers * sizeof(_WorkerSlot) + 63) / 64 * 64;
+        const size_t region_bytes = slots_bytes + n_workers * 2 * ring_bytes;
+        auto *region = (uint8_t *)mmap(nullptr, region_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED)
+        {
+            return;
+        }
+
+        slots = reinterpret_cast<_WorkerSlot *>(region);
+        for (int i = 0; i < n_workers; i++)
+        {
+            new (&slots[i]) _WorkerSlot;
+            slots[i].pid = 0;
+            slots[i].requests = reinterpret_cast<ShmRing *>(region + slots_bytes + 2 * i * ring_bytes);
+            slots[i].results = reinterpret_cast<ShmRing *>(region + slots_bytes + (2 * i + 1) * ring_bytes);
+        }
+
+        int fds[2];
+        if (pipe(fds))
+        {
+            return;
+        }
+
+        zygote = fork();
+        if (zygote == 0)
+        {
+            close(fds[1]);
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            _zygote_main(fds[0], slots, this->inner.get(), base);
+        }
+
+        close(fds[0]);
+        spawn_fd = fds[1];
+        for (int i = 0; i < n_workers && zygote > 0; i++)
+        {
+            spawn(i);
+        }
+    }
+
+    bool started() const
+    {
+        return zygote > 0;
+    }
+
+    std::vector<std::string> run_one_prompt(gpt_params &params, const SamplingParams &sampling, struct llama_timings *timings,
+                                            GenerationStats *stats, const preemption_check &preempt,
+                                            std::shared_ptr<PreemptedGeneration> *preempted, std::string *error) override
+    {
+        auto *remote = preempted && *preempted ? static_cast<_RemotePreemption *>(preempted->get()) : nullptr;
+        if (remote && remote->crashes >= WORKER_MAX_CRASHES)
+        {
+            HTTP_LOGGER("Giving up on a prompt after %d workers died running it\n", remote->crashes);
+            *error = std::to_string(remote->crashes) + " workers died running it";
+            preempted->reset();
+            return std::vector<std::string>(sampling.n, "");
+        }
+
+        // the worker it was preempted in, if that's still alive; else the one that last ran its model, whose
+        // context may share a prefix with it; else the one least recently used
+        int w = -1;
+        if (remote && remote->handle && workers[remote->worker].incarnation == remote->incarnation &&
+            slots[remote->worker].pid != 0)
+        {
+            w = remote->worker;
+        }
+        for (int i = 0; w < 0 && i < (int)workers.size(); i++)
+        {
+            if (workers[i].last_model == params.model && slots[i].pid != 0)
+            {
+                w = i;
+            }
+        }
+        if (w < 0)
+        {
+            w = 0;
+            for (int i = 1; i < (int)workers.size(); i++)
+            {
+                if (workers[i].last_used < workers[w].last_used)
+                {
+                    w = i;
+                }
+            }
+        }
+
+        if (slots[w].pid == 0)
+        {
+            spawn(w);
+        }
+
+        nlohmann::json request{
+            {"op", "run"},
+            {"params", _prompt_params_json(params)},
+            {"sampling", sampling_params_json(sampling)},
+            {"resume", remote && w == remote->worker && workers[w].incarnation == remote->incarnation ? remote->handle : 0},
+            {"preemptible", (bool)preempt},
+            {"threadShare", current_thread_share_slot()},
+        };
+
+        slots[w].preempt = false;
+        _WorkerSlot *slot = &slots[w];
+        nlohmann::json reply;
+        const bool ok = call(w, request, &reply, [slot, &preempt]()
+                             {
+            if (preempt && !slot->preempt && preempt())
+            {
+                slot->preempt = true;
+            }
+            return slot->pid != 0; });
+
+        workers[w].last_used = ++n_used;
+        if (!ok)
+        {
+            // it goes back on the queue as a preempted prompt would, marked as crashed, to start over in another worker
+            HTTP_LOGGER("Worker %d died running a prompt; requeueing it\n", w);
+            auto requeued = std::make_shared<_RemotePreemption>();
+            requeued->crashed = true;
+            requeued->crashes = (remote ? remote->crashes : 0) + 1;
+            *preempted = requeued;
+            workers[w].last_model.clear();
+            spawn(w);
+            return {};
+        }
+
+        workers[w].last_model = params.model;
+        *error = reply.value("error", "");
+        _pod_from_json(reply["timings"], timings);
+        _pod_from_json(reply["stats"], stats);
+
+        const uint64_t handle = reply["preempted"];
+        if (handle)
+        {
+            auto kept = std::make_shared<_RemotePreemption>();
+            kept->worker = w;
+            kept->incarnation = workers[w].incarnation;
+            kept->handle = handle;
+            kept->crashes = remote ? remote->crashes : 0;
+            *preempted = kept;
+        }
+        else if (preempted)
+        {
+            preempted->reset();
+        }
+
+        return reply["responses"].get<std::vector<std::string>>();
+    }
+
+    std::string preload(const gpt_params &params) override
+    {
+        nlohmann::json request{{"op", "preload"}, {"params", _prompt_params_json(params)}};
+        preloads.push_back(request);
+
+        std::string error;
+        for (int w = 0; w < (int)workers.size(); w++)
+        {
+            nlohmann::json reply;
+            if (!call(w, request, &reply, alive(w)))
+            {
+                error = "worker " + std::to_string(w) + " died";
+                spawn(w);
+            }
+            else if (reply["error"].get<std::string>().length())
+            {
+                error = reply["error"];
+            }
+        }
+        return error;
+    }
+
+    // computed here rather than in a worker, as they may be concurrent with prompts
+    std::string embed(const gpt_params &params, const std::vector<std::string> &texts,
+                      std::vector<float> &embeddings, int *n_embd) override
+    {
+        return inner->embed(params, texts, embeddings, n_embd);
+    }
+
+    // of this process only: the workers' are their own
+    std::map<std::string, ModelMemory> resident_memory() override
+    {
+        return inner->resident_memory();
+    }
+
+    size_t trim(bool weights) override
+    {
+        size_t released = inner->trim(weights);
+        for (int w = 0; w < (int)workers.size(); w++)
+        {
+            nlohmann::json reply;
+            if (slots[w].pid != 0 && call(w, nlohmann::json{{"op", "trim"}, {"weights", weights}}, &reply, alive(w)))
+            {
+                released += reply["released"].get<size_t>();
+            }
+        }
+        return released;
+    }
+
+    // each worker warms its own before running a prompt
+    void warm_up(const gpt_params &) override {}
+
+private:
+    struct WorkerState
+    {
+        uint64_t incarnation = 0;
+        int pending_replies = 0; // to requests sent before it started, which come before any other's
+        uint64_t last_used = 0;
+        std::string last_model;
+    };
+
+    std::unique_ptr<InferenceBackend> inner;
+    const gpt_params base;
+    std::vector<WorkerState> workers;
+    _WorkerSlot *slots = nullptr;
+    pid_t zygote = -1;
+    int spawn_fd = -1;
+    uint64_t n_used = 0;
+    std::vector<nlohmann::json> preloads; // replayed to each worker as it starts
+
+    ShmRing::alive_check alive(int w)
+    {
+        _WorkerSlot *slot = &slots[w];
+        return [slot]()
+        {
+            return slot->pid != 0;
+        };
+    }
+
+    // has the zygote fork a fresh worker into slot `w`, queuing up the preloads it must first do
+    void spawn(int w)
+    {
+        if (waitpid(zygote, nullptr, WNOHANG) != 0)
+        {
+            HTTP_LOGGER("The worker zygote is gone; exiting\n");
+            exit(1);
+        }
+
+        auto &slot = slots[w];
+        slot.pid = -1;
+        slot.preempt = false;
+        ShmRing::create(slot.requests, WORKER_RING_BYTES);
+        ShmRing::create(slot.results, WORKER_RING_BYTES);
+        workers[w].incarnation++;
+        workers[w].pending_replies = 0;
+
+        const int32_t index = w;
+        if (write(spawn_fd, &index, sizeof(index)) != sizeof(index))
+        {
+            slot.pid = 0;
+            return;
+        }
+
+        for (const auto &request : preloads)
+        {
+            if (slot.requests->send(nlohmann::json::to_cbor(request), alive(w)))
+            {
+                workers[w].pending_replies++;
+            }
+        }
+    }
+
+    // sends `request` to worker `w` & waits for its reply, first collecting any it owes for its preloads. returns
+    // false if the worker died (or `alive` otherwise gave up) first
+    bool call(int w, const nlohmann::json &request, nlohmann::json *reply, const ShmRing::alive_check &alive)
+    {
+        std::vector<uint8_t> message;
+        if (!slots[w].requests->send(nlohmann::json::to_cbor(request), this->alive(w)))
+        {
+            return false;
+        }
+
+        for (; workers[w].pending_replies > 0; workers[w].pending_replies--)
+        {
+            if (!slots[w].results->receive(message, this->alive(w)))
+            {
+                return false;
+            }
+
+            const auto preloaded = nlohmann::json::from_cbor(message);
+            if (preloaded["error"].get<std::string>().length())
+            {
+                HTTP_LOGGER("Worker %d was unable to preload a model: %s\n", w, preloaded["error"].get<std::string>().c_str());
+            }
+        }
+
+        if (!slots[w].results->receive(message, alive))
+        {
+            return false;
+        }
+
+        *reply = nlohmann::json::from_cbor(message);
+        return true;
+    }
+};
+
+std::unique_ptr<InferenceBackend> make_process_backend(std::unique_ptr<InferenceBackend> inner, int n_workers, const gpt_params &params)
+{
+    std::unique_ptr<ProcessBackend> backend(new ProcessBackend(std::move(inner), std::max(1, n_workers), params));
+    if (!backend->started())
+    {
+        return nullptr;
+    }
+    return backend;
+}
+
+#else
+
+std::unique_ptr<InferenceBackend> make_process_backend(std::unique_ptr<InferenceBackend>, int, const gpt_params &)
+{
+    return nullptr;
+}
+
+#endif
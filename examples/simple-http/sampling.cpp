@@ -0,0 +1,549 @@
+#include "sampling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+bool parse_sampling_params(const nlohmann::json &json, SamplingParams &params, std::string *error)
+{
+    if (!json.is_object())
+    {
+        return true;
+    }
+
+    SamplingParams parsed = params;
+    auto number = [&json, error](const char *key, float min, float max, float *value)
+    {
+        if (!json.contains(key))
+        {
+            return true;
+        }
+
+        if (!json[key].is_number() || json[key] < min || json[key] > max)
+        {
+            *error = std::string("`") + key + "` must be a number from " + nlohmann::json(min).dump() + " to " + nlohmann::json(max).dump();
+            return false;
+        }
+
+        *value = json[key];
+        return true;
+    };
+
+    auto integer = [&json, error](const char *key, int64_t min, int64_t max, std::function<void(int64_t)> set)
+    {
+        if (!json.contains(key))
+        {
+            return true;
+        }
+
+        if (!json[key].is_number_integer() || json[key] < min || json[key] > max)
+        {
+            *error = std::string("`") + key + "` must be an integer from " + std::to_string(min) + " to " + std::to_string(max);
+            return false;
+        }
+
+        set(json[key]);
+        return true;
+    };
+
+    if (!number("temperature", 0.0f, 100.0f, &parsed.temperature) ||
+        !integer("topK", INT32_MIN, INT32_MAX, [&parsed](int64_t v)
+                 { parsed.top_k = v; }) ||
+        !number("topP", 0.0f, 1.0f, &parsed.top_p) ||
+        !number("repeatPenalty", 0.0f, 100.0f, &parsed.repeat_penalty) ||
+        !integer("repeatLastN", -1, INT32_MAX, [&parsed](int64_t v)
+                 { parsed.repeat_last_n = v; }) ||
+        !number("frequencyPenalty", -100.0f, 100.0f, &parsed.frequency_penalty) ||
+        !number("presencePenalty", -100.0f, 100.0f, &parsed.presence_penalty) ||
+        !integer("mirostat", 0, 2, [&parsed](int64_t v)
+                 { parsed.mirostat = v; }) ||
+        !number("mirostatTau", 0.0f, 100.0f, &parsed.mirostat_tau) ||
+        !number("mirostatEta", 0.0f, 1.0f, &parsed.mirostat_eta) ||
+        !integer("seed", -1, UINT32_MAX, [&parsed](int64_t v)
+                 { parsed.seed = (uint32_t)v; }) ||
+        !integer("n", 1, MAX_COMPLETIONS, [&parsed](int64_t v)
+                 { parsed.n = v; }))
+    {
+        return false;
+    }
+
+    if (parsed.repeat_penalty <= 0.0f)
+    {
+        *error = "`repeatPenalty` must be greater than 0";
+        return false;
+    }
+
+    params = parsed;
+    return true;
+}
+
+nlohmann::json sampling_params_json(const SamplingParams &params)
+{
+    return nlohmann::json{
+        {"temperature", params.temperature},
+        {"topK", params.top_k},
+        {"topP", params.top_p},
+        {"repeatPenalty", params.repeat_penalty},
+        {"repeatLastN", params.repeat_last_n},
+        {"frequencyPenalty", params.frequency_penalty},
+        {"presencePenalty", params.presence_penalty},
+        {"mirostat", params.mirostat},
+        {"mirostatTau", params.mirostat_tau},
+        {"mirostatEta", params.mirostat_eta},
+        {"seed", params.seed},
+        {"n", params.n},
+    };
+}
+
+bool resolve_sampling_params(const SamplingParams &defaults, const nlohmann::json &model_spec,
+                             const nlohmann::json &request_body, SamplingParams &params, std::string *error)
+{
+    SamplingParams resolved = defaults;
+    if (!parse_sampling_params(model_spec, resolved, error))
+    {
+        *error = "bad sidecar sampling setting: " + *error;
+        return false;
+    }
+
+    if (!parse_sampling_params(request_body, resolved, error))
+    {
+        return false;
+    }
+
+    // mirostat needs a temperature to sample at, so it doesn't default to greedy as everything else does
+    const bool temperature_set = (model_spec.is_object() && model_spec.contains("temperature")) ||
+                                 (request_body.is_object() && request_body.contains("temperature"));
+    if (resolved.mirostat && resolved.temperature <= 0.0f && !temperature_set)
+    {
+        resolved.temperature = MIROSTAT_DEFAULT_TEMPERATURE;
+    }
+
+    // completions seeded by the clock as they start, as a lone one is, could well share a seed
+    if (resolved.n > 1 && resolved.seed == (uint32_t)-1)
+    {
+        resolved.seed = std::random_device{}() % (uint32_t)-1;
+    }
+
+    params = resolved;
+    return true;
+}
+
+SamplingParams completion_sampling(const SamplingParams &params, int i)
+{
+    SamplingParams completion = params;
+    if (params.seed != (uint32_t)-1)
+    {
+        completion.seed = params.seed + i;
+        // rather than the one value that means "random"
+        if (completion.seed == (uint32_t)-1)
+        {
+            completion.seed = 0;
+        }
+    }
+    completion.n = 1;
+    return completion;
+}
+
+// index of the greatest of `n` floats (the first, if tied): what llama_sample_token_greedy() would pick from
+// the raw logits, without building candidates first
+static llama_token _argmax(const float *x, int n)
+{
+    float max = -INFINITY;
+    int i = 0;
+#if defined(__AVX__)
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+    for (; i + 8 <= n; i += 8)
+    {
+        vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + i));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vmax);
+    for (float lane : lanes)
+    {
+        max = std::max(max, lane);
+    }
+#elif defined(__SSE__)
+    __m128 vmax = _mm_set1_ps(-INFINITY);
+    for (; i + 4 <= n; i += 4)
+    {
+        vmax = _mm_max_ps(vmax, _mm_loadu_ps(x + i));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, vmax);
+    for (float lane : lanes)
+    {
+        max = std::max(max, lane);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    float32x4_t vmax = vdupq_n_f32(-INFINITY);
+    for (; i + 4 <= n; i += 4)
+    {
+        vmax = vmaxq_f32(vmax, vld1q_f32(x + i));
+    }
+    max = vmaxvq_f32(vmax);
+#endif
+    for (; i < n; i++)
+    {
+        max = std::max(max, x[i]);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (x[i] == max)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static bool _by_logit(const llama_token_data &a, const llama_token_data &b)
+{
+    return a.logit > b.logit;
+}
+
+// fills `candidates` with the distribution llama_sample_token_mirostat{,_v2} would sample from for the given
+// `mu`: temperature-scaled, truncated, sorted & normalized. rather than softmaxing & sorting the whole vocabulary
+// as they do, only the survivors are sorted: v2 keeps the tokens whose surprise is within `mu`, which a threshold
+// on the logits identifies, & v1 the top k, where k is estimated from the top 100
+static void _mirostat_candidates(const float *logits, int n_vocab, int version, float temp, float mu,
+                                 std::vector<llama_token_data> &candidates)
+{
+    const float inv_temp = 1.0f / temp;
+
+    candidates.clear();
+    if (version == 1)
+    {
+        candidates.resize(n_vocab);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++)
+        {
+            candidates[token_id] = llama_token_data{token_id, logits[token_id] * inv_temp, 0.0f};
+        }
+
+        const int mirostat_m = std::min(100, n_vocab);
+        std::partial_sort(candidates.begin(), candidates.begin() + mirostat_m, candidates.end(), _by_logit);
+
+        // the log-ratio of consecutive probabilities is just the difference of their logits
+        float sum_ti_bi = 0.0f;
+        float sum_ti_sq = 0.0f;
+        for (int i = 0; i < mirostat_m - 1; ++i)
+        {
+            float t_i = logf(float(i + 2) / float(i + 1));
+            float b_i = candidates[i].logit - candidates[i + 1].logit;
+            sum_ti_bi += t_i * b_i;
+            sum_ti_sq += t_i * t_i;
+        }
+
+        const float s_hat = sum_ti_bi / sum_ti_sq;
+        const float epsilon_hat = s_hat - 1;
+        const float k = powf((epsilon_hat * powf(2, mu)) / (1 - powf((float)n_vocab, -epsilon_hat)), 1 / s_hat);
+        const int keep = k >= 1.0f ? (int)std::min(k, (float)n_vocab) : 1;
+        if (keep > mirostat_m)
+        {
+            std::partial_sort(candidates.begin() + mirostat_m, candidates.begin() + keep, candidates.end(), _by_logit);
+        }
+        candidates.resize(keep);
+    }
+    else
+    {
+        const llama_token top = _argmax(logits, n_vocab);
+        const float max = logits[top] * inv_temp;
+        float sum = 0.0f;
+        for (int i = 0; i < n_vocab; i++)
+        {
+            sum += expf(logits[i] * inv_temp - max);
+        }
+
+        // -log2(p) <= mu, where log(p) = logit - max - log(sum)
+        const float threshold = max + logf(sum) - mu * (float)M_LN2;
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++)
+        {
+            if (logits[token_id] * inv_temp >= threshold)
+            {
+                candidates.push_back(llama_token_data{token_id, logits[token_id] * inv_temp, 0.0f});
+            }
+        }
+
+        if (candidates.empty())
+        {
+            candidates.push_back(llama_token_data{top, max, 0.0f});
+        }
+        std::sort(candidates.begin(), candidates.end(), _by_logit);
+    }
+
+    llama_token_data_array candidates_array = {candidates.data(), candidates.size(), true};
+    llama_sample_softmax(nullptr, &candidates_array);
+}
+
+Sampler::Sampler(const SamplingParams &params)
+{
+    reset(params);
+}
+
+void Sampler::reset(const SamplingParams &params)
+{
+    cfg = params;
+    begin({});
+}
+
+void Sampler::begin(const std::vector<llama_token> &prompt)
+{
+    rng.seed(cfg.seed == (uint32_t)-1 ? (uint32_t)time(NULL) : cfg.seed);
+    mirostat_mu = 2.0f * cfg.mirostat_tau;
+    history.assign(prompt.begin(), prompt.end());
+    n_drafted = 0;
+    data.clear();
+    array = {data.data(), 0, true};
+}
+
+bool Sampler::greedy() const
+{
+    return cfg.temperature <= 0.0f;
+}
+
+// `logits`, or a copy of them penalized for the tokens in the recent history
+const float *Sampler::apply_penalties(const float *logits, int n_vocab)
+{
+    const bool penalize = cfg.repeat_penalty != 1.0f || cfg.frequency_penalty != 0.0f || cfg.presence_penalty != 0.0f;
+    const size_t last_n = cfg.repeat_last_n < 0 ? history.size() : std::min(history.size(), (size_t)cfg.repeat_last_n);
+    if (!penalize || !last_n)
+    {
+        return logits;
+    }
+
+    penalized.assign(logits, logits + n_vocab);
+    recent.assign(history.end() - last_n, history.end());
+    std::sort(recent.begin(), recent.end());
+
+    // as llama_sample_repetition_penalty() & llama_sample_frequency_and_presence_penalties() would, but only
+    // visiting the tokens that occur rather than searching the history for each of the vocabulary
+    for (size_t i = 0; i < recent.size();)
+    {
+        const llama_token id = recent[i];
+        size_t count = 0;
+        for (; i < recent.size() && recent[i] == id; i++)
+        {
+            count++;
+        }
+
+        if (id < 0 || id >= n_vocab)
+        {
+            continue;
+        }
+
+        float &logit = penalized[id];
+        logit = logit <= 0 ? logit * cfg.repeat_penalty : logit / cfg.repeat_penalty;
+        logit -= float(count) * cfg.frequency_penalty + cfg.presence_penalty;
+    }
+
+    return penalized.data();
+}
+
+void Sampler::build(const float *logits, int n_vocab)
+{
+    logits = apply_penalties(logits, n_vocab);
+
+    if (greedy())
+    {
+        const llama_token best = _argmax(logits, n_vocab);
+        data.assign(1, llama_token_data{best, logits[best], 1.0f});
+        array = {data.data(), data.size(), true};
+        return;
+    }
+
+    if (cfg.mirostat)
+    {
+        _mirostat_candidates(logits, n_vocab, cfg.mirostat, cfg.temperature, mirostat_mu, data);
+        array = {data.data(), data.size(), true};
+        return;
+    }
+
+    // the order of the main example: top-k, then top-p on the untempered distribution, then temperature
+    data.resize(n_vocab);
+    const int top_k = cfg.top_k <= 0 ? n_vocab : std::min(cfg.top_k, n_vocab);
+    if (top_k == n_vocab)
+    {
+        // top-p alone (if that), which needs the smallest set of most likely tokens with probability >= top_p but
+        // not their order: found by quickselecting on the cumulative probability instead of sorting the vocabulary
+        const float max = logits[_argmax(logits, n_vocab)];
+        float sum = 0.0f;
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++)
+        {
+            data[token_id] = llama_token_data{token_id, logits[token_id], expf(logits[token_id] - max)};
+            sum += data[token_id].p;
+        }
+
+        // [0, lo) are in the set, with a total of `above`, & [hi, n_vocab) aren't. the set is never empty, as
+        // llama_sample_top_p() keeps at least one token even for a top_p of 0
+        const float target = cfg.top_p * sum;
+        float above = 0.0f;
+        size_t lo = cfg.top_p < 1.0f ? 0 : n_vocab, hi = n_vocab;
+        while (lo < hi)
+        {
+            const size_t mid = lo + (hi - lo) / 2;
+            std::nth_element(data.begin() + lo, data.begin() + mid, data.begin() + hi, _by_logit);
+            float mass = 0.0f;
+            for (size_t i = lo; i < mid; i++)
+            {
+                mass += data[i].p;
+            }
+
+            if (above + mass >= target)
+            {
+                hi = mid;
+            }
+            else if (above + mass + data[mid].p >= target)
+            {
+                lo = mid + 1;
+                break;
+            }
+            else
+            {
+                above += mass + data[mid].p;
+                lo = mid + 1;
+            }
+        }
+        const size_t keep = std::max<size_t>(lo, 1);
+
+        // softmaxed at the temperature here, as llama_sample_softmax() would sort them
+        const float inv_temp = 1.0f / cfg.temperature;
+        float kept_sum = 0.0f;
+        for (size_t i = 0; i < keep; i++)
+        {
+            data[i].logit *= inv_temp;
+            data[i].p = expf(data[i].logit - max * inv_temp);
+            kept_sum += data[i].p;
+        }
+        for (size_t i = 0; i < keep; i++)
+        {
+            data[i].p /= kept_sum;
+        }
+
+        array = {data.data(), keep, false};
+        return;
+    }
+
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++)
+    {
+        data[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
+
+    array = {data.data(), data.size(), false};
+    llama_sample_top_k(nullptr, &array, top_k, 1);
+    llama_sample_top_p(nullptr, &array, cfg.top_p, 1);
+    llama_sample_temperature(nullptr, &array, cfg.temperature);
+    llama_sample_softmax(nullptr, &array);
+}
+
+float Sampler::p(llama_token id) const
+{
+    for (size_t i = 0; i < array.size; i++)
+    {
+        if (array.data[i].id == id)
+        {
+            return array.data[i].p;
+        }
+    }
+    return 0.0f;
+}
+
+llama_token Sampler::sample()
+{
+    float u = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+    for (size_t i = 0; i < array.size; i++)
+    {
+        u -= array.data[i].p;
+        if (u <= 0.0f)
+        {
+            return array.data[i].id;
+        }
+    }
+    return array.data[array.size - 1].id;
+}
+
+llama_token Sampler::sample_residual(const std::vector<float> &q)
+{
+    float total = 0.0f;
+    for (size_t i = 0; i < array.size; i++)
+    {
+        total += std::max(0.0f, array.data[i].p - q[array.data[i].id]);
+    }
+
+    if (total <= 0.0f)
+    {
+        return sample();
+    }
+
+    float u = std::uniform_real_distribution<float>(0.0f, total)(rng);
+    for (size_t i = 0; i < array.size; i++)
+    {
+        u -= std::max(0.0f, array.data[i].p - q[array.data[i].id]);
+        if (u <= 0.0f)
+        {
+            return array.data[i].id;
+        }
+    }
+    return array.data[array.size - 1].id;
+}
+
+bool Sampler::accepts_draft(llama_token draft, const std::vector<float> &q)
+{
+    return std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) * q[draft] < p(draft);
+}
+
+void Sampler::accept(llama_token id)
+{
+    if (cfg.mirostat && !greedy())
+    {
+        const float p_id = p(id);
+        if (p_id > 0.0f)
+        {
+            mirostat_mu -= cfg.mirostat_eta * (-log2f(p_id) - cfg.mirostat_tau);
+        }
+    }
+
+    history.push_back(id);
+}
+
+llama_token Sampler::next(const float *logits, int n_vocab)
+{
+    build(logits, n_vocab);
+    const llama_token id = sample();
+    accept(id);
+    return id;
+}
+
+llama_token Sampler::sample_draft(const float *logits, int n_vocab, std::vector<float> &q)
+{
+    // any q keeps the output exact, but the closer it is to the target's distribution the more drafts are
+    // accepted, so drafts are drawn through the same penalties & truncation
+    build(logits, n_vocab);
+    llama_token drafted = array.data[0].id;
+    if (!greedy())
+    {
+        q.assign(n_vocab, 0.0f);
+        for (size_t i = 0; i < array.size; i++)
+        {
+            q[array.data[i].id] = array.data[i].p;
+        }
+        drafted = sample();
+    }
+
+    history.push_back(drafted);
+    n_drafted++;
+    return drafted;
+}
+
+void Sampler::discard_drafts()
+{
+    history.resize(history.size() - n_drafted);
+    n_drafted = 0;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "llama.h"
+
+#include "deps/json/single_include/nlohmann/json.hpp"
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+// how a sequence's tokens are chosen from the logits. named in JSON (request bodies & sidecars) by the keys in
+// the comments; the defaults are greedy, as simple-http always has been
+struct SamplingParams
+{
+    float temperature = 0.0f;       // "temperature": <= 0 for greedy
+    int top_k = 40;                 // "topK": <= 0 for the whole vocabulary
+    float top_p = 0.95f;            // "topP": 1 to disable
+    float repeat_penalty = 1.0f;    // "repeatPenalty": 1 to disable
+    int repeat_last_n = 64;         // "repeatLastN": tokens the penalties look back over; -1 for all of them
+    float frequency_penalty = 0.0f; // "frequencyPenalty"
+    float presence_penalty = 0.0f;  // "presencePenalty"
+    int mirostat = 0;               // "mirostat": 1 or 2 to use that version in place of top-k & top-p
+    float mirostat_tau = 5.0f;      // "mirostatTau": target surprise, in bits
+    float mirostat_eta = 0.1f;      // "mirostatEta": learning rate
+    uint32_t seed = -1;             // "seed": -1 for a different one each sequence
+    int n = 1;                      // "n": completions of the prompt, each sampled independently
+};
+
+// the temperature mirostat samples at when nothing sets one
+const float MIROSTAT_DEFAULT_TEMPERATURE = 0.8f;
+// the most completions ("n") one request may ask for
+const int MAX_COMPLETIONS = 16;
+
+// overrides `params` with whichever sampling keys `json` has (other keys are ignored). returns false & sets
+// `*error` if any is of the wrong type or out of range, in which case `params` is left unchanged
+bool parse_sampling_params(const nlohmann::json &json, SamplingParams &params, std::string *error);
+
+// `params` with every sampling key, which parse_sampling_params() reads back as they are
+nlohmann::json sampling_params_json(const SamplingParams &params);
+
+// the sampling for a request: `defaults`, overridden by the model's sidecar, overridden in turn by the
+// request body. returns false & sets `*error` if either has a bad value. a random seed is drawn here for a
+// request of several completions, so that completion_sampling() can give each its own
+bool resolve_sampling_params(const SamplingParams &defaults, const nlohmann::json &model_spec,
+                             const nlohmann::json &request_body, SamplingParams &params, std::string *error);
+
+// the sampling of the `i`th of `params.n` completions, which is seeded `params.seed + i`
+SamplingParams completion_sampling(const SamplingParams &params, int i);
+
+// one sequence's sampling: its parameters along with the state that carries from token to token (the RNG,
+// mirostat's mu & the history the penalties see). cheap to create, & reset() starts another sequence without
+// reallocating, so a worker can keep one & run sequences of differing parameters through it back to back
+struct Sampler
+{
+    explicit Sampler(const SamplingParams &params = SamplingParams{});
+
+    // starts a new sequence with `params`
+    void reset(const SamplingParams &params);
+    // starts a new sequence with the same parameters, following `prompt` (which the penalties count as history)
+    void begin(const std::vector<llama_token> &prompt);
+
+    const SamplingParams &params() const { return cfg; }
+    bool greedy() const;
+
+    // computes the distribution of the next token from its `logits`: penalized, truncated & normalized (& sorted,
+    // unless top-k is off). a single token with p = 1 when greedy
+    void build(const float *logits, int n_vocab);
+    const llama_token_data_array &distribution() const { return array; }
+    // of `id` in the distribution last built
+    float p(llama_token id) const;
+    // draws from the distribution last built
+    llama_token sample();
+    // draws from the normalized residual max(0, p - q) left after a draft drawn from `q` was rejected
+    llama_token sample_residual(const std::vector<float> &q);
+    // the rejection sampling test for `draft`, drawn from `q`: true with probability min(1, p / q)
+    bool accepts_draft(llama_token draft, const std::vector<float> &q);
+
+    // appends `id` (drawn from the distribution last built) to the sequence, updating mirostat's mu & the history
+    void accept(llama_token id);
+    // build(), sample() & accept() in one
+    llama_token next(const float *logits, int n_vocab);
+
+    // draws a speculative draft token from a draft model's `logits` as build() & sample() would (replacing the
+    // distribution last built), filling `q` with the whole distribution it was drawn from, which rejection
+    // sampling needs. leaves `q` untouched when greedy. the draft joins the history, so that the penalties see
+    // it when drafting the next, until discard_drafts() is called before verifying them
+    llama_token sample_draft(const float *logits, int n_vocab, std::vector<float> &q);
+    void discard_drafts();
+
+private:
+    SamplingParams cfg;
+    std::mt19937 rng;
+    float mirostat_mu;
+    std::vector<llama_token> history;
+    size_t n_drafted = 0; // at the end of `history`
+
+    // reused from token to token, so as not to allocate at token rate
+    std::vector<float> penalized;
+    std::vector<llama_token> recent;
+    std::vector<llama_token_data> data;
+    llama_token_data_array array;
+
+    const float *apply_penalties(const float *logits, int n_vocab);
+};
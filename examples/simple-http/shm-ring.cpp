@@ -0,0 +1,120 @@
+#include "shm-ring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+// how often a blocked side asks whether to keep waiting
+const long SHM_RING_CHECK_NS = 2 * 1000 * 1000;
+
+size_t ShmRing::size_for(size_t capacity)
+{
+    return sizeof(ShmRing) + capacity;
+}
+
+ShmRing *ShmRing::create(void *mem, size_t capacity)
+{
+    auto *ring = new (mem) ShmRing;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->capacity = capacity;
+    sem_init(&ring->written, 1, 0);
+    sem_init(&ring->consumed, 1, 0);
+    return ring;
+}
+
+// waits for `sem` to be posted, or a short while. returns false if `alive` then says to give up
+static bool _wait(sem_t *sem, const ShmRing::alive_check &alive)
+{
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += SHM_RING_CHECK_NS;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    if (!sem_timedwait(sem, &deadline) || errno == EINTR)
+    {
+        return true;
+    }
+    return !alive || alive();
+}
+
+bool ShmRing::write(const void *src, size_t n, const alive_check &alive)
+{
+    const auto *bytes = static_cast<const uint8_t *>(src);
+    while (n)
+    {
+        const uint64_t h = head.load(std::memory_order_relaxed);
+        const size_t space = capacity - (size_t)(h - tail.load(std::memory_order_acquire));
+        if (!space)
+        {
+            if (!_wait(&consumed, alive))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        // up to the free space, or the end of the buffer, whichever is first
+        const size_t offset = h % capacity;
+        const size_t chunk = std::min(n, std::min(space, capacity - offset));
+        memcpy(data() + offset, bytes, chunk);
+        head.store(h + chunk, std::memory_order_release);
+        sem_post(&written);
+
+        bytes += chunk;
+        n -= chunk;
+    }
+    return true;
+}
+
+bool ShmRing::read(void *dst, size_t n, const alive_check &alive)
+{
+    auto *bytes = static_cast<uint8_t *>(dst);
+    while (n)
+    {
+        const uint64_t t = tail.load(std::memory_order_relaxed);
+        const size_t available = (size_t)(head.load(std::memory_order_acquire) - t);
+        if (!available)
+        {
+            if (!_wait(&written, alive))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        const size_t offset = t % capacity;
+        const size_t chunk = std::min(n, std::min(available, capacity - offset));
+        memcpy(bytes, data() + offset, chunk);
+        tail.store(t + chunk, std::memory_order_release);
+        sem_post(&consumed);
+
+        bytes += chunk;
+        n -= chunk;
+    }
+    return true;
+}
+
+bool ShmRing::send(const std::vector<uint8_t> &message, const alive_check &alive)
+{
+    const uint64_t size = message.size();
+    return write(&size, sizeof(size), alive) && write(message.data(), message.size(), alive);
+}
+
+bool ShmRing::receive(std::vector<uint8_t> &message, const alive_check &alive)
+{
+    uint64_t size;
+    if (!read(&size, sizeof(size), alive))
+    {
+        return false;
+    }
+
+    message.resize(size);
+    return read(message.data(), size, alive);
+}
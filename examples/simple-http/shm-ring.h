@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <semaphore.h>
+
+// a single-producer, single-consumer stream of bytes between two processes, in memory both have mapped (e.g.
+// MAP_SHARED before fork(), so that it's at the same address in each). lock-free, so a process dying mid-write
+// can't leave the other blocked on a lock; each side waits on a process-shared semaphore while it can't go on,
+// checking every few milliseconds with `alive` whether it should keep waiting
+struct ShmRing
+{
+    // returns false to stop waiting, failing the call
+    using alive_check = std::function<bool()>;
+
+    // the bytes of shared memory one with `capacity` bytes of data needs
+    static size_t size_for(size_t capacity);
+    // constructs one in `mem` (size_for(capacity) bytes), or resets one that a dead process left mid-message
+    static ShmRing *create(void *mem, size_t capacity);
+
+    // waits until all `n` bytes are written or read. returns false if `alive` returned false first
+    bool write(const void *data, size_t n, const alive_check &alive);
+    bool read(void *data, size_t n, const alive_check &alive);
+
+    // a length-prefixed message of any size (streamed through as the reader keeps up)
+    bool send(const std::vector<uint8_t> &message, const alive_check &alive);
+    bool receive(std::vector<uint8_t> &message, const alive_check &alive);
+
+private:
+    std::atomic<uint64_t> head; // bytes ever written
+    std::atomic<uint64_t> tail; // bytes ever read
+    sem_t written;              // posted after each write, which the reader waits on when empty
+    sem_t consumed;             // & after each read, which the writer waits on when full
+    size_t capacity;
+
+    uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+};
@@ -0,0 +1,458 @@
+// load generator & benchmark harness for simple-http's serving layer
+#include "deps/cpp-httplib/httplib.h"
+#include "deps/json/single_include/nlohmann/json.hpp"
+#include "deps/popl/include/popl.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_LOGGER(fmt_str, ...) fprintf(stderr, "[bench] " fmt_str, ##__VA_ARGS__)
+
+using bench_clock = std::chrono::steady_clock;
+
+struct BenchResult
+{
+    std::string priority;
+    bool ok = false;
+    std::string error = "";
+    int tokens = 0;
+    // as reported by the server, from when the prompt was queued; negative if unavailable
+    double queue_ms = -1;
+    double ttft_ms = -1;
+    double e2e_ms = -1;
+    // as observed by this client
+    double post_ms = -1;
+    double client_e2e_ms = -1;
+};
+
+// "N": always N words; "A-B": uniformly between A & B; "exp:N": exponentially distributed with mean N
+struct PromptLengthDist
+{
+    enum
+    {
+        FIXED,
+        UNIFORM,
+        EXP
+    } kind = FIXED;
+    double a = 16, b = 16;
+
+    static bool parse(const std::string &spec, PromptLengthDist &out)
+    {
+        try
+        {
+            if (spec.rfind("exp:", 0) == 0)
+            {
+                out.kind = EXP;
+                out.a = std::stod(spec.substr(4));
+                return out.a > 0;
+            }
+
+            auto dash = spec.find('-');
+            if (dash != std::string::npos)
+            {
+                out.kind = UNIFORM;
+                out.a = std::stod(spec.substr(0, dash));
+                out.b = std::stod(spec.substr(dash + 1));
+                return out.a >= 1 && out.b >= out.a;
+            }
+
+            out.kind = FIXED;
+            out.a = out.b = std::stod(spec);
+            return out.a >= 1;
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+    }
+
+    int sample(std::mt19937_64 &rng) const
+    {
+        switch (kind)
+        {
+        case UNIFORM:
+            return std::uniform_int_distribution<int>((int)a, (int)b)(rng);
+        case EXP:
+            return std::max(1, (int)std::exponential_distribution<double>(1.0 / a)(rng));
+        default:
+            return (int)a;
+        }
+    }
+};
+
+// "LOW:1,NORMAL:8,HIGH:1"
+bool parse_priority_mix(const std::string &spec, std::vector<std::string> &names, std::vector<double> &weights)
+{
+    std::stringstream ss(spec);
+    std::string ent;
+    while (std::getline(ss, ent, ','))
+    {
+        auto colon = ent.find(':');
+        auto name = ent.substr(0, colon);
+        if (name != "LOW" && name != "NORMAL" && name != "HIGH")
+        {
+            return false;
+        }
+
+        double weight = 1.0;
+        if (colon != std::string::npos)
+        {
+            try
+            {
+                weight = std::stod(ent.substr(colon + 1));
+            }
+            catch (const std::exception &)
+            {
+                return false;
+            }
+        }
+
+        names.push_back(name);
+        weights.push_back(weight);
+    }
+
+    return names.size() > 0;
+}
+
+std::string make_prompt(int n_words, std::mt19937_64 &rng)
+{
+    static const char *words[] = {
+        "tell", "me", "about", "the", "history", "of", "alpacas", "and", "llamas", "in", "south", "america",
+        "why", "do", "they", "hum", "what", "is", "a", "cria", "how", "much", "fleece", "each", "year"};
+    const size_t n_vocab = sizeof(words) / sizeof(words[0]);
+
+    std::string prompt;
+    for (int i = 0; i < n_words; i++)
+    {
+        if (i)
+        {
+            prompt += " ";
+        }
+        prompt += words[rng() % n_vocab];
+    }
+
+    return prompt;
+}
+
+double _ms_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+nlohmann::json percentiles(std::vector<double> values)
+{
+    values.erase(std::remove_if(values.begin(), values.end(), [](double v)
+                                { return v < 0; }),
+                 values.end());
+
+    if (!values.size())
+    {
+        return nullptr;
+    }
+
+    std::sort(values.begin(), values.end());
+    auto pct = [&values](double p)
+    {
+        size_t idx = (size_t)std::ceil(p / 100.0 * values.size());
+        return values[std::min(values.size() - 1, idx ? idx - 1 : 0)];
+    };
+
+    double sum = 0;
+    for (auto v : values)
+    {
+        sum += v;
+    }
+
+    return nlohmann::json{
+        {"n", values.size()},
+        {"mean", sum / values.size()},
+        {"p50", pct(50)},
+        {"p90", pct(90)},
+        {"p99", pct(99)},
+        {"max", values.back()},
+    };
+}
+
+nlohmann::json summarize(const std::vector<BenchResult> &results, double wall_s)
+{
+    std::vector<double> queue_ms, ttft_ms, e2e_ms, post_ms, client_e2e_ms;
+    std::map<std::string, size_t> errors;
+    size_t completed = 0;
+    uint64_t tokens = 0;
+
+    for (const auto &r : results)
+    {
+        post_ms.push_back(r.post_ms);
+        if (!r.ok)
+        {
+            errors[r.error]++;
+            continue;
+        }
+
+        completed++;
+        tokens += r.tokens;
+        queue_ms.push_back(r.queue_ms);
+        ttft_ms.push_back(r.ttft_ms);
+        e2e_ms.push_back(r.e2e_ms);
+        client_e2e_ms.push_back(r.client_e2e_ms);
+    }
+
+    return nlohmann::json{
+        {"requests", results.size()},
+        {"completed", completed},
+        {"failed", results.size() - completed},
+        {"errors", errors},
+        {"throughput_rps", wall_s > 0 ? completed / wall_s : 0.0},
+        {"tokens_per_s", wall_s > 0 ? tokens / wall_s : 0.0},
+        {"queue_ms", percentiles(queue_ms)},
+        {"ttft_ms", percentiles(ttft_ms)},
+        {"e2e_ms", percentiles(e2e_ms)},
+        {"post_ms", percentiles(post_ms)},
+        {"client_e2e_ms", percentiles(client_e2e_ms)},
+    };
+}
+
+int main(int argc, char **argv)
+{
+    popl::OptionParser op("allowed options");
+    auto help_opt = op.add<popl::Switch>("h", "help", "This help");
+    auto host_opt = op.add<popl::Value<std::string>>("H", "host", "simple-http host", "localhost");
+    auto port_opt = op.add<popl::Value<int>>("p", "port", "simple-http port", 42000);
+    auto model_opt = op.add<popl::Value<std::string>>("m", "model", "Model name to prompt (as listed by GET /models); defaults to the first listed");
+    auto key_opt = op.add<popl::Value<std::string>>("k", "key", "API key, if the server requires one");
+    auto num_opt = op.add<popl::Value<int>>("n", "requests", "Total number of prompts to send", 100);
+    auto conc_opt = op.add<popl::Value<int>>("c", "concurrency", "Closed loop: number of prompts kept in flight", 4);
+    auto rate_opt = op.add<popl::Value<double>>("r", "rate", "Open loop: mean arrival rate in prompts/s (Poisson); overrides -c");
+    auto len_opt = op.add<popl::Value<std::string>>("l", "prompt-length", "Prompt length in words: N, A-B (uniform) or exp:N (exponential, mean N)", "16");
+    auto prio_opt = op.add<popl::Value<std::string>>("P", "priorities", "Priority mix as NAME:WEIGHT pairs, e.g. LOW:1,NORMAL:8,HIGH:1", "NORMAL");
+    auto poll_opt = op.add<popl::Value<int>>("i", "poll-interval", "Milliseconds between polls of GET /prompt/:id", 10);
+    auto timeout_opt = op.add<popl::Value<int>>("t", "timeout", "Seconds after which an unfinished prompt is counted as failed", 600);
+    auto seed_opt = op.add<popl::Value<int>>("s", "seed", "RNG seed", 42);
+    op.parse(argc, argv);
+
+    if (help_opt->is_set())
+    {
+        std::cout << argv[0] << " " << op.help();
+        exit(0);
+    }
+
+    PromptLengthDist length_dist;
+    if (!PromptLengthDist::parse(len_opt->value(), length_dist))
+    {
+        BENCH_LOGGER("Bad prompt length spec: %s\n", len_opt->value().c_str());
+        exit(1);
+    }
+
+    std::vector<std::string> prio_names;
+    std::vector<double> prio_weights;
+    if (!parse_priority_mix(prio_opt->value(), prio_names, prio_weights))
+    {
+        BENCH_LOGGER("Bad priority mix: %s\n", prio_opt->value().c_str());
+        exit(1);
+    }
+
+    const std::string host = host_opt->value();
+    const int port = port_opt->value();
+    const int n_requests = num_opt->value();
+    const int poll_ms = std::max(1, poll_opt->value());
+    const double timeout_ms = timeout_opt->value() * 1000.0;
+    const bool open_loop = rate_opt->is_set() && rate_opt->value() > 0;
+
+    auto make_client = [&]()
+    {
+        std::unique_ptr<httplib::Client> cli(new httplib::Client(host, port));
+        cli->set_keep_alive(true);
+        if (key_opt->is_set())
+        {
+            cli->set_basic_auth("bench", key_opt->value());
+        }
+        return cli;
+    };
+
+    std::string model;
+    {
+        auto cli = make_client();
+        auto res = cli->Get("/models");
+        if (!res || res->status != 200)
+        {
+            BENCH_LOGGER("GET /models failed; is simple-http listening on %s:%d?\n", host.c_str(), port);
+            exit(1);
+        }
+
+        auto models = nlohmann::json::parse(res->body, nullptr, false);
+        if (model_opt->is_set())
+        {
+            model = model_opt->value();
+        }
+        else if (models.is_object() && models.size())
+        {
+            model = models.begin().key();
+        }
+
+        if (model.empty() || !models.is_object() || !models.contains(model))
+        {
+            BENCH_LOGGER("Model '%s' not available\n", model.c_str());
+            exit(1);
+        }
+    }
+
+    // all prompts are drawn up front so that generating them isn't measured
+    std::mt19937_64 rng(seed_opt->value());
+    std::discrete_distribution<size_t> prio_dist(prio_weights.begin(), prio_weights.end());
+    std::vector<std::pair<std::string, std::string>> work; // (priority, body)
+    for (int i = 0; i < n_requests; i++)
+    {
+        const auto &priority = prio_names[prio_dist(rng)];
+        nlohmann::json body{
+            {"model", model},
+            {"prompt", make_prompt(length_dist.sample(rng), rng)},
+            {"priority", priority}};
+        work.emplace_back(priority, body.dump());
+    }
+
+    std::vector<BenchResult> results(work.size());
+
+    auto run_one = [&](httplib::Client &cli, size_t idx)
+    {
+        auto &result = results[idx];
+        result.priority = work[idx].first;
+
+        const auto start = bench_clock::now();
+        auto post_res = cli.Post("/prompt", work[idx].second, "application/json");
+        result.post_ms = _ms_since(start);
+
+        if (!post_res || post_res->status != 200)
+        {
+            result.error = post_res ? "POST " + std::to_string(post_res->status) : "POST failed";
+            return;
+        }
+
+        auto posted = nlohmann::json::parse(post_res->body, nullptr, false);
+        if (posted.is_discarded() || !posted.contains("promptId"))
+        {
+            result.error = "POST bad response";
+            return;
+        }
+
+        const std::string path = "/prompt/" + posted["promptId"].get<std::string>();
+        while (_ms_since(start) < timeout_ms)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+
+            auto get_res = cli.Get(path.c_str());
+            if (!get_res || (get_res->status != 200 && get_res->status != 202))
+            {
+                result.error = get_res ? "GET " + std::to_string(get_res->status) : "GET failed";
+                return;
+            }
+
+            if (get_res->status == 202)
+            {
+                continue;
+            }
+
+            result.client_e2e_ms = _ms_since(start);
+            auto done = nlohmann::json::parse(get_res->body, nullptr, false);
+            if (done.is_discarded())
+            {
+                result.error = "GET bad response";
+                return;
+            }
+
+            result.ok = true;
+            result.tokens = done.value("tokens", 0);
+            result.queue_ms = done.value("queue_ms", -1.0);
+            result.ttft_ms = done.value("ttft_ms", -1.0);
+            result.e2e_ms = done.value("e2e_ms", -1.0);
+            return;
+        }
+
+        result.error = "timeout";
+    };
+
+    BENCH_LOGGER("Sending %d prompts to %s on %s:%d, %s\n", n_requests, model.c_str(), host.c_str(), port,
+                 open_loop ? "open loop" : "closed loop");
+
+    const auto bench_start = bench_clock::now();
+    std::vector<std::thread> threads;
+
+    if (open_loop)
+    {
+        // each arrival gets its own thread (& connection) so that slow responses never delay later arrivals
+        std::exponential_distribution<double> inter_arrival_s(rate_opt->value());
+        auto next_arrival = bench_clock::now();
+        for (size_t idx = 0; idx < work.size(); idx++)
+        {
+            std::this_thread::sleep_until(next_arrival);
+            threads.emplace_back([&, idx]()
+                                 {
+                auto cli = make_client();
+                run_one(*cli, idx); });
+            next_arrival += std::chrono::duration_cast<bench_clock::duration>(
+                std::chrono::duration<double>(inter_arrival_s(rng)));
+        }
+    }
+    else
+    {
+        std::atomic<size_t> cursor{0};
+        for (int c = 0; c < std::max(1, conc_opt->value()); c++)
+        {
+            threads.emplace_back([&]()
+                                 {
+                auto cli = make_client();
+                size_t idx;
+                while ((idx = cursor++) < work.size())
+                {
+                    run_one(*cli, idx);
+                } });
+        }
+    }
+
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+
+    const double wall_s = _ms_since(bench_start) / 1000.0;
+
+    std::map<std::string, std::vector<BenchResult>> by_priority;
+    for (const auto &r : results)
+    {
+        by_priority[r.priority].push_back(r);
+    }
+
+    nlohmann::json report{
+        {"config", {
+                       {"host", host},
+                       {"port", port},
+                       {"model", model},
+                       {"requests", n_requests},
+                       {"mode", open_loop ? "open" : "closed"},
+                       {"rate", open_loop ? rate_opt->value() : 0.0},
+                       {"concurrency", open_loop ? 0 : conc_opt->value()},
+                       {"prompt_length", len_opt->value()},
+                       {"priorities", prio_opt->value()},
+                   }},
+        {"wall_s", wall_s},
+        {"overall", summarize(results, wall_s)},
+    };
+
+    for (const auto &ent : by_priority)
+    {
+        report["by_priority"][ent.first] = summarize(ent.second, wall_s);
+    }
+
+    std::cout << report.dump(2) << std::endl;
+    return 0;
+}
@@ -7,6 +7,13 @@
 #include "llama.h"
 #include "build-info.h"
 #include "http.h"
+#include "backend.h"
+#include "cpu-affinity.h"
+#include "federation.h"
+#include "model-cache.h"
+#include "thread-budget.h"
+#include "thread-tuning.h"
+#include "vector-index.h"
 
 #include <cassert>
 #include <cinttypes>
@@ -20,6 +27,11 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
 #include <experimental/filesystem>
 
 #include "deps/popl/include/popl.hpp"
@@ -28,6 +40,9 @@
 #if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
 #include <signal.h>
 #include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #elif defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
@@ -37,139 +52,697 @@
 
 namespace fs = std::experimental::filesystem;
 
-std::string run_one_prompt(gpt_params &params, struct llama_timings *timings = nullptr)
+// what can be allocated without swapping: free memory & the page cache the kernel would reclaim for it (in which
+// the weights of models mapped from their files, & of those recently run, count), per /proc/meminfo where it's
+// available
+size_t _available_memory_bytes()
+{
+    std::ifstream meminfo{"/proc/meminfo"};
+    for (std::string line; std::getline(meminfo, line);)
+    {
+        size_t kb;
+        if (sscanf(line.c_str(), "MemAvailable: %zu kB", &kb) == 1)
+        {
+            return kb * 1024;
+        }
+    }
+#if defined(_SC_AVPHYS_PAGES) && defined(_SC_PAGESIZE)
+    return (size_t)sysconf(_SC_AVPHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return SIZE_MAX;
+#endif
+}
+
+size_t _physical_memory_bytes()
+{
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    return (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+#else
+    return SIZE_MAX;
+#endif
+}
+
+void discover_valid_models(std::string model_path, models_map_t *models)
+{
+    std::vector<fs::path> bins;
+    std::map<std::string, fs::path> jsons;
+    for (const fs::directory_entry &entry : fs::directory_iterator{model_path})
+    {
+        auto path_ent = entry.path();
+        if (path_ent.extension() == ".bin")
+        {
+            bins.push_back(entry.path());
+        }
+        else if (path_ent.extension() == ".json")
+        {
+            jsons.emplace(std::make_pair(path_ent.filename(), path_ent));
+        }
+    }
+
+    // each model's name & sidecar: a .bin's, or a LoRA variant's, whose sidecar (named for the variant, with no .bin
+    // of its own) names a `base` model in the directory & the `lora` adapter to apply to it
+    std::vector<std::pair<std::string, fs::path>> sidecars;
+    for (const auto &bin : bins)
+    {
+        auto have_json = jsons.find(bin.filename().string() + ".json");
+        if (have_json != jsons.end())
+        {
+            sidecars.emplace_back(bin.filename().string(), have_json->second);
+            jsons.erase(have_json);
+        }
+    }
+    for (const auto &json_ent : jsons)
+    {
+        sidecars.emplace_back(json_ent.second.stem().string(), json_ent.second);
+    }
+
+    for (const auto &sidecar : sidecars)
+    {
+        const std::string &name = sidecar.first;
+        std::ifstream json_read{sidecar.second.string()};
+        auto json_parsed = nlohmann::json::parse(json_read, nullptr, false);
+        if (!json_parsed.is_discarded() &&
+            !json_parsed["displayName"].is_null() &&
+            !json_parsed["sourceURL"].is_null())
+        {
+            const bool variant = !fs::exists(fs::path{model_path} / name);
+            if (variant)
+            {
+                if (!json_parsed["base"].is_string() || !json_parsed["lora"].is_string())
+                {
+                    continue;
+                }
+                if (!fs::exists(fs::path{model_path} / std::string(json_parsed["base"])) ||
+                    !fs::exists(fs::path{model_path} / std::string(json_parsed["lora"])))
+                {
+                    HTTP_LOGGER("Ignoring model %s: its base %s or LoRA adapter %s wasn't found\n", name.c_str(),
+                                std::string(json_parsed["base"]).c_str(), std::string(json_parsed["lora"]).c_str());
+                    continue;
+                }
+            }
+            else
+            {
+                json_parsed.erase("base");
+                json_parsed.erase("lora");
+            }
+
+            if (json_parsed["draftModel"].is_string() &&
+                !fs::exists(fs::path{model_path} / std::string(json_parsed["draftModel"])))
+            {
+                HTTP_LOGGER("Draft model %s for %s not found; ignoring it\n",
+                            std::string(json_parsed["draftModel"]).c_str(), name.c_str());
+                json_parsed.erase("draftModel");
+            }
+
+            if ((json_parsed.contains("preload") && !json_parsed["preload"].is_boolean()) ||
+                (json_parsed.contains("mlock") && !json_parsed["mlock"].is_boolean()))
+            {
+                HTTP_LOGGER("Ignoring model %s: `preload` & `mlock` in its sidecar must be true or false\n",
+                            name.c_str());
+                continue;
+            }
+
+            if (json_parsed.value("mlock", false) && !json_parsed.value("preload", false))
+            {
+                HTTP_LOGGER("Model %s sets `mlock` without `preload`, which it only applies to; ignoring it\n",
+                            name.c_str());
+            }
+
+            SamplingParams sampling;
+            std::string error;
+            if (!parse_sampling_params(json_parsed, sampling, &error))
+            {
+                HTTP_LOGGER("Ignoring model %s: bad sampling setting in its sidecar: %s\n",
+                            name.c_str(), error.c_str());
+                continue;
+            }
+
+            json_parsed["parentPath"] = model_path;
+            models->emplace(std::make_pair(name, json_parsed));
+            if (variant)
+            {
+                HTTP_LOGGER("Found valid model %s in %s (LoRA adapter %s on %s)\n", name.c_str(), model_path.c_str(),
+                            std::string(json_parsed["lora"]).c_str(), std::string(json_parsed["base"]).c_str());
+            }
+            else
+            {
+                HTTP_LOGGER("Found valid model %s in %s\n", name.c_str(), model_path.c_str());
+            }
+        }
+    }
+}
+
+// points `params` at the files `model` runs from: its own .bin, or for a LoRA variant, its base's, with the
+// adapter to apply (unmerged, so the base stays shared) in `lora_adapter`
+void use_model_files(const models_map_t &models, const std::string &model, gpt_params &params)
+{
+    const auto &model_spec = models.at(model);
+    const fs::path parent_path{std::string(model_spec.at("parentPath"))};
+    if (model_spec.contains("lora"))
+    {
+        params.model = parent_path / std::string(model_spec["base"]);
+        params.lora_adapter = parent_path / std::string(model_spec["lora"]);
+    }
+    else
+    {
+        params.model = parent_path / model;
+        params.lora_adapter = "";
+    }
+
+    if (model_spec.contains("cachedPath"))
+    {
+        params.model = model_spec["cachedPath"];
+    }
+}
+
+// the path of `model`'s draft model, or an empty string if it has none
+std::string draft_model_file(const models_map_t &models, const std::string &model)
+{
+    const auto &model_spec = models.at(model);
+    if (model_spec.contains("cachedDraftPath"))
+    {
+        return model_spec["cachedDraftPath"];
+    }
+    if (model_spec.contains("draftModel") && model_spec["draftModel"].is_string())
+    {
+        return (fs::path{std::string(model_spec["parentPath"])} / std::string(model_spec["draftModel"])).string();
+    }
+    return "";
+}
+
+// what the model file at `path` holds, read from its header & tensor table without loading its weights, setting
+// `*estimate` to the memory it & a context of it (as `params` configures them) take. null if llama.cpp can't read it
+nlohmann::json _model_file_json(const std::string &path, const gpt_params &params, nlohmann::json *estimate)
+{
+    llama_model_file_info info;
+    if (llama_model_file_info_from_file(path.c_str(), llama_context_params_from_gpt_params(params), &info))
+    {
+        return nlohmann::json{};
+    }
+
+    *estimate = {
+        {"contextSize", params.n_ctx},
+        {"weightsBytes", info.weights_size},
+        {"kvCacheBytes", info.kv_size},
+        {"computeBytes", info.compute_size},
+        {"totalBytes", info.weights_size + info.kv_size + info.compute_size},
+    };
+    return {
+        {"fileFormat", info.format},
+        {"quantization", info.ftype},
+        {"parameters", info.n_params},
+        {"hyperparameters", {
+                                {"vocabSize", info.n_vocab},
+                                {"embeddingSize", info.n_embd},
+                                {"feedForwardSize", info.n_ff},
+                                {"heads", info.n_head},
+                                {"kvHeads", info.n_head_kv},
+                                {"layers", info.n_layer},
+                            }},
+    };
+}
+
+// describes each model in `models` by what its file (a LoRA variant's base's) holds, read at startup without loading
+// any weights, & estimates the memory it takes to run with `params`' context: its weights, a context's KV cache &
+// compute buffers, & its draft model's & LoRA adapter's, if it has them. a model whose file can't be read is
+// removed, as is a draft model's, & a model estimated to need more memory than the machine has is marked as such
+void read_model_files(models_map_t *models, const gpt_params &params)
+{
+    const size_t physical_bytes = _physical_memory_bytes();
+    for (auto model_ent = models->begin(); model_ent != models->end();)
+    {
+        const std::string &name = model_ent->first;
+        auto &model_spec = model_ent->second;
+        gpt_params model_params = params;
+        use_model_files(*models, name, model_params);
+
+        nlohmann::json estimate;
+        auto file_json = _model_file_json(model_params.model, params, &estimate);
+        if (file_json.is_null())
+        {
+            HTTP_LOGGER("Ignoring model %s: %s isn't a model file that can be loaded\n", name.c_str(), model_params.model.c_str());
+            model_ent = models->erase(model_ent);
+            continue;
+        }
+        model_spec.update(file_json);
+
+        size_t total_bytes = estimate["totalBytes"];
+        if (!model_params.lora_adapter.empty())
+        {
+            // converted to f32 as it's loaded, so up to twice its f16 file's size
+            const size_t adapter_bytes = 2 * fs::file_size(model_params.lora_adapter);
+            estimate["adapterBytes"] = adapter_bytes;
+            total_bytes += adapter_bytes;
+        }
+
+        const std::string draft_path = draft_model_file(*models, name);
+        if (!draft_path.empty())
+        {
+            nlohmann::json draft_estimate;
+            if (_model_file_json(draft_path, params, &draft_estimate).is_null())
+            {
+                HTTP_LOGGER("Draft model %s for %s isn't a model file that can be loaded; ignoring it\n",
+                            std::string(model_spec["draftModel"]).c_str(), name.c_str());
+                model_spec.erase("draftModel");
+            }
+            else
+            {
+                estimate["draftBytes"] = draft_estimate["totalBytes"];
+                total_bytes += (size_t)draft_estimate["totalBytes"];
+            }
+        }
+
+        estimate["totalBytes"] = total_bytes;
+        model_spec["memoryEstimate"] = estimate;
+        model_spec["fitsInMemory"] = total_bytes <= physical_bytes;
+        HTTP_LOGGER("Model %s: %.1fM parameters, %s; an estimated %.1f MiB to run with a %d-token context\n", name.c_str(),
+                    (uint64_t)model_spec["parameters"] / 1e6, std::string(model_spec["quantization"]).c_str(),
+                    total_bytes / 1048576.0, params.n_ctx);
+        if (total_bytes > physical_bytes)
+        {
+            HTTP_LOGGER("Warning: model %s needs more than this machine's %.1f MiB of memory, so its prompts will be refused\n",
+                        name.c_str(), physical_bytes / 1048576.0);
+        }
+        ++model_ent;
+    }
+}
+
+// points each model in `models` at a copy of its file (& its draft model's) in `cache_dir`, made if there's no valid
+// one already, so that its weights are mapped from memory that outlives this process
+void cache_model_files(models_map_t *models, const std::string &cache_dir)
+{
+    // LoRA variants share their base's copy
+    std::map<std::string, std::string> cached;
+    auto cache = [&cached, &cache_dir](const std::string &path)
+    {
+        auto found = cached.find(path);
+        if (found == cached.end())
+        {
+            found = cached.emplace(path, cached_model_path(cache_dir, path)).first;
+        }
+        return found->second;
+    };
+
+    for (auto &model_ent : *models)
+    {
+        gpt_params model_params;
+        use_model_files(*models, model_ent.first, model_params);
+        const std::string draft_path = draft_model_file(*models, model_ent.first);
+
+        auto &model_spec = model_ent.second;
+        const std::string cached_path = cache(model_params.model);
+        if (cached_path != model_params.model)
+        {
+            model_spec["cachedPath"] = cached_path;
+        }
+        if (!draft_path.empty() && cache(draft_path) != draft_path)
+        {
+            model_spec["cachedDraftPath"] = cache(draft_path);
+        }
+    }
+}
+
+struct BatchItem
 {
-    llama_model *model;
-    llama_context *ctx;
+    size_t line;
+    nlohmann::json id;
+    std::string model;
+    std::string prompt;
+    SamplingParams sampling;
+};
 
-    std::tie(model, ctx) = llama_init_from_gpt_params(params);
+// number of consecutive (sorted) items a batch worker claims at once, so that neighbouring prompts with
+// shared prefixes tend to land on the same context & reuse its KV cache
+const size_t BATCH_CLAIM_SIZE = 8;
 
-    if (model == nullptr)
+// the process's resident set, & how much of it is anonymous (heap, KV caches) & file-backed (mapped weights), in
+// bytes. all zero where /proc/self/status isn't available
+void _process_memory(size_t *rss, size_t *anon, size_t *file)
+{
+    *rss = *anon = *file = 0;
+    std::ifstream status{"/proc/self/status"};
+    for (std::string line; std::getline(status, line);)
     {
-        HTTP_LOGGER("error: unable to load model\n");
-        exit(-1);
+        size_t kb;
+        if (sscanf(line.c_str(), "VmRSS: %zu kB", &kb) == 1)
+        {
+            *rss = kb * 1024;
+        }
+        else if (sscanf(line.c_str(), "RssAnon: %zu kB", &kb) == 1)
+        {
+            *anon = kb * 1024;
+        }
+        else if (sscanf(line.c_str(), "RssFile: %zu kB", &kb) == 1)
+        {
+            *file = kb * 1024;
+        }
     }
+}
 
-    std::vector<llama_token> tokens_list;
-    tokens_list = ::llama_tokenize(ctx, params.prompt, true);
+// runs every prompt in the JSONL file `in_path` (each line shaped like a `POST /prompt` body, optionally with an
+// `id`) & writes one JSON line per result to `out_path` as each finishes. Work is sorted by model & then prompt,
+// so each model is loaded once & neighbouring prompts share KV prefixes. Up to `n_contexts` contexts (0 to size
+// by available cores & memory) share each loaded model's weights & run concurrently, each line sampled as it says.
+// returns the process exit code.
+int run_batch(const std::string &in_path, const std::string &out_path, models_map_t &models, gpt_params params,
+              const SamplingParams &sampling_defaults, int n_contexts)
+{
+    std::ifstream in{in_path};
+    if (!in)
+    {
+        HTTP_LOGGER("Unable to open batch input %s\n", in_path.c_str());
+        return 1;
+    }
+
+    std::ofstream out{out_path, std::ios::out | std::ios::trunc};
+    if (!out)
+    {
+        HTTP_LOGGER("Unable to open batch output %s\n", out_path.c_str());
+        return 1;
+    }
 
-    const int max_context_size = llama_n_ctx(ctx);
-    const int max_tokens_list_size = max_context_size - 4;
+    std::mutex out_lock;
+    auto write_result = [&out, &out_lock](const nlohmann::json &json)
+    {
+        std::lock_guard<std::mutex> lg(out_lock);
+        out << json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace) << "\n";
+        out.flush();
+    };
 
-    if ((int)tokens_list.size() > max_tokens_list_size)
+    std::vector<BatchItem> items;
+    std::string line;
+    for (size_t line_no = 1; std::getline(in, line); line_no++)
     {
-        HTTP_LOGGER("error: prompt too long (%d tokens, max %d)\n",
-                    (int)tokens_list.size(), max_tokens_list_size);
-        return "";
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+        {
+            continue;
+        }
+
+        auto parsed = nlohmann::json::parse(line, nullptr, false);
+        if (parsed.is_discarded() || !parsed.is_object() ||
+            !parsed.contains("prompt") || !parsed["prompt"].is_string() ||
+            !parsed.contains("model") || !parsed["model"].is_string())
+        {
+            write_result({{"line", line_no}, {"error", "bad request"}});
+            continue;
+        }
+
+        std::string model = parsed["model"];
+        auto model_spec = models.find(model);
+        if (model_spec == models.end())
+        {
+            write_result({{"line", line_no}, {"model", model}, {"error", "unknown model"}});
+            continue;
+        }
+
+        SamplingParams sampling;
+        std::string error;
+        if (!resolve_sampling_params(sampling_defaults, model_spec->second, parsed, sampling, &error))
+        {
+            write_result({{"line", line_no}, {"model", model}, {"error", error}});
+            continue;
+        }
+
+        error = model_admission_error(model_spec->second);
+        if (error.length())
+        {
+            write_result({{"line", line_no}, {"model", model}, {"error", error}});
+            continue;
+        }
+
+        items.push_back(BatchItem{
+            line_no,
+            parsed.contains("id") ? parsed["id"] : nlohmann::json{},
+            model,
+            wrap_prompt(model_spec->second, parsed),
+            sampling});
     }
 
-    // The LLM keeps a contextual cache memory of previous token evaluation.
-    // Usually, once this cache is full, it is required to recompute a compressed context based on previous
-    // tokens (see "infinite text generation via context swapping" in the main example), but in this minimalist
-    // example, we will just stop the loop once this cache is full or once an end of stream is detected.
+    // LoRA variants of one base run after one another, on the same loaded base
+    auto base_of = [&models](const std::string &model)
+    {
+        return models.at(model).value("base", model);
+    };
+    std::stable_sort(items.begin(), items.end(), [&base_of](const BatchItem &a, const BatchItem &b)
+                     {
+        const auto a_base = base_of(a.model), b_base = base_of(b.model);
+        if (a_base != b_base)
+        {
+            return a_base < b_base;
+        }
+        return a.model == b.model ? a.prompt < b.prompt : a.model < b.model; });
+
+    HTTP_LOGGER("Batch of %lu prompts read from %s\n", items.size(), in_path.c_str());
 
-    std::stringstream outstream;
-    while (llama_get_kv_cache_token_count(ctx) < max_context_size)
+    // of those this process may run on, which -C may have narrowed
+    const int n_cores = std::max(1, std::min((int)get_num_physical_cores(), (int)current_thread_cpus().size()));
+    std::atomic<uint64_t> total_generated{0}, total_prompt{0}, total_prompt_evaluated{0};
+    const int64_t batch_start_us = llama_time_us();
+
+    // kept loaded from one group to the next while they share it, as LoRA variants of one base do
+    llama_model *model = nullptr;
+    std::string model_path;
+    for (size_t group_begin = 0; group_begin < items.size();)
     {
-        if (llama_eval(ctx, tokens_list.data(), tokens_list.size(), llama_get_kv_cache_token_count(ctx), params.n_threads))
+        const std::string &model_name = items[group_begin].model;
+        size_t group_end = group_begin;
+        while (group_end < items.size() && items[group_end].model == model_name)
+        {
+            group_end++;
+        }
+
+        use_model_files(models, model_name, params);
+        auto lparams = llama_context_params_from_gpt_params(params);
+        if (model && params.model != model_path)
+        {
+            llama_free_model(model);
+            model = nullptr;
+        }
+        if (!model)
         {
-            HTTP_LOGGER("failed to eval\n");
-            return "";
+            model = llama_load_model_from_file(params.model.c_str(), lparams);
+            model_path = params.model;
         }
 
-        tokens_list.clear();
-        llama_token new_token_id = 0;
+        llama_lora_adapter *adapter = nullptr;
+        if (model && !params.lora_adapter.empty())
+        {
+            adapter = llama_load_lora_adapter_from_file(model, params.lora_adapter.c_str());
+        }
 
-        auto logits = llama_get_logits(ctx);
-        auto n_vocab = llama_n_vocab(ctx); // the size of the LLM vocabulary (in tokens)
+        if (model == nullptr || (!params.lora_adapter.empty() && !adapter))
+        {
+            HTTP_LOGGER("error: unable to load model %s\n", model_name.c_str());
+            for (size_t i = group_begin; i < group_end; i++)
+            {
+                write_result({{"line", items[i].line}, {"id", items[i].id}, {"model", model_name}, {"error", "unable to load model"}});
+            }
 
-        std::vector<llama_token_data> candidates;
-        candidates.reserve(n_vocab);
+            group_begin = group_end;
+            continue;
+        }
 
-        for (llama_token token_id = 0; token_id < n_vocab; token_id++)
+        // bounded by cores first (each context needs threads of its own to make progress), then by
+        // the memory each context's KV cache & compute buffers are estimated to take, of that left with the model loaded
+        int target_contexts = n_contexts > 0 ? n_contexts : std::max(1, n_cores / 4);
+        target_contexts = std::min(target_contexts, (int)(group_end - group_begin));
+        const auto &estimate = models.at(model_name)["memoryEstimate"];
+        const size_t context_bytes = (size_t)estimate["kvCacheBytes"] + (size_t)estimate["computeBytes"];
+        const size_t memory_contexts = std::max((size_t)1, _available_memory_bytes() / context_bytes);
+        if (memory_contexts < (size_t)target_contexts)
         {
-            candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+            HTTP_LOGGER("Memory for only %zu contexts of an estimated %.1f MiB each\n", memory_contexts, context_bytes / 1048576.0);
+            target_contexts = memory_contexts;
         }
 
-        llama_token_data_array candidates_p = {candidates.data(), candidates.size(), false};
+        std::vector<llama_context *> contexts;
+        while ((int)contexts.size() < target_contexts)
+        {
+            llama_context *ctx = llama_new_context_with_model(model, lparams);
+            if (ctx == nullptr)
+            {
+                break;
+            }
+            if (adapter && llama_set_lora_adapter(ctx, adapter))
+            {
+                llama_free(ctx);
+                break;
+            }
+
+            contexts.push_back(ctx);
+        }
 
-        if (params.mirostat == 1)
+        if (!contexts.size())
         {
-            static float mirostat_mu = 2.0f * params.mirostat_tau;
-            const int mirostat_m = 100;
-            llama_sample_temperature(ctx, &candidates_p, params.temp);
-            new_token_id = llama_sample_token_mirostat(ctx, &candidates_p, params.mirostat_tau, params.mirostat_eta, mirostat_m, &mirostat_mu);
+            HTTP_LOGGER("error: unable to create a context for %s\n", model_name.c_str());
+            llama_free_lora_adapter(adapter);
+            llama_free_model(model);
+            return 1;
         }
-        else if (params.mirostat == 2)
+
+        // with a thread budget, the contexts split the cores between them as they go, so those still running when
+        // the others have run out of prompts get all of them
+        const int threads_per_context = thread_budget() ? params.n_threads : std::max(1, n_cores / (int)contexts.size());
+        if (thread_budget())
         {
-            static float mirostat_mu = 2.0f * params.mirostat_tau;
-            llama_sample_temperature(ctx, &candidates_p, params.temp);
-            new_token_id = llama_sample_token_mirostat_v2(ctx, &candidates_p, params.mirostat_tau, params.mirostat_eta, &mirostat_mu);
+            HTTP_LOGGER("Running %lu prompts for %s on %lu contexts sharing %d cores\n",
+                        group_end - group_begin, model_name.c_str(), contexts.size(), thread_budget()->n_cores);
         }
         else
         {
-            // Select it using the "Greedy sampling" method :
-            new_token_id = llama_sample_token_greedy(ctx, &candidates_p);
+            HTTP_LOGGER("Running %lu prompts for %s on %lu contexts of %d threads each\n",
+                        group_end - group_begin, model_name.c_str(), contexts.size(), threads_per_context);
         }
 
-        // is it an end of stream ?
-        if (new_token_id == llama_token_eos())
+        std::atomic<size_t> cursor{group_begin};
+        std::vector<std::thread> workers;
+        for (auto ctx : contexts)
         {
-            break;
+            workers.emplace_back([&, ctx]()
+                                 {
+                ScopedThreadShare share(thread_share_weight(NORMAL));
+                std::vector<llama_token> ctx_tokens;
+                Sampler sampler;
+                gpt_params item_params = params;
+                item_params.n_threads = threads_per_context;
+
+                size_t claimed;
+                while ((claimed = cursor.fetch_add(BATCH_CLAIM_SIZE)) < group_end)
+                {
+                    for (size_t i = claimed; i < std::min(claimed + BATCH_CLAIM_SIZE, group_end); i++)
+                    {
+                        const auto &item = items[i];
+                        item_params.prompt = item.prompt;
+
+                        // several completions follow one another in the context, sharing the prompt's evaluation
+                        GenerationStats stats;
+                        std::vector<std::string> responses;
+                        for (int c = 0; c < item.sampling.n; c++)
+                        {
+                            sampler.reset(completion_sampling(item.sampling, c));
+                            responses.push_back(generate(ctx, item_params, ctx_tokens, sampler, &stats));
+                        }
+                        const float elapsed_ms = (llama_time_us() - stats.start_us) / 1000.0f;
+
+                        total_generated += stats.n_generated;
+                        total_prompt += stats.n_prompt_evaluated + stats.n_prompt_reused;
+                        total_prompt_evaluated += stats.n_prompt_evaluated;
+
+                        nlohmann::json result{
+                            {"line", item.line},
+                            {"id", item.id},
+                            {"model", item.model},
+                            {"prompt", item.prompt},
+                            {"response", responses.front()},
+                            {"elapsed_ms", elapsed_ms},
+                            {"tokens", stats.n_generated},
+                            {"prompt_tokens_evaluated", stats.n_prompt_evaluated},
+                            {"ms_per_token", stats.n_generated ? elapsed_ms / stats.n_generated : 0.0f},
+                        };
+                        if (responses.size() > 1)
+                        {
+                            result["responses"] = responses;
+                        }
+                        write_result(result);
+                    }
+                } });
         }
 
-        outstream << llama_token_to_str(ctx, new_token_id);
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+
+        for (auto ctx : contexts)
+        {
+            llama_free(ctx);
+        }
 
-        // Push this new token for next evaluation :
-        tokens_list.push_back(new_token_id);
+        llama_free_lora_adapter(adapter);
+        group_begin = group_end;
     }
 
-    if (timings)
+    if (model)
     {
-        auto local_timings = llama_get_timings(ctx);
-        memcpy(timings, &local_timings, sizeof(struct llama_timings));
+        llama_free_model(model);
     }
 
-    llama_free(ctx);
-    llama_free_model(model);
+    const double elapsed_s = (llama_time_us() - batch_start_us) / 1e6;
+    HTTP_LOGGER("Batch complete: %lu prompts in %.2f s; %" PRIu64 " tokens generated (%.2f tokens/s), "
+                "%" PRIu64 " of %" PRIu64 " prompt tokens evaluated (%.2f tokens/s)\n",
+                items.size(), elapsed_s,
+                (uint64_t)total_generated, elapsed_s > 0 ? total_generated / elapsed_s : 0.0,
+                (uint64_t)total_prompt_evaluated, (uint64_t)total_prompt,
+                elapsed_s > 0 ? total_prompt_evaluated / elapsed_s : 0.0);
 
-    llama_backend_free();
+    return 0;
+}
 
-    return outstream.str();
+std::string index_path(const std::string &index_dir, const std::string &model)
+{
+    return (fs::path{index_dir} / (model + ".index")).string();
 }
 
-void discover_valid_models(std::string model_path, models_map_t *models)
+void load_vector_indexes(const std::string &index_dir, const models_map_t &models, VectorIndexes *indexes)
 {
-    std::vector<fs::path> bins;
-    std::map<std::string, fs::path> jsons;
-    for (const fs::directory_entry &entry : fs::directory_iterator{model_path})
+    for (const auto &model_ent : models)
     {
-        auto path_ent = entry.path();
-        if (path_ent.extension() == ".bin")
+        const auto path = index_path(index_dir, model_ent.first);
+        if (!fs::exists(path))
         {
-            bins.push_back(entry.path());
+            continue;
         }
-        else if (path_ent.extension() == ".json")
+
+        std::string error;
+        auto index = load_vector_index(path, &error);
+        if (!index)
         {
-            jsons.emplace(std::make_pair(path_ent.filename(), path_ent));
+            HTTP_LOGGER("Not loading vector index: %s\n", error.c_str());
+            continue;
         }
+
+        HTTP_LOGGER("Loaded vector index of %zu vectors for %s\n", index->size(), model_ent.first.c_str());
+        indexes->by_model[model_ent.first] = std::move(index);
     }
+}
 
-    for (const auto &bin : bins)
+// a saved index is only as stale as this interval; inserts & queries carry on while it's written
+const int INDEX_SAVE_INTERVAL_S = 30;
+
+void save_vector_indexes_periodically(std::string index_dir, VectorIndexes *indexes)
+{
+    std::map<std::string, uint64_t> saved_generations;
+    while (true)
     {
-        auto expect_json_name = bin.filename().string() + ".json";
-        auto have_json = jsons.find(expect_json_name);
-        if (have_json != jsons.end())
+        std::this_thread::sleep_for(std::chrono::seconds(INDEX_SAVE_INTERVAL_S));
+
+        std::vector<std::pair<std::string, VectorIndex *>> to_save;
+        {
+            std::lock_guard<std::mutex> lg(indexes->lock);
+            for (const auto &index_ent : indexes->by_model)
+            {
+                to_save.emplace_back(index_ent.first, index_ent.second.get());
+            }
+        }
+
+        for (const auto &index_ent : to_save)
         {
-            std::ifstream json_read{have_json->second.string()};
-            auto json_parsed = nlohmann::json::parse(json_read, nullptr, false);
-            if (!json_parsed.is_discarded() &&
-                !json_parsed["displayName"].is_null() &&
-                !json_parsed["sourceURL"].is_null())
+            const auto generation = index_ent.second->generation();
+            auto saved = saved_generations.find(index_ent.first);
+            if (saved != saved_generations.end() ? saved->second == generation : generation == 0)
             {
-                json_parsed["parentPath"] = model_path;
-                models->emplace(std::make_pair(bin.filename().string(), json_parsed));
-                HTTP_LOGGER("Found valid model %s in %s\n", bin.filename().string().c_str(), model_path.c_str());
+                continue;
+            }
+
+            std::string error;
+            if (index_ent.second->save(index_path(index_dir, index_ent.first), &error))
+            {
+                saved_generations[index_ent.first] = generation;
+                HTTP_LOGGER("Saved vector index of %zu vectors for %s\n", index_ent.second->size(), index_ent.first.c_str());
+            }
+            else
+            {
+                HTTP_LOGGER("Failed to save vector index: %s\n", error.c_str());
             }
         }
     }
@@ -181,6 +754,106 @@ void sighandler(int signal)
     exit(0);
 }
 
+void increment_model_totals(const GenerationStats &stats, ModelTotals *totals)
+{
+    totals->prompts++;
+    totals->tokens += stats.n_generated;
+    if (stats.decode_start_us >= 0 && stats.end_us >= stats.decode_start_us)
+    {
+        totals->decode_ms += (stats.end_us - stats.decode_start_us) / 1000.0;
+    }
+    totals->drafted += stats.n_drafted;
+    totals->draft_accepted += stats.n_draft_accepted;
+    totals->preemptions += stats.n_preemptions;
+    totals->preemption_overhead_ms += stats.preemption_overhead_us / 1000.0;
+}
+
+using model_threads_map_t = std::map<std::string, ThreadCounts>;
+
+// tunes the thread counts of each model in `models`, reusing those cached in `cache_path`
+void tune_model_threads(const models_map_t &models, const gpt_params &params, const std::string &cache_path,
+                        model_threads_map_t *model_threads)
+{
+    for (const auto &model_ent : models)
+    {
+        gpt_params tune_params = params;
+        use_model_files(models, model_ent.first, tune_params);
+        // a LoRA variant is tuned as its base, whose cost its low-rank products hardly add to
+        tune_params.lora_adapter = "";
+
+        ThreadCounts counts;
+        if (!cached_tune_threads(cache_path, tune_params, &counts))
+        {
+            HTTP_LOGGER("Unable to tune thread counts for %s; using the defaults\n", model_ent.first.c_str());
+            continue;
+        }
+
+        HTTP_LOGGER("Using %d threads for prompts & %d for decoding with %s\n", counts.prefill, counts.decode, model_ent.first.c_str());
+        (*model_threads)[model_ent.first] = counts;
+    }
+}
+
+// sets `params`' thread counts to those tuned for `model`, if they were
+void use_model_threads(const model_threads_map_t &model_threads, const std::string &model, gpt_params &params)
+{
+    auto tuned = model_threads.find(model);
+    if (tuned != model_threads.end())
+    {
+        params.n_threads = tuned->second.decode;
+        params.n_threads_batch = tuned->second.prefill;
+    }
+}
+
+// loads & warms each model whose sidecar sets `preload`, marking each model `warm` or not in `models`
+void preload_models(InferenceBackend *backend, models_map_t *models, const gpt_params &params,
+                    const model_threads_map_t &model_threads)
+{
+    for (auto &model_ent : *models)
+    {
+        auto &model_spec = model_ent.second;
+        model_spec["warm"] = false;
+        if (!model_spec.value("preload", false))
+        {
+            continue;
+        }
+
+        gpt_params preload_params = params;
+        use_model_files(*models, model_ent.first, preload_params);
+        preload_params.use_mlock = model_spec.value("mlock", false);
+        use_model_threads(model_threads, model_ent.first, preload_params);
+
+        // kept resident from now on, so only if what it's estimated to take is free: a LoRA variant whose base is
+        // already resident adds just its adapter
+        if (model_spec.contains("memoryEstimate"))
+        {
+            const auto &estimate = model_spec["memoryEstimate"];
+            const size_t needed = backend->resident_memory().count(preload_params.model)
+                                      ? estimate.value("adapterBytes", (size_t)0)
+                                      : (size_t)estimate["totalBytes"];
+            const size_t available = _available_memory_bytes();
+            if (needed > available)
+            {
+                HTTP_LOGGER("Not preloading %s: it needs an estimated %.1f MiB, but only %.1f MiB is available\n",
+                            model_ent.first.c_str(), needed / 1048576.0, available / 1048576.0);
+                continue;
+            }
+        }
+
+        const int64_t start_us = llama_time_us();
+        auto error = backend->preload(preload_params);
+        if (!error.empty())
+        {
+            HTTP_LOGGER("Unable to preload %s: %s\n", model_ent.first.c_str(), error.c_str());
+            continue;
+        }
+
+        const double elapsed_ms = (llama_time_us() - start_us) / 1000.0;
+        model_spec["warm"] = true;
+        model_spec["warmupMs"] = elapsed_ms;
+        HTTP_LOGGER("Preloaded %s%s in %.1f ms\n", model_ent.first.c_str(), preload_params.use_mlock ? " (locked in memory)" : "", elapsed_ms);
+    }
+}
+
 void increment_total_timings(struct llama_timings *new_timings, struct llama_timings *total_timings)
 {
     total_timings->t_load_ms += new_timings->t_load_ms;
@@ -189,6 +862,69 @@ void increment_total_timings(struct llama_timings *new_timings, struct llama_tim
     total_timings->n_sample += new_timings->n_sample;
 }
 
+// splits the CPUs this process may run on between inference & housekeeping per -C & -K (either of which may be
+// empty, to take the rest). leaves both empty, for threads to run anywhere, if neither is set
+bool partition_cpus(const std::string &inference_spec, const std::string &housekeeping_spec,
+                    cpu_list_t *inference_cpus, cpu_list_t *housekeeping_cpus)
+{
+    if (inference_spec.empty() && housekeeping_spec.empty())
+    {
+        return true;
+    }
+
+    const cpu_list_t available = current_thread_cpus();
+    for (const auto &spec : {std::make_pair(&inference_spec, inference_cpus), std::make_pair(&housekeeping_spec, housekeeping_cpus)})
+    {
+        if (!spec.first->empty())
+        {
+            if (!parse_cpu_list(*spec.first, spec.second))
+            {
+                HTTP_LOGGER("Bad CPU list: %s\n", spec.first->c_str());
+                return false;
+            }
+
+            if (cpu_list_difference(*spec.second, available).size())
+            {
+                HTTP_LOGGER("CPUs %s aren't among those available (%s)\n",
+                            format_cpu_list(cpu_list_difference(*spec.second, available)).c_str(), format_cpu_list(available).c_str());
+                return false;
+            }
+        }
+    }
+
+    if (inference_spec.empty())
+    {
+        *inference_cpus = cpu_list_difference(available, *housekeeping_cpus);
+    }
+    else if (housekeeping_spec.empty())
+    {
+        *housekeeping_cpus = cpu_list_difference(available, *inference_cpus);
+    }
+    else if (cpu_list_difference(*inference_cpus, *housekeeping_cpus).size() < inference_cpus->size())
+    {
+        HTTP_LOGGER("Warning: inference & housekeeping CPUs overlap, so housekeeping may still disturb inference\n");
+    }
+
+    if (inference_cpus->empty() || housekeeping_cpus->empty())
+    {
+        HTTP_LOGGER("Of the CPUs available (%s), none are left for %s\n",
+                    format_cpu_list(available).c_str(), inference_cpus->empty() ? "inference" : "housekeeping");
+        return false;
+    }
+
+    if (!pin_current_thread(current_thread_cpus()))
+    {
+        HTTP_LOGGER("Warning: this platform can't pin threads to CPUs; ignoring -C & -K\n");
+        inference_cpus->clear();
+        housekeeping_cpus->clear();
+        return true;
+    }
+
+    HTTP_LOGGER("Running inference on CPUs %s & housekeeping on CPUs %s\n",
+                format_cpu_list(*inference_cpus).c_str(), format_cpu_list(*housekeeping_cpus).c_str());
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     popl::OptionParser op("allowed options");
@@ -196,7 +932,7 @@ int main(int argc, char **argv)
     auto model_opt = op.add<popl::Value<std::string>>("m", "model-path", "Path(s) to model binaries & their sidecar JSONs. Can be set multiple times & is not recursive.");
     auto host_opt = op.add<popl::Value<std::string>>("H", "host", "Hostname on which to bind & listen", "localhost");
     auto port_opt = op.add<popl::Value<int>>("p", "port", "Port on which to bind & listen", 42000);
-    auto temp_opt = op.add<popl::Value<float>>("t", "temperature", "Model temperature, between 0 and 1", 0.0);
+    auto temp_opt = op.add<popl::Value<float>>("t", "temperature", "Default sampling temperature; 0 for greedy (except with mirostat, which then uses 0.8)", 0.0);
     auto ctx_sz_opt = op.add<popl::Value<int>>("c", "context-size", "Set the model's context size (in tokens)", 2048);
     auto ptimings_opt = op.add<popl::Switch>("T", "print-timings", "Print timing info for each response to stderr");
     auto priv_opt = op.add<popl::Switch>("r", "runtime", "Enable runtime data endpoint. If -k and not -N, will be <runtime-prefix>/data; else instead of 'data', a random string.");
@@ -204,6 +940,26 @@ int main(int argc, char **argv)
     auto keys_json_opt = op.add<popl::Value<std::string>>("k", "keys", "Path to a JSON file with an array of valid API keys");
     auto rt_open_opt = op.add<popl::Switch>("N", "no-key-runtime", "When using -k & -s: do not require an API key for the runtime endpoint.");
     auto protect_post_op = op.add<popl::Switch>("P", "protect-post", "When using -k: require an API key for the POST endpoint. Overrides -N.");
+    auto batch_opt = op.add<popl::Value<std::string>>("b", "batch", "Run every prompt in this JSONL file (one POST /prompt body per line) offline, instead of serving HTTP. Requires -o.");
+    auto batch_out_opt = op.add<popl::Value<std::string>>("o", "out", "With -b: path of the JSONL file to which results are written as they finish");
+    auto batch_ctxs_opt = op.add<popl::Value<int>>("B", "batch-contexts", "With -b: number of concurrent contexts per model; 0 sizes by available cores & memory", 0);
+    auto index_dir_opt = op.add<popl::Value<std::string>>("I", "index-dir", "Load each model's vector index from <model name>.index in this directory at startup & save it there when changed");
+    auto no_preempt_opt = op.add<popl::Switch>("x", "no-preemption", "Let a generation run to completion even when a HIGH priority prompt arrives, rather than preempting it");
+    auto tune_threads_opt = op.add<popl::Value<std::string>>("A", "tune-threads", "Time each model at startup to choose separate thread counts for prompt evaluation & decoding, caching them in this JSON file (by CPU & model) for later starts");
+    auto prefill_chunk_opt = op.add<popl::Value<int>>("u", "prefill-chunk", "Evaluate prompts this many tokens at a time, between which a HIGH priority prompt may preempt them; smaller chunks preempt sooner, but evaluate a little slower", 512);
+    auto inference_cpus_opt = op.add<popl::Value<std::string>>("C", "inference-cpus", "CPUs (e.g. 0-13,28-41) to run inference on; the HTTP server & other housekeeping get the rest of those available unless -K is set");
+    auto housekeeping_cpus_opt = op.add<popl::Value<std::string>>("K", "housekeeping-cpus", "CPUs to confine the HTTP server, JSON encoding & other housekeeping threads to; inference gets the rest of those available unless -C is set");
+    auto numa_opt = op.add<popl::Switch>("", "numa", "Spread inference threads across NUMA nodes, using only the CPUs of each that inference may run on");
+    auto synthetic_opt = op.add<popl::Value<std::string>>("S", "synthetic", "Serve from a synthetic backend that loads no models, configured by comma-separated key=value pairs (load_ms, prefill_tokens_per_s, token_ms, n_predict, kv_bytes_per_token, n_vocab, n_embd); may be empty for the defaults");
+    auto idle_trim_opt = op.add<popl::Value<int>>("i", "idle-trim", "After this many seconds without a prompt, release the memory preloaded models' contexts hold & return freed heap to the OS, warming each back up when next used; 0 to never", 0);
+    auto idle_trim_weights_opt = op.add<popl::Switch>("", "idle-trim-weights", "With -i: also drop the resident pages of memory-mapped (not mlocked) weights, which are read back from disk as they're next used");
+    auto peer_opt = op.add<popl::Value<std::string>>("F", "peer", "host:port of another simple-http node to share queued work with: when idle, take prompts waiting on the busiest that serves the same model, & let it take them from here. Can be set multiple times.");
+    auto peer_key_opt = op.add<popl::Value<std::string>>("", "peer-key", "With -F: the API key to authenticate to peers with, if they were started with -k");
+    auto peer_poll_opt = op.add<popl::Value<int>>("", "peer-poll-ms", "With -F: how often to poll each peer's queue, in milliseconds", 500);
+    auto workers_opt = op.add<popl::Value<int>>("W", "workers", "Run prompts in this many worker processes, which share memory-mapped weights through the page cache, so that a crash fails only the prompt it was running (which is requeued); 0 to run them in this process", 0);
+    auto fixed_threads_opt = op.add<popl::Switch>("", "fixed-threads", "Evaluate with the full thread count (-A's tuned or the default) whatever else is evaluating at the time, rather than sharing the inference CPUs among a prompt, embeddings & batch contexts running at once, by priority & phase");
+    auto model_cache_opt = op.add<popl::Value<std::string>>("", "model-cache", "Directory on a memory-backed filesystem (e.g. /dev/shm/simple-http, or a tmpfs mounted with huge=always) to keep copies of the models' files in, which outlive this process, so that a restart maps their weights from memory instead of reading them from disk; each is checked against its file's size, modification time & fingerprint & copied again if stale");
+    auto event_loop_opt = op.add<popl::Value<int>>("E", "event-loop", "Serve HTTP from an epoll event loop, running requests' handlers on this many threads, so that idle, keep-alive & slow connections hold no thread of their own; 0 for cpp-httplib's thread per connection", 0);
     op.parse(argc, argv);
 
     gpt_params params;
@@ -220,12 +976,25 @@ int main(int argc, char **argv)
         exit(0);
     }
 
+    params.n_ctx = ctx_sz_opt->value();
+    params.n_batch = std::max(1, prefill_chunk_opt->value());
+
     models_map_t models;
     for (size_t c = 0; c < model_opt->count(); c++)
     {
         discover_valid_models(model_opt->value(c), &models);
     }
 
+    // the synthetic backend loads no models, whose files then needn't be models at all
+    if (!synthetic_opt->is_set())
+    {
+        read_model_files(&models, params);
+        if (model_cache_opt->is_set())
+        {
+            cache_model_files(&models, model_cache_opt->value());
+        }
+    }
+
     if (!models.size())
     {
         HTTP_LOGGER("No valid models found!\n");
@@ -263,21 +1032,216 @@ int main(int argc, char **argv)
         }
     }
 
-    if (temp_opt->is_set())
-    {
-        params.temp = temp_opt->value();
-    }
+    SamplingParams sampling_defaults;
+    sampling_defaults.temperature = temp_opt->value();
 
-    params.n_ctx = ctx_sz_opt->value();
     std::string hname = host_opt->value();
     uint16_t port = port_opt->value();
 
+    std::unique_ptr<InferenceBackend> backend = make_llama_backend();
+    if (synthetic_opt->is_set())
+    {
+        SyntheticBackendOptions synthetic_options;
+        if (!parse_synthetic_backend_options(synthetic_opt->value(), synthetic_options))
+        {
+            HTTP_LOGGER("Bad synthetic backend options: %s\n", synthetic_opt->value().c_str());
+            exit(1);
+        }
+
+        backend = make_synthetic_backend(synthetic_options);
+        HTTP_LOGGER("Using the synthetic backend: %.1f ms load, %.1f prefill tokens/s, %.1f ms/token, %d tokens\n",
+                    synthetic_options.load_ms, synthetic_options.prefill_tokens_per_s,
+                    synthetic_options.token_ms, synthetic_options.n_predict);
+    }
+
+    cpu_list_t inference_cpus, housekeeping_cpus;
+    if (!partition_cpus(inference_cpus_opt->is_set() ? inference_cpus_opt->value() : "",
+                        housekeeping_cpus_opt->is_set() ? housekeeping_cpus_opt->value() : "",
+                        &inference_cpus, &housekeeping_cpus))
+    {
+        exit(1);
+    }
+
+    // before initializing ggml, whose NUMA mode only uses the CPUs the process may then run on. the threads ggml
+    // creates for each evaluation inherit the pin, as do those of the batch workers & embedder below
+    if (inference_cpus.size())
+    {
+        pin_current_thread(inference_cpus);
+        if (params.n_threads > (int)inference_cpus.size())
+        {
+            HTTP_LOGGER("Reducing threads from %d to the %zu inference CPUs\n", params.n_threads, inference_cpus.size());
+            params.n_threads = inference_cpus.size();
+        }
+    }
+
+    params.numa = numa_opt->is_set();
     llama_backend_init(params.numa);
+
+    // before the worker processes (-W) are forked, which share it
+    if (!fixed_threads_opt->is_set())
+    {
+        set_thread_budget(ThreadBudget::create(std::min((int)get_num_physical_cores(), (int)current_thread_cpus().size())));
+    }
+
+    if (batch_opt->is_set())
+    {
+        if (synthetic_opt->is_set())
+        {
+            HTTP_LOGGER("Batch mode (-b) requires real models, not the synthetic backend (-S)\n");
+            exit(1);
+        }
+
+        if (!batch_out_opt->is_set())
+        {
+            HTTP_LOGGER("Batch mode (-b) requires an output path (-o)\n");
+            exit(1);
+        }
+
+        auto rc = run_batch(batch_opt->value(), batch_out_opt->value(), models, params, sampling_defaults, batch_ctxs_opt->value());
+        llama_backend_free();
+        return rc;
+    }
+
+    model_threads_map_t model_threads;
+    if (tune_threads_opt->is_set())
+    {
+        if (synthetic_opt->is_set())
+        {
+            HTTP_LOGGER("The synthetic backend (-S) has no thread counts to tune; ignoring -A\n");
+        }
+        else
+        {
+            tune_model_threads(models, params, tune_threads_opt->value(), &model_threads);
+        }
+    }
+
+    // before any thread is started, which forking isn't safe alongside
+    if (workers_opt->value() > 0)
+    {
+        backend = make_process_backend(std::move(backend), workers_opt->value(), params);
+        if (!backend)
+        {
+            HTTP_LOGGER("Unable to start worker processes (-W), which are only supported on Linux\n");
+            exit(1);
+        }
+        HTTP_LOGGER("Running prompts in %d worker processes\n", workers_opt->value());
+    }
+
     signal(SIGINT, sighandler);
     signal(SIGTERM, sighandler);
 
     llama_timings total_timings;
     bzero(&total_timings, sizeof(llama_timings));
+
+    // every entry is created up front, as the runtime endpoint reads this concurrently
+    model_totals_map_t model_totals;
+    for (const auto &model_ent : models)
+    {
+        model_totals[model_ent.first] = ModelTotals{};
+    }
+    // takes a copy of `params`, which the servicer loop below changes for each prompt
+    http_embedder embedder = [&backend, &models, &model_threads, inference_cpus, params](const std::string &model, const std::vector<std::string> &texts,
+                                                                                         std::vector<float> &embeddings, int *n_embd)
+    {
+        // off the HTTP server's housekeeping CPUs for the duration, so it competes with prompts rather than requests
+        ScopedThreadPin pin(inference_cpus);
+        ScopedThreadShare share(thread_share_weight(NORMAL));
+        gpt_params embd_params = params;
+        use_model_files(models, model, embd_params);
+        use_model_threads(model_threads, model, embd_params);
+
+        const int64_t start_us = llama_time_us();
+        auto error = backend->embed(embd_params, texts, embeddings, n_embd);
+        const double elapsed_s = (llama_time_us() - start_us) / 1e6;
+        if (error.empty())
+        {
+            HTTP_LOGGER("Embedded %zu texts with %s in %.3f s (%.1f texts/s)\n",
+                        texts.size(), model.c_str(), elapsed_s, elapsed_s > 0 ? texts.size() / elapsed_s : 0.0);
+        }
+        return error;
+    };
+
+    // before serving, so that no prompt waits on it
+    preload_models(backend.get(), &models, params, model_threads);
+
+    // the threads started from here until serving begins (the HTTP server's, its pool's & the index saver) inherit
+    // the housekeeping CPUs, while this one goes back to servicing prompts on the inference CPUs
+    std::unique_ptr<ScopedThreadPin> housekeeping_pin(new ScopedThreadPin(housekeeping_cpus));
+
+    VectorIndexes indexes;
+    if (index_dir_opt->is_set())
+    {
+        load_vector_indexes(index_dir_opt->value(), models, &indexes);
+        std::thread(save_vector_indexes_periodically, index_dir_opt->value(), &indexes).detach();
+    }
+
+    // runs on the HTTP server's threads, concurrently with prompts
+    http_memory_reporter memory_reporter = [&backend, &models]()
+    {
+        size_t rss, anon, file;
+        _process_memory(&rss, &anon, &file);
+        nlohmann::json memory{{"rss_bytes", rss}, {"anon_bytes", anon}, {"file_bytes", file}};
+
+        auto &by_model = memory["models"] = std::map<std::string, nlohmann::json>{};
+        const auto resident = backend->resident_memory();
+        for (const auto &model_ent : models)
+        {
+            // a LoRA variant's are its base's, which it shares
+            gpt_params model_params;
+            use_model_files(models, model_ent.first, model_params);
+            const auto it = resident.find(model_params.model);
+            if (it != resident.end())
+            {
+                by_model[model_ent.first] = {
+                    {"weights_bytes", it->second.weights},
+                    {"prompt_context_bytes", it->second.prompt_context},
+                    {"embedding_context_bytes", it->second.embedding_context},
+                };
+            }
+        }
+        return memory;
+    };
+
+    // runs on this thread, between prompts
+    const bool idle_trim_weights = idle_trim_weights_opt->is_set();
+    http_idle_handler idle_handler = [&backend, idle_trim_weights]()
+    {
+        size_t rss_before, rss_after, anon, file;
+        _process_memory(&rss_before, &anon, &file);
+        const size_t released = backend->trim(idle_trim_weights);
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+        _process_memory(&rss_after, &anon, &file);
+        HTTP_LOGGER("Idle: released %.1f MiB of model memory; resident set %.1f -> %.1f MiB\n",
+                    released / 1048576.0, rss_before / 1048576.0, rss_after / 1048576.0);
+    };
+    const int64_t idle_ms = std::max(0, idle_trim_opt->value()) * (int64_t)1000;
+
+    std::unique_ptr<Federation> federation;
+    if (peer_opt->is_set())
+    {
+        std::vector<Peer> peers;
+        for (size_t c = 0; c < peer_opt->count(); c++)
+        {
+            Peer peer;
+            if (!parse_peer(peer_opt->value(c), &peer))
+            {
+                HTTP_LOGGER("Bad peer (expected host:port): %s\n", peer_opt->value(c).c_str());
+                exit(1);
+            }
+            peers.push_back(peer);
+        }
+
+        char node_host[256] = "localhost";
+        gethostname(node_host, sizeof(node_host) - 1);
+        federation.reset(new Federation(peers, std::string(node_host) + ":" + std::to_string(port),
+                                        peer_key_opt->is_set() ? peer_key_opt->value() : "", std::max(10, peer_poll_opt->value())));
+        // its polling thread joins the HTTP server's on the housekeeping CPUs
+        federation->start();
+        HTTP_LOGGER("Sharing work with %zu peers as %s\n", peers.size(), federation->name().c_str());
+    }
+
     http_prompt_servicer prompt_servicer;
     std::shared_ptr<std::string> session_ep;
     if (priv_opt->is_set())
@@ -287,71 +1251,138 @@ int main(int argc, char **argv)
             session_ep = std::make_shared<std::string>(priv_path_opt->value());
         }
 
-        prompt_servicer = http_server_run(hname, port, params.n_ctx, models, &session_ep, &total_timings, auth_options);
+        prompt_servicer = http_server_run(hname, port, params.n_ctx, models, &session_ep, &total_timings, &model_totals, sampling_defaults, embedder, &indexes, auth_options,
+                                          memory_reporter, idle_handler, idle_ms, federation.get(), event_loop_opt->value());
         HTTP_LOGGER("Session private endpoint is %s\n", session_ep->c_str());
     }
     else
     {
-        prompt_servicer = http_server_run(hname, port, params.n_ctx, models, nullptr, &total_timings, auth_options);
+        prompt_servicer = http_server_run(hname, port, params.n_ctx, models, nullptr, &total_timings, &model_totals, sampling_defaults, embedder, &indexes, auth_options,
+                                          memory_reporter, idle_handler, idle_ms, federation.get(), event_loop_opt->value());
     }
 
+    housekeeping_pin.reset();
     HTTP_LOGGER("Using context size of %d\n", params.n_ctx);
     HTTP_LOGGER("Listening on %s:%d\n", hname.c_str(), port);
 
+    const int32_t default_n_draft = params.n_draft;
+    const int32_t default_n_threads = params.n_threads;
     ServicerResponse prompt_resp;
     while (true)
     {
-        std::string response;
+        std::vector<std::string> responses;
         struct llama_timings timings;
         bzero(&timings, sizeof(struct llama_timings));
+        GenerationStats stats;
+        std::string error;
+        std::shared_ptr<PreemptedGeneration> preempted = std::move(prompt_resp.preempted);
 
         if (params.prompt.size())
         {
-            uint set_mirostat = 0;
-
-            // from config
-            const auto &model_spec = models[prompt_resp.model];
-            if (!model_spec["mirostat"].is_null() && model_spec["mirostat"].is_number_unsigned())
+            const auto &sampling = prompt_resp.sampling;
+            if (sampling.mirostat)
             {
-                uint mirostat_val = model_spec["mirostat"];
-                if (mirostat_val > 0 && mirostat_val <= 2)
-                {
-                    set_mirostat = mirostat_val;
-                }
+                HTTP_LOGGER("Using mirostat %d at temperature %.2f for model %s\n",
+                            sampling.mirostat, sampling.temperature, prompt_resp.model.c_str());
+            }
+            else if (sampling.temperature > 0)
+            {
+                HTTP_LOGGER("Sampling at temperature %.2f, top-k %d, top-p %.2f for model %s\n",
+                            sampling.temperature, sampling.top_k, sampling.top_p, prompt_resp.model.c_str());
             }
 
-            // from request, overrides config
-            if (prompt_resp.mirostat)
+            if (sampling.n > 1)
             {
-                set_mirostat = prompt_resp.mirostat;
+                HTTP_LOGGER("Generating %d completions, sharing the prompt's evaluation\n", sampling.n);
             }
 
-            if (set_mirostat > 0)
+            if (preempted && !preempted->crashed)
+            {
+                HTTP_LOGGER("Resuming preempted prompt ID %s with %s\n", prompt_resp.id.c_str(), prompt_resp.model.c_str());
+            }
+            else
             {
-                params.mirostat = set_mirostat;
-                HTTP_LOGGER("Using mirostat %d for model %s\n", params.mirostat, prompt_resp.model.c_str());
+                HTTP_LOGGER("Processing starting on prompt ID %s with %s:\n%s\n",
+                            prompt_resp.id.c_str(), prompt_resp.model.c_str(), params.prompt.c_str());
             }
 
-            HTTP_LOGGER("Processing starting on prompt ID %s with %s:\n%s\n",
-                        prompt_resp.id.c_str(), prompt_resp.model.c_str(), params.prompt.c_str());
-            response = run_one_prompt(params, &timings);
-            HTTP_LOGGER("Response to prompt ID %s:\n%s\n", prompt_resp.id.c_str(), response.c_str());
+            backend->warm_up(params);
+            ScopedThreadShare share(thread_share_weight(prompt_resp.priority));
+            responses = backend->run_one_prompt(params, prompt_resp.sampling, &timings, &stats,
+                                               no_preempt_opt->is_set() ? nullptr : prompt_resp.outranked, &preempted, &error);
 
-            increment_total_timings(&timings, &total_timings);
-            if (ptimings_opt->is_set())
+            if (preempted && preempted->crashed)
+            {
+                HTTP_LOGGER("Requeued prompt ID %s to start over, as what was running it died\n", prompt_resp.id.c_str());
+                model_totals[prompt_resp.model].crashes++;
+            }
+            else if (preempted)
+            {
+                HTTP_LOGGER("Preempted prompt ID %s after %d tokens\n", prompt_resp.id.c_str(), stats.n_generated);
+            }
+            else if (error.length())
             {
-                llama_print_timings_direct(timings, stdout);
+                HTTP_LOGGER("Prompt ID %s failed: %s\n", prompt_resp.id.c_str(), error.c_str());
+            }
+            else
+            {
+                for (size_t i = 0; i < responses.size(); i++)
+                {
+                    if (responses.size() > 1)
+                    {
+                        HTTP_LOGGER("Response %lu of %lu to prompt ID %s:\n%s\n", i + 1, responses.size(), prompt_resp.id.c_str(), responses[i].c_str());
+                    }
+                    else
+                    {
+                        HTTP_LOGGER("Response to prompt ID %s:\n%s\n", prompt_resp.id.c_str(), responses[i].c_str());
+                    }
+                }
+
+                increment_total_timings(&timings, &total_timings);
+                increment_model_totals(stats, &model_totals[prompt_resp.model]);
+                if (stats.n_drafted)
+                {
+                    HTTP_LOGGER("Speculative decoding accepted %d of %d drafted tokens (%.1f%%); %.2f tokens/s\n",
+                                stats.n_draft_accepted, stats.n_drafted, 100.0f * stats.n_draft_accepted / stats.n_drafted,
+                                stats.end_us > stats.decode_start_us ? stats.n_generated * 1e6 / (stats.end_us - stats.decode_start_us) : 0.0);
+                }
+
+                if (ptimings_opt->is_set())
+                {
+                    llama_print_timings_direct(timings, stdout);
+                }
             }
         }
 
-        std::string prompt;
-        prompt_resp = prompt_servicer(
-            response.size() ? &response : nullptr,
-            timings.t_eval_ms,
-            timings.n_sample);
+        if (preempted)
+        {
+            // back on the queue; its timings & totals are counted once it completes
+            prompt_resp = prompt_servicer(nullptr, -1.0f, -1, -1.0f, preempted, "");
+        }
+        else
+        {
+            prompt_resp = prompt_servicer(
+                params.prompt.size() ? &responses : nullptr,
+                timings.t_eval_ms,
+                timings.n_sample,
+                stats.first_token_us >= 0 ? (stats.first_token_us - stats.start_us) / 1000.0f : -1.0f,
+                nullptr,
+                error);
+        }
 
         params.prompt = prompt_resp.prompt;
-        params.model = fs::path{std::string(models[prompt_resp.model]["parentPath"])} / prompt_resp.model;
+        use_model_files(models, prompt_resp.model, params);
+
+        const auto &model_spec = models[prompt_resp.model];
+        params.n_draft = default_n_draft;
+        params.n_threads = default_n_threads;
+        params.n_threads_batch = -1;
+        use_model_threads(model_threads, prompt_resp.model, params);
+        params.model_draft = draft_model_file(models, prompt_resp.model);
+        if (!params.model_draft.empty() && model_spec.contains("draftTokens") && model_spec["draftTokens"].is_number_unsigned())
+        {
+            params.n_draft = std::max(1, (int)model_spec["draftTokens"]);
+        }
     }
 
     return 0;
@@ -0,0 +1,211 @@
+#include "thread-budget.h"
+
+#include <algorithm>
+#include <initializer_list>
+#include <new>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// how much more of the CPUs a worker evaluating a prompt takes than it would decoding
+const int PREFILL_WEIGHT_FACTOR = 2;
+
+static ThreadBudget *_budget = nullptr;
+
+static thread_local int _share_slot = -1;
+
+ThreadBudget::ThreadBudget(int n_cores) : n_cores(std::max(1, n_cores))
+{
+    for (int i = 0; i < THREAD_BUDGET_SLOTS; i++)
+    {
+        weights[i] = 0;
+        prefilling[i] = 0;
+        max_threads[i] = 0;
+    }
+}
+
+ThreadBudget *ThreadBudget::create(int n_cores)
+{
+#if defined(__linux__)
+    void *mem = mmap(nullptr, sizeof(ThreadBudget), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED)
+    {
+        return new (mem) ThreadBudget(n_cores);
+    }
+#endif
+    return new ThreadBudget(n_cores);
+}
+
+int ThreadBudget::join(int weight)
+{
+    weight = std::max(1, weight);
+    for (int i = 0; i < THREAD_BUDGET_SLOTS; i++)
+    {
+        int32_t free_slot = 0;
+        if (weights[i].load() == 0 && weights[i].compare_exchange_strong(free_slot, weight))
+        {
+            prefilling[i] = 0;
+            max_threads[i] = n_cores;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void ThreadBudget::leave(int slot)
+{
+    weights[slot] = 0;
+}
+
+int ThreadBudget::threads(int slot, bool prefill, int max)
+{
+    prefilling[slot] = prefill;
+    max_threads[slot] = std::max(1, max);
+
+    // the workers' weights & limits as of now, which the others update as they go
+    struct Worker
+    {
+        int slot;
+        int weight;
+        int max_threads;
+        int share;
+        double remainder;
+    };
+    std::vector<Worker> open;
+    for (int i = 0; i < THREAD_BUDGET_SLOTS; i++)
+    {
+        const int weight = weights[i];
+        if (weight > 0)
+        {
+            open.push_back(Worker{i, weight * (prefilling[i] ? PREFILL_WEIGHT_FACTOR : 1), max_threads[i], 0, 0.0});
+        }
+    }
+
+    // those that would be given more than they'd use get only that, & the rest is shared among the others anew
+    std::vector<Worker> shared;
+    int remaining = n_cores;
+    for (bool limited = true; limited && open.size();)
+    {
+        limited = false;
+        int64_t total_weight = 0;
+        for (const auto &w : open)
+        {
+            total_weight += w.weight;
+        }
+        for (size_t i = 0; i < open.size();)
+        {
+            if (open[i].max_threads * total_weight <= (int64_t)remaining * open[i].weight)
+            {
+                open[i].share = open[i].max_threads;
+                remaining -= open[i].share;
+                shared.push_back(open[i]);
+                open.erase(open.begin() + i);
+                limited = true;
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+
+    // the rest in proportion to weight, rounded down, with what that leaves going to the largest remainders
+    int64_t total_weight = 0;
+    for (const auto &w : open)
+    {
+        total_weight += w.weight;
+    }
+    int left = remaining;
+    for (auto &w : open)
+    {
+        const double exact = (double)remaining * w.weight / total_weight;
+        w.share = (int)exact;
+        w.remainder = exact - w.share;
+        left -= w.share;
+    }
+    std::stable_sort(open.begin(), open.end(), [](const Worker &a, const Worker &b)
+                     { return a.remainder > b.remainder; });
+    for (auto &w : open)
+    {
+        if (left-- > 0)
+        {
+            w.share++;
+        }
+    }
+
+    for (const auto *workers : {&shared, &open})
+    {
+        for (const auto &w : *workers)
+        {
+            if (w.slot == slot)
+            {
+                // more workers than CPUs each still need a thread
+                return std::max(1, std::min(w.share, max));
+            }
+        }
+    }
+    return max;
+}
+
+ThreadBudget *thread_budget()
+{
+    return _budget;
+}
+
+void set_thread_budget(ThreadBudget *budget)
+{
+    _budget = budget;
+}
+
+int thread_share_weight(int priority)
+{
+    return priority > 0 ? 4 : priority < 0 ? 1 : 2;
+}
+
+ScopedThreadShare::ScopedThreadShare(int weight)
+    : slot(-1), previous_slot(_share_slot)
+{
+    if (_budget && weight > 0)
+    {
+        slot = _budget->join(weight);
+        if (slot >= 0)
+        {
+            _share_slot = slot;
+        }
+    }
+}
+
+ScopedThreadShare::~ScopedThreadShare()
+{
+    if (slot >= 0)
+    {
+        _budget->leave(slot);
+        _share_slot = previous_slot;
+    }
+}
+
+ScopedThreadShareAdoption::ScopedThreadShareAdoption(int slot) : previous_slot(_share_slot)
+{
+    _share_slot = slot;
+}
+
+ScopedThreadShareAdoption::~ScopedThreadShareAdoption()
+{
+    _share_slot = previous_slot;
+}
+
+int budget_threads(bool prefill, int max_threads)
+{
+    if (!_budget || _share_slot < 0)
+    {
+        return max_threads;
+    }
+    return _budget->threads(_share_slot, prefill, max_threads);
+}
+
+int current_thread_share_slot()
+{
+    return _share_slot;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// the most evaluations that can take a share of a budget at once; any more run with their own thread counts
+const int THREAD_BUDGET_SLOTS = 64;
+
+// shares the inference CPUs among the evaluations running at once (a prompt, embeddings, batch contexts), so that
+// together they neither oversubscribe the CPUs nor leave them idle. each asks for its share before every evaluation,
+// which ggml then starts that many threads for, so shares follow workers joining & leaving without restarting any
+// context: a lone worker gets every CPU, & concurrent ones split them by weight, a prompt's by its priority & doubled
+// while it evaluates a prompt (whose matmuls scale with threads far better than decoding's)
+struct ThreadBudget
+{
+    // in memory shared with the worker processes forked after it's created (where they're supported), which
+    // evaluate in the slots this process joins on their behalf. never freed
+    static ThreadBudget *create(int n_cores);
+
+    // takes a slot for a worker of `weight`, returning it, or -1 if none is free
+    int join(int weight);
+    void leave(int slot);
+
+    // the threads the worker in `slot` should evaluate with now: never more than `max_threads` (what it would run
+    // with alone), any CPUs that leaves going to the others
+    int threads(int slot, bool prefill, int max_threads);
+
+    const int n_cores;
+
+private:
+    explicit ThreadBudget(int n_cores);
+
+    // 0 where the slot is free
+    std::atomic<int32_t> weights[THREAD_BUDGET_SLOTS];
+    std::atomic<int32_t> prefilling[THREAD_BUDGET_SLOTS];
+    std::atomic<int32_t> max_threads[THREAD_BUDGET_SLOTS];
+};
+
+// the budget of this process (& its workers), if one has been set
+ThreadBudget *thread_budget();
+void set_thread_budget(ThreadBudget *budget);
+
+// the weight of a worker of this priority (as QueuePriority ranks them)
+int thread_share_weight(int priority);
+
+// joins the budget, if there is one (& `weight` is positive), for as long as it lives, so that the calling thread's
+// evaluations take a share of it
+struct ScopedThreadShare
+{
+    explicit ScopedThreadShare(int weight);
+    ~ScopedThreadShare();
+
+private:
+    int slot;
+    int previous_slot;
+};
+
+// has the calling thread evaluate in `slot`, joined by another thread (or the process that forked this one) on its
+// behalf, for as long as it lives
+struct ScopedThreadShareAdoption
+{
+    explicit ScopedThreadShareAdoption(int slot);
+    ~ScopedThreadShareAdoption();
+
+private:
+    int previous_slot;
+};
+
+// the threads an evaluation on the calling thread should use: its share of the budget, if it has joined it, else
+// `max_threads`
+int budget_threads(bool prefill, int max_threads);
+
+// the slot the calling thread evaluates in, or -1
+int current_thread_share_slot();
@@ -0,0 +1,197 @@
+#include "thread-tuning.h"
+#include "cpu-affinity.h"
+#include "http.h"
+#include "model-cache.h"
+
+#include "deps/json/single_include/nlohmann/json.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <thread>
+#include <vector>
+
+// tokens decoded per measurement, & measurements of each count (the fastest of which is kept, as the others are
+// more likely to have been disturbed)
+const int TUNE_DECODE_TOKENS = 16;
+const int TUNE_REPEATS = 2;
+
+// counts to try: every one up to 4, then roughly 1.5x apart, plus the physical & hardware thread counts. only the
+// CPUs the calling thread may run on (which -C may have confined it to) count, as no more can be kept busy
+static std::vector<int> _candidate_thread_counts()
+{
+    const int n_hw = std::max(1, (int)current_thread_cpus().size());
+    std::set<int> counts{std::min(get_num_physical_cores(), n_hw), n_hw};
+    for (int power = 1; power <= n_hw; power *= 2)
+    {
+        counts.insert(power);
+        if (power >= 2 && power * 3 / 2 <= n_hw)
+        {
+            counts.insert(power * 3 / 2);
+        }
+    }
+    return std::vector<int>(counts.begin(), counts.end());
+}
+
+// tries each of `counts` in ascending order, returning the one for which `measure` (in us) is least. gives up once
+// two in a row are more than 10% slower than the best, as adding threads past the best rarely helps again
+template <typename F>
+static int _fastest(const std::vector<int> &counts, const char *what, F measure)
+{
+    int best = counts.front();
+    int64_t best_us = INT64_MAX;
+    int n_slower = 0;
+    for (int n_threads : counts)
+    {
+        int64_t us = INT64_MAX;
+        for (int r = 0; r < TUNE_REPEATS; r++)
+        {
+            us = std::min(us, measure(n_threads));
+        }
+
+        HTTP_LOGGER("  %s with %d threads: %.2f ms\n", what, n_threads, us / 1000.0);
+        if (us < best_us)
+        {
+            best = n_threads;
+            best_us = us;
+            n_slower = 0;
+        }
+        else if (us > best_us * 11 / 10 && ++n_slower == 2)
+        {
+            break;
+        }
+    }
+    return best;
+}
+
+bool tune_threads(const gpt_params &params, ThreadCounts *counts)
+{
+    llama_model *model;
+    llama_context *ctx;
+    std::tie(model, ctx) = llama_init_from_gpt_params(params);
+    if (!model)
+    {
+        return false;
+    }
+
+    // what's evaluated doesn't affect how long it takes, so any tokens will do
+    const int n_vocab = llama_n_vocab(ctx);
+    const int n_prompt = std::max(1, std::min(params.n_batch, llama_n_ctx(ctx) - TUNE_DECODE_TOKENS));
+    std::vector<llama_token> prompt(n_prompt);
+    prompt[0] = llama_token_bos();
+    for (int i = 1; i < n_prompt; i++)
+    {
+        prompt[i] = (llama_token)((i * 7919) % n_vocab);
+    }
+
+    auto eval_prompt = [&](int n_threads)
+    {
+        const int64_t start_us = llama_time_us();
+        llama_eval(ctx, prompt.data(), prompt.size(), 0, n_threads);
+        return llama_time_us() - start_us;
+    };
+
+    auto decode = [&](int n_threads)
+    {
+        const int64_t start_us = llama_time_us();
+        for (int i = 0; i < TUNE_DECODE_TOKENS; i++)
+        {
+            llama_eval(ctx, &prompt[(i + 1) % n_prompt], 1, n_prompt + i, n_threads);
+        }
+        return (llama_time_us() - start_us) / TUNE_DECODE_TOKENS;
+    };
+
+    // the first evaluation allocates & faults in buffers, which no count should be charged for. the prompt it
+    // leaves in the KV cache is what decoding attends to
+    eval_prompt(params.n_threads);
+
+    const auto candidates = _candidate_thread_counts();
+    HTTP_LOGGER("Tuning thread counts for %s (%d-token prompt)\n", params.model.c_str(), n_prompt);
+    counts->prefill = _fastest(candidates, "prompt evaluation", eval_prompt);
+    eval_prompt(counts->prefill);
+    counts->decode = _fastest(candidates, "decoding a token", decode);
+
+    llama_free(ctx);
+    llama_free_model(model);
+    return true;
+}
+
+static std::string _cpu_name()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+    {
+        if (line.compare(0, 10, "model name") == 0)
+        {
+            auto colon = line.find(':');
+            if (colon != std::string::npos)
+            {
+                line = line.substr(line.find_first_not_of(' ', colon + 1));
+                break;
+            }
+        }
+        line.clear();
+    }
+
+    return (line.empty() ? "unknown CPU" : line) + " x" + std::to_string(current_thread_cpus().size());
+}
+
+bool cached_tune_threads(const std::string &cache_path, const gpt_params &params, ThreadCounts *counts)
+{
+    const std::string cpu = _cpu_name();
+    const std::string fingerprint = model_file_fingerprint(params.model);
+
+    nlohmann::json cache = nlohmann::json::object();
+    {
+        std::ifstream in(cache_path);
+        if (in)
+        {
+            cache = nlohmann::json::parse(in, nullptr, false);
+            if (!cache.is_object())
+            {
+                HTTP_LOGGER("Ignoring unreadable thread count cache %s\n", cache_path.c_str());
+                cache = nlohmann::json::object();
+            }
+        }
+    }
+
+    if (!fingerprint.empty() && cache.contains(cpu) && cache[cpu].contains(fingerprint))
+    {
+        const auto &cached = cache[cpu][fingerprint];
+        if (cached.value("prefill", 0) > 0 && cached.value("decode", 0) > 0)
+        {
+            counts->prefill = cached["prefill"];
+            counts->decode = cached["decode"];
+            return true;
+        }
+    }
+
+    if (!tune_threads(params, counts))
+    {
+        return false;
+    }
+
+    if (!fingerprint.empty())
+    {
+        cache[cpu][fingerprint] = nlohmann::json{
+            {"model", params.model},
+            {"prefill", counts->prefill},
+            {"decode", counts->decode},
+        };
+
+        const std::string tmp_path = cache_path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::trunc);
+        out << cache.dump(4) << "\n";
+        out.close();
+        if (!out || rename(tmp_path.c_str(), cache_path.c_str()))
+        {
+            HTTP_LOGGER("Unable to write thread count cache %s\n", cache_path.c_str());
+        }
+    }
+
+    return true;
+}
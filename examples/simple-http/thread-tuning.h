@@ -0,0 +1,22 @@
+#pragma once
+
+#include "common.h"
+
+#include <string>
+
+// how many threads to evaluate a model with: prompts (many tokens per evaluation) are compute bound & usually want
+// every core, while decoding (a token at a time) is bound by memory bandwidth & thread synchronization, & on
+// machines with several sockets or many cores often runs fastest on fewer
+struct ThreadCounts
+{
+    int prefill = 0;
+    int decode = 0;
+};
+
+// loads the model at `params.model` & times evaluating a prompt & decoding with it across thread counts up to the
+// machine's hardware threads (those it may run on), setting `*counts` to the fastest for each. returns false if the model can't be loaded.
+bool tune_threads(const gpt_params &params, ThreadCounts *counts);
+
+// as tune_threads(), but reuses the counts in the JSON file at `cache_path` if it has them for this CPU & model
+// (identified by a fingerprint of its file), & otherwise adds them to it once measured
+bool cached_tune_threads(const std::string &cache_path, const gpt_params &params, ThreadCounts *counts);
@@ -0,0 +1,236 @@
+// recall & throughput benchmark for simple-http's vector index, against exact (brute force) search
+#include "vector-index.h"
+#include "deps/json/single_include/nlohmann/json.hpp"
+#include "deps/popl/include/popl.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#define BENCH_LOGGER(fmt_str, ...) fprintf(stderr, "[bench] " fmt_str, ##__VA_ARGS__)
+
+using bench_clock = std::chrono::steady_clock;
+
+static double _seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// gaussian clusters, which real embeddings resemble far more than uniform noise does
+static std::vector<float> _make_vectors(size_t n, int n_dims, int n_clusters, std::mt19937 &rng,
+                                        const std::vector<float> &centroids)
+{
+    std::normal_distribution<float> normal;
+    std::uniform_int_distribution<int> cluster(0, std::max(n_clusters, 1) - 1);
+    std::vector<float> vectors(n * n_dims);
+    for (size_t i = 0; i < n; i++)
+    {
+        const float *centroid = n_clusters > 0 ? centroids.data() + (size_t)cluster(rng) * n_dims : nullptr;
+        for (int d = 0; d < n_dims; d++)
+        {
+            vectors[i * n_dims + d] = normal(rng) * (centroid ? 0.35f : 1.0f) + (centroid ? centroid[d] : 0.0f);
+        }
+    }
+    return vectors;
+}
+
+static void _normalize(std::vector<float> &vectors, int n_dims)
+{
+    for (size_t i = 0; i < vectors.size(); i += n_dims)
+    {
+        float sum_sq = 0.0f;
+        for (int d = 0; d < n_dims; d++)
+        {
+            sum_sq += vectors[i + d] * vectors[i + d];
+        }
+        const float scale = 1.0f / sqrtf(sum_sq);
+        for (int d = 0; d < n_dims; d++)
+        {
+            vectors[i + d] *= scale;
+        }
+    }
+}
+
+// runs `fn(i)` for each of `n` queries across `n_threads`, returning the elapsed seconds
+template <typename F>
+static double _run_queries(size_t n, int n_threads, F fn)
+{
+    std::atomic<size_t> next{0};
+    const auto start = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++)
+    {
+        threads.emplace_back([&next, n, &fn]()
+                             {
+            for (size_t i = next++; i < n; i = next++)
+            {
+                fn(i);
+            } });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    return _seconds_since(start);
+}
+
+int main(int argc, char **argv)
+{
+    popl::OptionParser op("allowed options");
+    auto help_opt = op.add<popl::Switch>("h", "help", "This help");
+    auto num_opt = op.add<popl::Value<int>>("n", "vectors", "Number of vectors to index", 100000);
+    auto dims_opt = op.add<popl::Value<int>>("d", "dimensions", "Vector dimensions", 256);
+    auto queries_opt = op.add<popl::Value<int>>("q", "queries", "Number of queries", 500);
+    auto k_opt = op.add<popl::Value<int>>("k", "k", "Neighbours per query", 10);
+    auto m_opt = op.add<popl::Value<int>>("M", "links", "HNSW links per vector", 16);
+    auto efc_opt = op.add<popl::Value<int>>("e", "ef-construction", "HNSW candidates considered per insert", 200);
+    auto efs_opt = op.add<popl::Value<std::string>>("E", "ef-search", "Comma-separated HNSW candidates considered per query, each measured", "16,32,64,128,256");
+    auto type_opt = op.add<popl::Value<std::string>>("t", "type", "Vector storage: f16 or f32", "f16");
+    auto clusters_opt = op.add<popl::Value<int>>("c", "clusters", "Number of gaussian clusters to draw vectors from; 0 for isotropic noise", 100);
+    auto threads_opt = op.add<popl::Value<int>>("j", "threads", "Threads issuing queries", 1);
+    auto save_opt = op.add<popl::Value<std::string>>("o", "save", "Save the index here, then reload (memory-mapped) & measure it again");
+    auto seed_opt = op.add<popl::Value<int>>("s", "seed", "RNG seed", 42);
+    op.parse(argc, argv);
+
+    if (help_opt->is_set())
+    {
+        std::cout << argv[0] << " " << op.help();
+        return 0;
+    }
+
+    VectorIndexParams params;
+    params.n_dims = dims_opt->value();
+    params.type = type_opt->value() == "f32" ? GGML_TYPE_F32 : GGML_TYPE_F16;
+    params.M = m_opt->value();
+    params.ef_construction = efc_opt->value();
+
+    std::vector<int> efs;
+    std::stringstream efs_ss(efs_opt->value());
+    for (std::string ef; std::getline(efs_ss, ef, ',');)
+    {
+        efs.push_back(std::stoi(ef));
+    }
+
+    const size_t n = num_opt->value();
+    const size_t n_queries = queries_opt->value();
+    const int n_dims = params.n_dims;
+    const int k = k_opt->value();
+    const int n_threads = std::max(threads_opt->value(), 1);
+
+    std::mt19937 rng(seed_opt->value());
+    std::normal_distribution<float> normal;
+    std::vector<float> centroids((size_t)clusters_opt->value() * n_dims);
+    for (auto &c : centroids)
+    {
+        c = normal(rng);
+    }
+    auto vectors = _make_vectors(n, n_dims, clusters_opt->value(), rng, centroids);
+    auto queries = _make_vectors(n_queries, n_dims, clusters_opt->value(), rng, centroids);
+    _normalize(vectors, n_dims);
+    _normalize(queries, n_dims);
+
+    BENCH_LOGGER("computing exact neighbours of %zu queries among %zu vectors\n", n_queries, n);
+    auto vec_dot = ggml_internal_get_type_traits(GGML_TYPE_F32).vec_dot;
+    std::vector<std::vector<uint64_t>> truth(n_queries);
+    const double brute_s = _run_queries(n_queries, n_threads, [&](size_t q)
+                                        {
+        std::vector<std::pair<float, uint64_t>> sims(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            vec_dot(n_dims, &sims[i].first, vectors.data() + i * n_dims, queries.data() + q * n_dims);
+            sims[i].second = i;
+        }
+        const size_t top = std::min((size_t)k, n);
+        std::partial_sort(sims.begin(), sims.begin() + top, sims.end(), std::greater<std::pair<float, uint64_t>>());
+        for (size_t i = 0; i < top; i++)
+        {
+            truth[q].push_back(sims[i].second);
+        } });
+
+    BENCH_LOGGER("building the index\n");
+    auto index = make_vector_index(params);
+    const auto build_start = bench_clock::now();
+    for (size_t i = 0; i < n; i++)
+    {
+        index->insert(i, vectors.data() + i * n_dims);
+    }
+    const double build_s = _seconds_since(build_start);
+
+    auto measure = [&](const VectorIndex &idx)
+    {
+        auto results = nlohmann::json::array();
+        for (int ef : efs)
+        {
+            std::vector<std::vector<VectorIndexMatch>> found(n_queries);
+            const double query_s = _run_queries(n_queries, n_threads, [&](size_t q)
+                                                { found[q] = idx.query(queries.data() + q * n_dims, k, ef); });
+
+            size_t hits = 0, expected = 0;
+            for (size_t q = 0; q < n_queries; q++)
+            {
+                std::unordered_set<uint64_t> want(truth[q].begin(), truth[q].end());
+                for (const auto &match : found[q])
+                {
+                    hits += want.count(match.id);
+                }
+                expected += want.size();
+            }
+
+            results.push_back(nlohmann::json{
+                {"ef_search", ef},
+                {"recall", expected ? (double)hits / expected : 0.0},
+                {"qps", n_queries / query_s},
+            });
+        }
+        return results;
+    };
+
+    nlohmann::json report{
+        {"vectors", n},
+        {"dimensions", n_dims},
+        {"type", params.type == GGML_TYPE_F32 ? "f32" : "f16"},
+        {"M", params.M},
+        {"ef_construction", params.ef_construction},
+        {"k", k},
+        {"threads", n_threads},
+        {"build_s", build_s},
+        {"inserts_per_s", n / build_s},
+        {"brute_force_qps", n_queries / brute_s},
+        {"hnsw", measure(*index)},
+    };
+
+    if (save_opt->is_set())
+    {
+        std::string error;
+        const auto save_start = bench_clock::now();
+        if (!index->save(save_opt->value(), &error))
+        {
+            BENCH_LOGGER("%s\n", error.c_str());
+            return 1;
+        }
+        report["save_s"] = _seconds_since(save_start);
+        index.reset();
+
+        const auto load_start = bench_clock::now();
+        auto loaded = load_vector_index(save_opt->value(), &error);
+        if (!loaded)
+        {
+            BENCH_LOGGER("%s\n", error.c_str());
+            return 1;
+        }
+        report["load_s"] = _seconds_since(load_start);
+        report["loaded"] = measure(*loaded);
+    }
+
+    std::cout << report.dump(4) << std::endl;
+    return 0;
+}
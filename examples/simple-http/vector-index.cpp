@@ -0,0 +1,641 @@
+#include "vector-index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <random>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char _INDEX_MAGIC[4] = {'v', 'i', 'd', 'x'};
+static const uint32_t _INDEX_VERSION = 1;
+static const size_t _INDEX_ALIGN = 64;
+static const int _INDEX_MAX_LEVEL = 16;
+
+// followed by each of these arrays, in order & each aligned to _INDEX_ALIGN: ids (uint64 per vector), levels
+// (uint8), removed flags (uint8), vectors (n_dims of `type`), bottom-layer links (uint32 count then 2 * M
+// uint32 per vector) & the upper layers' links (levels[i] * (uint32 count then M uint32) per vector, in order)
+struct _IndexFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t n_dims;
+    uint32_t type;
+    uint32_t M;
+    uint32_t ef_construction;
+    uint32_t ef_search;
+    int32_t max_level;
+    int64_t entry;
+    uint64_t n_vectors;
+    uint64_t n_upper_links;
+};
+
+static size_t _aligned(size_t offset)
+{
+    return (offset + _INDEX_ALIGN - 1) / _INDEX_ALIGN * _INDEX_ALIGN;
+}
+
+// marks the vectors one search has visited; bumping the tag clears it without touching the array
+struct _VisitedSet
+{
+    std::vector<uint32_t> tags;
+    uint32_t tag = 0;
+
+    static _VisitedSet &for_this_thread(size_t n)
+    {
+        thread_local _VisitedSet visited;
+        if (visited.tags.size() < n)
+        {
+            visited.tags.resize(n, 0);
+        }
+        if (++visited.tag == 0)
+        {
+            std::fill(visited.tags.begin(), visited.tags.end(), 0);
+            visited.tag = 1;
+        }
+        return visited;
+    }
+
+    // returns true if `i` had already been visited
+    bool visit(uint32_t i)
+    {
+        if (tags[i] == tag)
+        {
+            return true;
+        }
+        tags[i] = tag;
+        return false;
+    }
+};
+
+struct HnswIndex : VectorIndex
+{
+    using dist_node = std::pair<float, uint32_t>; // cosine distance, vector
+
+    VectorIndexParams p;
+    size_t row_size;
+    int M0; // links per vector on the bottom layer
+    double level_mult;
+    ggml_vec_dot_t vec_dot;
+    ggml_from_float_t from_float;
+
+    mutable pthread_rwlock_t rwlock;
+    std::mt19937 rng{42};
+    uint64_t gen = 0;
+
+    std::vector<uint64_t> ids;
+    std::vector<uint8_t> levels;
+    std::vector<uint8_t> removed;
+    // levels[i] * (M + 1) for layers 1 & up: a count, then the links
+    std::vector<std::vector<uint32_t>> upper_links;
+    std::unordered_map<uint64_t, uint32_t> by_id;
+    size_t n_removed = 0;
+    int64_t entry = -1;
+    int max_level = -1;
+
+    // vectors & (M0 + 1) bottom-layer links each, either in the heap or in `mapping`
+    std::vector<uint8_t> vectors_heap;
+    std::vector<uint32_t> links0_heap;
+    const uint8_t *vectors = nullptr;
+    const uint32_t *links0 = nullptr;
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    HnswIndex(const VectorIndexParams &params) : p(params)
+    {
+        // ggml's f16 conversion tables are set up by its first init
+        static std::once_flag ggml_tables;
+        std::call_once(ggml_tables, []()
+                       { ggml_free(ggml_init({0, nullptr, true})); });
+
+        if (p.type != GGML_TYPE_F32)
+        {
+            p.type = GGML_TYPE_F16;
+        }
+        p.M = std::max(p.M, 2);
+        p.ef_construction = std::max(p.ef_construction, p.M);
+        p.ef_search = std::max(p.ef_search, 1);
+
+        auto traits = ggml_internal_get_type_traits(p.type);
+        vec_dot = traits.vec_dot;
+        from_float = traits.from_float;
+        row_size = (size_t)p.n_dims * ggml_type_size(p.type);
+        M0 = 2 * p.M;
+        level_mult = 1.0 / log((double)p.M);
+
+        pthread_rwlock_init(&rwlock, nullptr);
+    }
+
+    ~HnswIndex()
+    {
+        if (mapping)
+        {
+            munmap(mapping, mapping_size);
+        }
+        pthread_rwlock_destroy(&rwlock);
+    }
+
+    struct ReadLock
+    {
+        pthread_rwlock_t *l;
+        ReadLock(pthread_rwlock_t *l) : l(l) { pthread_rwlock_rdlock(l); }
+        ~ReadLock() { pthread_rwlock_unlock(l); }
+    };
+
+    struct WriteLock
+    {
+        pthread_rwlock_t *l;
+        WriteLock(pthread_rwlock_t *l) : l(l) { pthread_rwlock_wrlock(l); }
+        ~WriteLock() { pthread_rwlock_unlock(l); }
+    };
+
+    // normalizes `vec` & converts it to the storage type
+    void to_row(const float *vec, uint8_t *row) const
+    {
+        float sum_sq = 0.0f;
+        for (int i = 0; i < p.n_dims; i++)
+        {
+            sum_sq += vec[i] * vec[i];
+        }
+        const float scale = sum_sq > 0.0f ? 1.0f / sqrtf(sum_sq) : 0.0f;
+
+        std::vector<float> normalized(vec, vec + p.n_dims);
+        for (auto &f : normalized)
+        {
+            f *= scale;
+        }
+
+        if (p.type == GGML_TYPE_F32)
+        {
+            memcpy(row, normalized.data(), row_size);
+        }
+        else
+        {
+            from_float(normalized.data(), row, p.n_dims);
+        }
+    }
+
+    const uint8_t *row_at(uint32_t i) const
+    {
+        return vectors + (size_t)i * row_size;
+    }
+
+    float distance(const uint8_t *row, uint32_t i) const
+    {
+        float dot;
+        vec_dot(p.n_dims, &dot, row_at(i), row);
+        return 1.0f - dot;
+    }
+
+    const uint32_t *links_at(uint32_t i, int level) const
+    {
+        return level == 0 ? links0 + (size_t)i * (M0 + 1) : upper_links[i].data() + (size_t)(level - 1) * (p.M + 1);
+    }
+
+    // only once materialize()d
+    uint32_t *mutable_links_at(uint32_t i, int level)
+    {
+        return level == 0 ? links0_heap.data() + (size_t)i * (M0 + 1) : upper_links[i].data() + (size_t)(level - 1) * (p.M + 1);
+    }
+
+    // copies anything still read from the mapping to the heap, so that it can grow
+    void materialize()
+    {
+        if (!mapping)
+        {
+            return;
+        }
+
+        vectors_heap.assign(vectors, vectors + ids.size() * row_size);
+        links0_heap.assign(links0, links0 + ids.size() * (M0 + 1));
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        vectors = vectors_heap.data();
+        links0 = links0_heap.data();
+    }
+
+    // the (at most) `ef` vectors nearest `row` on `level` reachable from `entry_points`, nearest first. removed
+    // vectors are still followed, but only returned if `include_removed`
+    std::vector<dist_node> search_layer(const uint8_t *row, const std::vector<dist_node> &entry_points, size_t ef,
+                                        int level, bool include_removed) const
+    {
+        auto &visited = _VisitedSet::for_this_thread(ids.size());
+        std::priority_queue<dist_node, std::vector<dist_node>, std::greater<dist_node>> candidates;
+        std::priority_queue<dist_node> found; // furthest first
+
+        for (const auto &ep : entry_points)
+        {
+            visited.visit(ep.second);
+            candidates.push(ep);
+            if (include_removed || !removed[ep.second])
+            {
+                found.push(ep);
+            }
+        }
+
+        while (!candidates.empty())
+        {
+            const auto nearest = candidates.top();
+            if (found.size() >= ef && nearest.first > found.top().first)
+            {
+                break;
+            }
+            candidates.pop();
+
+            const uint32_t *links = links_at(nearest.second, level);
+            for (uint32_t l = 1; l <= links[0]; l++)
+            {
+                const uint32_t n = links[l];
+                if (visited.visit(n))
+                {
+                    continue;
+                }
+
+                const float d = distance(row, n);
+                if (found.size() < ef || d < found.top().first)
+                {
+                    candidates.emplace(d, n);
+                    if (include_removed || !removed[n])
+                    {
+                        found.emplace(d, n);
+                        if (found.size() > ef)
+                        {
+                            found.pop();
+                        }
+                    }
+                }
+            }
+        }
+
+        std::vector<dist_node> result(found.size());
+        for (size_t i = result.size(); i-- > 0; found.pop())
+        {
+            result[i] = found.top();
+        }
+        return result;
+    }
+
+    // descends greedily from the entry point to `level`
+    dist_node descend(const uint8_t *row, int level) const
+    {
+        dist_node ep{distance(row, entry), (uint32_t)entry};
+        for (int l = max_level; l > level; l--)
+        {
+            bool improved = true;
+            while (improved)
+            {
+                improved = false;
+                const uint32_t *links = links_at(ep.second, l);
+                for (uint32_t i = 1; i <= links[0]; i++)
+                {
+                    const float d = distance(row, links[i]);
+                    if (d < ep.first)
+                    {
+                        ep = dist_node{d, links[i]};
+                        improved = true;
+                    }
+                }
+            }
+        }
+        return ep;
+    }
+
+    // the heuristic of the HNSW paper's algorithm 4: prefers candidates (nearest first) that are nearer the base
+    // vector than to any already selected, so that links spread in all directions rather than clustering
+    std::vector<dist_node> select_neighbors(const std::vector<dist_node> &candidates, size_t max_links) const
+    {
+        std::vector<dist_node> selected;
+        for (const auto &c : candidates)
+        {
+            if (selected.size() >= max_links)
+            {
+                break;
+            }
+
+            bool diverse = true;
+            for (const auto &s : selected)
+            {
+                if (distance(row_at(s.second), c.second) < c.first)
+                {
+                    diverse = false;
+                    break;
+                }
+            }
+
+            if (diverse)
+            {
+                selected.push_back(c);
+            }
+        }
+        return selected;
+    }
+
+    void link(uint32_t from, uint32_t to, int level)
+    {
+        const size_t max_links = level == 0 ? M0 : p.M;
+        uint32_t *links = mutable_links_at(from, level);
+        if (links[0] < max_links)
+        {
+            links[++links[0]] = to;
+            return;
+        }
+
+        std::vector<dist_node> candidates;
+        const uint8_t *from_row = row_at(from);
+        candidates.emplace_back(distance(from_row, to), to);
+        for (uint32_t l = 1; l <= links[0]; l++)
+        {
+            candidates.emplace_back(distance(from_row, links[l]), links[l]);
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        auto selected = select_neighbors(candidates, max_links);
+        links[0] = selected.size();
+        for (size_t l = 0; l < selected.size(); l++)
+        {
+            links[l + 1] = selected[l].second;
+        }
+    }
+
+    void insert(uint64_t id, const float *vec) override
+    {
+        WriteLock lock(&rwlock);
+        materialize();
+        gen++;
+
+        auto existing = by_id.find(id);
+        if (existing != by_id.end())
+        {
+            removed[existing->second] = 1;
+            n_removed++;
+            by_id.erase(existing);
+        }
+
+        const uint32_t n = ids.size();
+        const int level = std::min((int)(-log(std::uniform_real_distribution<double>(1e-12, 1.0)(rng)) * level_mult), _INDEX_MAX_LEVEL);
+
+        ids.push_back(id);
+        levels.push_back(level);
+        removed.push_back(0);
+        upper_links.emplace_back((size_t)level * (p.M + 1), 0);
+        vectors_heap.resize(vectors_heap.size() + row_size);
+        links0_heap.resize(links0_heap.size() + M0 + 1, 0);
+        vectors = vectors_heap.data();
+        links0 = links0_heap.data();
+        by_id[id] = n;
+
+        uint8_t *row = vectors_heap.data() + (size_t)n * row_size;
+        to_row(vec, row);
+
+        if (entry < 0)
+        {
+            entry = n;
+            max_level = level;
+            return;
+        }
+
+        std::vector<dist_node> entry_points{descend(row, level)};
+        for (int l = std::min(level, max_level); l >= 0; l--)
+        {
+            auto candidates = search_layer(row, entry_points, p.ef_construction, l, true);
+            auto neighbors = select_neighbors(candidates, p.M);
+
+            uint32_t *links = mutable_links_at(n, l);
+            links[0] = neighbors.size();
+            for (size_t i = 0; i < neighbors.size(); i++)
+            {
+                links[i + 1] = neighbors[i].second;
+                link(neighbors[i].second, n, l);
+            }
+
+            entry_points = std::move(candidates);
+        }
+
+        if (level > max_level)
+        {
+            entry = n;
+            max_level = level;
+        }
+    }
+
+    bool remove(uint64_t id) override
+    {
+        WriteLock lock(&rwlock);
+        auto existing = by_id.find(id);
+        if (existing == by_id.end())
+        {
+            return false;
+        }
+
+        // removed vectors stay in the graph, as others are reached through them, but are never returned
+        removed[existing->second] = 1;
+        n_removed++;
+        by_id.erase(existing);
+        gen++;
+        return true;
+    }
+
+    std::vector<VectorIndexMatch> query(const float *vec, int k, int ef) const override
+    {
+        ReadLock lock(&rwlock);
+        std::vector<VectorIndexMatch> matches;
+        if (entry < 0 || k <= 0 || ids.size() == n_removed)
+        {
+            return matches;
+        }
+
+        std::vector<uint8_t> row(row_size);
+        to_row(vec, row.data());
+
+        std::vector<dist_node> entry_points{descend(row.data(), 0)};
+        auto found = search_layer(row.data(), entry_points, std::max(ef > 0 ? ef : p.ef_search, k), 0, false);
+        for (size_t i = 0; i < found.size() && (int)i < k; i++)
+        {
+            matches.push_back(VectorIndexMatch{ids[found[i].second], 1.0f - found[i].first});
+        }
+        return matches;
+    }
+
+    size_t size() const override
+    {
+        ReadLock lock(&rwlock);
+        return ids.size() - n_removed;
+    }
+
+    uint64_t generation() const override
+    {
+        ReadLock lock(&rwlock);
+        return gen;
+    }
+
+    const VectorIndexParams &params() const override
+    {
+        return p;
+    }
+
+    bool save(const std::string &path, std::string *error) const override
+    {
+        ReadLock lock(&rwlock);
+
+        _IndexFileHeader header;
+        memcpy(header.magic, _INDEX_MAGIC, sizeof(_INDEX_MAGIC));
+        header.version = _INDEX_VERSION;
+        header.n_dims = p.n_dims;
+        header.type = p.type;
+        header.M = p.M;
+        header.ef_construction = p.ef_construction;
+        header.ef_search = p.ef_search;
+        header.max_level = max_level;
+        header.entry = entry;
+        header.n_vectors = ids.size();
+        header.n_upper_links = 0;
+        for (const auto &links : upper_links)
+        {
+            header.n_upper_links += links.size();
+        }
+
+        const std::string tmp_path = path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        size_t offset = 0;
+        auto write_aligned = [&out, &offset](const void *data, size_t size)
+        {
+            static const char zeros[_INDEX_ALIGN] = {0};
+            out.write(zeros, _aligned(offset) - offset);
+            out.write((const char *)data, size);
+            offset = _aligned(offset) + size;
+        };
+
+        write_aligned(&header, sizeof(header));
+        write_aligned(ids.data(), ids.size() * sizeof(uint64_t));
+        write_aligned(levels.data(), levels.size());
+        write_aligned(removed.data(), removed.size());
+        write_aligned(vectors, ids.size() * row_size);
+        write_aligned(links0, ids.size() * (M0 + 1) * sizeof(uint32_t));
+        write_aligned(nullptr, 0);
+        for (const auto &links : upper_links)
+        {
+            out.write((const char *)links.data(), links.size() * sizeof(uint32_t));
+        }
+        out.close();
+
+        if (!out || rename(tmp_path.c_str(), path.c_str()))
+        {
+            *error = "failed to write " + path + ": " + strerror(errno);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+std::unique_ptr<VectorIndex> make_vector_index(const VectorIndexParams &params)
+{
+    return std::unique_ptr<VectorIndex>(new HnswIndex(params));
+}
+
+std::unique_ptr<VectorIndex> load_vector_index(const std::string &path, std::string *error)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        *error = "failed to open " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(_IndexFileHeader))
+    {
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        *error = "failed to map " + path;
+        return nullptr;
+    }
+
+    const auto *base = (const uint8_t *)mapping;
+    const size_t size = st.st_size;
+    _IndexFileHeader header;
+    memcpy(&header, base, sizeof(header));
+
+    VectorIndexParams params;
+    params.n_dims = header.n_dims;
+    params.type = (enum ggml_type)header.type;
+    params.M = header.M;
+    params.ef_construction = header.ef_construction;
+    params.ef_search = header.ef_search;
+    std::unique_ptr<HnswIndex> index(new HnswIndex(params));
+
+    const size_t n = header.n_vectors;
+    const size_t ids_at = _aligned(sizeof(header));
+    const size_t levels_at = _aligned(ids_at + n * sizeof(uint64_t));
+    const size_t removed_at = _aligned(levels_at + n);
+    const size_t vectors_at = _aligned(removed_at + n);
+    const size_t links0_at = _aligned(vectors_at + n * index->row_size);
+    const size_t upper_at = _aligned(links0_at + n * (index->M0 + 1) * sizeof(uint32_t));
+
+    if (memcmp(header.magic, _INDEX_MAGIC, sizeof(_INDEX_MAGIC)) || header.version != _INDEX_VERSION ||
+        (header.type != GGML_TYPE_F16 && header.type != GGML_TYPE_F32) || header.n_dims == 0 ||
+        index->p.M != (int)header.M || upper_at + header.n_upper_links * sizeof(uint32_t) > size)
+    {
+        munmap(mapping, size);
+        *error = path + " is not a valid vector index";
+        return nullptr;
+    }
+
+    index->mapping = mapping;
+    index->mapping_size = size;
+    index->entry = header.entry;
+    index->max_level = header.max_level;
+    index->gen = 0;
+
+    const auto *ids = (const uint64_t *)(base + ids_at);
+    index->ids.assign(ids, ids + n);
+    index->levels.assign(base + levels_at, base + levels_at + n);
+    index->removed.assign(base + removed_at, base + removed_at + n);
+    index->vectors = base + vectors_at;
+    index->links0 = (const uint32_t *)(base + links0_at);
+
+    uint64_t n_upper_links = 0;
+    for (auto level : index->levels)
+    {
+        n_upper_links += (uint64_t)level * (index->p.M + 1);
+    }
+    if (n_upper_links != header.n_upper_links || header.entry >= (int64_t)n || (n && header.entry < 0))
+    {
+        *error = path + " is not a valid vector index";
+        return nullptr;
+    }
+
+    const auto *upper = (const uint32_t *)(base + upper_at);
+    index->upper_links.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const size_t n_links = (size_t)index->levels[i] * (index->p.M + 1);
+        index->upper_links[i].assign(upper, upper + n_links);
+        upper += n_links;
+
+        if (index->removed[i])
+        {
+            index->n_removed++;
+        }
+        else
+        {
+            index->by_id[index->ids[i]] = i;
+        }
+    }
+
+    return std::unique_ptr<VectorIndex>(index.release());
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct VectorIndexParams
+{
+    int n_dims = 0;
+    enum ggml_type type = GGML_TYPE_F16; // how vectors are stored: GGML_TYPE_F16 or GGML_TYPE_F32
+    int M = 16;                          // links per vector on each layer (twice as many on the bottom one)
+    int ef_construction = 200;           // candidates considered when linking a new vector
+    int ef_search = 64;                  // candidates considered per query, unless it asks otherwise
+};
+
+struct VectorIndexMatch
+{
+    uint64_t id;
+    float similarity; // cosine
+};
+
+// nearest-neighbour search by cosine similarity over vectors stored unit-normalized. queries may run
+// concurrently with one another; inserts & removals exclude everything else while they run.
+struct VectorIndex
+{
+    virtual ~VectorIndex() {}
+
+    // stores `vec` (`params().n_dims` floats) as `id`, replacing whatever was already stored as it
+    virtual void insert(uint64_t id, const float *vec) = 0;
+    // returns false if nothing was stored as `id`
+    virtual bool remove(uint64_t id) = 0;
+    // the (at most) `k` stored vectors most similar to `vec`, best first. `ef` <= 0 uses `params().ef_search`
+    virtual std::vector<VectorIndexMatch> query(const float *vec, int k, int ef = 0) const = 0;
+
+    virtual size_t size() const = 0; // not counting removed vectors
+    // bumped by every insert & removal, so that the index need only be saved when it changes
+    virtual uint64_t generation() const = 0;
+    virtual const VectorIndexParams &params() const = 0;
+
+    // writes the index to `path`, by way of a temporary file so that nothing ever loads it half-written
+    virtual bool save(const std::string &path, std::string *error) const = 0;
+};
+
+// an empty HNSW index (Malkov & Yashunin, "Efficient and robust approximate nearest neighbor search using
+// Hierarchical Navigable Small World graphs"), whose distances are computed by ggml's f16 or f32 dot product
+std::unique_ptr<VectorIndex> make_vector_index(const VectorIndexParams &params);
+
+// memory-maps an index written by VectorIndex::save(). its vectors & bottom-layer links are read straight from
+// the mapping, & so are shared with the page cache & faulted in only as queries touch them, until the first
+// insert copies them to the heap. returns null & sets `*error` on failure.
+std::unique_ptr<VectorIndex> load_vector_index(const std::string &path, std::string *error);
+
+// the index of each model's embeddings, created on its first insert
+struct VectorIndexes
+{
+    std::mutex lock; // guards `by_model` itself; each index guards its own contents
+    std::map<std::string, std::unique_ptr<VectorIndex>> by_model;
+};
@@ -4034,20 +4034,31 @@ void ggml_numa_init(void) {
         return;
     }
 
+    // only the CPUs this process may run on (e.g. as restricted by taskset, or by sched_setaffinity() before
+    // calling this) are used, & nodes with none of them are left out
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    const bool have_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    uint32_t n_nodes = 0;
     for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
-        struct ggml_numa_node * node = &g_state.numa.nodes[n];
+        struct ggml_numa_node * node = &g_state.numa.nodes[n_nodes];
         GGML_PRINT_DEBUG("CPUs on node %u:", n);
         node->n_cpus = 0;
         for (uint32_t c = 0; c < g_state.numa.total_cpus; ++c) {
             rv = snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpu%u", n, c);
             GGML_ASSERT(rv > 0 && (unsigned)rv < sizeof(path));
-            if (stat(path, &st) == 0) {
+            if (stat(path, &st) == 0 && (!have_allowed || (c < CPU_SETSIZE && CPU_ISSET(c, &allowed)))) {
                 node->cpus[node->n_cpus++] = c;
                 GGML_PRINT_DEBUG(" %u", c);
             }
         }
         GGML_PRINT_DEBUG("\n");
+        if (node->n_cpus > 0) {
+            ++n_nodes;
+        }
     }
+    g_state.numa.n_nodes = n_nodes;
 
     if (ggml_is_numa()) {
         FILE *fptr = fopen("/proc/sys/kernel/numa_balancing", "r");
@@ -16193,10 +16204,14 @@ static void clear_numa_thread_affinity(void) {
 
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
+    // every CPU of every node, i.e. those the process was allowed when NUMA was initialized
     cpu_set_t * cpus = CPU_ALLOC(g_state.numa.total_cpus);
     CPU_ZERO_S(setsize, cpus);
-    for (unsigned i = 0; i < g_state.numa.total_cpus; ++i) {
-        CPU_SET_S(i, setsize, cpus);
+    for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+        const struct ggml_numa_node * node = &g_state.numa.nodes[n];
+        for (size_t i = 0; i < node->n_cpus; ++i) {
+            CPU_SET_S(node->cpus[i], setsize, cpus);
+        }
     }
 
     int rv = pthread_setaffinity_np(pthread_self(), setsize, cpus);
@@ -314,6 +314,57 @@ struct llama_mmap {
 #endif
 };
 
+// Returns the bytes of the pages spanning [addr, addr + size) that are resident in memory.
+static size_t llama_resident_size(const void * addr, size_t size) {
+#ifdef __linux__
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t begin = (uintptr_t) addr & ~(page - 1);
+    const uintptr_t end = ((uintptr_t) addr + size + page - 1) & ~(page - 1);
+    if (addr == NULL || end <= begin) {
+        return 0;
+    }
+
+    std::vector<unsigned char> vec((end - begin) / page);
+    if (mincore((void *) begin, end - begin, vec.data())) {
+        return 0;
+    }
+
+    size_t n_resident = 0;
+    for (unsigned char v : vec) {
+        n_resident += v & 1;
+    }
+    return n_resident * page;
+#else
+    (void) addr;
+    (void) size;
+    return 0;
+#endif
+}
+
+// Gives the pages wholly within [addr, addr + size) back to the OS, leaving them mapped: they read as zeros (or from
+// the file, for a file mapping) when next touched. Returns the bytes of them that were resident.
+static size_t llama_release_pages(void * addr, size_t size) {
+#ifdef __linux__
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t begin = ((uintptr_t) addr + page - 1) & ~(page - 1);
+    const uintptr_t end = ((uintptr_t) addr + size) & ~(page - 1);
+    if (addr == NULL || end <= begin) {
+        return 0;
+    }
+
+    const size_t resident = llama_resident_size((void *) begin, end - begin);
+    if (madvise((void *) begin, end - begin, MADV_DONTNEED)) {
+        fprintf(stderr, "warning: madvise(.., MADV_DONTNEED) failed: %s\n", strerror(errno));
+        return 0;
+    }
+    return resident;
+#else
+    (void) addr;
+    (void) size;
+    return 0;
+#endif
+}
+
 // Represents some region of memory being locked using mlock or VirtualLock;
 // will automatically unlock on destruction.
 struct llama_mlock {
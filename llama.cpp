@@ -338,6 +338,29 @@ struct llama_model {
     }
 };
 
+// a LoRA adapter kept apart from the model's weights, to be added to their products in the graph rather than merged
+// into them, so that contexts of one model may each use a different adapter (or none)
+struct llama_lora_adapter {
+    struct llama_lora_weights {
+        struct ggml_tensor * a; // [n_in, r], transposed from the file's loraA
+        struct ggml_tensor * b; // [r, n_out], pre-multiplied by alpha/r
+    };
+
+    const llama_model * model = NULL;
+
+    // keyed by the model's weight tensor each applies to
+    std::unordered_map<const struct ggml_tensor *, llama_lora_weights> weights;
+
+    struct ggml_context * ctx = NULL;
+    llama_buffer buf;
+
+    ~llama_lora_adapter() {
+        if (ctx) {
+            ggml_free(ctx);
+        }
+    }
+};
+
 struct llama_context {
     llama_context(const llama_model & model) : model(model), t_load_us(model.t_load_us), t_start_us(model.t_start_us) {}
     ~llama_context() {
@@ -380,6 +403,12 @@ struct llama_context {
 
     size_t mem_per_token = 0;
 
+    // the batch size the compute buffers were measured for
+    int n_batch = 0;
+
+    // the adapter added to the layers' products, if any
+    const llama_lora_adapter * lora = NULL;
+
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
     bool logits_all = false;
@@ -1033,6 +1062,17 @@ static const char * llama_model_type_name(e_model type) {
     }
 }
 
+static e_model llama_model_type_for(uint32_t n_layer, int n_gqa) {
+    switch (n_layer) {
+        case 26: return e_model::MODEL_3B;
+        case 32: return e_model::MODEL_7B;
+        case 40: return e_model::MODEL_13B;
+        case 60: return e_model::MODEL_30B;
+        case 80: return n_gqa == 8 ? e_model::MODEL_70B : e_model::MODEL_65B;
+        default: return n_layer < 32 ? e_model::MODEL_7B : e_model::MODEL_UNKNOWN;
+    }
+}
+
 static void llama_model_load_internal(
         const std::string & fname,
         llama_model & model,
@@ -1070,19 +1110,7 @@ static void llama_model_load_internal(
     hparams.f_rms_norm_eps = rms_norm_eps;
 
     {
-        switch (hparams.n_layer) {
-            case 26: model.type = e_model::MODEL_3B; break;
-            case 32: model.type = e_model::MODEL_7B; break;
-            case 40: model.type = e_model::MODEL_13B; break;
-            case 60: model.type = e_model::MODEL_30B; break;
-            case 80: model.type = e_model::MODEL_65B; break;
-            default:
-                {
-                    if (hparams.n_layer < 32) {
-                        model.type = e_model::MODEL_7B;
-                    }
-                } break;
-        }
+        model.type = llama_model_type_for(hparams.n_layer, n_gqa);
 
         hparams.n_ctx = n_ctx;
 
@@ -1090,9 +1118,8 @@ static void llama_model_load_internal(
         // TODO: temporary until GGUF
         LLAMA_ASSERT(hparams.n_head % n_gqa == 0);
         hparams.n_head_kv = hparams.n_head / n_gqa;
-        if (model.type == e_model::MODEL_65B && n_gqa == 8) {
+        if (model.type == e_model::MODEL_70B) {
             LLAMA_LOG_WARN("%s: warning: assuming 70B model based on GQA == %d\n", __func__, n_gqa);
-            model.type = e_model::MODEL_70B;
             hparams.f_ffn_mult = 1.3f; // from the params.json of the 70B model
         }
 
@@ -1407,6 +1434,28 @@ static bool llama_model_load(
     }
 }
 
+// w*cur, plus the context's adapter's low-rank product B*(A*cur) if it has one for w
+static struct ggml_tensor * llama_lora_mul_mat(
+        struct ggml_context * ctx0,
+        const llama_context & lctx,
+         struct ggml_tensor * w,
+         struct ggml_tensor * cur) {
+    struct ggml_tensor * out = ggml_mul_mat(ctx0, w, cur);
+    if (!lctx.lora) {
+        return out;
+    }
+
+    const auto it = lctx.lora->weights.find(w);
+    if (it == lctx.lora->weights.end()) {
+        return out;
+    }
+
+    struct ggml_tensor * ax = ggml_mul_mat(ctx0, it->second.a, cur);
+    ggml_set_name(ax, "lora_a");
+
+    return ggml_add(ctx0, out, ggml_mul_mat(ctx0, it->second.b, ax));
+}
+
 static struct ggml_cgraph * llama_build_graph(
          llama_context & lctx,
      const llama_token * tokens,
@@ -1558,11 +1607,11 @@ static struct ggml_cgraph * llama_build_graph(
         // self-attention
         {
             // compute Q and K and RoPE them
-            struct ggml_tensor * tmpk = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+            struct ggml_tensor * tmpk = llama_lora_mul_mat(ctx0, lctx, model.layers[il].wk, cur);
             offload_func_kq(tmpk);
             ggml_set_name(tmpk, "tmpk");
 
-            struct ggml_tensor * tmpq = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+            struct ggml_tensor * tmpq = llama_lora_mul_mat(ctx0, lctx, model.layers[il].wq, cur);
             offload_func_kq(tmpq);
             ggml_set_name(tmpq, "tmpq");
 
@@ -1578,7 +1627,7 @@ static struct ggml_cgraph * llama_build_graph(
             {
                 // compute the transposed [N, n_embd] V matrix
 
-                struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+                struct ggml_tensor * tmpv = llama_lora_mul_mat(ctx0, lctx, model.layers[il].wv, cur);
                 offload_func_v(tmpv);
                 ggml_set_name(tmpv, "tmpv");
 
@@ -1673,7 +1722,7 @@ static struct ggml_cgraph * llama_build_graph(
             ggml_set_name(cur, "KQV_merged_contiguous");
 
             // projection (no bias)
-            cur = ggml_mul_mat(ctx0,
+            cur = llama_lora_mul_mat(ctx0, lctx,
                     model.layers[il].wo,
                     cur);
             offload_func(cur);
@@ -1700,13 +1749,13 @@ static struct ggml_cgraph * llama_build_graph(
                 ggml_set_name(cur, "ffn_norm");
             }
 
-            struct ggml_tensor * tmp = ggml_mul_mat(ctx0,
+            struct ggml_tensor * tmp = llama_lora_mul_mat(ctx0, lctx,
                     model.layers[il].w3,
                     cur);
             offload_func(tmp);
             ggml_set_name(tmp, "result_w3");
 
-            cur = ggml_mul_mat(ctx0,
+            cur = llama_lora_mul_mat(ctx0, lctx,
                     model.layers[il].w1,
                     cur);
             offload_func(cur);
@@ -1721,7 +1770,7 @@ static struct ggml_cgraph * llama_build_graph(
             offload_func(cur);
             ggml_set_name(cur, "silu_x_result_w3");
 
-            cur = ggml_mul_mat(ctx0,
+            cur = llama_lora_mul_mat(ctx0, lctx,
                     model.layers[il].w2,
                     cur);
             offload_func(cur);
@@ -3322,6 +3371,68 @@ void llama_free_model(struct llama_model * model) {
     delete model;
 }
 
+int llama_model_file_info_from_file(const char * path_model, struct llama_context_params params, struct llama_model_file_info * info) {
+    try {
+        // reads the header, vocab & tensor table, seeking past the tensors' data
+        llama_load_tensors_map tensors_map;
+        llama_file_loader loader(path_model, tensors_map);
+        const auto & hparams = loader.hparams;
+
+        if (params.n_gqa <= 0 || hparams.n_head % params.n_gqa != 0) {
+            throw std::runtime_error(format("n_gqa = %d doesn't divide n_head = %u", params.n_gqa, hparams.n_head));
+        }
+
+        auto ff = tensors_map.name_to_idx.find("layers.0.feed_forward.w1.weight");
+        if (ff == tensors_map.name_to_idx.end() || tensors_map.tensors[ff->second].ne.size() != 2) {
+            throw std::runtime_error("tensor 'layers.0.feed_forward.w1.weight' is missing from model");
+        }
+
+        memset(info, 0, sizeof(*info));
+        snprintf(info->format, sizeof(info->format), "%s", llama_file_version_name(loader.file_version));
+        snprintf(info->ftype,  sizeof(info->ftype),  "%s", llama_ftype_name(hparams.ftype));
+        info->n_vocab   = hparams.n_vocab;
+        info->n_embd    = hparams.n_embd;
+        info->n_head    = hparams.n_head;
+        info->n_head_kv = hparams.n_head / params.n_gqa;
+        info->n_layer   = hparams.n_layer;
+        info->n_ff      = tensors_map.tensors[ff->second].ne[1];
+
+        for (const llama_load_tensor & lt : tensors_map.tensors) {
+            uint64_t n_elements = 1;
+            for (uint32_t dim : lt.ne) {
+                n_elements *= dim;
+            }
+            info->n_params     += n_elements;
+            info->weights_size += lt.size;
+        }
+
+        const size_t n_ctx       = std::max(1, params.n_ctx);
+        const size_t n_embd_gqa  = hparams.n_embd / params.n_gqa;
+        info->kv_size = 2*n_embd_gqa*n_ctx*hparams.n_layer*(params.f16_kv ? sizeof(ggml_fp16_t) : sizeof(float));
+
+#ifdef LLAMA_USE_ALLOCATOR
+        // the allocator is sized by the worst-case graph (a full batch at the end of the context), whose peak is the
+        // widest of its activations: the attention scores across the context, the feed-forward's or the logits,
+        // along with a few of the embedding's width alive alongside them
+        const size_t n_tokens = std::min<size_t>(n_ctx, std::max(1, params.n_batch));
+        const size_t n_widest = std::max({ (size_t) hparams.n_head*n_ctx, (size_t) 3*info->n_ff, (size_t) hparams.n_vocab });
+        info->compute_size = ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead() +
+            n_tokens*(n_widest + 4*hparams.n_embd)*sizeof(float);
+#else
+        const e_model type = llama_model_type_for(hparams.n_layer, params.n_gqa);
+        info->compute_size = MEM_REQ_EVAL().at(type) + ggml_graph_overhead();
+#ifdef LLAMA_USE_SCRATCH
+        info->compute_size += MEM_REQ_SCRATCH0(n_ctx).at(type) + MEM_REQ_SCRATCH1().at(type);
+#endif
+#endif
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to read model info: %s\n", __func__, err.what());
+        return 1;
+    }
+
+    return 0;
+}
+
 struct llama_context * llama_new_context_with_model(
                  struct llama_model * model,
         struct llama_context_params   params) {
@@ -3354,6 +3465,7 @@ struct llama_context * llama_new_context_with_model(
 
     ctx->rng = std::mt19937(params.seed);
     ctx->logits_all = params.logits_all;
+    ctx->n_batch = params.n_batch;
 
     ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
 
@@ -3821,10 +3933,353 @@ int llama_model_apply_lora_from_file(const struct llama_model * model, const cha
     }
 }
 
+static llama_lora_adapter * llama_load_lora_adapter_internal(const struct llama_model & model, const char * path_lora) {
+    LLAMA_LOG_INFO("%s: loading lora adapter from '%s'\n", __func__, path_lora);
+
+    const int64_t t_start_lora_us = ggml_time_us();
+
+    auto fin = std::ifstream(path_lora, std::ios::binary);
+    if (!fin) {
+        throw std::runtime_error(format("failed to open '%s'", path_lora));
+    }
+
+    uint32_t magic;
+    uint32_t format_version;
+    fin.read((char *) &magic, sizeof(magic));
+    fin.read((char *) &format_version, sizeof(format_version));
+    if (magic != LLAMA_FILE_MAGIC_GGLA) {
+        throw std::runtime_error("bad file magic");
+    }
+    if (format_version != 1) {
+        throw std::runtime_error("unsupported file version");
+    }
+
+    int32_t lora_r;
+    int32_t lora_alpha;
+    fin.read((char *) &lora_r, sizeof(lora_r));
+    fin.read((char *) &lora_alpha, sizeof(lora_alpha));
+    if (!fin || lora_r <= 0) {
+        throw std::runtime_error("bad lora rank");
+    }
+    const float scaling = (float)lora_alpha / (float)lora_r;
+
+    // only the layers' matrices are multiplied through llama_lora_mul_mat
+    std::unordered_map<std::string, const struct ggml_tensor *> layer_tensors;
+    {
+        std::unordered_map<const struct ggml_tensor *, bool> is_layer_matrix;
+        for (const auto & layer : model.layers) {
+            for (const struct ggml_tensor * t : { layer.wq, layer.wk, layer.wv, layer.wo, layer.w1, layer.w2, layer.w3 }) {
+                is_layer_matrix[t] = true;
+            }
+        }
+        for (const auto & kv : model.tensors_by_name) {
+            if (is_layer_matrix.count(kv.second)) {
+                layer_tensors[kv.first] = kv.second;
+            }
+        }
+    }
+
+    // the file's loraA & loraB, as f32, by the name of the weight they apply to
+    struct lora_pair {
+        std::vector<float> a;
+        std::vector<float> b;
+        int64_t a_ne[2] = { 0, 0 };
+        int64_t b_ne[2] = { 0, 0 };
+    };
+    std::map<std::string, lora_pair> pairs;
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ftype;
+
+        fin.read(reinterpret_cast<char *>(&n_dims), sizeof(n_dims));
+        fin.read(reinterpret_cast<char *>(&length), sizeof(length));
+        fin.read(reinterpret_cast<char *>(&ftype),  sizeof(ftype));
+        if (fin.eof()) {
+            break;
+        }
+        if (n_dims != 2) {
+            throw std::runtime_error(format("unsupported tensor dimension %d", n_dims));
+        }
+        if (ftype != 0 && ftype != 1) {
+            throw std::runtime_error(format("invalid tensor data type '%d'", ftype));
+        }
+        if (length <= 0 || length > 1024) {
+            throw std::runtime_error(format("bad tensor name length %d", length));
+        }
+
+        int32_t ne[2] = { 1, 1 };
+        fin.read(reinterpret_cast<char *>(ne), sizeof(ne));
+
+        std::string name(length, '\0');
+        fin.read(&name[0], length);
+
+        const std::string lora_suffix = ".lora";
+        const size_t pos = name.rfind(lora_suffix);
+        const std::string lora_type = pos == std::string::npos ? "" : name.substr(pos + lora_suffix.length());
+        if (lora_type != "A" && lora_type != "B") {
+            throw std::runtime_error(format("'%s' is not a lora tensor", name.c_str()));
+        }
+
+        const std::string base_name = name.substr(0, pos);
+        if (!layer_tensors.count(base_name)) {
+            throw std::runtime_error(format("'%s' doesn't apply to one of the layers' matrices", name.c_str()));
+        }
+
+        const size_t n_elements = (size_t)ne[0] * ne[1];
+        std::vector<float> data(n_elements);
+        fin.seekg(((size_t)fin.tellg() + 31) & -32);
+        if (ftype == 0) {
+            fin.read((char *) data.data(), n_elements * sizeof(float));
+        } else {
+            std::vector<ggml_fp16_t> data_f16(n_elements);
+            fin.read((char *) data_f16.data(), n_elements * sizeof(ggml_fp16_t));
+            ggml_fp16_to_fp32_row(data_f16.data(), data.data(), n_elements);
+        }
+        if (!fin) {
+            throw std::runtime_error(format("unexpected end of file reading '%s'", name.c_str()));
+        }
+
+        auto & pair = pairs[base_name];
+        (lora_type == "A" ? pair.a : pair.b) = std::move(data);
+        int64_t * pair_ne = lora_type == "A" ? pair.a_ne : pair.b_ne;
+        pair_ne[0] = ne[0];
+        pair_ne[1] = ne[1];
+    }
+
+    size_t ctx_size = 0;
+    for (const auto & kv : pairs) {
+        const auto & pair = kv.second;
+        const struct ggml_tensor * w = layer_tensors[kv.first];
+        if (pair.a.empty() || pair.b.empty()) {
+            throw std::runtime_error(format("'%s' has only one of loraA & loraB", kv.first.c_str()));
+        }
+        if (pair.a_ne[0] != lora_r || pair.b_ne[0] != lora_r || w->ne[0] != pair.a_ne[1] || w->ne[1] != pair.b_ne[1]) {
+            throw std::runtime_error(format("incompatible tensor dimensions for '%s';"
+                                            " are you sure that this adapter is for this model?", kv.first.c_str()));
+        }
+        ctx_size += 2*ggml_tensor_overhead() + (pair.a.size() + pair.b.size())*sizeof(float);
+    }
+
+    std::unique_ptr<llama_lora_adapter> adapter(new llama_lora_adapter);
+    adapter->model = &model;
+    adapter->buf.resize(ctx_size + ggml_tensor_overhead());
+
+    struct ggml_init_params params;
+    params.mem_size   = adapter->buf.size;
+    params.mem_buffer = adapter->buf.addr;
+    params.no_alloc   = false;
+    adapter->ctx = ggml_init(params);
+
+    for (const auto & kv : pairs) {
+        const auto & pair = kv.second;
+        const int64_t n_in  = pair.a_ne[1];
+        const int64_t n_out = pair.b_ne[1];
+
+        llama_lora_adapter::llama_lora_weights weights;
+        weights.a = ggml_new_tensor_2d(adapter->ctx, GGML_TYPE_F32, n_in, lora_r);
+        weights.b = ggml_new_tensor_2d(adapter->ctx, GGML_TYPE_F32, lora_r, n_out);
+        ggml_set_name(weights.a, (kv.first + ".loraA").c_str());
+        ggml_set_name(weights.b, (kv.first + ".loraB").c_str());
+
+        float * a = (float *) weights.a->data;
+        for (int64_t r = 0; r < lora_r; r++) {
+            for (int64_t i = 0; i < n_in; i++) {
+                a[r*n_in + i] = pair.a[i*lora_r + r];
+            }
+        }
+        float * b = (float *) weights.b->data;
+        for (size_t i = 0; i < pair.b.size(); i++) {
+            b[i] = pair.b[i] * scaling;
+        }
+
+        adapter->weights[layer_tensors[kv.first]] = weights;
+    }
+
+    LLAMA_LOG_INFO("%s: r = %d, alpha = %d, scaling = %.2f, %zu tensors, %.2f MB (%.2f ms)\n", __func__,
+                   lora_r, lora_alpha, scaling, pairs.size(), ctx_size / 1024.0 / 1024.0,
+                   (ggml_time_us() - t_start_lora_us) / 1000.0);
+
+    return adapter.release();
+}
+
+struct llama_lora_adapter * llama_load_lora_adapter_from_file(const struct llama_model * model, const char * path_lora) {
+    try {
+        return llama_load_lora_adapter_internal(*model, path_lora);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: failed to load lora adapter: %s\n", __func__, err.what());
+        return NULL;
+    }
+}
+
+void llama_free_lora_adapter(struct llama_lora_adapter * adapter) {
+    delete adapter;
+}
+
+// builds the graph of a one-token evaluation without any adapter, whose node & leaf counts don't depend on the batch
+static void llama_count_graph(struct llama_context * ctx, int * n_nodes, int * n_leafs) {
+    const llama_lora_adapter * lora = ctx->lora;
+    ctx->lora = NULL;
+
+#ifdef LLAMA_USE_ALLOCATOR
+    ggml_allocr * alloc = ctx->alloc;
+    ctx->alloc = ggml_allocr_new_measure(32);
+#endif
+
+    llama_token token = llama_token_bos();
+    ggml_cgraph * gf = llama_build_graph(*ctx, &token, NULL, 1, 0);
+    *n_nodes = gf->n_nodes;
+    *n_leafs = gf->n_leafs;
+
+#ifdef LLAMA_USE_ALLOCATOR
+    ggml_allocr_free(ctx->alloc);
+    ctx->alloc = alloc;
+#endif
+
+    ctx->lora = lora;
+}
+
+int llama_set_lora_adapter(struct llama_context * ctx, const struct llama_lora_adapter * adapter) {
+    if (adapter == ctx->lora) {
+        return 0;
+    }
+    if (adapter && adapter->model != &ctx->model) {
+        LLAMA_LOG_ERROR("%s: the lora adapter was loaded for another model\n", __func__);
+        return 1;
+    }
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_METAL)
+    if (adapter && ctx->model.n_gpu_layers > 0) {
+        LLAMA_LOG_ERROR("%s: unmerged lora adapters can't be used with offloaded layers\n", __func__);
+        return 1;
+    }
+#endif
+
+    if (adapter) {
+        // each adapted product adds 3 nodes (A*x, B*(A*x) & the sum) & 2 leafs (A & B) to the graph, which can't
+        // hold more than GGML_MAX_NODES of either
+        int n_nodes = 0;
+        int n_leafs = 0;
+        llama_count_graph(ctx, &n_nodes, &n_leafs);
+        const int n_adapted = (int) adapter->weights.size();
+        if (n_nodes + 3*n_adapted > GGML_MAX_NODES || n_leafs + 2*n_adapted > GGML_MAX_NODES) {
+            LLAMA_LOG_ERROR("%s: the lora adapter's %d products would grow the graph of %d nodes beyond GGML_MAX_NODES (%d)\n",
+                    __func__, n_adapted, n_nodes, GGML_MAX_NODES);
+            return 1;
+        }
+    }
+
+    ctx->lora = adapter;
+
+#ifdef LLAMA_USE_ALLOCATOR
+    if (adapter) {
+        // the adapter's products need room in the compute buffer beyond what the model's own graph was measured for
+        static const size_t tensor_alignment = 32;
+        const auto & hparams = ctx->model.hparams;
+
+        ggml_allocr * alloc = ctx->alloc;
+        ctx->alloc = ggml_allocr_new_measure(tensor_alignment);
+
+        int n_tokens = std::min((int)hparams.n_ctx, ctx->n_batch);
+        int n_past = hparams.n_ctx - n_tokens;
+        llama_token token = llama_token_bos();
+        ggml_cgraph * gf = llama_build_graph(*ctx, &token, NULL, n_tokens, n_past);
+        size_t alloc_size = ggml_allocr_alloc_graph(ctx->alloc, gf) + tensor_alignment;
+
+        ggml_allocr_free(ctx->alloc);
+        ctx->alloc = alloc;
+
+        if (alloc_size > ctx->buf_alloc.size) {
+            LLAMA_LOG_INFO("%s: compute buffer grows to %7.2f MB for the lora adapter\n", __func__,
+                           (ctx->buf_compute.size + alloc_size) / 1024.0 / 1024.0);
+            ggml_allocr_free(ctx->alloc);
+            ctx->buf_alloc.resize(alloc_size);
+            ctx->alloc = ggml_allocr_new(ctx->buf_alloc.addr, ctx->buf_alloc.size, tensor_alignment);
+        }
+    }
+#else
+    {
+        // without the allocator, the adapter's products are allocated from the compute buffer along with the model's
+        // own, for as many tokens as a batch may hold
+        const size_t n_tokens = std::min((int) ctx->model.hparams.n_ctx, ctx->n_batch);
+        size_t lora_size = 0;
+        if (adapter) {
+            for (const auto & it : adapter->weights) {
+                const int64_t r     = it.second.a->ne[1];
+                const int64_t n_out = it.second.b->ne[1];
+                lora_size += 3*ggml_tensor_overhead() + n_tokens*(r + 2*n_out)*sizeof(float);
+            }
+        }
+        ctx->buf_compute.resize(MEM_REQ_EVAL().at(ctx->model.type) + ggml_graph_overhead() + lora_size);
+    }
+#endif
+
+    return 0;
+}
+
 int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
     return ctx->kv_self.n;
 }
 
+// The CPU memory of a context's KV cache & compute buffers, as (address, size) ranges: for the KV cache, only its
+// tensors' data, as the ggml context holding the tensors themselves shares its buffer. Empty when they may be shared
+// with a GPU.
+static std::vector<std::pair<void *, size_t>> llama_context_buffers(const struct llama_context * ctx) {
+    std::vector<std::pair<void *, size_t>> buffers;
+#if !defined(GGML_USE_CUBLAS) && !defined(GGML_USE_METAL)
+    for (const struct ggml_tensor * t : { ctx->kv_self.k, ctx->kv_self.v }) {
+        if (t) {
+            buffers.emplace_back(t->data, ggml_nbytes(t));
+        }
+    }
+    buffers.emplace_back(const_cast<uint8_t *>(ctx->work_buffer.data()), ctx->work_buffer.size());
+    buffers.emplace_back(ctx->buf_compute.addr, ctx->buf_compute.size);
+#ifdef LLAMA_USE_ALLOCATOR
+    buffers.emplace_back(ctx->buf_alloc.addr, ctx->buf_alloc.size);
+#endif
+#ifdef LLAMA_USE_SCRATCH
+    for (const auto & buf : ctx->buf_scratch) {
+        buffers.emplace_back(buf.addr, buf.size);
+    }
+#endif
+#else
+    (void) ctx;
+#endif
+    return buffers;
+}
+
+size_t llama_get_resident_size(const struct llama_context * ctx) {
+    size_t resident = 0;
+    for (const auto & buf : llama_context_buffers(ctx)) {
+        resident += llama_resident_size(buf.first, buf.second);
+    }
+    return resident;
+}
+
+size_t llama_release_memory(struct llama_context * ctx) {
+    size_t released = 0;
+    for (const auto & buf : llama_context_buffers(ctx)) {
+        released += llama_release_pages(buf.first, buf.second);
+    }
+    ctx->kv_self.n = 0;
+    return released;
+}
+
+size_t llama_model_get_resident_size(const struct llama_model * model) {
+    if (model->mapping) {
+        return llama_resident_size(model->mapping->addr, model->mapping->size);
+    }
+    return llama_resident_size(model->buf.addr, model->buf.size);
+}
+
+size_t llama_model_release_memory(struct llama_model * model) {
+    // weights read into memory rather than mapped couldn't be read back
+    if (!model->mapping || model->mlock_mmap.size) {
+        return 0;
+    }
+    return llama_release_pages(model->mapping->addr, model->mapping->size);
+}
+
 #define LLAMA_MAX_RNG_STATE (64*1024)
 
 void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed) {
@@ -4089,6 +4544,72 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
     return nread;
 }
 
+bool llama_kv_rows_supported(const struct llama_context * ctx) {
+    return ctx->kv_self.k->backend == GGML_BACKEND_CPU && ctx->kv_self.v->backend == GGML_BACKEND_CPU;
+}
+
+size_t llama_get_kv_rows_size(const struct llama_context * ctx, int n_tokens) {
+    const auto & hparams = ctx->model.hparams;
+
+    return 2u*ggml_element_size(ctx->kv_self.k)*hparams.n_layer*hparams.n_embd_gqa()*n_tokens;
+}
+
+// the K rows of each layer are laid out in the cache (& copied) as n_tokens x n_embd, & the V rows, which the cache
+// holds transposed, as n_embd x n_tokens, so a layer's rows are copied with one memcpy for K & n_embd for V
+void llama_copy_kv_rows(struct llama_context * ctx, uint8_t * dst, int p0, int n_tokens) {
+    const auto & kv_self  = ctx->kv_self;
+    const auto & hparams  = ctx->model.hparams;
+    const size_t n_layer  = hparams.n_layer;
+    const size_t n_embd   = hparams.n_embd_gqa();
+    const size_t n_ctx    = hparams.n_ctx;
+    const size_t elt_size = ggml_element_size(kv_self.k);
+
+    LLAMA_ASSERT(kv_self.k->backend == GGML_BACKEND_CPU && kv_self.v->backend == GGML_BACKEND_CPU);
+    LLAMA_ASSERT(p0 >= 0 && n_tokens >= 0 && (size_t) (p0 + n_tokens) <= n_ctx);
+
+    const uint8_t * k = (const uint8_t *) kv_self.k->data;
+    const uint8_t * v = (const uint8_t *) kv_self.v->data;
+
+    for (size_t il = 0; il < n_layer; il++) {
+        memcpy(dst, k + elt_size*n_embd*(il*n_ctx + p0), elt_size*n_embd*n_tokens);
+        dst += elt_size*n_embd*n_tokens;
+    }
+    for (size_t il = 0; il < n_layer; il++) {
+        for (size_t i = 0; i < n_embd; i++) {
+            memcpy(dst, v + elt_size*((il*n_embd + i)*n_ctx + p0), elt_size*n_tokens);
+            dst += elt_size*n_tokens;
+        }
+    }
+}
+
+void llama_set_kv_rows(struct llama_context * ctx, const uint8_t * src, int n_src, int i0, int p0, int n_tokens) {
+    auto & kv_self        = ctx->kv_self;
+    const auto & hparams  = ctx->model.hparams;
+    const size_t n_layer  = hparams.n_layer;
+    const size_t n_embd   = hparams.n_embd_gqa();
+    const size_t n_ctx    = hparams.n_ctx;
+    const size_t elt_size = ggml_element_size(kv_self.k);
+
+    LLAMA_ASSERT(kv_self.k->backend == GGML_BACKEND_CPU && kv_self.v->backend == GGML_BACKEND_CPU);
+    LLAMA_ASSERT(i0 >= 0 && n_tokens >= 0 && i0 + n_tokens <= n_src);
+    LLAMA_ASSERT(p0 >= 0 && (size_t) (p0 + n_tokens) <= n_ctx);
+
+    uint8_t * k = (uint8_t *) kv_self.k->data;
+    uint8_t * v = (uint8_t *) kv_self.v->data;
+
+    for (size_t il = 0; il < n_layer; il++) {
+        memcpy(k + elt_size*n_embd*(il*n_ctx + p0), src + elt_size*n_embd*(il*n_src + i0), elt_size*n_embd*n_tokens);
+    }
+    src += elt_size*n_embd*n_layer*n_src;
+    for (size_t il = 0; il < n_layer; il++) {
+        for (size_t i = 0; i < n_embd; i++) {
+            memcpy(v + elt_size*((il*n_embd + i)*n_ctx + p0), src + elt_size*((il*n_embd + i)*n_src + i0), elt_size*n_tokens);
+        }
+    }
+
+    kv_self.n = p0 + n_tokens;
+}
+
 static bool llama_load_session_file_internal(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     llama_file file(path_session, "rb");
 
@@ -70,6 +70,7 @@ extern "C" {
 
     struct llama_model;
     struct llama_context;
+    struct llama_lora_adapter;
 
     typedef int llama_token;
 
@@ -161,6 +162,24 @@ extern "C" {
         bool quantize_output_tensor; // quantize output.weight
     } llama_model_quantize_params;
 
+    // what a model file holds & the memory running it takes, as read from its header & tensor table
+    typedef struct llama_model_file_info {
+        char     format[128];  // the file format, e.g. "ggjt v3 (latest)"
+        char     ftype[64];    // the weights' quantization, e.g. "mostly Q4_0"
+        uint32_t n_vocab;
+        uint32_t n_embd;
+        uint32_t n_head;
+        uint32_t n_head_kv;    // per the n_gqa the info was read with
+        uint32_t n_layer;
+        uint32_t n_ff;
+        uint64_t n_params;     // elements across all tensors
+
+        // bytes, for the n_ctx, n_batch & f16_kv the info was read with
+        size_t   weights_size; // the tensors' data
+        size_t   kv_size;      // one context's KV cache
+        size_t   compute_size; // one context's compute (or scratch) buffers; an estimate
+    } llama_model_file_info;
+
     // grammar types
     struct llama_grammar;
 
@@ -237,6 +256,14 @@ extern "C" {
 
     LLAMA_API void llama_free_model(struct llama_model * model);
 
+    // Reads the hyperparameters & tensor table of the model at path_model, without loading its weights, & the memory
+    // the model & each context of it would take with params
+    // Returns 0 on success
+    LLAMA_API int llama_model_file_info_from_file(
+                             const char * path_model,
+            struct llama_context_params   params,
+           struct llama_model_file_info * info);
+
     LLAMA_API struct llama_context * llama_new_context_with_model(
                      struct llama_model * model,
             struct llama_context_params   params);
@@ -277,12 +304,43 @@ extern "C" {
                       const char * path_base_model,
                              int   n_threads);
 
+    // Load a LoRA adapter for a model without merging it into the model's weights. Instead, a context the adapter is
+    // set on adds its low-rank products to those of the weights it applies to as it evaluates, so contexts of one
+    // model can each use a different adapter. Only adapters for the layers' matrices are supported
+    // Returns NULL on failure
+    LLAMA_API struct llama_lora_adapter * llama_load_lora_adapter_from_file(
+            const struct llama_model * model,
+                          const char * path_lora);
+
+    // Frees the adapter, which no context may still have set
+    LLAMA_API void llama_free_lora_adapter(struct llama_lora_adapter * adapter);
+
+    // Sets the adapter the context evaluates with, or none if NULL. The KV cache holds what was evaluated with the
+    // previous one, so it shouldn't be reused across a change
+    // Returns 0 on success, or non-zero (leaving the adapter set before) if the adapter's products would grow the
+    // graph beyond GGML_MAX_NODES
+    LLAMA_API int llama_set_lora_adapter(
+            struct llama_context * ctx,
+            const struct llama_lora_adapter * adapter);
+
     // Returns the number of tokens in the KV cache
     LLAMA_API int llama_get_kv_cache_token_count(const struct llama_context * ctx);
 
     // Sets the current rng seed.
     LLAMA_API void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed);
 
+    // Returns the bytes of the context's KV cache & compute buffers that are resident in memory
+    LLAMA_API size_t llama_get_resident_size(const struct llama_context * ctx);
+
+    // Gives the memory of the context's KV cache & compute buffers back to the OS, leaving them allocated, to be
+    // faulted back in by the next evaluation. Empties the KV cache. Returns the bytes released
+    LLAMA_API size_t llama_release_memory(struct llama_context * ctx);
+
+    // As above, for the model's weights. Only memory-mapped, unlocked weights are released, to be read back from the
+    // file (or page cache) as they're next used
+    LLAMA_API size_t llama_model_get_resident_size(const struct llama_model * model);
+    LLAMA_API size_t llama_model_release_memory(struct llama_model * model);
+
     // Returns the maximum size in bytes of the state (rng, logits, embedding
     // and kv_cache) - will often be smaller after compacting tokens
     LLAMA_API size_t llama_get_state_size(const struct llama_context * ctx);
@@ -296,6 +354,22 @@ extern "C" {
     // Returns the number of bytes read
     LLAMA_API size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src);
 
+    // Returns whether the KV cache is in CPU memory, which llama_copy_kv_rows & llama_set_kv_rows need;
+    // it isn't when its layers are offloaded to a GPU
+    LLAMA_API bool llama_kv_rows_supported(const struct llama_context * ctx);
+
+    // Returns the size in bytes of the KV cache rows of n_tokens tokens, as llama_copy_kv_rows copies them
+    LLAMA_API size_t llama_get_kv_rows_size(const struct llama_context * ctx, int n_tokens);
+
+    // Copies the KV cache rows of the n_tokens tokens at positions [p0, p0 + n_tokens) to dst, which
+    // needs llama_get_kv_rows_size(ctx, n_tokens) bytes. The rows are only valid for the same tokens
+    // at the same positions, preceded by the same tokens
+    LLAMA_API void llama_copy_kv_rows(struct llama_context * ctx, uint8_t * dst, int p0, int n_tokens);
+
+    // Sets the KV cache rows at positions [p0, p0 + n_tokens) to those of tokens [i0, i0 + n_tokens) in
+    // src, which llama_copy_kv_rows copied for n_src tokens, & the KV cache token count to p0 + n_tokens
+    LLAMA_API void llama_set_kv_rows(struct llama_context * ctx, const uint8_t * src, int n_src, int i0, int p0, int n_tokens);
+
     // Save/load session file
     LLAMA_API bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
     LLAMA_API bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count);
@@ -0,0 +1,82 @@
+#include "llama.h"
+#include "tiny-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static std::vector<float> logits_of(llama_context * ctx) {
+    const float * logits = llama_get_logits(ctx);
+    return std::vector<float>(logits, logits + llama_n_vocab(ctx));
+}
+
+static void assert_logits_near(const std::vector<float> & a, const std::vector<float> & b) {
+    assert(a.size() == b.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        assert(std::fabs(a[i] - b[i]) < 1e-3f);
+    }
+}
+
+int main(void) {
+    const char * path = "test-kv-rows.bin";
+    assert(tiny_model_write(path));
+
+    llama_backend_init(false);
+
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx = 64;
+    params.seed  = 1;
+    llama_model * model = llama_load_model_from_file(path, params);
+    assert(model != NULL);
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    llama_context * ctx_restored = llama_new_context_with_model(model, params);
+    assert(llama_kv_rows_supported(ctx));
+
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < 24; i++) {
+        tokens.push_back(3 + (i*37) % 250);
+    }
+
+    // the reference: the whole sequence evaluated from scratch
+    assert(llama_eval(ctx, tokens.data(), tokens.size(), 0, 1) == 0);
+    const std::vector<float> expected = logits_of(ctx);
+
+    std::vector<uint8_t> rows(llama_get_kv_rows_size(ctx, 20));
+    assert(rows.size() > 0 && llama_get_kv_rows_size(ctx, 40) == 2*rows.size());
+    llama_copy_kv_rows(ctx, rows.data(), 0, 20);
+
+    // rows that a restore must overwrite
+    std::vector<llama_token> junk(tokens.size(), 5);
+    assert(llama_eval(ctx_restored, junk.data(), junk.size(), 0, 1) == 0);
+
+    // restored in two parts, the second a sub-range starting partway into the copied rows, & the rest evaluated
+    llama_set_kv_rows(ctx_restored, rows.data(), 20, 0, 0, 7);
+    llama_set_kv_rows(ctx_restored, rows.data(), 20, 7, 7, 11);
+    assert(llama_get_kv_cache_token_count(ctx_restored) == 18);
+    assert(llama_eval(ctx_restored, tokens.data() + 18, tokens.size() - 18, 18, 1) == 0);
+    assert_logits_near(logits_of(ctx_restored), expected);
+
+    // rows copied from the middle of the sequence, restored at the same positions
+    std::vector<uint8_t> middle(llama_get_kv_rows_size(ctx, 10));
+    llama_copy_kv_rows(ctx, middle.data(), 10, 10);
+    assert(llama_eval(ctx_restored, junk.data(), junk.size(), 0, 1) == 0);
+    llama_set_kv_rows(ctx_restored, rows.data(), 20, 0, 0, 10);
+    llama_set_kv_rows(ctx_restored, middle.data(), 10, 0, 10, 3);
+    llama_set_kv_rows(ctx_restored, middle.data(), 10, 3, 13, 7);
+    assert(llama_get_kv_cache_token_count(ctx_restored) == 20);
+    assert(llama_eval(ctx_restored, tokens.data() + 20, tokens.size() - 20, 20, 1) == 0);
+    assert_logits_near(logits_of(ctx_restored), expected);
+
+    llama_free(ctx_restored);
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+    std::remove(path);
+
+    return 0;
+}
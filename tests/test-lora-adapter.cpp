@@ -0,0 +1,128 @@
+#include "llama.h"
+#include "tiny-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static std::vector<float> eval_logits(llama_context * ctx, const std::vector<llama_token> & tokens) {
+    assert(llama_eval(ctx, tokens.data(), tokens.size(), 0, 1) == 0);
+    const float * logits = llama_get_logits(ctx);
+    return std::vector<float>(logits, logits + llama_n_vocab(ctx));
+}
+
+static float max_diff(const std::vector<float> & a, const std::vector<float> & b) {
+    assert(a.size() == b.size());
+    float diff = 0.0f;
+    for (size_t i = 0; i < a.size(); i++) {
+        diff = std::max(diff, std::fabs(a[i] - b[i]));
+    }
+    return diff;
+}
+
+// an adapter added to the products in the graph must give what merging it into the weights does, & setting none
+// must give the base model back
+static void test_adapter(const char * path_model, const char * path_lora) {
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx = 64;
+    params.seed  = 1;
+
+    llama_model * model = llama_load_model_from_file(path_model, params);
+    assert(model != NULL);
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    assert(ctx != NULL);
+
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < 16; i++) {
+        tokens.push_back(3 + (i*37) % 250);
+    }
+    const std::vector<float> base = eval_logits(ctx, tokens);
+
+    assert(llama_load_lora_adapter_from_file(model, "test-lora-adapter-missing.bin") == NULL);
+    llama_lora_adapter * adapter = llama_load_lora_adapter_from_file(model, path_lora);
+    assert(adapter != NULL);
+    assert(llama_set_lora_adapter(ctx, adapter) == 0);
+    const std::vector<float> adapted = eval_logits(ctx, tokens);
+    printf("%s: adapted logits differ from the base's by up to %f\n", __func__, max_diff(adapted, base));
+    assert(max_diff(adapted, base) > 1e-2f);
+
+    // merging writes to the weights, which can't be mapped read-only from the file
+    llama_context_params merged_params = params;
+    merged_params.use_mmap = false;
+    llama_model * merged_model = llama_load_model_from_file(path_model, merged_params);
+    assert(merged_model != NULL);
+    assert(llama_model_apply_lora_from_file(merged_model, path_lora, NULL, 1) == 0);
+    llama_context * merged_ctx = llama_new_context_with_model(merged_model, merged_params);
+    const std::vector<float> merged = eval_logits(merged_ctx, tokens);
+    printf("%s: adapted logits differ from the merged model's by up to %f\n", __func__, max_diff(adapted, merged));
+    assert(max_diff(adapted, merged) < 1e-3f);
+
+    // one loaded for another model isn't accepted
+    llama_lora_adapter * other = llama_load_lora_adapter_from_file(merged_model, path_lora);
+    assert(other != NULL);
+    assert(llama_set_lora_adapter(ctx, other) != 0);
+
+    assert(llama_set_lora_adapter(ctx, NULL) == 0);
+    assert(max_diff(eval_logits(ctx, tokens), base) < 1e-5f);
+
+    llama_free(merged_ctx);
+    llama_free_lora_adapter(other);
+    llama_free_model(merged_model);
+    llama_free(ctx);
+    llama_free_lora_adapter(adapter);
+    llama_free_model(model);
+}
+
+// an adapter whose products wouldn't fit in the graph is refused, & the context goes on without it
+static void test_graph_overflow(const char * path_model, const char * path_lora) {
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx   = 16;
+    params.n_batch = 16;
+
+    llama_model * model = llama_load_model_from_file(path_model, params);
+    assert(model != NULL);
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    assert(ctx != NULL);
+    llama_lora_adapter * adapter = llama_load_lora_adapter_from_file(model, path_lora);
+    assert(adapter != NULL);
+
+    assert(llama_set_lora_adapter(ctx, adapter) != 0);
+    const llama_token bos = llama_token_bos();
+    assert(llama_eval(ctx, &bos, 1, 0, 1) == 0);
+
+    llama_free(ctx);
+    llama_free_lora_adapter(adapter);
+    llama_free_model(model);
+}
+
+int main(void) {
+    llama_backend_init(false);
+
+    tiny_model_params hp;
+    assert(tiny_model_write("test-lora-adapter-model.bin", hp));
+    assert(tiny_lora_write("test-lora-adapter-lora.bin", hp, 4, 8, 2));
+    test_adapter("test-lora-adapter-model.bin", "test-lora-adapter-lora.bin");
+
+    // deep enough that its own graph fits in GGML_MAX_NODES but not with 3 more nodes for each of its 7 matrices a
+    // layer
+    tiny_model_params deep;
+    deep.n_embd  = 32;
+    deep.n_head  = 2;
+    deep.n_layer = 80;
+    assert(tiny_model_write("test-lora-adapter-deep.bin", deep));
+    assert(tiny_lora_write("test-lora-adapter-deep-lora.bin", deep, 2, 2, 3));
+    test_graph_overflow("test-lora-adapter-deep.bin", "test-lora-adapter-deep-lora.bin");
+
+    for (const char * path : { "test-lora-adapter-model.bin", "test-lora-adapter-lora.bin",
+                               "test-lora-adapter-deep.bin", "test-lora-adapter-deep-lora.bin" }) {
+        std::remove(path);
+    }
+    llama_backend_free();
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "llama.h"
+#include "tiny-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+int main(void) {
+    const char * path = "test-model-file-info.bin";
+    tiny_model_params hp;
+    assert(tiny_model_write(path, hp));
+
+    llama_backend_init(false);
+
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx   = 128;
+    params.n_batch = 32;
+
+    llama_model_file_info info;
+    assert(llama_model_file_info_from_file(path, params, &info) == 0);
+    printf("format %s, ftype %s, %llu params: weights %zu, KV %zu, compute %zu bytes\n", info.format, info.ftype,
+           (unsigned long long) info.n_params, info.weights_size, info.kv_size, info.compute_size);
+
+    const uint64_t n_ff = tiny_model_n_ff(hp);
+    const uint64_t n_layer_params = 2*hp.n_embd + 4*hp.n_embd*hp.n_embd + 3*hp.n_embd*n_ff;
+    assert(strncmp(info.format, "ggjt v3", 7) == 0);
+    assert(strcmp(info.ftype, "all F32") == 0);
+    assert(info.n_vocab == hp.n_vocab && info.n_embd == hp.n_embd && info.n_head == hp.n_head);
+    assert(info.n_head_kv == hp.n_head && info.n_layer == hp.n_layer && info.n_ff == n_ff);
+    assert(info.n_params == 2*hp.n_vocab*hp.n_embd + hp.n_embd + hp.n_layer*n_layer_params);
+    assert(info.weights_size == info.n_params*sizeof(float));
+    assert(info.kv_size == 2*hp.n_embd*params.n_ctx*hp.n_layer*sizeof(ggml_fp16_t));
+    assert(info.compute_size > 0);
+
+    // what is read from the header matches what loading the model finds
+    llama_model * model = llama_load_model_from_file(path, params);
+    assert(model != NULL);
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    assert(ctx != NULL);
+    assert(llama_n_vocab(ctx) == (int) info.n_vocab && llama_n_embd(ctx) == (int) info.n_embd);
+    assert(llama_get_kv_rows_size(ctx, params.n_ctx) == info.kv_size);
+    std::vector<llama_token> tokens(params.n_batch, 5);
+    assert(llama_eval(ctx, tokens.data(), tokens.size(), params.n_ctx - params.n_batch, 1) == 0);
+    // the worst case the compute estimate is for, which must not touch more than it allows
+    printf("resident after a full batch at the end of the context: %zu bytes\n", llama_get_resident_size(ctx));
+    assert(llama_get_resident_size(ctx) <= info.kv_size + info.compute_size);
+    llama_free(ctx);
+    llama_free_model(model);
+
+    // the KV cache halves with the heads shared by grouped-query attention, & doubles again with f32 keys & values
+    llama_context_params gqa_params = params;
+    gqa_params.n_gqa  = 2;
+    gqa_params.f16_kv = false;
+    llama_model_file_info gqa_info;
+    assert(llama_model_file_info_from_file(path, gqa_params, &gqa_info) == 0);
+    assert(gqa_info.n_head_kv == hp.n_head/2);
+    assert(gqa_info.kv_size == info.kv_size);
+    assert(gqa_info.weights_size == info.weights_size);
+
+    gqa_params.n_gqa = 3;
+    assert(llama_model_file_info_from_file(path, gqa_params, &gqa_info) != 0);
+    assert(llama_model_file_info_from_file("test-model-file-info-missing.bin", params, &gqa_info) != 0);
+
+    llama_backend_free();
+    std::remove(path);
+
+    return 0;
+}
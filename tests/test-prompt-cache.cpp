@@ -0,0 +1,155 @@
+#include "llama.h"
+#include "tiny-model.h"
+#include "examples/common.cpp"
+#include "examples/prompt-cache.cpp"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const char * dir = "test-prompt-cache.d";
+
+static std::vector<llama_token> tokens_of(const std::vector<llama_token> & prefix, int n, int seed) {
+    std::vector<llama_token> tokens = prefix;
+    for (int i = 0; i < n; i++) {
+        tokens.push_back(3 + (i*37 + seed*101) % 250);
+    }
+    return tokens;
+}
+
+static std::vector<float> eval_logits(llama_context * ctx, const std::vector<llama_token> & tokens, int n_past) {
+    assert(llama_eval(ctx, tokens.data() + n_past, tokens.size() - n_past, n_past, 1) == 0);
+    const float * logits = llama_get_logits(ctx);
+    return std::vector<float>(logits, logits + llama_n_vocab(ctx));
+}
+
+static void save_entry(const prompt_cache::store & cache, llama_context * ctx, const std::vector<llama_token> & tokens) {
+    eval_logits(ctx, tokens, 0);
+    assert(prompt_cache::save(cache, ctx, tokens));
+    // file times are only as fine as the kernel's clock tick, & tell which entry was used last
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+}
+
+// the entry restored for `prompt`, or none; the rest of the prompt evaluated after it must give the logits of the
+// whole prompt evaluated from scratch
+static std::vector<llama_token> load_entry(const prompt_cache::store & cache, llama_context * ctx, llama_context * ctx_fresh,
+                                           const std::vector<llama_token> & prompt) {
+    std::vector<llama_token> restored;
+    if (!prompt_cache::load(cache, ctx, prompt, restored)) {
+        return {};
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    size_t n_past = 0;
+    while (n_past < restored.size() && n_past < prompt.size() - 1 && restored[n_past] == prompt[n_past]) {
+        n_past++;
+    }
+    const std::vector<float> logits   = eval_logits(ctx, prompt, n_past);
+    const std::vector<float> expected = eval_logits(ctx_fresh, prompt, 0);
+    for (size_t i = 0; i < logits.size(); i++) {
+        assert(std::fabs(logits[i] - expected[i]) < 1e-3f);
+    }
+    return restored;
+}
+
+static size_t n_entries(const prompt_cache::store & cache) {
+    return prompt_cache::list_entries(cache.dir).size();
+}
+
+static bool has_entry(const prompt_cache::store & cache, const std::vector<llama_token> & tokens) {
+    FILE * f = fopen(prompt_cache::entry_path(cache, tokens).c_str(), "rb");
+    if (f != NULL) {
+        fclose(f);
+    }
+    return f != NULL;
+}
+
+int main(void) {
+    const char * path = "test-prompt-cache.bin";
+    assert(tiny_model_write(path));
+
+    llama_backend_init(false);
+
+    gpt_params params;
+    params.model                 = path;
+    params.path_prompt_cache_dir = dir;
+
+    llama_context_params lparams = llama_context_default_params();
+    lparams.n_ctx = 64;
+    lparams.seed  = 1;
+    llama_model * model = llama_load_model_from_file(path, lparams);
+    assert(model != NULL);
+    llama_context * ctx       = llama_new_context_with_model(model, lparams);
+    llama_context * ctx_fresh = llama_new_context_with_model(model, lparams);
+
+    prompt_cache::store cache;
+    assert(prompt_cache::init(cache, params, ctx));
+    for (const prompt_cache::entry & e : prompt_cache::list_entries(dir)) {
+        std::remove(e.path.c_str());
+    }
+
+    const std::vector<llama_token> preamble = tokens_of({ llama_token_bos() }, 12, 0);
+    const std::vector<llama_token> a  = tokens_of(preamble, 8,  1);
+    const std::vector<llama_token> b  = tokens_of(preamble, 16, 2);
+    const std::vector<llama_token> ab = tokens_of(a, 8, 2);
+
+    // nothing to restore, & nothing sharing only the BOS token is restored
+    assert(load_entry(cache, ctx, ctx_fresh, a).empty());
+    save_entry(cache, ctx, a);
+    save_entry(cache, ctx, b);
+    assert(load_entry(cache, ctx, ctx_fresh, tokens_of({ llama_token_bos() }, 8, 3)).empty());
+
+    // the entry sharing the longest prefix, whether the prompt extends it or stops partway into it; of entries
+    // sharing as long a one, the smallest
+    assert(load_entry(cache, ctx, ctx_fresh, tokens_of(a, 4, 5)) == a);
+    assert(load_entry(cache, ctx, ctx_fresh, std::vector<llama_token>(b.begin(), b.end() - 4)) == b);
+    assert(load_entry(cache, ctx, ctx_fresh, tokens_of(preamble, 6, 7)) == a);
+    assert(load_entry(cache, ctx, ctx_fresh, a) == a);
+
+    // an entry that extends another replaces it
+    save_entry(cache, ctx, ab);
+    assert(n_entries(cache) == 2 && has_entry(cache, ab) && !has_entry(cache, a));
+    assert(load_entry(cache, ctx, ctx_fresh, a) == ab);
+
+    // entries saved with settings that change the KV rows aren't restored with others
+    gpt_params other_params = params;
+    other_params.rope_freq_scale = 0.5f;
+    prompt_cache::store other;
+    assert(prompt_cache::init(other, other_params, ctx));
+    assert(other.key != cache.key);
+    std::vector<llama_token> restored;
+    assert(!prompt_cache::load(other, ctx, ab, restored));
+
+    // room for two entries: saving a third evicts the least recently used, which b is since ab was restored
+    size_t entry_size = 0;
+    for (const prompt_cache::entry & e : prompt_cache::list_entries(dir)) {
+        entry_size = std::max(entry_size, e.size);
+    }
+    cache.max_bytes = 2*entry_size + entry_size/2;
+    const std::vector<llama_token> c = tokens_of({ llama_token_bos() }, 20, 4);
+    save_entry(cache, ctx, c);
+    assert(n_entries(cache) == 2 && has_entry(cache, ab) && has_entry(cache, c) && !has_entry(cache, b));
+    assert(load_entry(cache, ctx, ctx_fresh, b) == ab);
+
+    // & an entry that would be over the bound on its own isn't kept
+    cache.max_bytes = entry_size/2;
+    eval_logits(ctx, b, 0);
+    assert(!prompt_cache::save(cache, ctx, b));
+    assert(n_entries(cache) == 0);
+
+    llama_free(ctx_fresh);
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+    std::remove(path);
+    rmdir(dir);
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "llama.h"
+#include "tiny-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static std::vector<float> eval_logits(llama_context * ctx, const std::vector<llama_token> & tokens) {
+    assert(llama_eval(ctx, tokens.data(), tokens.size(), 0, 1) == 0);
+    const float * logits = llama_get_logits(ctx);
+    return std::vector<float>(logits, logits + llama_n_vocab(ctx));
+}
+
+static void assert_logits_equal(const std::vector<float> & a, const std::vector<float> & b) {
+    assert(a.size() == b.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        assert(std::fabs(a[i] - b[i]) < 1e-5f);
+    }
+}
+
+// memory given back is faulted back in by the next evaluation, which must give what it did before
+static void test_release(const char * path, bool use_mmap) {
+    llama_context_params params = llama_context_default_params();
+    params.n_ctx    = 512;
+    params.seed     = 1;
+    params.use_mmap = use_mmap;
+
+    llama_model * model = llama_load_model_from_file(path, params);
+    assert(model != NULL);
+    llama_context * ctx = llama_new_context_with_model(model, params);
+    assert(ctx != NULL);
+
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < 32; i++) {
+        tokens.push_back(3 + (i*37) % 250);
+    }
+    const std::vector<float> expected = eval_logits(ctx, tokens);
+
+    const size_t resident = llama_get_resident_size(ctx);
+    const size_t released = llama_release_memory(ctx);
+    printf("%s: mmap %d: context had %zu bytes resident, released %zu, %zu left\n",
+           __func__, use_mmap, resident, released, llama_get_resident_size(ctx));
+    assert(llama_get_kv_cache_token_count(ctx) == 0);
+#ifdef __linux__
+    assert(resident > 0 && released > 0 && released <= resident);
+    assert(llama_get_resident_size(ctx) < resident);
+#endif
+
+    const size_t released_weights = llama_model_release_memory(model);
+    printf("%s: mmap %d: model had %zu bytes resident, released %zu\n",
+           __func__, use_mmap, llama_model_get_resident_size(model), released_weights);
+    if (!use_mmap) {
+        // weights read into memory would be lost
+        assert(released_weights == 0);
+    }
+
+    assert_logits_equal(eval_logits(ctx, tokens), expected);
+#ifdef __linux__
+    assert(llama_get_resident_size(ctx) > 0);
+#endif
+
+    llama_free(ctx);
+    llama_free_model(model);
+}
+
+int main(void) {
+    const char * path = "test-resident-memory.bin";
+    assert(tiny_model_write(path));
+
+    llama_backend_init(false);
+
+    test_release(path, true);
+    test_release(path, false);
+
+    llama_backend_free();
+    std::remove(path);
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "examples/simple-http/sampling.cpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <set>
+#include <vector>
+
+static std::vector<float> random_logits(int n_vocab, uint32_t seed, float stddev) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, stddev);
+    std::vector<float> logits(n_vocab);
+    for (float & logit : logits) {
+        logit = dist(rng);
+    }
+    return logits;
+}
+
+static SamplingParams sampling(float temperature, int top_k, float top_p) {
+    SamplingParams params;
+    params.temperature = temperature;
+    params.top_k       = top_k;
+    params.top_p       = top_p;
+    params.seed        = 1;
+    return params;
+}
+
+// the quickselected top-p set must be the one llama_sample_top_p() keeps, normalized at the temperature
+static void test_top_p(const std::vector<float> & logits, float top_p, float temperature) {
+    const int n_vocab = logits.size();
+
+    std::vector<llama_token_data> candidates;
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        candidates.push_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+    llama_token_data_array expected = { candidates.data(), candidates.size(), false };
+    llama_sample_top_p(nullptr, &expected, top_p, 1);
+
+    Sampler sampler(sampling(temperature, 0, top_p));
+    sampler.build(logits.data(), n_vocab);
+    const llama_token_data_array & kept = sampler.distribution();
+
+    std::set<llama_token> expected_ids, kept_ids;
+    for (size_t i = 0; i < expected.size; i++) {
+        expected_ids.insert(expected.data[i].id);
+    }
+    float max = -INFINITY, sum = 0.0f, p_sum = 0.0f;
+    for (size_t i = 0; i < kept.size; i++) {
+        kept_ids.insert(kept.data[i].id);
+        max = std::max(max, logits[kept.data[i].id]);
+    }
+    for (size_t i = 0; i < kept.size; i++) {
+        sum += expf((logits[kept.data[i].id] - max) / temperature);
+    }
+    for (size_t i = 0; i < kept.size; i++) {
+        assert(std::fabs(kept.data[i].p - expf((logits[kept.data[i].id] - max) / temperature) / sum) < 1e-5f);
+        p_sum += kept.data[i].p;
+    }
+
+    printf("top_p %.2f: kept %zu of %d\n", top_p, kept.size, n_vocab);
+    assert(kept_ids == expected_ids);
+    assert(std::fabs(p_sum - 1.0f) < 1e-4f);
+}
+
+// the first of the greatest, whatever the length (& so however many are left over from the SIMD lanes) & wherever
+// it falls
+static void test_argmax() {
+    std::mt19937 rng(4);
+    std::uniform_int_distribution<int> small(-3, 3);
+    for (int n = 1; n <= 40; n++) {
+        for (int trial = 0; trial < 20; trial++) {
+            std::vector<float> x(n);
+            for (float & v : x) {
+                v = small(rng);
+            }
+            if (trial % 4 == 0) {
+                x[rng() % n] = -INFINITY;
+            }
+            const int expected = std::max_element(x.begin(), x.end()) - x.begin();
+            assert(_argmax(x.data(), n) == expected);
+        }
+    }
+
+    const std::vector<float> logits = random_logits(32000, 5, 2.0f);
+    assert(_argmax(logits.data(), logits.size()) == std::max_element(logits.begin(), logits.end()) - logits.begin());
+}
+
+// the candidates mirostat samples from must be those llama_sample_token_mirostat{,_v2} would, with the same
+// probabilities
+static void test_mirostat(const std::vector<float> & logits, int version, float temperature, float mu) {
+    const int n_vocab = logits.size();
+
+    std::vector<llama_token_data> data;
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        data.push_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+    llama_token_data_array expected = { data.data(), data.size(), false };
+    llama_sample_temperature(nullptr, &expected, temperature);
+    llama_sample_softmax(nullptr, &expected);
+    if (version == 1) {
+        // as llama_sample_token_mirostat() estimates k, from the top 100
+        float sum_ti_bi = 0.0f, sum_ti_sq = 0.0f;
+        for (int i = 0; i < 99; i++) {
+            const float t_i = logf(float(i + 2) / float(i + 1));
+            sum_ti_bi += t_i * logf(expected.data[i].p / expected.data[i + 1].p);
+            sum_ti_sq += t_i * t_i;
+        }
+        const float s_hat = sum_ti_bi / sum_ti_sq;
+        const float epsilon_hat = s_hat - 1;
+        const float k = powf((epsilon_hat * powf(2, mu)) / (1 - powf(float(n_vocab), -epsilon_hat)), 1 / s_hat);
+        if (k >= 1.0f) {
+            llama_sample_top_k(nullptr, &expected, int(k), 1);
+        } else {
+            // which llama_sample_top_k() would take to mean no limit; the top token is kept instead, as v2 keeps it
+            // when none is within mu
+            expected.size = 1;
+        }
+    } else {
+        size_t keep = 0;
+        while (keep < expected.size && -log2f(expected.data[keep].p) <= mu) {
+            keep++;
+        }
+        expected.size = std::max<size_t>(keep, 1);
+    }
+    llama_sample_softmax(nullptr, &expected);
+
+    std::vector<llama_token_data> candidates;
+    _mirostat_candidates(logits.data(), n_vocab, version, temperature, mu, candidates);
+
+    printf("mirostat v%d, temperature %.2f, mu %.1f: kept %zu of %d\n", version, temperature, mu, candidates.size(), n_vocab);
+    assert(candidates.size() == expected.size);
+    for (size_t i = 0; i < candidates.size(); i++) {
+        assert(candidates[i].id == expected.data[i].id);
+        assert(std::fabs(candidates[i].p - expected.data[i].p) < 1e-5f);
+    }
+}
+
+// drafting from q, accepting with probability min(1, p / q) & otherwise drawing from the residual must sample
+// from p exactly
+static void test_rejection_sampling(const std::vector<float> & logits_target, const std::vector<float> & logits_draft) {
+    const int n_vocab = logits_target.size();
+    const int n_trials = 200000;
+
+    Sampler target(sampling(1.0f, 0, 1.0f));
+    target.build(logits_target.data(), n_vocab);
+    std::vector<float> p(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        p[id] = target.p(id);
+    }
+
+    SamplingParams draft_params = sampling(1.0f, 0, 1.0f);
+    draft_params.seed = 2;
+    Sampler draft(draft_params);
+    std::vector<float> q;
+    std::vector<int> counts(n_vocab, 0);
+    int n_accepted = 0;
+    for (int i = 0; i < n_trials; i++) {
+        const llama_token drafted = draft.sample_draft(logits_draft.data(), n_vocab, q);
+        draft.discard_drafts();
+        target.build(logits_target.data(), n_vocab);
+        if (target.accepts_draft(drafted, q)) {
+            counts[drafted]++;
+            n_accepted++;
+        } else {
+            counts[target.sample_residual(q)]++;
+        }
+    }
+
+    printf("rejection sampling: accepted %d of %d drafts\n", n_accepted, n_trials);
+    assert(n_accepted > 0 && n_accepted < n_trials);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        assert(std::fabs(float(counts[id]) / n_trials - p[id]) < 0.01f);
+    }
+}
+
+int main(void) {
+    const std::vector<float> logits = random_logits(1000, 1, 2.0f);
+    for (float top_p : { 0.0f, 0.1f, 0.9f, 1.0f }) {
+        test_top_p(logits, top_p, 1.0f);
+    }
+    test_top_p(logits, 0.5f, 0.7f);
+
+    test_argmax();
+    for (float mu : { 14.0f, 12.0f, 10.0f, 6.0f, 3.0f }) {
+        test_mirostat(logits, 1, 1.0f, mu);
+    }
+    for (float mu : { 10.0f, 6.0f, 3.0f, 0.1f }) {
+        test_mirostat(logits, 2, 1.0f, mu);
+    }
+    test_mirostat(logits, 1, 0.7f, 12.0f);
+    test_mirostat(logits, 2, 0.7f, 6.0f);
+
+    // a draft distribution near the target's, as a draft model's would be
+    const std::vector<float> logits_target = random_logits(8, 2, 1.0f);
+    std::vector<float> logits_draft = random_logits(8, 3, 0.5f);
+    for (size_t i = 0; i < logits_draft.size(); i++) {
+        logits_draft[i] += logits_target[i];
+    }
+    test_rejection_sampling(logits_target, logits_draft);
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "examples/simple-http/vector-index.cpp"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <set>
+#include <vector>
+
+static const int n_dims = 32;
+
+static std::vector<float> random_vectors(int n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<float> vectors(n*n_dims);
+    for (float & x : vectors) {
+        x = dist(rng);
+    }
+    return vectors;
+}
+
+static float cosine(const float * a, const float * b) {
+    float dot = 0.0f, norm_a = 0.0f, norm_b = 0.0f;
+    for (int i = 0; i < n_dims; i++) {
+        dot    += a[i]*b[i];
+        norm_a += a[i]*a[i];
+        norm_b += b[i]*b[i];
+    }
+    return dot / std::sqrt(norm_a*norm_b);
+}
+
+// the fraction of the exact `k` nearest of the stored vectors (those with `stored[id]`) that the index finds, over
+// every query
+static float recall(const VectorIndex & index, const std::vector<float> & vectors, const std::vector<bool> & stored,
+                    const std::vector<float> & queries, int k) {
+    const int n_queries = queries.size() / n_dims;
+    int n_found = 0;
+    for (int q = 0; q < n_queries; q++) {
+        const float * query = queries.data() + q*n_dims;
+        std::vector<std::pair<float, uint64_t>> exact;
+        for (size_t id = 0; id < stored.size(); id++) {
+            if (stored[id]) {
+                exact.emplace_back(-cosine(query, vectors.data() + id*n_dims), id);
+            }
+        }
+        std::sort(exact.begin(), exact.end());
+        std::set<uint64_t> expected;
+        for (int i = 0; i < k; i++) {
+            expected.insert(exact[i].second);
+        }
+
+        const std::vector<VectorIndexMatch> matches = index.query(query, k);
+        assert((int) matches.size() == k);
+        for (size_t i = 0; i < matches.size(); i++) {
+            assert(stored[matches[i].id]);
+            assert(i == 0 || matches[i].similarity <= matches[i - 1].similarity);
+            assert(std::fabs(matches[i].similarity - cosine(query, vectors.data() + matches[i].id*n_dims)) < 1e-2f);
+            n_found += expected.count(matches[i].id);
+        }
+    }
+    return float(n_found) / (n_queries*k);
+}
+
+static void assert_same_results(const VectorIndex & a, const VectorIndex & b, const std::vector<float> & queries) {
+    for (size_t q = 0; q < queries.size() / n_dims; q++) {
+        const auto matches_a = a.query(queries.data() + q*n_dims, 10);
+        const auto matches_b = b.query(queries.data() + q*n_dims, 10);
+        assert(matches_a.size() == matches_b.size());
+        for (size_t i = 0; i < matches_a.size(); i++) {
+            assert(matches_a[i].id == matches_b[i].id);
+            assert(matches_a[i].similarity == matches_b[i].similarity);
+        }
+    }
+}
+
+static void test_index(enum ggml_type type) {
+    const int n = 2000;
+    const std::vector<float> vectors = random_vectors(n, 1);
+    const std::vector<float> queries = random_vectors(50, 2);
+
+    VectorIndexParams params;
+    params.n_dims = n_dims;
+    params.type   = type;
+    std::unique_ptr<VectorIndex> index = make_vector_index(params);
+    assert(index->query(queries.data(), 10).empty());
+
+    std::vector<bool> stored(n, true);
+    for (int id = 0; id < n; id++) {
+        index->insert(id, vectors.data() + id*n_dims);
+    }
+    assert(index->size() == (size_t) n);
+    assert(index->query(queries.data(), 0).empty());
+    const float recall_inserted = recall(*index, vectors, stored, queries, 10);
+
+    // a removed vector is never found, though others are still found through it
+    for (int id = 0; id < n; id += 3) {
+        assert(index->remove(id));
+        stored[id] = false;
+    }
+    assert(!index->remove(0));
+    assert(index->size() == (size_t) (n - (n + 2)/3));
+    const float recall_removed = recall(*index, vectors, stored, queries, 10);
+
+    // a vector stored again under an id replaces the one there
+    const uint64_t generation = index->generation();
+    index->insert(1, queries.data());
+    assert(index->generation() > generation);
+    const std::vector<VectorIndexMatch> best = index->query(queries.data(), 1);
+    assert(best.size() == 1 && best[0].id == 1 && best[0].similarity > 0.99f);
+    index->insert(1, vectors.data() + n_dims);
+
+    printf("%s: type %s: recall %.3f, %.3f after removals\n", __func__, ggml_type_name(type), recall_inserted, recall_removed);
+    assert(recall_inserted > 0.9f);
+    assert(recall_removed > 0.9f);
+
+    // a reloaded index answers exactly as the one saved, & can be changed without touching the file
+    const char * path = "test-vector-index.index";
+    std::string error;
+    assert(index->save(path, &error));
+    std::unique_ptr<VectorIndex> loaded = load_vector_index(path, &error);
+    assert(loaded != nullptr);
+    assert(loaded->size() == index->size());
+    assert(loaded->params().type == type && loaded->params().n_dims == n_dims);
+    assert_same_results(*index, *loaded, queries);
+
+    assert(loaded->remove(2));
+    loaded->insert(n, queries.data());
+    assert(loaded->query(queries.data(), 1)[0].id == (uint64_t) n);
+    std::unique_ptr<VectorIndex> reloaded = load_vector_index(path, &error);
+    assert(reloaded != nullptr);
+    assert_same_results(*index, *reloaded, queries);
+
+    std::remove(path);
+}
+
+int main(void) {
+    test_index(GGML_TYPE_F16);
+    test_index(GGML_TYPE_F32);
+
+    std::string error;
+    assert(load_vector_index("test-vector-index-missing.index", &error) == nullptr);
+    assert(!error.empty());
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+// Writes small LLaMA models with random f32 weights in the ggjt v3 format, for tests that load & evaluate one
+// without a model file of their own. Token i of the vocab is the byte i (empty for the first 3, the special tokens).
+// Also writes LoRA adapters for them, in the ggla format
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+struct tiny_model_params {
+    uint32_t n_vocab = 256;
+    uint32_t n_embd  = 64;
+    uint32_t n_mult  = 32;
+    uint32_t n_head  = 4;
+    uint32_t n_layer = 2;
+    uint32_t seed    = 1;
+};
+
+static uint32_t tiny_model_n_ff(const tiny_model_params & hp) {
+    return ((2*(4*hp.n_embd)/3 + hp.n_mult - 1)/hp.n_mult)*hp.n_mult;
+}
+
+static void tiny_model_write_u32(FILE * f, uint32_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+// writes a tensor's header & data, padding the data to 32 bytes as the loader expects
+static void tiny_model_write_tensor(FILE * f, const std::string & name, const std::vector<uint32_t> & ne, const std::vector<float> & data) {
+    tiny_model_write_u32(f, ne.size());
+    tiny_model_write_u32(f, name.size());
+    tiny_model_write_u32(f, 0); // GGML_TYPE_F32
+    for (uint32_t n : ne) {
+        tiny_model_write_u32(f, n);
+    }
+    fwrite(name.data(), 1, name.size(), f);
+    const long pad = (32 - ftell(f) % 32) % 32;
+    for (long i = 0; i < pad; i++) {
+        fputc(0, f);
+    }
+    fwrite(data.data(), sizeof(float), data.size(), f);
+}
+
+static bool tiny_model_write(const char * path, const tiny_model_params & hp = tiny_model_params()) {
+    FILE * f = fopen(path, "wb");
+    if (f == NULL) {
+        return false;
+    }
+
+    tiny_model_write_u32(f, 0x67676a74); // 'ggjt'
+    tiny_model_write_u32(f, 3);
+    for (uint32_t v : { hp.n_vocab, hp.n_embd, hp.n_mult, hp.n_head, hp.n_layer, hp.n_embd/hp.n_head, 0u }) {
+        tiny_model_write_u32(f, v);
+    }
+    for (uint32_t i = 0; i < hp.n_vocab; i++) {
+        const float score = 0.0f;
+        const char c = (char) i;
+        tiny_model_write_u32(f, i > 2 ? 1 : 0);
+        if (i > 2) {
+            fwrite(&c, 1, 1, f);
+        }
+        fwrite(&score, sizeof(score), 1, f);
+    }
+
+    std::mt19937 rng(hp.seed);
+    std::normal_distribution<float> dist(0.0f, 0.5f);
+    const auto weights = [&](uint32_t n0, uint32_t n1) {
+        std::vector<float> w(n0*n1);
+        for (float & x : w) {
+            x = dist(rng) / std::sqrt((float) n0);
+        }
+        return w;
+    };
+    const std::vector<float> ones(hp.n_embd, 1.0f);
+    const uint32_t n_ff = tiny_model_n_ff(hp);
+
+    tiny_model_write_tensor(f, "tok_embeddings.weight", { hp.n_embd, hp.n_vocab }, weights(hp.n_embd, hp.n_vocab));
+    tiny_model_write_tensor(f, "norm.weight",           { hp.n_embd },             ones);
+    tiny_model_write_tensor(f, "output.weight",         { hp.n_embd, hp.n_vocab }, weights(hp.n_embd, hp.n_vocab));
+    for (uint32_t il = 0; il < hp.n_layer; il++) {
+        const std::string p = "layers." + std::to_string(il) + ".";
+        tiny_model_write_tensor(f, p + "attention_norm.weight", { hp.n_embd }, ones);
+        for (const char * w : { "wq", "wk", "wv", "wo" }) {
+            tiny_model_write_tensor(f, p + "attention." + w + ".weight", { hp.n_embd, hp.n_embd }, weights(hp.n_embd, hp.n_embd));
+        }
+        tiny_model_write_tensor(f, p + "ffn_norm.weight",        { hp.n_embd },       ones);
+        tiny_model_write_tensor(f, p + "feed_forward.w1.weight", { hp.n_embd, n_ff }, weights(hp.n_embd, n_ff));
+        tiny_model_write_tensor(f, p + "feed_forward.w2.weight", { n_ff, hp.n_embd }, weights(n_ff, hp.n_embd));
+        tiny_model_write_tensor(f, p + "feed_forward.w3.weight", { hp.n_embd, n_ff }, weights(hp.n_embd, n_ff));
+    }
+
+    return fclose(f) == 0;
+}
+
+// writes a tensor as the ggla format does: dims, name length & type first, & the data aligned to 32 bytes
+static void tiny_lora_write_tensor(FILE * f, const std::string & name, uint32_t ne0, uint32_t ne1, const std::vector<float> & data) {
+    tiny_model_write_u32(f, 2);
+    tiny_model_write_u32(f, name.size());
+    tiny_model_write_u32(f, 0); // GGML_TYPE_F32
+    tiny_model_write_u32(f, ne0);
+    tiny_model_write_u32(f, ne1);
+    fwrite(name.data(), 1, name.size(), f);
+    const long pad = (32 - ftell(f) % 32) % 32;
+    for (long i = 0; i < pad; i++) {
+        fputc(0, f);
+    }
+    fwrite(data.data(), sizeof(float), data.size(), f);
+}
+
+// writes a LoRA adapter of rank r for every matrix of the layers of a model with the hyperparameters `hp`
+static bool tiny_lora_write(const char * path, const tiny_model_params & hp, uint32_t r, uint32_t alpha, uint32_t seed) {
+    FILE * f = fopen(path, "wb");
+    if (f == NULL) {
+        return false;
+    }
+
+    tiny_model_write_u32(f, 0x67676c61); // 'ggla'
+    tiny_model_write_u32(f, 1);
+    tiny_model_write_u32(f, r);
+    tiny_model_write_u32(f, alpha);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 0.5f);
+    const auto weights = [&](uint32_t n) {
+        std::vector<float> w(n*r);
+        for (float & x : w) {
+            x = dist(rng) / std::sqrt((float) n);
+        }
+        return w;
+    };
+    const uint32_t n_ff = tiny_model_n_ff(hp);
+
+    for (uint32_t il = 0; il < hp.n_layer; il++) {
+        const std::string p = "layers." + std::to_string(il) + ".";
+        const struct { std::string name; uint32_t n_in, n_out; } mats[] = {
+            { p + "attention.wq.weight",    hp.n_embd, hp.n_embd },
+            { p + "attention.wk.weight",    hp.n_embd, hp.n_embd },
+            { p + "attention.wv.weight",    hp.n_embd, hp.n_embd },
+            { p + "attention.wo.weight",    hp.n_embd, hp.n_embd },
+            { p + "feed_forward.w1.weight", hp.n_embd, n_ff      },
+            { p + "feed_forward.w2.weight", n_ff,      hp.n_embd },
+            { p + "feed_forward.w3.weight", hp.n_embd, n_ff      },
+        };
+        for (const auto & m : mats) {
+            tiny_lora_write_tensor(f, m.name + ".loraA", r, m.n_in,  weights(m.n_in));
+            tiny_lora_write_tensor(f, m.name + ".loraB", r, m.n_out, weights(m.n_out));
+        }
+    }
+
+    return fclose(f) == 0;
+}